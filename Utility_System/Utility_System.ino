@@ -1,11 +1,26 @@
 #include <WiFi.h>
+#include <sys/time.h>
 #include <Preferences.h>
+#include <LittleFS.h>
 #include <WiFiManager.h> //Version 2.0.12-beta (tzapu)
 #include <PubSubClient.h>
 #include <SPI.h>
 #include <nRF24L01.h>
 #include <RF24.h> //Version 1.4.6
 #include "sim800l.h"
+#include "ledger.h"
+#include "otp_table.h"
+#include "rollup.h"
+#include "notifier.h"
+#include "radiolink.h"
+#include "radiocrypt.h"
+#include "cloudcmd.h"
+#include "memreport.h"
+#include "numfmt.h"
+#include "cpuprofiler.h"
+#include "latency.h"
+#include "log.h"
+#include "log_config.h"
 
 //Max number of characters
 #define SIZE_TOPIC            30 
@@ -13,6 +28,59 @@
 #define SIZE_OTP              11 
 #define SIZE_REQUEST          11 //for units requested by the user
 #define SIZE_CLIENT_ID        23
+#define SIZE_ROLLUP_PERIOD    7
+#define SIZE_CLOUD_KEY        (2 * CLOUD_KEY_SIZE + 1) //hex
+
+#define LEDGER_FLUSH_PERIOD   600000 //millisecs (persists account balances)
+#define MAX_PENDING_OTPS      32 //recharges awaiting OTP verification
+#define ROLLUP_DEFAULT_PERIOD 60 //secs between rollups (0: readings are published raw)
+#define RAW_QUEUE_LENGTH      8 //readings waiting to be published (raw mode)
+#define MAX_PENDING_CREDITS   8 //cloud recharges awaiting the reply of meters
+//Notifications (SMS)
+#define NOTIFY_MAX_USERS      (RADIO_MAX_METERS * ROLLUP_NUM_OF_USERS)
+#define NOTIFY_LOW_BALANCE    20000 //mL
+#define NOTIFY_LEAK_PERIOD    7200000 //millisecs of continuous consumption (possible leak)
+#define NOTIFY_FLOW_GAP       600000 //millisecs without consumption that end continuous consumption
+#define NOTIFY_MIN_INTERVAL   3600000 //millisecs between notifications of a user
+#define NOTIFY_BATCH_SIZE     4 //notifications sent in a row (if no OTP is waiting)
+
+//Task stack sizes (bytes): max usage (from the memory report) + margin
+#define WIFI_TASK_STACK       8192
+#define MQTT_TASK_STACK       6144
+#define APP_TASK_STACK        8192
+#define METER_TASK_STACK      8192
+#define MEM_REPORT_PERIOD     600000 //millisecs (also printed when 'm' is received)
+//Task placement: radio (SPI) and GSM (UART) work runs on core 0 alongside
+//the WiFi stack, leaving core 1 to WiFi management and MQTT.
+#define WIFI_TASK_CORE        1
+#define WIFI_TASK_PRIORITY    1
+#define MQTT_TASK_CORE        1
+#define MQTT_TASK_PRIORITY    1
+#define APP_TASK_CORE         0
+#define APP_TASK_PRIORITY     1
+#define METER_TASK_CORE       0
+#define METER_TASK_PRIORITY   2
+#define LOG_TASK_CORE         1
+#define LOG_TASK_PRIORITY     0 //prints buffered log records when nothing else runs
+#define CPU_PROFILER_TIMER    0 //hardware timer (CPU report printed when 'c' is received)
+#define STATS_REPORT_PERIOD   60000 //millisecs (published to "<topic>/cpu", "/radio", "/links" and "/latency")
+#define SIZE_REPORT           256 //statistics report (payload)
+//Largest MQTT message: fixed header (5) + topic length (2) + topic + payload
+#define MQTT_BUFFER_SIZE      (5 + 2 + SIZE_TOPIC + 13 + SIZE_REPORT)
+#define NRF24_CE_PIN          15
+#define NRF24_CSN_PIN         5
+#define RADIO_EVAL_PERIOD     600000 //millisecs between radio profile evaluations
+#define RADIO_MIN_PACKETS     20 //packets needed (per evaluation) to judge the links
+#define RADIO_POOR_ARC        4 //mean retries reported by meters (poor link)
+#define RADIO_GOOD_ARC        1 //mean retries reported by meters (good link)
+#define RADIO_MAX_LOSS        10 //% of packets reported lost by meters
+#define RADIO_MAX_BUSY        20 //% of carrier samples (busy channel)
+#define RADIO_MAX_METERS      256 //meters tracked for replay protection
+#define RADIO_COUNTER_BLOCK   1000 //frame counters reserved in flash at a time
+//Time (UTC) from NTP servers, distributed to meters on request
+#define NTP_SERVER1           "pool.ntp.org"
+#define NTP_SERVER2           "time.google.com"
+#define TIME_VALID_AFTER      1600000000 //Unix time (earlier: not synced yet)
 
 //Meter(Master) -> Utility
 typedef struct
@@ -28,26 +96,148 @@ typedef struct
   uint32_t units;
 }recharge_util_t;
 
+//Radio messages (encrypted into frames, see radiocrypt.h). The first byte
+//is the type. The meter ID is in the frame header.
+enum RadioMsgType
+{
+  RADIO_MSG_TELEMETRY = 1,
+  RADIO_MSG_RECHARGE,
+  RADIO_MSG_OTP,
+  RADIO_MSG_CREDIT,
+  RADIO_MSG_CREDIT_ACK,
+  RADIO_MSG_TIME_REQUEST,
+  RADIO_MSG_TIME,
+  RADIO_MSG_RECHARGE_ACK
+};
+
+//Meter(Master) -> Utility (every few seconds)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t linkQuality; //retries of the previous frame (0xFF: lost)
+  sensor_t sensorData;
+  uint32_t timestamp; //Unix time of the reading (0: unknown)
+}telemetry_util_t; //18 bytes (max plaintext)
+
+//Meter(Master) -> Utility (recharge request)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex; //user requesting a recharge
+  uint8_t requestId; //new for every request (the same for a resent one)
+  char phoneNum[SIZE_PHONE - 1]; //not NULL-terminated
+  uint32_t units;
+}meter_util_t; //18 bytes (max plaintext)
+
+//Utility -> Meter(Master)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  char otp[SIZE_OTP];
+}otp_meter_t;
+
+//Utility -> Meter(Master) (recharge from the cloud, no OTP needed)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  uint32_t units;
+  uint32_t commandId;
+}credit_meter_t;
+
+//Utility -> Meter(Master) (reply to RADIO_MSG_TIME_REQUEST)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint32_t time; //Unix time (secs)
+  uint16_t milliseconds;
+}time_meter_t;
+
+//Meter(Master) -> Utility (outcome of a cloud recharge)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  uint32_t commandId;
+  uint8_t status; //CreditStatus
+}credit_ack_t;
+
+//Meter(Master) -> Utility (recharge with OTP applied by the node)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  uint32_t units;
+  uint32_t txnId; //node transaction (the same for a resent report)
+}recharge_ack_t;
+
+//Meter task -> MQTT task (outcome of a cloud recharge)
 typedef struct
 {
-  recharge_util_t recharge;
+  uint32_t commandId;
+  uint16_t meterId;
+  uint8_t status; //CreditStatus
+}credit_status_t;
+
+//Meter task -> MQTT task (raw mode)
+typedef struct
+{
+  uint16_t meterId;
   sensor_t sensorData;
-}meter_util_t;
+  uint32_t timestamp; //Unix time of the reading (0: unknown)
+}reading_t;
+
+//Meter task -> App task (OTP to be sent via SMS)
+typedef struct
+{
+  recharge_util_t recharge;
+  char otp[SIZE_OTP];
+  uint32_t requestTime; //millis (latency statistics)
+}otp_sms_t;
+
+//Stages of a recharge (latency statistics)
+enum RechargeStage
+{
+  STAGE_OTP = 0, //request received -> OTP received by the meter
+  STAGE_SMS,     //request received -> OTP SMS sent
+  STAGE_CREDIT,  //cloud recharge received -> applied by the meter
+  NUM_OF_STAGES
+};
+const char* const stageNames[NUM_OF_STAGES] = {"OTP","SMS","Credit"};
 
 //Queues
 typedef struct
 {
   QueueHandle_t utilToMqtt;
-  QueueHandle_t utilToApp1;
-  QueueHandle_t utilToApp2;
+  QueueHandle_t utilToApp;
+  QueueHandle_t mqttToMeter; //cloud recharges
+  QueueHandle_t meterToMqtt; //outcome of cloud recharges
 }queue_t;
 
 WiFiManagerParameter subTopic("5","HiveMQ Subscription topic","",SIZE_TOPIC);
 WiFiManagerParameter clientID("A","MQTT client ID","",SIZE_CLIENT_ID);
+WiFiManagerParameter rollupPeriodParam("P","Rollup period (secs, 0: raw readings)","",SIZE_ROLLUP_PERIOD);
+WiFiManagerParameter cloudKeyParam("C","Cloud command key (32 hex digits)","",SIZE_CLOUD_KEY);
+LOG_DEFINE_BUFFER(LOG_BUFFER_SIZE);
 Preferences preferences; //for accessing ESP32 flash memory
 queue_t queue;
+Ledger ledger(&LittleFS); //accounts of all users of all meters
+OtpTable otpTable(MAX_PENDING_OTPS);
+Rollup rollup(RADIO_MAX_METERS); //readings of each meter between publications
+uint32_t rollupPeriod; //secs
+Notifier notifier(NOTIFY_MAX_USERS,NOTIFY_LOW_BALANCE,NOTIFY_LEAK_PERIOD,
+                  NOTIFY_FLOW_GAP,NOTIFY_MIN_INTERVAL);
 TaskHandle_t wifiTaskHandle;
 uint32_t setupTime;
+MemReport memReport;
+RF24 nrf24(NRF24_CE_PIN,NRF24_CSN_PIN);
+RadioLink radioLink(&nrf24);
+RadioCrypto radioCrypto; //used by the Meter task only
+ReplayGuard replayGuard(RADIO_MAX_METERS);
+CpuProfiler cpuProfiler;
+LatencyStats latencyStats(stageNames,NUM_OF_STAGES);
+uint32_t numOfTelemetry; //packets received (written by the Meter task only)
 
 /**
  * @brief Store new data in specified location in ESP32's 
@@ -86,90 +276,394 @@ static void RandomizeOtp(char* otp)
 }
 
 /**
- * @brief Send auto-generated OTP to the meter of the user that 
- * just sent a request to recharge.
+ * @brief Gets the site key (from which each meter's radio key is derived).
+ * It is generated on first boot.
 */
-static void SendOtpToMeter(RF24& nrf24,char* otp)
+static void GetSiteKey(uint8_t* siteKey)
 {
-  nrf24.stopListening();
-  nrf24.write(otp,SIZE_OTP);
-  nrf24.startListening();
+  if(preferences.getBytes("S",siteKey,RADIO_KEY_SIZE) != RADIO_KEY_SIZE)
+  {
+    esp_fill_random(siteKey,RADIO_KEY_SIZE);
+    preferences.putBytes("S",siteKey,RADIO_KEY_SIZE);
+  }
 }
 
 /**
- * @brief Converts an integer to a string.
+ * @brief Loads the radio key of a meter. The key of the previous meter is
+ * kept (a reply goes to the meter just heard from): deriving a key costs
+ * about 12 times as much as sealing a frame.
+ * @return true if successful, false if otherwise.
 */
-static void IntegerToString(uint32_t integer,char* stringPtr)
+static bool SetMeterKey(uint16_t meterId)
 {
-  if(integer == 0)
-  {  
-    stringPtr[0] = '0';
-    return;
+  static uint8_t siteKey[RADIO_KEY_SIZE];
+  static bool hasSiteKey = false;
+  static bool isKeySet = false;
+  static uint16_t keyMeterId = 0;
+  uint8_t key[RADIO_KEY_SIZE];
+  if(!hasSiteKey)
+  {
+    GetSiteKey(siteKey);
+    hasSiteKey = true;
+  }
+  if(isKeySet && keyMeterId == meterId)
+  {
+    return true;
   }
-  uint32_t integerCopy = integer;
-  uint8_t numOfDigits = 0;
+  isKeySet = RadioCrypto::DeriveKey(siteKey,meterId,key) && radioCrypto.SetKey(key);
+  keyMeterId = meterId;
+  memset(key,0,sizeof(key));
+  return isKeySet;
+}
 
-  while(integerCopy > 0)
+/**
+ * @brief Gets the counter of the next frame sent to the meters. Counters 
+ * are reserved in flash in blocks so they are never reused after a restart.
+*/
+static uint32_t NextTxCounter(void)
+{
+  static uint32_t counter = 0;
+  static uint32_t reservedUntil = 0;
+  if(counter == 0)
   {
-    integerCopy /= 10;
-    numOfDigits++;
+    counter = preferences.getULong("N",1);
+    reservedUntil = counter;
   }
-  while(integer > 0)
+  if(counter >= reservedUntil)
   {
-    stringPtr[numOfDigits - 1] = '0' + (integer % 10);
-    integer /= 10;
-    numOfDigits--;
+    reservedUntil = counter + RADIO_COUNTER_BLOCK;
+    preferences.putULong("N",reservedUntil);
   }
+  return counter++;
 }
 
 /**
- * @brief Converts a float to a string.
+ * @brief Encrypts a message and sends it to a meter.
+ * @return true if the meter received the frame, false if otherwise.
 */
-static void FloatToString(float floatPt,char* stringPtr,uint8_t decimalPlaces)
+static bool SendToMeter(uint16_t meterId,const void* message,uint8_t messageSize,
+                        uint8_t maxAttempts)
 {
-  uint32_t multiplier = 1;
-  for(uint8_t i = 0; i < decimalPlaces; i++)
+  radio_frame_t frame;
+  if(!SetMeterKey(meterId) || 
+     !radioCrypto.Seal(RADIO_DOWNLINK,meterId,NextTxCounter(),message,messageSize,&frame))
   {
-    multiplier *= 10;
-  }  
-  uint32_t floatAsInt = lround(floatPt * multiplier);
-  char quotientBuff[20] = {0};
-  char remainderBuff[20] = {0};
+    return false;
+  }
+  for(uint8_t i = 0; i < maxAttempts; i++)
+  {
+    if(radioLink.Write(&frame,sizeof(frame),meterId))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Send auto-generated OTP to the meter of the user that 
+ * just sent a request to recharge.
+ * @return true if the meter received the OTP, false if otherwise.
+*/
+static bool SendOtpToMeter(uint16_t meterId,uint8_t userIndex,char* otp)
+{
+  const uint8_t maxAttempts = 3;
+  otp_meter_t otpToMeter = {};
+  otpToMeter.type = RADIO_MSG_OTP;
+  otpToMeter.userIndex = userIndex;
+  strcpy(otpToMeter.otp,otp);
+  if(!SendToMeter(meterId,&otpToMeter,sizeof(otpToMeter),maxAttempts))
+  {
+    LOG_WARN(METER,"OTP not delivered to meter %lu",meterId);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Gets the time (UTC) kept by NTP.
+ * @param millisPtr: (optional) Stores the millisecs part of the time.
+ * @return Unix time (secs), 0 if the time hasn't been synced yet.
+*/
+static uint32_t GetTime(uint16_t* millisPtr)
+{
+  struct timeval now;
+  if(gettimeofday(&now,NULL) != 0 || now.tv_sec < TIME_VALID_AFTER)
+  {
+    return 0;
+  }
+  if(millisPtr != NULL)
+  {
+    *millisPtr = now.tv_usec / 1000;
+  }
+  return now.tv_sec;
+}
+
+/**
+ * @brief Replies to a meter's request for the time (if it is known).
+*/
+static void SendTimeToMeter(uint16_t meterId)
+{
+  time_meter_t timeToMeter = {};
+  uint16_t milliseconds;
+  timeToMeter.type = RADIO_MSG_TIME;
+  timeToMeter.time = GetTime(&milliseconds);
+  timeToMeter.milliseconds = milliseconds;
+  if(timeToMeter.time == 0)
+  {
+    LOG_DEBUG(METER,"Time request from meter %lu (time not synced)",meterId);
+    return;
+  }
+  SendToMeter(meterId,&timeToMeter,sizeof(timeToMeter),1);
+}
+
+/**
+ * @brief Gets the latency of each stage of a recharge (millisecs) and the 
+ * rate of telemetry packets (per minute) since the previous call.
+ * @return Length of the report.
+*/
+static size_t GetLatencyReport(char* report,size_t reportSize)
+{
+  static uint32_t prevTime = 0;
+  static uint32_t prevNumOfTelemetry = 0;
+  uint32_t elapsed = millis() - prevTime;
+  uint32_t count = numOfTelemetry;
+  size_t len = latencyStats.GetReport(report,reportSize);
+  StringBuilder text(report + len,reportSize - len);
+  text.Append((len > 0) ? " telemetry/min:" : "telemetry/min:")
+      .AppendUnsigned((elapsed > 0) ? (60000ULL * (count - prevNumOfTelemetry) / elapsed) : 0);
+  prevTime = millis();
+  prevNumOfTelemetry = count;
+  return len + text.GetLength();
+}
+
+/**
+ * @brief Chooses the radio profile (channel/data rate) shared by all meters
+ * from the link quality they reported and the carrier detected on the 
+ * channel since the previous evaluation. Meters follow a change by scanning
+ * the profiles.
+ * @param numOfPackets: Packets received in the period.
+ * @param numOfRetries: Sum of the retries reported for delivered packets.
+ * @param numOfLost: Packets reported as lost.
+*/
+static void EvaluateRadioProfile(uint32_t numOfPackets,uint32_t numOfRetries,uint32_t numOfLost)
+{
+  static RadioLink::stats_t prevStats;
+  RadioLink::stats_t stats;
+  radioLink.GetStats(&stats);
+  uint32_t numOfSamples = stats.numOfCarrierSamples - prevStats.numOfCarrierSamples;
+  uint32_t numOfHits = stats.numOfCarrierHits - prevStats.numOfCarrierHits;
+  prevStats = stats;
   
-  IntegerToString((floatAsInt / multiplier),quotientBuff);
-  IntegerToString((floatAsInt % multiplier),remainderBuff);
-  strcat(stringPtr,quotientBuff);
-  strcat(stringPtr,".");
-  uint8_t remainderLen = strlen(remainderBuff);
-  while(remainderLen < decimalPlaces)
-  {
-    strcat(stringPtr,"0");
-    remainderLen++;
-  }  
-  strcat(stringPtr,remainderBuff);
+  bool isLowRate = (radioLink.GetProfile() % 2) == 1; //odd profiles: 250kbps
+  bool isBusy = numOfSamples > 0 && (100 * numOfHits / numOfSamples) > RADIO_MAX_BUSY;
+  bool isPoor = false;
+  bool isGood = false;
+  if(numOfPackets >= RADIO_MIN_PACKETS)
+  {
+    uint32_t numOfDelivered = numOfPackets - numOfLost;
+    isPoor = (100 * numOfLost / numOfPackets) > RADIO_MAX_LOSS ||
+             (numOfDelivered > 0 && (numOfRetries / numOfDelivered) >= RADIO_POOR_ARC);
+    isGood = numOfLost == 0 && (numOfRetries / numOfPackets) < RADIO_GOOD_ARC;
+  }
+  if(!isBusy && !isPoor && !(isLowRate && isGood))
+  {
+    return; //keep the current profile
+  }
+  //Poor links need the lower (more sensitive) data rate, good ones go back
+  //to the higher rate (less airtime, less power)
+  if(isPoor)
+  {
+    isLowRate = true;
+  }
+  else if(isGood)
+  {
+    isLowRate = false;
+  }
+  uint8_t profile = radioLink.FindQuietestProfile(isLowRate);
+  if(profile != radioLink.GetProfile())
+  {
+    radioLink.SetProfile(profile);
+    preferences.putUChar("R",profile);
+    LOG_WARN(METER,"Radio profile changed to %ld (busy: %ld, poor: %ld)",profile,isBusy,isPoor);
+  }
 }
 
 void setup() 
 {
+  //Statically allocated tasks and queues
+  static StackType_t wifiTaskStack[WIFI_TASK_STACK];
+  static StackType_t mqttTaskStack[MQTT_TASK_STACK];
+  static StackType_t appTaskStack[APP_TASK_STACK];
+  static StackType_t meterTaskStack[METER_TASK_STACK];
+  static StaticTask_t wifiTaskBuffer;
+  static StaticTask_t mqttTaskBuffer;
+  static StaticTask_t appTaskBuffer;
+  static StaticTask_t meterTaskBuffer;
+  static uint8_t utilToMqttStorage[RAW_QUEUE_LENGTH * sizeof(reading_t)];
+  static uint8_t utilToAppStorage[MAX_PENDING_OTPS * sizeof(otp_sms_t)];
+  static StaticQueue_t utilToMqttBuffer;
+  static StaticQueue_t utilToAppBuffer;
+  static uint8_t mqttToMeterStorage[MAX_PENDING_CREDITS * sizeof(cloud_recharge_t)];
+  static uint8_t meterToMqttStorage[MAX_PENDING_CREDITS * sizeof(credit_status_t)];
+  static StaticQueue_t mqttToMeterBuffer;
+  static StaticQueue_t meterToMqttBuffer;
+  
   setCpuFrequencyMhz(80);
   Serial.begin(115200);  
+  Log::Begin(&Serial,LOG_TASK_PRIORITY,LOG_TASK_CORE);
   preferences.begin("Utility",false);
-  queue.utilToMqtt = xQueueCreate(1,sizeof(sensor_t));
-  queue.utilToApp1 = xQueueCreate(1,sizeof(recharge_util_t));
-  queue.utilToApp2 = xQueueCreate(1,SIZE_OTP);
-  if(queue.utilToMqtt != NULL && queue.utilToApp1 != NULL && queue.utilToApp2 != NULL)
+  char rollupPeriodStr[SIZE_ROLLUP_PERIOD] = {0};
+  preferences.getBytes("P",rollupPeriodStr,SIZE_ROLLUP_PERIOD);
+  rollupPeriodStr[SIZE_ROLLUP_PERIOD - 1] = '\0';
+  if(!ParseUnsigned(rollupPeriodStr,&rollupPeriod))
+  {
+    rollupPeriod = ROLLUP_DEFAULT_PERIOD;
+  }
+  if(!LittleFS.begin(true) || !ledger.Begin())
+  {
+    Serial.println("Ledger could not be loaded");
+  }
+  queue.utilToMqtt = xQueueCreateStatic(RAW_QUEUE_LENGTH,sizeof(reading_t),
+                                        utilToMqttStorage,&utilToMqttBuffer);
+  queue.utilToApp = xQueueCreateStatic(MAX_PENDING_OTPS,sizeof(otp_sms_t),
+                                       utilToAppStorage,&utilToAppBuffer);
+  queue.mqttToMeter = xQueueCreateStatic(MAX_PENDING_CREDITS,sizeof(cloud_recharge_t),
+                                         mqttToMeterStorage,&mqttToMeterBuffer);
+  queue.meterToMqtt = xQueueCreateStatic(MAX_PENDING_CREDITS,sizeof(credit_status_t),
+                                         meterToMqttStorage,&meterToMqttBuffer);
+  if(queue.utilToMqtt != NULL && queue.utilToApp != NULL &&
+     queue.mqttToMeter != NULL && queue.meterToMqtt != NULL)
   {
     Serial.println("Queues successfully created");
   }  
-  xTaskCreatePinnedToCore(WiFiManagementTask,"",7000,NULL,1,&wifiTaskHandle,1);
-  xTaskCreatePinnedToCore(MqttTask,"",7000,NULL,1,NULL,1);
-  xTaskCreatePinnedToCore(ApplicationTask,"",20000,NULL,1,NULL,1); 
-  xTaskCreatePinnedToCore(MeterTask,"",20000,NULL,1,NULL,1);  
+  else
+  {
+    Serial.println("Queue creation failed");
+  }
+  wifiTaskHandle = 
+  xTaskCreateStaticPinnedToCore(WiFiManagementTask,"WiFi",WIFI_TASK_STACK,NULL,WIFI_TASK_PRIORITY,
+                                wifiTaskStack,&wifiTaskBuffer,WIFI_TASK_CORE);
+  TaskHandle_t mqttTaskHandle = 
+  xTaskCreateStaticPinnedToCore(MqttTask,"MQTT",MQTT_TASK_STACK,NULL,MQTT_TASK_PRIORITY,
+                                mqttTaskStack,&mqttTaskBuffer,MQTT_TASK_CORE);
+  TaskHandle_t appTaskHandle = 
+  xTaskCreateStaticPinnedToCore(ApplicationTask,"App",APP_TASK_STACK,NULL,APP_TASK_PRIORITY,
+                                appTaskStack,&appTaskBuffer,APP_TASK_CORE);
+  TaskHandle_t meterTaskHandle = 
+  xTaskCreateStaticPinnedToCore(MeterTask,"Meter",METER_TASK_STACK,NULL,METER_TASK_PRIORITY,
+                                meterTaskStack,&meterTaskBuffer,METER_TASK_CORE);
+  if(!memReport.AddTask(wifiTaskHandle,WIFI_TASK_STACK) ||
+     !memReport.AddTask(mqttTaskHandle,MQTT_TASK_STACK) ||
+     !memReport.AddTask(appTaskHandle,APP_TASK_STACK) ||
+     !memReport.AddTask(meterTaskHandle,METER_TASK_STACK))
+  {
+    Serial.println("Task creation failed");
+  }
+  cpuProfiler.AddTask(wifiTaskHandle);
+  cpuProfiler.AddTask(mqttTaskHandle);
+  cpuProfiler.AddTask(appTaskHandle);
+  cpuProfiler.AddTask(meterTaskHandle);
+  cpuProfiler.AddTask(xTaskGetCurrentTaskHandle()); //loop
+  if(!cpuProfiler.Begin(CPU_PROFILER_TIMER))
+  {
+    Serial.println("CPU profiler failed");
+  }
   setupTime = micros();
 }
 
+/**
+ * @brief Prints the memory report periodically or when 'm' is received
+ * on the serial port.
+*/
 void loop() 
 {
+  static uint32_t prevReportTime = millis();
+  bool isReportRequested = false;
+  while(Serial.available() > 0)
+  {
+    switch(Serial.read())
+    {
+      case 'm':
+        isReportRequested = true;
+        break;
+      case 'r':
+      {
+        char report[SIZE_REPORT];
+        radioLink.GetReport(report,sizeof(report));
+        Serial.print("Radio: ");
+        Serial.print(report);
+        Serial.print(" crypto(us):");
+        Serial.println(radioCrypto.GetMeanMicros());
+        radioLink.GetPeerReport(report,sizeof(report));
+        Serial.print(report);
+        break;
+      }
+      case 'K':
+      {//K<meter ID>: prints the radio key to provision on the meter
+        char idStr[6] = {0};
+        uint32_t id = 0;
+        uint8_t siteKey[RADIO_KEY_SIZE];
+        uint8_t key[RADIO_KEY_SIZE];
+        char keyStr[2 * RADIO_KEY_SIZE + 1];
+        Serial.readBytesUntil('\n',idStr,sizeof(idStr) - 1);
+        idStr[strcspn(idStr,"\r")] = '\0';
+        GetSiteKey(siteKey);
+        if(ParseUnsigned(idStr,&id) && id <= UINT16_MAX &&
+           RadioCrypto::DeriveKey(siteKey,id,key))
+        {
+          FormatHex(key,sizeof(key),keyStr,sizeof(keyStr));
+          Serial.print("Radio key of meter ");
+          Serial.print(id);
+          Serial.print(": K");
+          Serial.println(keyStr);
+        }
+        memset(siteKey,0,sizeof(siteKey));
+        memset(key,0,sizeof(key));
+        break;
+      }
+      case 'l':
+      {
+        char report[192];
+        GetLatencyReport(report,sizeof(report));
+        Serial.print("Latency(ms): ");
+        Serial.println(report);
+        break;
+      }
+      case 't':
+      {
+        uint16_t milliseconds;
+        uint32_t time = GetTime(&milliseconds);
+        Serial.print("Time: ");
+        Serial.print(time);
+        Serial.print('.');
+        Serial.println(milliseconds);
+        break;
+      }
+      case 'n':
+      {
+        char report[64];
+        notifier.GetReport(report,sizeof(report));
+        Serial.print("Notifications: ");
+        Serial.println(report);
+        break;
+      }
+      case 'c':
+      {
+        char report[256];
+        cpuProfiler.GetReport(report,sizeof(report));
+        Serial.print("CPU: ");
+        Serial.println(report);
+        break;
+      }
+    }
+  }
+  if(isReportRequested || (millis() - prevReportTime) >= MEM_REPORT_PERIOD)
+  {
+    memReport.Report(Serial);
+    prevReportTime = millis();
+  }
+  vTaskDelay(pdMS_TO_TICKS(100));
 }
 
 /**
@@ -182,8 +676,11 @@ void WiFiManagementTask(void* pvParameters)
   const uint16_t accessPointTimeout = 50000; //millisecs
   static WiFiManager wm;
   WiFi.mode(WIFI_STA);  
+  configTime(0,0,NTP_SERVER1,NTP_SERVER2); //UTC, synced once connected (and periodically)
   wm.addParameter(&subTopic);
   wm.addParameter(&clientID);
+  wm.addParameter(&rollupPeriodParam);
+  wm.addParameter(&cloudKeyParam);
   wm.setConfigPortalBlocking(false);
   wm.setSaveParamsCallback(WiFiManagerCallback);   
   //Auto-connect to previous network if available.
@@ -228,9 +725,53 @@ void WiFiManagementTask(void* pvParameters)
         esp_restart();
       }
     }    
+    vTaskDelay(pdMS_TO_TICKS(10));
   }
 }
 
+/**
+ * @brief Publishes a message (a failure is logged).
+ * @return true if successful, false if otherwise (e.g. connection lost).
+*/
+static bool Publish(PubSubClient& mqttClient,const char* topic,const char* payload)
+{
+  if(!mqttClient.publish(topic,payload))
+  {
+    LOG_WARN(MQTT,"Publish failed (%lu bytes)",strlen(payload));
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Publishes (to "<topic>/rollup") one message per meter with the 
+ * aggregates of its readings since the previous rollup (see Rollup::Format()).
+*/
+static void PublishRollups(PubSubClient& mqttClient,const char* topic)
+{
+  char rollupTopic[SIZE_TOPIC + 7];
+  char dataToPublish[SIZE_REPORT];
+  Rollup::summary_t summary;
+  uint16_t cursor = 0;
+  uint32_t numOfMeters = 0;
+  uint32_t numOfReadings = 0;
+  uint32_t numOfFailures = 0;
+  
+  snprintf(rollupTopic,sizeof(rollupTopic),"%s/rollup",topic);
+  while(rollup.Take(&cursor,&summary))
+  {
+    if(Rollup::Format(&summary,dataToPublish,sizeof(dataToPublish)) == 0 ||
+       !Publish(mqttClient,rollupTopic,dataToPublish))
+    {
+      numOfFailures++;
+    }
+    numOfMeters++;
+    numOfReadings += summary.numOfReadings;
+  }
+  LOG_INFO(MQTT,"Rollup: %lu readings in %lu messages (%lu failed)",numOfReadings,
+           numOfMeters,numOfFailures);
+}
+
 /**
  * @brief Handles communication with the HiveMQ broker.
 */
@@ -238,14 +779,23 @@ void MqttTask(void* pvParameters)
 {
   static WiFiClient wifiClient;
   static PubSubClient mqttClient(wifiClient);
-  static char dataToPublish[120];
   
   char prevSubTopic[SIZE_TOPIC] = {0};
   char prevClientID[SIZE_CLIENT_ID] = {0};
   const char *mqttBroker = "broker.hivemq.com";
   const uint16_t mqttPort = 1883;  
-  sensor_t sensorData = {};
+  reading_t reading = {};
+  uint32_t prevStatsTime = millis();
+  uint32_t prevRollupTime = millis();
+  credit_status_t creditStatus = {};
+  bool isStatusPending = false; //not yet published
   
+  mqttClient.setCallback(MqttCallback);
+  //The default buffer (256 bytes) can't hold a report plus its topic
+  if(!mqttClient.setBufferSize(MQTT_BUFFER_SIZE))
+  {
+    LOG_ERROR(MQTT,"MQTT buffer allocation failed");
+  }
   while(1)
   {
     if(WiFi.status() == WL_CONNECTED)
@@ -261,48 +811,124 @@ void MqttTask(void* pvParameters)
         {
           if(mqttClient.connect(prevClientID))
           {
-            Serial.println("Connected to HiveMQ broker");
+            LOG_INFO(MQTT,"Connected to HiveMQ broker");
           }
         } 
+        char commandTopic[SIZE_TOPIC + 9] = {0};
+        snprintf(commandTopic,sizeof(commandTopic),"%s/recharge",prevSubTopic);
+        mqttClient.subscribe(commandTopic);
       }
       else
       {
-        //Receive 'units consumed' by users from Utility task
-        if(xQueueReceive(queue.utilToMqtt,&sensorData,0) == pdPASS)
+        mqttClient.loop(); //receives commands (see MqttCallback)
+        //Acknowledge cloud recharges: "<command ID>,<meter ID>,<status>"
+        //(retried until published). Only FAIL means that the credit will 
+        //never be applied. PENDING is followed by the final status (EXPIRED:
+        //no reply from the meter, which may have applied it).
+        if(isStatusPending || xQueueReceive(queue.meterToMqtt,&creditStatus,0) == pdPASS)
         {
-          //Converting the user units (volumes) from mL to L
-          sensorData.volume1 /= 1000.0;
-          sensorData.volume2 /= 1000.0;
-          sensorData.volume3 /= 1000.0;
-          Serial.println("Util-MQTT RX PASS\n");
-
-          char volume1Buff[11] = {0};
-          char volume2Buff[11] = {0};
-          char volume3Buff[11] = {0};
-
-          FloatToString(sensorData.volume1,volume1Buff,2);
-          FloatToString(sensorData.volume2,volume2Buff,2);
-          FloatToString(sensorData.volume3,volume3Buff,2);
-
-          strcat(dataToPublish,"USER1: ");
-          strcat(dataToPublish,volume1Buff);
-          strcat(dataToPublish," L\n");
-          strcat(dataToPublish,"USER2: ");
-          strcat(dataToPublish,volume2Buff);
-          strcat(dataToPublish," L\n");
-          strcat(dataToPublish,"USER3: ");
-          strcat(dataToPublish,volume3Buff);
-          strcat(dataToPublish," L");
-                                                     
-          mqttClient.publish(prevSubTopic,dataToPublish);
-          uint32_t dataLen = strlen(dataToPublish);
-          memset(dataToPublish,'\0',dataLen);
+          const char* const statusNames[] = {",OK",",FAIL",",UNKNOWN",",PENDING",",EXPIRED"};
+          char ackTopic[SIZE_TOPIC + 13] = {0};
+          char ack[32];
+          StringBuilder payload(ack,sizeof(ack));
+          payload.AppendUnsigned(creditStatus.commandId).Append(',')
+                 .AppendUnsigned(creditStatus.meterId)
+                 .Append(statusNames[creditStatus.status]);
+          snprintf(ackTopic,sizeof(ackTopic),"%s/recharge/ack",prevSubTopic);
+          isStatusPending = !Publish(mqttClient,ackTopic,ack);
+        }
+        //Receive 'units consumed' by users from Utility task (raw mode)
+        if(xQueueReceive(queue.utilToMqtt,&reading,0) == pdPASS)
+        {
+          //User units (volumes) in L with 2 decimal places (volumes are in mL)
+          sensor_t& sensorData = reading.sensorData;
+          char dataToPublish[112];
+          StringBuilder payload(dataToPublish,sizeof(dataToPublish));
+          payload.Append("METER: ").AppendUnsigned(reading.meterId).Append('\n')
+                 .Append("TIME: ").AppendUnsigned(reading.timestamp).Append('\n')
+                 .Append("USER1: ").AppendFixed(lround(sensorData.volume1 / 10),2).Append(" L\n")
+                 .Append("USER2: ").AppendFixed(lround(sensorData.volume2 / 10),2).Append(" L\n")
+                 .Append("USER3: ").AppendFixed(lround(sensorData.volume3 / 10),2).Append(" L");
+          Publish(mqttClient,prevSubTopic,dataToPublish);
         }  
+        if(rollupPeriod > 0 && (millis() - prevRollupTime) >= (1000 * rollupPeriod))
+        {
+          PublishRollups(mqttClient,prevSubTopic);
+          prevRollupTime = millis();
+        }
+        //Publish CPU usage per task and radio link statistics
+        if((millis() - prevStatsTime) >= STATS_REPORT_PERIOD)
+        {
+          char statsTopic[SIZE_TOPIC + 8] = {0};
+          char report[SIZE_REPORT];
+          snprintf(statsTopic,sizeof(statsTopic),"%s/cpu",prevSubTopic);
+          cpuProfiler.GetReport(report,sizeof(report));
+          Publish(mqttClient,statsTopic,report);
+          snprintf(statsTopic,sizeof(statsTopic),"%s/radio",prevSubTopic);
+          radioLink.GetReport(report,sizeof(report));
+          Publish(mqttClient,statsTopic,report);
+          snprintf(statsTopic,sizeof(statsTopic),"%s/links",prevSubTopic);
+          radioLink.GetPeerReport(report,sizeof(report));
+          Publish(mqttClient,statsTopic,report);
+          snprintf(statsTopic,sizeof(statsTopic),"%s/latency",prevSubTopic);
+          GetLatencyReport(report,sizeof(report));
+          Publish(mqttClient,statsTopic,report);
+          snprintf(statsTopic,sizeof(statsTopic),"%s/notify",prevSubTopic);
+          notifier.GetReport(report,sizeof(report));
+          Publish(mqttClient,statsTopic,report);
+          prevStatsTime = millis();
+        }
       }
     }
+    vTaskDelay(pdMS_TO_TICKS(10));
   }
 }
 
+/**
+ * @brief Sends an SMS to a local phone number (e.g. 08012345678).
+*/
+static void SendSMS(SIM800L& gsm,const char* phoneNum,char* message)
+{
+  char ccPhoneNum[SIZE_PHONE + 3] = "+234"; //country code (+234:NG)
+  strcpy(ccPhoneNum + 4,phoneNum + 1);
+  gsm.SendSMS(ccPhoneNum,message);
+}
+
+/**
+ * @brief Sends a notification (all of its events in one SMS) to a user. 
+ * Users are reached on the phone number of their last recharge request.
+*/
+static void SendNotification(SIM800L& gsm,const notification_t* notification)
+{
+  Ledger::account_t account;
+  if(!ledger.GetAccount(notification->meterId,notification->userIndex,&account) ||
+     account.phoneNum[0] == '\0')
+  {
+    LOG_DEBUG(APP,"No phone number (meter %lu, user %ld)",notification->meterId,
+              notification->userIndex);
+    return;
+  }
+  account.phoneNum[SIZE_PHONE - 1] = '\0';
+  char message[161]; //1 SMS
+  StringBuilder sms(message,sizeof(message));
+  sms.Append("Water meter ").AppendUnsigned(notification->meterId)
+     .Append(", user ").AppendUnsigned(notification->userIndex + 1).Append(':');
+  if(notification->events & NOTIFY_LOW_BALANCE)
+  {
+    sms.Append(" Your balance is low (").AppendFixed(notification->balance / 10,2).Append(" L).");
+  }
+  if(notification->events & NOTIFY_ZERO_BALANCE)
+  {
+    sms.Append(" Your balance is exhausted, the valve is closed.");
+  }
+  if(notification->events & NOTIFY_LEAK)
+  {
+    sms.Append(" Water has been flowing for hours, check for a leak.");
+  }
+  SendSMS(gsm,account.phoneNum,message);
+  LOG_INFO(APP,"Notification SMS sent (events: 0x%02lx)",notification->events);
+}
+
 /**
  * @brief Handles main application logic
 */
@@ -310,11 +936,17 @@ void ApplicationTask(void* pvParameters)
 {
   static SIM800L gsm(&Serial2);
   bool isWifiTaskSuspended = false;
-  recharge_util_t recharge = {};
-  char otp[SIZE_OTP] = {0};
+  otp_sms_t otpSms = {};
+  uint32_t prevFlushTime = millis();
   
   while(1)
   {
+    //Persist account balances periodically (kept off the radio path)
+    if((millis() - prevFlushTime) >= LEDGER_FLUSH_PERIOD)
+    {
+      ledger.Flush();
+      prevFlushTime = millis();
+    }
     //Suspend WiFi Management task if the system is already.... 
     //connected to a Wi-Fi network
     if(WiFi.status() == WL_CONNECTED && !isWifiTaskSuspended)
@@ -329,46 +961,249 @@ void ApplicationTask(void* pvParameters)
       vTaskResume(wifiTaskHandle);
       isWifiTaskSuspended = false;
     }
-    //Receive recharge details (phone number & units) from Utility task
-    if(xQueueReceive(queue.utilToApp1,&recharge,0) == pdPASS)
+    //Receive recharge details (phone number, units & OTP) from Meter task
+    if(xQueueReceive(queue.utilToApp,&otpSms,0) == pdPASS)
     {
-      Serial.println("Util-App recharge RX PASS\n");
+      //Structuring the SMS to be sent to the user
+      char message[64];
+      StringBuilder sms(message,sizeof(message));
+      sms.Append("OTP for a recharge of ").AppendUnsigned(otpSms.recharge.units)
+         .Append(" units is: ").Append(otpSms.otp);
+
+      SendSMS(gsm,otpSms.recharge.phoneNum,message);
+      latencyStats.Record(STAGE_SMS,otpSms.requestTime);
+      LOG_INFO(APP,"OTP SMS sent (%lu units)",otpSms.recharge.units);
     }
-    //Receive OTP from Utility task
-    if(xQueueReceive(queue.utilToApp2,otp,0) == pdPASS)
+    //Notifications are sent in small batches, never ahead of a waiting OTP
+    notification_t notification;
+    for(uint8_t i = 0; i < NOTIFY_BATCH_SIZE && uxQueueMessagesWaiting(queue.utilToApp) == 0 &&
+        notifier.GetNext(&notification); i++)
     {
-      Serial.println("Util-App OTP RX PASS\n");
+      SendNotification(gsm,&notification);
     }
-    //Send SMS containing OTP and units to the user
-    if(strcmp(recharge.phoneNum,"") && recharge.units > 0 && strcmp(otp,""))
-    { 
-      const char msg1[] = "OTP for a recharge of ";
-      const char msg2[] = " units is: ";      
-      char unitsStr[SIZE_REQUEST] = {0};
-      IntegerToString(recharge.units,unitsStr);
-      
-      //Structuring the SMS to be sent to the user
-      uint8_t msgSize = strlen(msg1) + strlen(unitsStr) + strlen(msg2) + SIZE_OTP;
-      char message[msgSize] = {0};      
-      strcat(message,msg1);
-      strcat(message,unitsStr);
-      strcat(message,msg2);
-      strcat(message,otp);
-
-      char ccPhoneNum[SIZE_PHONE + 3] = "+234"; //country code (+234:NG)
-      strcpy(ccPhoneNum + 4,recharge.phoneNum + 1);
-      gsm.SendSMS(ccPhoneNum,message);
-
-      Serial.print("MESSAGE: ");
-      Serial.println(message);
-      Serial.print("CC PHONE: ");
-      Serial.println(ccPhoneNum);
-      
-      memset(recharge.phoneNum,'\0',SIZE_PHONE);
-      recharge.units = 0;
-      memset(otp,'\0',SIZE_OTP);
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+/**
+ * @brief Flash key of the last counter accepted from a meter's recharge request.
+*/
+static String CounterKey(uint16_t meterId)
+{
+  return String("r") + meterId;
+}
+
+/**
+ * @brief Authenticates and decrypts a frame from a meter and rejects replays.
+ * @param message: Buffer of RADIO_MAX_PLAINTEXT bytes.
+ * @return true if the frame is authentic and fresh, false if otherwise.
+*/
+static bool OpenFrame(const radio_frame_t* frame,uint8_t* message)
+{
+  if(!replayGuard.IsKnown(frame->meterId))
+  {
+    replayGuard.Accept(frame->meterId,preferences.getULong(CounterKey(frame->meterId).c_str(),0));
+  }
+  if(!replayGuard.IsFresh(frame->meterId,frame->counter))
+  {
+    LOG_WARN(METER,"Replayed frame from meter %lu",frame->meterId);
+    return false;
+  }
+  if(!SetMeterKey(frame->meterId) || !radioCrypto.Open(RADIO_UPLINK,frame,message))
+  {
+    LOG_WARN(METER,"Unauthentic frame (meter %lu)",frame->meterId);
+    return false;
+  }
+  replayGuard.Accept(frame->meterId,frame->counter);
+  return true;
+}
+
+/**
+ * @brief Updates the ledger (and MQTT) with the latest readings of a meter.
+*/
+static void HandleTelemetry(uint16_t meterId,const telemetry_util_t* telemetry)
+{
+  sensor_t sensorData = telemetry->sensorData;
+  //Readings are timestamped at the source (by the utility if the meter's clock isn't set)
+  uint32_t timestamp = (telemetry->timestamp != 0) ? telemetry->timestamp : GetTime(NULL);
+  LOG_DEBUG(METER,"Meter %lu volumes (mL): %ld %ld %ld",meterId,lround(sensorData.volume1),
+            lround(sensorData.volume2),lround(sensorData.volume3));
+  //Update the ledger with the latest balances of the meter's users
+  const float volume[] = {sensorData.volume1,sensorData.volume2,sensorData.volume3};
+  uint32_t balances[ROLLUP_NUM_OF_USERS];
+  for(uint8_t i = 0; i < ROLLUP_NUM_OF_USERS; i++)
+  {
+    balances[i] = (volume[i] > 0) ? lround(volume[i]) : 0;
+    ledger.UpdateBalance(meterId,i,balances[i]);
+    notifier.Update(meterId,i,balances[i]);
+  }
+  if(rollupPeriod > 0)
+  {//Published by the MQTT task at the end of the rollup period
+    if(!rollup.Add(meterId,balances,timestamp))
+    {
+      LOG_WARN(METER,"Rollup full, reading of meter %lu dropped",meterId);
+    }
+    return;
+  }
+  //Send 'units consumed' by users to the MQTT task
+  reading_t reading = {meterId,sensorData,timestamp};
+  if(xQueueSend(queue.utilToMqtt,&reading,0) != pdPASS)
+  {
+    LOG_DEBUG(METER,"Util-MQTT TX FAIL (queue full)");
+  }
+}
+
+/**
+ * @brief Issues (or reissues) the OTP of a recharge request and sends it to
+ * the meter and (via SMS) to the user. A reissued OTP is only resent to the
+ * meter: the user already has it by SMS.
+*/
+static void HandleRechargeRequest(uint16_t meterId,const meter_util_t* meterToUtil)
+{
+  uint32_t requestTime = millis();
+  recharge_util_t recharge = {};
+  uint8_t userIndex = meterToUtil->userIndex;
+  memcpy(recharge.phoneNum,meterToUtil->phoneNum,sizeof(meterToUtil->phoneNum));
+  recharge.units = meterToUtil->units;
+  if(userIndex >= ROLLUP_NUM_OF_USERS || !strcmp(recharge.phoneNum,"") || 
+     recharge.units == 0)
+  {
+    LOG_WARN(METER,"Invalid recharge request: meter %lu, user %ld",meterId,userIndex);
+    return;
+  }
+  ledger.UpdatePhone(meterId,userIndex,recharge.phoneNum);
+  //A retransmitted request reuses the pending OTP (the user may already have it)
+  otp_sms_t otpSms = {};
+  OtpTable::entry_t pending = {};
+  bool isNewOtp = !(otpTable.Get(meterId,userIndex,&pending) &&
+                    pending.requestId == meterToUtil->requestId && pending.otp[0] != '\0');
+  if(!isNewOtp)
+  {
+    strcpy(otpSms.otp,pending.otp);
+  }
+  else
+  {
+    RandomizeOtp(otpSms.otp);
+    otpTable.Add(meterId,userIndex,recharge.units,meterToUtil->requestId);
+    otpTable.SetOtp(meterId,userIndex,otpSms.otp);
+  }
+  if(SendOtpToMeter(meterId,userIndex,otpSms.otp))
+  {
+    latencyStats.Record(STAGE_OTP,requestTime);
+  }
+  LOG_INFO(METER,"Recharge request: meter %lu, user %ld, %lu units",meterId,
+           userIndex,recharge.units);
+  if(!isNewOtp)
+  {//e.g. the meter missed the radio acknowledgement and resent the request
+    return;
+  }
+  //Send recharge details (phone number, units & OTP) to App task
+  otpSms.recharge = recharge;
+  otpSms.requestTime = requestTime;
+  if(xQueueSend(queue.utilToApp,&otpSms,0) != pdPASS)
+  {
+    LOG_ERROR(METER,"Util-App OTP TX FAIL");
+  }
+}
+
+/**
+ * @brief Records a recharge with OTP once the meter reports that its node
+ * has applied it (a request may never be completed by the user). The OTP is
+ * no longer needed.
+*/
+static void HandleRechargeAck(uint16_t meterId,const recharge_ack_t* ack)
+{
+  if(ack->userIndex >= ROLLUP_NUM_OF_USERS)
+  {
+    return;
+  }
+  if(!ledger.RecordRecharge(meterId,ack->userIndex,ack->units,ack->txnId))
+  {
+    LOG_ERROR(METER,"Recharge of meter %lu not recorded",meterId);
+  }
+  otpTable.Remove(meterId,ack->userIndex);
+  LOG_INFO(METER,"Recharge applied: meter %lu, user %ld, %lu units",meterId,
+           ack->userIndex,ack->units);
+}
+
+/**
+ * @brief Reports the status of a cloud recharge to the MQTT task.
+*/
+static void ReportCredit(uint32_t commandId,uint16_t meterId,CreditStatus status)
+{
+  credit_status_t creditStatus = {commandId,meterId,(uint8_t)status};
+  if(xQueueSend(queue.meterToMqtt,&creditStatus,0) != pdPASS)
+  {
+    LOG_ERROR(METER,"Meter-MQTT TX FAIL");
+  }
+}
+
+/**
+ * @brief Takes new cloud recharges (from the MQTT task) and sends each one
+ * to its meter until the meter replies. A credit without a reply after 
+ * CREDIT_TIMEOUT is reported as pending, not failed: the meter may still
+ * apply it. The meter applies a recharge only once, so resending it is safe.
+ * A credit without a reply after CREDIT_EXPIRY is reported as expired and
+ * no longer sent. NB: Credits are kept in RAM (lost if the utility restarts).
+*/
+static void UpdateCredits(CreditTable& credits)
+{
+  cloud_recharge_t recharge;
+  while(!credits.IsFull() && xQueueReceive(queue.mqttToMeter,&recharge,0) == pdPASS)
+  {
+    if(!credits.Add(&recharge))
+    {
+      LOG_WARN(METER,"Recharge command %lu refused (meter %lu has too many credits)",
+               recharge.commandId,recharge.meterId);
+      ReportCredit(recharge.commandId,recharge.meterId,CREDIT_REFUSED);
     }
   }
+  while(credits.TakeTimedOut(&recharge))
+  {
+    LOG_WARN(METER,"Recharge command %lu pending (no reply from meter %lu)",
+             recharge.commandId,recharge.meterId);
+    ReportCredit(recharge.commandId,recharge.meterId,CREDIT_PENDING);
+  }
+  while(credits.TakeExpired(&recharge))
+  {
+    LOG_ERROR(METER,"Recharge command %lu expired (no reply from meter %lu)",
+              recharge.commandId,recharge.meterId);
+    ReportCredit(recharge.commandId,recharge.meterId,CREDIT_EXPIRED);
+  }
+  while(credits.TakeDue(&recharge))
+  {
+    credit_meter_t creditToMeter = {};
+    creditToMeter.type = RADIO_MSG_CREDIT;
+    creditToMeter.userIndex = recharge.userIndex;
+    creditToMeter.units = recharge.units;
+    creditToMeter.commandId = recharge.commandId;
+    SendToMeter(recharge.meterId,&creditToMeter,sizeof(creditToMeter),1);
+  }
+}
+
+/**
+ * @brief Handles the reply of a meter to a cloud recharge (final status).
+*/
+static void HandleCreditAck(CreditTable& credits,uint16_t meterId,const credit_ack_t* ack)
+{
+  cloud_recharge_t recharge;
+  uint32_t receivedTime;
+  if(ack->status >= CREDIT_PENDING || 
+     !credits.Remove(meterId,ack->commandId,&recharge,&receivedTime))
+  {
+    return; //reply to a resent credit (already handled)
+  }
+  if(ack->status == CREDIT_APPLIED)
+  {
+    ledger.RecordRecharge(meterId,recharge.userIndex,recharge.units);
+    latencyStats.Record(STAGE_CREDIT,receivedTime);
+  }
+  else
+  {
+    LOG_WARN(METER,"Recharge command %lu not applied (status: %ld)",
+             ack->commandId,ack->status);
+  }
+  ReportCredit(ack->commandId,meterId,(CreditStatus)ack->status);
 }
 
 /**
@@ -376,56 +1211,87 @@ void ApplicationTask(void* pvParameters)
 */
 void MeterTask(void* pvParameters)
 {
-  const uint8_t chipEn = 15;
-  const uint8_t chipSel = 5; 
   const byte addr[][6] = {"00001","00002"};
-  static RF24 nrf24(chipEn,chipSel);
+  uint32_t numOfPackets = 0; //link quality reported by meters (per evaluation)
+  uint32_t numOfRetries = 0;
+  uint32_t numOfLost = 0;
+  uint32_t prevEvalTime = millis();
+  static CreditTable credits(MAX_PENDING_CREDITS);
 
-  nrf24.begin();
+  if(!radioLink.Begin(preferences.getUChar("R",0),0))
+  {
+    LOG_ERROR(METER,"Radio not responding");
+  }
   nrf24.openWritingPipe(addr[0]);
   nrf24.openReadingPipe(1,addr[1]);
-  nrf24.setPALevel(RF24_PA_MAX);
   nrf24.startListening();
     
   while(1)
   {
-    if(nrf24.available())
+    radioLink.SampleCarrier();
+    if((millis() - prevEvalTime) >= RADIO_EVAL_PERIOD)
     {
-      meter_util_t meterToUtil = {};
-      nrf24.read(&meterToUtil,sizeof(meterToUtil));
-      //Debug
-      Serial.println("User volumes: ");
-      Serial.println(meterToUtil.sensorData.volume1);
-      Serial.println(meterToUtil.sensorData.volume2);
-      Serial.println(meterToUtil.sensorData.volume3);
-      Serial.print("Phone: ");
-      Serial.println(meterToUtil.recharge.phoneNum);
-      Serial.print("Units required: ");
-      Serial.println(meterToUtil.recharge.units);
-      //Send 'units consumed' by users to the MQTT task
-      if(xQueueSend(queue.utilToMqtt,&meterToUtil.sensorData,0) == pdPASS)
-      {
-        Serial.println("Util-MQTT TX PASS\n");
-      }
-      if(strcmp(meterToUtil.recharge.phoneNum,"") && (meterToUtil.recharge.units > 0))
+      EvaluateRadioProfile(numOfPackets,numOfRetries,numOfLost);
+      numOfPackets = 0;
+      numOfRetries = 0;
+      numOfLost = 0;
+      prevEvalTime = millis();
+    }
+    UpdateCredits(credits);
+    radio_frame_t frame;
+    uint8_t message[RADIO_MAX_PLAINTEXT];
+    if(radioLink.Read(&frame,sizeof(frame)) && OpenFrame(&frame,message))
+    {
+      switch(message[0])
       {
-        char otp[SIZE_OTP] = {0};
-        RandomizeOtp(otp);
-        SendOtpToMeter(nrf24,otp);
-        Serial.print("OTP = ");
-        Serial.println(otp);
-        //Send recharge details (phone number & units) to App task
-        if(xQueueSend(queue.utilToApp1,&meterToUtil.recharge,0) == pdPASS)
+        case RADIO_MSG_TELEMETRY:
         {
-          Serial.println("Util-App recharge TX PASS\n");
+          telemetry_util_t telemetry;
+          memcpy(&telemetry,message,sizeof(telemetry));
+          numOfPackets++;
+          numOfTelemetry++;
+          radioLink.ReportQuality(frame.meterId,telemetry.linkQuality);
+          if(telemetry.linkQuality == 0xFF)
+          {
+            numOfLost++;
+          }
+          else
+          {
+            numOfRetries += telemetry.linkQuality;
+          }
+          HandleTelemetry(frame.meterId,&telemetry);
+          break;
+        }
+        case RADIO_MSG_RECHARGE:
+        {
+          meter_util_t meterToUtil;
+          memcpy(&meterToUtil,message,sizeof(meterToUtil));
+          //Replays of recharge requests are also rejected after a restart
+          preferences.putULong(CounterKey(frame.meterId).c_str(),frame.counter);
+          HandleRechargeRequest(frame.meterId,&meterToUtil);
+          break;
+        }
+        case RADIO_MSG_TIME_REQUEST:
+          SendTimeToMeter(frame.meterId);
+          break;
+        case RADIO_MSG_CREDIT_ACK:
+        {
+          credit_ack_t ack;
+          memcpy(&ack,message,sizeof(ack));
+          HandleCreditAck(credits,frame.meterId,&ack);
+          break;
         }
-        //Send OTP to App task
-        if(xQueueSend(queue.utilToApp2,otp,0) == pdPASS)
+        case RADIO_MSG_RECHARGE_ACK:
         {
-          Serial.println("Util-App OTP TX PASS\n");
+          recharge_ack_t ack;
+          memcpy(&ack,message,sizeof(ack));
+          HandleRechargeAck(frame.meterId,&ack);
+          break;
         }
       }
     }
+    //Yield (the radio FIFO holds 3 packets, meters transmit every few seconds)
+    vTaskDelay(pdMS_TO_TICKS(5));
   }
 }
 
@@ -437,8 +1303,59 @@ void WiFiManagerCallback(void)
 {
   char prevSubTopic[SIZE_TOPIC] = {0};
   char prevClientID[SIZE_CLIENT_ID] = {0};
+  char prevRollupPeriod[SIZE_ROLLUP_PERIOD] = {0};
+  char prevCloudKey[SIZE_CLOUD_KEY] = {0};
   preferences.getBytes("5",prevSubTopic,SIZE_TOPIC);  
   preferences.getBytes("A",prevClientID,SIZE_CLIENT_ID);
+  preferences.getBytes("P",prevRollupPeriod,SIZE_ROLLUP_PERIOD);
+  preferences.getBytes("C",prevCloudKey,SIZE_CLOUD_KEY);
   StoreNewFlashData("5",subTopic.getValue(),prevSubTopic,SIZE_TOPIC);
   StoreNewFlashData("A",clientID.getValue(),prevClientID,SIZE_CLIENT_ID);
+  StoreNewFlashData("P",rollupPeriodParam.getValue(),prevRollupPeriod,SIZE_ROLLUP_PERIOD);
+  StoreNewFlashData("C",cloudKeyParam.getValue(),prevCloudKey,SIZE_CLOUD_KEY);
+}
+
+/**
+ * @brief Callback function that is called when a message is received on
+ * the command topic ("<topic>/recharge"). Authentic recharge commands that
+ * are newer than the last one accepted are passed to the Meter task, if the
+ * utility has received readings from the meter (it has an account for the
+ * user).
+*/
+void MqttCallback(char* topic,byte* payload,unsigned int length)
+{
+  char keyStr[SIZE_CLOUD_KEY] = {0};
+  uint8_t key[CLOUD_KEY_SIZE];
+  cloud_recharge_t recharge = {};
+  preferences.getBytes("C",keyStr,SIZE_CLOUD_KEY);
+  keyStr[SIZE_CLOUD_KEY - 1] = '\0';
+  bool isValid = ParseHex(keyStr,key,sizeof(key)) &&
+                 CloudCommand::ParseRecharge((const char*)payload,length,key,&recharge);
+  memset(key,0,sizeof(key));
+  if(!isValid)
+  {
+    LOG_WARN(MQTT,"Invalid recharge command");
+    return;
+  }
+  //Command IDs are never reused (replays are rejected, even after a restart)
+  if(recharge.commandId <= preferences.getULong("Q",0))
+  {
+    LOG_WARN(MQTT,"Replayed recharge command %lu",recharge.commandId);
+    return;
+  }
+  preferences.putULong("Q",recharge.commandId);
+  LOG_INFO(MQTT,"Recharge command %lu: meter %lu, user %ld, %lu units",recharge.commandId,
+           recharge.meterId,recharge.userIndex,recharge.units);
+  Ledger::account_t account;
+  credit_status_t status = {recharge.commandId,recharge.meterId,CREDIT_REFUSED};
+  if(!ledger.GetAccount(recharge.meterId,recharge.userIndex,&account))
+  {//Never sent to the meter (which may not exist)
+    xQueueSend(queue.meterToMqtt,&status,0);
+    LOG_WARN(MQTT,"Recharge command %lu: unknown meter/user",recharge.commandId);
+  }
+  else if(xQueueSend(queue.mqttToMeter,&recharge,0) != pdPASS)
+  {//Never sent to the meter
+    xQueueSend(queue.meterToMqtt,&status,0);
+    LOG_ERROR(MQTT,"MQTT-Meter TX FAIL");
+  }
 }
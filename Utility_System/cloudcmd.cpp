@@ -0,0 +1,266 @@
+#include <Arduino.h>
+#include <string.h>
+#include <mbedtls/md.h>
+#include "cloudcmd.h"
+#include "numfmt.h"
+
+/**
+ * @brief Checks the signature of a command in constant time (i.e. the time
+ * taken doesn't depend on how many bytes match).
+*/
+bool CloudCommand::IsSignatureValid(const char* text,size_t textLength,
+                                    const char* signature,const uint8_t* key)
+{
+  uint8_t expected[CLOUD_SIGNATURE_SIZE];
+  uint8_t received[CLOUD_SIGNATURE_SIZE];
+  const mbedtls_md_info_t* sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  if(!ParseHex(signature,received,sizeof(received)) ||
+     mbedtls_md_hmac(sha256,key,CLOUD_KEY_SIZE,(const uint8_t*)text,textLength,expected) != 0)
+  {
+    return false;
+  }
+  uint8_t diff = 0;
+  for(uint8_t i = 0; i < CLOUD_SIGNATURE_SIZE; i++)
+  {
+    diff |= (expected[i] ^ received[i]);
+  }
+  memset(expected,0,sizeof(expected));
+  return (diff == 0);
+}
+
+/**
+ * @brief Parses and authenticates a recharge command.
+ * @param payload: Command (not NULL-terminated).
+ * @param key: Cloud key (CLOUD_KEY_SIZE bytes).
+ * @return true if the command is valid and authentic, false if otherwise.
+*/
+bool CloudCommand::ParseRecharge(const char* payload,size_t payloadLength,
+                                 const uint8_t* key,cloud_recharge_t* recharge)
+{
+  const uint8_t numOfFields = 4;
+  char text[CLOUD_MAX_COMMAND_SIZE + 1];
+  if(payloadLength > CLOUD_MAX_COMMAND_SIZE)
+  {
+    return false;
+  }
+  memcpy(text,payload,payloadLength);
+  text[payloadLength] = '\0';
+  char* signature = strrchr(text,',');
+  if(signature == NULL || 
+     !CloudCommand::IsSignatureValid(text,signature - text,signature + 1,key))
+  {
+    return false;
+  }
+  *signature = '\0';
+  //Fields: command ID, meter ID, user, units
+  uint32_t fields[numOfFields];
+  char* field = text;
+  for(uint8_t i = 0; i < numOfFields; i++)
+  {
+    char* next = strchr(field,',');
+    if((next == NULL) != (i == numOfFields - 1))
+    {
+      return false; //too few or too many fields
+    }
+    if(next != NULL)
+    {
+      *next = '\0';
+    }
+    if(!ParseUnsigned(field,&fields[i]))
+    {
+      return false;
+    }
+    if(next != NULL)
+    {
+      field = next + 1;
+    }
+  }
+  if(fields[0] == 0 || fields[1] > UINT16_MAX || 
+     fields[2] == 0 || fields[2] > UINT8_MAX || fields[3] == 0 || fields[3] > CLOUD_MAX_UNITS)
+  {
+    return false;
+  }
+  recharge->commandId = fields[0];
+  recharge->meterId = fields[1];
+  recharge->userIndex = fields[2] - 1;
+  recharge->units = fields[3];
+  return true;
+}
+
+/**
+ * @brief Checks if a credit is the oldest one of its meter (the only one
+ * that may be sent).
+*/
+bool CreditTable::IsOldest(const entry_t* entry)
+{
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    if(entries[i].isInUse && entries[i].recharge.meterId == entry->recharge.meterId &&
+       entries[i].recharge.commandId < entry->recharge.commandId)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Creates the table.
+ * @param capacity: Max number of credits awaiting a reply.
+*/
+CreditTable::CreditTable(uint8_t capacity)
+{
+  //Initialize private variables
+  entries = new entry_t[capacity];
+  memset(entries,0,capacity * sizeof(entry_t));
+  this->capacity = capacity;
+}
+
+bool CreditTable::IsFull(void)
+{
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    if(!entries[i].isInUse)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Adds a credit (due to be sent immediately).
+ * @return true if the credit was added, false if the table is full or its
+ * meter already has CREDIT_MAX_PER_METER credits.
+*/
+bool CreditTable::Add(const cloud_recharge_t* recharge)
+{
+  entry_t* freeEntry = NULL;
+  uint8_t numOfCredits = 0; //of the meter
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    entry_t* entry = &entries[i];
+    if(!entry->isInUse)
+    {
+      freeEntry = (freeEntry == NULL) ? entry : freeEntry;
+    }
+    else if(entry->recharge.meterId == recharge->meterId)
+    {
+      numOfCredits++;
+    }
+  }
+  if(freeEntry == NULL || numOfCredits >= CREDIT_MAX_PER_METER)
+  {
+    return false;
+  }
+  freeEntry->recharge = *recharge;
+  freeEntry->receivedTime = millis();
+  freeEntry->prevSendTime = freeEntry->receivedTime - CREDIT_RETRY_PERIOD;
+  freeEntry->isPending = false;
+  freeEntry->isInUse = true;
+  return true;
+}
+
+/**
+ * @brief Takes the next credit that has just timed out (to be reported as
+ * pending). The credit stays in the table.
+ * @return true if a credit has timed out, false if otherwise.
+*/
+bool CreditTable::TakeTimedOut(cloud_recharge_t* recharge)
+{
+  uint32_t currentTime = millis();
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    entry_t* entry = &entries[i];
+    if(entry->isInUse && !entry->isPending && 
+       (currentTime - entry->receivedTime) >= CREDIT_TIMEOUT)
+    {
+      entry->isPending = true;
+      *recharge = entry->recharge;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Takes the next credit without a reply after CREDIT_EXPIRY (to be
+ * reported as expired). The credit is removed.
+ * @return true if a credit has expired, false if otherwise.
+*/
+bool CreditTable::TakeExpired(cloud_recharge_t* recharge)
+{
+  uint32_t currentTime = millis();
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    entry_t* entry = &entries[i];
+    if(entry->isInUse && (currentTime - entry->receivedTime) >= CREDIT_EXPIRY)
+    {
+      entry->isInUse = false;
+      *recharge = entry->recharge;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Takes the next credit due to be (re)sent. Its retry period 
+ * restarts.
+ * @return true if a credit is due, false if otherwise.
+*/
+bool CreditTable::TakeDue(cloud_recharge_t* recharge)
+{
+  uint32_t currentTime = millis();
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    entry_t* entry = &entries[i];
+    uint32_t retryPeriod = entry->isPending ? CREDIT_SLOW_RETRY_PERIOD : CREDIT_RETRY_PERIOD;
+    if(entry->isInUse && (currentTime - entry->prevSendTime) >= retryPeriod &&
+       CreditTable::IsOldest(entry))
+    {
+      entry->prevSendTime = currentTime;
+      *recharge = entry->recharge;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Removes a credit (its meter has replied).
+ * @param recharge: Stores the credit.
+ * @param receivedTimePtr: (optional) Stores the time (millis) at which the
+ * credit was added.
+ * @return true if the credit was found, false if otherwise.
+*/
+bool CreditTable::Remove(uint16_t meterId,uint32_t commandId,cloud_recharge_t* recharge,
+                         uint32_t* receivedTimePtr)
+{
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    entry_t* entry = &entries[i];
+    if(entry->isInUse && entry->recharge.meterId == meterId && 
+       entry->recharge.commandId == commandId)
+    {
+      *recharge = entry->recharge;
+      if(receivedTimePtr != NULL)
+      {
+        *receivedTimePtr = entry->receivedTime;
+      }
+      entry->isInUse = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t CreditTable::GetNumOfPending(void)
+{
+  uint8_t numOfPending = 0;
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    numOfPending += (entries[i].isInUse && entries[i].isPending) ? 1 : 0;
+  }
+  return numOfPending;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#define CLOUD_KEY_SIZE          16
+#define CLOUD_SIGNATURE_SIZE    32 //HMAC-SHA256
+#define CLOUD_MAX_COMMAND_SIZE  128 //chars (payload)
+#define CREDIT_RETRY_PERIOD     1000 //millisecs (until the meter replies)
+#define CREDIT_TIMEOUT          30000 //millisecs (reported as pending afterwards)
+#define CREDIT_SLOW_RETRY_PERIOD 60000 //millisecs (pending credits)
+#define CREDIT_EXPIRY           3600000 //millisecs (reported as expired, no more retries)
+#define CREDIT_MAX_PER_METER    3 //credits of a meter awaiting its reply
+#define CLOUD_MAX_UNITS         100000 //per recharge command (L)
+
+//Outcome of a cloud recharge (reported by the meter, except CREDIT_PENDING)
+enum CreditStatus
+{
+  CREDIT_APPLIED = 0, //applied by the node
+  CREDIT_REFUSED,     //never applied (invalid command)
+  CREDIT_UNKNOWN,     //not applied now, may have been before (e.g. meter restarted)
+  CREDIT_PENDING,     //no reply from the meter yet
+  CREDIT_EXPIRED      //no reply from the meter before CREDIT_EXPIRY (no longer sent)
+};
+
+//Recharge command from the cloud
+typedef struct
+{
+  uint32_t commandId; //unique, increasing
+  uint16_t meterId;
+  uint8_t userIndex;
+  uint32_t units;
+}cloud_recharge_t;
+
+/**
+ * @brief Signed commands received from the cloud (via MQTT).
+ *
+ * A recharge command is the text "<command ID>,<meter ID>,<user>,<units>,<signature>"
+ * where users are numbered from 1, units are at most CLOUD_MAX_UNITS and the 
+ * signature is the HMAC-SHA256 (64 hex digits) of everything before the last
+ * comma, keyed with the cloud key.
+*/
+class CloudCommand
+{
+  private:
+    static bool IsSignatureValid(const char* text,size_t textLength,
+                                 const char* signature,const uint8_t* key);
+
+  public:
+    static bool ParseRecharge(const char* payload,size_t payloadLength,
+                              const uint8_t* key,cloud_recharge_t* recharge);
+};
+
+/**
+ * @brief Cloud recharges awaiting the reply of their meters.
+ *
+ * A credit is resent every CREDIT_RETRY_PERIOD until its meter replies. After
+ * CREDIT_TIMEOUT it is reported once as pending and resent every
+ * CREDIT_SLOW_RETRY_PERIOD: the meter may still apply it (e.g. when the node
+ * comes back), so the outcome is only known from the meter's reply. After
+ * CREDIT_EXPIRY it is removed and reported as expired. The meter may have 
+ * received it (and may still apply it), so the cloud has to check the 
+ * balance before issuing a new command.
+ *
+ * A meter has at most CREDIT_MAX_PER_METER credits in the table, so meters
+ * that don't reply can't fill it.
+ *
+ * NB: The table is kept in RAM. The credits in it are lost if the utility
+ * restarts (without a final status).
+ *
+ * The credits of a meter are sent one at a time, oldest (lowest command ID)
+ * first. A meter only applies a command newer than the last one it received,
+ * so a command it replies to can't have been overtaken by a later one.
+ *
+ * Not thread-safe (used by the task that talks to the meters).
+*/
+class CreditTable
+{
+  private:
+    typedef struct
+    {
+      cloud_recharge_t recharge;
+      uint32_t receivedTime; //millis
+      uint32_t prevSendTime;
+      bool isPending; //reported as pending
+      bool isInUse;
+    }entry_t;
+    entry_t* entries;
+    uint8_t capacity;
+
+    bool IsOldest(const entry_t* entry);
+
+  public:
+    CreditTable(uint8_t capacity);
+    bool IsFull(void);
+    bool Add(const cloud_recharge_t* recharge);
+    bool TakeTimedOut(cloud_recharge_t* recharge);
+    bool TakeExpired(cloud_recharge_t* recharge);
+    bool TakeDue(cloud_recharge_t* recharge);
+    bool Remove(uint16_t meterId,uint32_t commandId,cloud_recharge_t* recharge,
+                uint32_t* receivedTimePtr = NULL);
+    uint8_t GetNumOfPending(void);
+};
@@ -0,0 +1,589 @@
+#include <Arduino.h>
+#include <string.h>
+#include <algorithm>
+#include "ledger.h"
+
+uint32_t Ledger::Key(uint16_t meterId,uint8_t userIndex)
+{
+  return ((uint32_t)meterId << 8) | userIndex;
+}
+
+/**
+ * @brief FNV-1a hash of a log record (excluding the checksum field).
+ * Used to detect records that were partially written (e.g. power loss).
+*/
+uint32_t Ledger::Checksum(const record_t* record)
+{
+  const uint8_t* bytes = (const uint8_t*)record;
+  uint32_t hash = 2166136261UL;
+  for(uint8_t i = 0; i < offsetof(record_t,checksum); i++)
+  {
+    hash ^= bytes[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+uint16_t Ledger::Slot(uint32_t key)
+{
+  uint32_t hash = key * 2654435761UL;
+  hash ^= (hash >> 16);
+  return (hash & indexMask);
+}
+
+/**
+ * @brief Looks up an account using the hash index (linear probing).
+ * @return Pointer to the account, NULL if it doesn't exist.
+*/
+Ledger::account_t* Ledger::Find(uint16_t meterId,uint8_t userIndex)
+{
+  uint32_t key = Ledger::Key(meterId,userIndex);
+  uint16_t slot = Ledger::Slot(key);
+  while(index[slot] != 0)
+  {
+    account_t* account = &accounts[index[slot] - 1];
+    if(account->meterId == meterId && account->userIndex == userIndex)
+    {
+      return account;
+    }
+    slot = (slot + 1) & indexMask;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Looks up an account and creates it if it doesn't exist.
+ * @return Pointer to the account, NULL if the ledger is full.
+*/
+Ledger::account_t* Ledger::FindOrInsert(uint16_t meterId,uint8_t userIndex)
+{
+  uint32_t key = Ledger::Key(meterId,userIndex);
+  uint16_t slot = Ledger::Slot(key);
+  while(index[slot] != 0)
+  {
+    account_t* account = &accounts[index[slot] - 1];
+    if(account->meterId == meterId && account->userIndex == userIndex)
+    {
+      return account;
+    }
+    slot = (slot + 1) & indexMask;
+  }
+  if(numOfAccounts == maxAccounts)
+  {
+    return NULL;
+  }
+  account_t* account = &accounts[numOfAccounts];
+  memset(account,0,sizeof(account_t));
+  account->meterId = meterId;
+  account->userIndex = userIndex;
+  account->isDirty = 1; //new account, not yet persisted
+  numOfAccounts++;
+  index[slot] = numOfAccounts;
+  return account;
+}
+
+bool Ledger::WriteRecord(File& file,record_t* record)
+{
+  record->checksum = Ledger::Checksum(record);
+  return (file.write((uint8_t*)record,sizeof(record_t)) == sizeof(record_t));
+}
+
+/**
+ * @brief Appends a record to the log (opened by the caller). Nothing is
+ * appended after a corrupted (or partially written) record: the replay stops
+ * there, so the record would be lost. The log is compacted by the next flush.
+*/
+bool Ledger::AppendRecord(File& file,record_t* record)
+{
+  if(!isLogValid)
+  {
+    return false;
+  }
+  if(!Ledger::WriteRecord(file,record))
+  {
+    isLogValid = false; //part of the record may have been written
+    return false;
+  }
+  logSize += sizeof(record_t);
+  return true;
+}
+
+void Ledger::ApplyRecord(const record_t* record)
+{
+  account_t* account = Ledger::FindOrInsert(record->meterId,record->userIndex);
+  if(account == NULL)
+  {
+    return;
+  }
+  switch(record->type)
+  {
+    case REC_BALANCE:
+      account->balance = record->value1;
+      break;
+    case REC_PHONE:
+      memcpy(account->phoneNum,record->phoneNum,LEDGER_SIZE_PHONE);
+      break;
+    case REC_RECHARGE:
+      account->totalRecharged += record->value1;
+      account->lastRecharge = record->value1;
+      if(record->value2 != 0)
+      {
+        account->lastTxnId = record->value2;
+      }
+      break;
+    case REC_ACCOUNT:
+      account->balance = record->value1;
+      account->totalRecharged = record->value2;
+      account->lastRecharge = record->value3;
+      account->lastTxnId = record->value4;
+      memcpy(account->phoneNum,record->phoneNum,LEDGER_SIZE_PHONE);
+      break;
+  }
+}
+
+/**
+ * @brief Rebuilds the accounts from the log. A corrupted (or partially
+ * written) record ends the replay and the log is compacted to drop it.
+*/
+void Ledger::Replay(void)
+{
+  File file = fsPtr->open(path,"r");
+  if(!file)
+  {
+    return;
+  }
+  bool isCorrupted = false;
+  record_t record;
+  while(file.read((uint8_t*)&record,sizeof(record_t)) == sizeof(record_t))
+  {
+    if(record.checksum != Ledger::Checksum(&record))
+    {
+      isCorrupted = true;
+      break;
+    }
+    Ledger::ApplyRecord(&record);
+    logSize += sizeof(record_t);
+  }
+  for(uint16_t i = 0; i < numOfAccounts; i++)
+  {
+    accounts[i].isDirty = 0; //everything replayed is already persisted
+  }
+  if(file.size() > logSize)
+  {
+    isCorrupted = true; //incomplete record at the end of the log
+  }
+  file.close();
+  isLogValid = !isCorrupted;
+  if(isCorrupted)
+  {
+    Serial.println("Ledger: corrupted log, compacting");
+    Ledger::Compact();
+  }
+}
+
+/**
+ * @brief Copies the records of the log between two offsets to another file.
+*/
+bool Ledger::CopyRecords(File& file,uint32_t start,uint32_t end)
+{
+  File log = fsPtr->open(path,"r");
+  bool isWritten = log && log.seek(start);
+  record_t record;
+  for(uint32_t pos = start; isWritten && pos < end; pos += sizeof(record_t))
+  {
+    isWritten = (log.read((uint8_t*)&record,sizeof(record_t)) == sizeof(record_t)) &&
+                Ledger::WriteRecord(file,&record);
+  }
+  log.close();
+  return isWritten;
+}
+
+/**
+ * @brief Rewrites the log as the most recent recharge records, one record per
+ * account and the records appended during the compaction. Only the accounts
+ * are copied under the lock: the files are written without it, so updates
+ * wait for the copy and for the records appended meanwhile to be carried
+ * over, not for the whole log to be rewritten. The new log is written to a
+ * temporary file which then replaces the old one (rename is atomic), so a
+ * power loss during compaction loses nothing.
+ * @return true if successful, false if otherwise (the old log is kept).
+*/
+bool Ledger::Compact(void)
+{
+  //Copy of the accounts as of 'snapshotSize' bytes of log
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  uint16_t numInSnapshot = numOfAccounts;
+  uint32_t snapshotSize = logSize;
+  account_t* snapshot = NULL;
+  if(!isCompacting)
+  {
+    snapshot = (account_t*)malloc((numInSnapshot + 1) * sizeof(account_t));
+  }
+  if(snapshot != NULL)
+  {
+    memcpy(snapshot,accounts,numInSnapshot * sizeof(account_t));
+    isCompacting = true;
+  }
+  xSemaphoreGive(mutex);
+  if(snapshot == NULL)
+  {
+    return false;
+  }
+  File newLog = fsPtr->open(tmpPath,"w");
+  bool isWritten = newLog;
+  uint32_t newLogSize = 0;
+  record_t record;
+  //Keep recent recharge history (the account records that follow restore
+  //totals). Only the records replayed or appended are copied.
+  File oldLog = fsPtr->open(path,"r");
+  if(isWritten && oldLog)
+  {
+    uint32_t numOfRecharges = 0;
+    for(uint32_t pos = 0; pos < snapshotSize; pos += sizeof(record_t))
+    {
+      if(oldLog.read((uint8_t*)&record,sizeof(record_t)) != sizeof(record_t))
+      {
+        break;
+      }
+      numOfRecharges += (record.type == REC_RECHARGE);
+    }
+    uint32_t numToSkip = (numOfRecharges > LEDGER_MAX_HISTORY) ?
+                         (numOfRecharges - LEDGER_MAX_HISTORY) : 0;
+    oldLog.seek(0);
+    for(uint32_t pos = 0; isWritten && pos < snapshotSize; pos += sizeof(record_t))
+    {
+      isWritten = (oldLog.read((uint8_t*)&record,sizeof(record_t)) == sizeof(record_t));
+      if(!isWritten || record.type != REC_RECHARGE)
+      {
+        continue;
+      }
+      if(numToSkip > 0)
+      {
+        numToSkip--;
+        continue;
+      }
+      isWritten = Ledger::WriteRecord(newLog,&record);
+      newLogSize += sizeof(record_t);
+    }
+  }
+  oldLog.close();
+  for(uint16_t i = 0; isWritten && i < numInSnapshot; i++)
+  {
+    memset(&record,0,sizeof(record_t));
+    record.type = REC_ACCOUNT;
+    record.meterId = snapshot[i].meterId;
+    record.userIndex = snapshot[i].userIndex;
+    record.value1 = snapshot[i].balance;
+    record.value2 = snapshot[i].totalRecharged;
+    record.value3 = snapshot[i].lastRecharge;
+    record.value4 = snapshot[i].lastTxnId;
+    memcpy(record.phoneNum,snapshot[i].phoneNum,LEDGER_SIZE_PHONE);
+    isWritten = Ledger::WriteRecord(newLog,&record);
+    newLogSize += sizeof(record_t);
+  }
+  //Carry over the records appended since the copy: without the lock while
+  //there are many (appended records don't change), then the last ones and the
+  //rename with it
+  uint32_t copiedSize = snapshotSize;
+  for(uint8_t pass = 0; isWritten && pass < LEDGER_MAX_COPY_PASSES; pass++)
+  {
+    xSemaphoreTake(mutex,portMAX_DELAY);
+    uint32_t size = logSize;
+    xSemaphoreGive(mutex);
+    if((size - copiedSize) <= LEDGER_MAX_LOCKED_COPY * sizeof(record_t))
+    {
+      break;
+    }
+    isWritten = Ledger::CopyRecords(newLog,copiedSize,size);
+    newLogSize += size - copiedSize;
+    copiedSize = size;
+  }
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  if(isWritten && logSize > copiedSize)
+  {
+    isWritten = Ledger::CopyRecords(newLog,copiedSize,logSize);
+    newLogSize += logSize - copiedSize;
+  }
+  newLog.close();
+  bool isCompacted = isWritten && fsPtr->rename(tmpPath,path);
+  if(!isCompacted)
+  {
+    Serial.println("Ledger: compaction failed");
+    fsPtr->remove(tmpPath);
+  }
+  else
+  {
+    logSize = newLogSize;
+    isLogValid = true;
+    for(uint16_t i = 0; i < numInSnapshot; i++)
+    {//Balances changed since the copy are persisted by the next flush
+      if(accounts[i].balance == snapshot[i].balance)
+      {
+        accounts[i].isDirty = 0;
+      }
+    }
+  }
+  isCompacting = false;
+  xSemaphoreGive(mutex);
+  free(snapshot);
+  return isCompacted;
+}
+
+/**
+ * @brief Cleans up after a compaction interrupted by a power loss. A
+ * temporary log next to the log is incomplete and is deleted. Without the log,
+ * it is complete (the old log was removed before the rename by earlier
+ * versions) and becomes the log.
+*/
+void Ledger::Recover(void)
+{
+  if(!fsPtr->exists(tmpPath))
+  {
+    return;
+  }
+  if(fsPtr->exists(path))
+  {
+    Serial.println("Ledger: incomplete compaction deleted");
+    fsPtr->remove(tmpPath);
+  }
+  else
+  {
+    Serial.println("Ledger: compacted log recovered");
+    fsPtr->rename(tmpPath,path);
+  }
+}
+
+/**
+ * @brief Creates the ledger. Call Begin() before using it.
+ * @param fsPtr: Filesystem holding the log (e.g. &LittleFS, mounted by the caller).
+ * @param path: Path of the log file.
+ * @param maxAccounts: Max number of accounts to keep in RAM.
+*/
+Ledger::Ledger(fs::FS* fsPtr,const char* path,uint16_t maxAccounts)
+{
+  //Initialize private variables
+  this->fsPtr = fsPtr;
+  this->path = path;
+  memset(tmpPath,0,sizeof(tmpPath));
+  strncpy(tmpPath,path,sizeof(tmpPath) - 5);
+  strcat(tmpPath,".tmp");
+  this->maxAccounts = maxAccounts;
+  mutex = NULL;
+  accounts = NULL;
+  index = NULL;
+  numOfAccounts = 0;
+  indexMask = 0;
+  logSize = 0;
+  isLogValid = true;
+  isCompacting = false;
+}
+
+/**
+ * @brief Allocates the accounts and the index, then loads the log from flash.
+ * @return true if successful, false if memory could not be allocated.
+*/
+bool Ledger::Begin(void)
+{
+  //Index size: power of 2, at least twice the number of accounts (load factor <= 0.5)
+  uint32_t indexSize = 1;
+  while(indexSize < (2UL * maxAccounts))
+  {
+    indexSize <<= 1;
+  }
+  indexMask = indexSize - 1;
+  mutex = xSemaphoreCreateMutex();
+  accounts = (account_t*)calloc(maxAccounts,sizeof(account_t));
+  index = (uint16_t*)calloc(indexSize,sizeof(uint16_t));
+  if(mutex == NULL || accounts == NULL || index == NULL)
+  {
+    Serial.println("Ledger: allocation failed");
+    return false;
+  }
+  Ledger::Recover();
+  Ledger::Replay();
+  Serial.print("Ledger: accounts loaded = ");
+  Serial.println(numOfAccounts);
+  return true;
+}
+
+/**
+ * @brief Gets a copy of an account.
+ * @return true if the account exists, false if otherwise.
+*/
+bool Ledger::GetAccount(uint16_t meterId,uint8_t userIndex,account_t* accountPtr)
+{
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  account_t* account = Ledger::Find(meterId,userIndex);
+  if(account != NULL)
+  {
+    *accountPtr = *account;
+  }
+  xSemaphoreGive(mutex);
+  return (account != NULL);
+}
+
+/**
+ * @brief Updates the balance of an account (created if it doesn't exist).
+ * The balance is persisted on the next call to Flush().
+*/
+bool Ledger::UpdateBalance(uint16_t meterId,uint8_t userIndex,uint32_t balance)
+{
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  account_t* account = Ledger::FindOrInsert(meterId,userIndex);
+  if(account != NULL && account->balance != balance)
+  {
+    account->balance = balance;
+    account->isDirty = 1;
+  }
+  xSemaphoreGive(mutex);
+  return (account != NULL);
+}
+
+/**
+ * @brief Updates the phone number of an account (persisted immediately if changed).
+*/
+bool Ledger::UpdatePhone(uint16_t meterId,uint8_t userIndex,const char* phoneNum)
+{
+  bool isUpdated = false;
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  account_t* account = Ledger::FindOrInsert(meterId,userIndex);
+  if(account != NULL)
+  {
+    isUpdated = true;
+    if(strncmp(account->phoneNum,phoneNum,LEDGER_SIZE_PHONE))
+    {
+      record_t record = {};
+      record.type = REC_PHONE;
+      record.meterId = meterId;
+      record.userIndex = userIndex;
+      strncpy(record.phoneNum,phoneNum,LEDGER_SIZE_PHONE - 1);
+      memcpy(account->phoneNum,record.phoneNum,LEDGER_SIZE_PHONE);
+      File file = fsPtr->open(path,"a");
+      isUpdated = file && Ledger::AppendRecord(file,&record);
+      file.close();
+    }
+  }
+  xSemaphoreGive(mutex);
+  return isUpdated;
+}
+
+/**
+ * @brief Appends a recharge to the history of an account.
+ * @param txnId: (optional) Meter transaction that applied the recharge. A
+ * recharge with the same transaction as the last one recorded for the account
+ * is a duplicate (e.g. resent report) and is ignored.
+ * @return true if recorded (or a duplicate), false if otherwise.
+*/
+bool Ledger::RecordRecharge(uint16_t meterId,uint8_t userIndex,uint32_t units,
+                            uint32_t txnId)
+{
+  bool isRecorded = false;
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  account_t* account = Ledger::FindOrInsert(meterId,userIndex);
+  if(account != NULL && txnId != 0 && txnId == account->lastTxnId)
+  {
+    isRecorded = true;
+  }
+  else if(account != NULL)
+  {
+    record_t record = {};
+    record.type = REC_RECHARGE;
+    record.meterId = meterId;
+    record.userIndex = userIndex;
+    record.value1 = units;
+    record.value2 = txnId;
+    File file = fsPtr->open(path,"a");
+    isRecorded = file && Ledger::AppendRecord(file,&record);
+    file.close();
+    Ledger::ApplyRecord(&record);
+  }
+  xSemaphoreGive(mutex);
+  return isRecorded;
+}
+
+/**
+ * @brief Gets the most recent recharges of an account from the log.
+ * NB: This scans the log so it shouldn't be used in time-critical code.
+ * @param history: Buffer to store the recharged units (oldest first).
+ * @param maxEntries: Capacity of the 'history' buffer.
+ * @return Number of entries stored in 'history'.
+*/
+uint16_t Ledger::GetRechargeHistory(uint16_t meterId,uint8_t userIndex,
+                                    uint32_t* history,uint16_t maxEntries)
+{
+  if(maxEntries == 0)
+  {
+    return 0;
+  }
+  uint32_t numOfEntries = 0; //total number of matches (history is a ring buffer)
+  record_t record;
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  File file = fsPtr->open(path,"r");
+  if(file)
+  {
+    while(file.read((uint8_t*)&record,sizeof(record_t)) == sizeof(record_t))
+    {
+      if(record.type == REC_RECHARGE && record.meterId == meterId &&
+         record.userIndex == userIndex && record.checksum == Ledger::Checksum(&record))
+      {
+        history[numOfEntries % maxEntries] = record.value1;
+        numOfEntries++;
+      }
+    }
+    file.close();
+  }
+  xSemaphoreGive(mutex);
+  if(numOfEntries > maxEntries)
+  {//rotate so that the oldest entry comes first
+    uint16_t start = numOfEntries % maxEntries;
+    std::rotate(history,history + start,history + maxEntries);
+    numOfEntries = maxEntries;
+  }
+  return numOfEntries;
+}
+
+/**
+ * @brief Persists balances that changed since the last flush and compacts
+ * the log if it is too large (or ends with a corrupted record). Should be 
+ * called periodically.
+*/
+void Ledger::Flush(void)
+{
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  File file = isLogValid ? fsPtr->open(path,"a") : File();
+  if(file)
+  {
+    record_t record = {};
+    record.type = REC_BALANCE;
+    for(uint16_t i = 0; i < numOfAccounts; i++)
+    {
+      if(!accounts[i].isDirty)
+      {
+        continue;
+      }
+      record.meterId = accounts[i].meterId;
+      record.userIndex = accounts[i].userIndex;
+      record.value1 = accounts[i].balance;
+      if(!Ledger::AppendRecord(file,&record))
+      {
+        break;
+      }
+      accounts[i].isDirty = 0;
+    }
+    file.close();
+  }
+  bool isCompactionDue = (logSize > LEDGER_MAX_LOG_SIZE || !isLogValid);
+  xSemaphoreGive(mutex);
+  if(isCompactionDue)
+  {//Takes the lock only briefly (see Compact())
+    Ledger::Compact();
+  }
+}
+
+uint16_t Ledger::GetNumOfAccounts(void)
+{
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  uint16_t count = numOfAccounts;
+  xSemaphoreGive(mutex);
+  return count;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <FS.h>
+
+//Max number of accounts (1 account = 1 user of a meter)
+#define LEDGER_MAX_ACCOUNTS       3072
+//Log is compacted when it grows beyond this size (bytes)
+#define LEDGER_MAX_LOG_SIZE       (256 * 1024)
+//Max number of recharge records retained after compaction
+#define LEDGER_MAX_HISTORY        2048
+//Records appended during a compaction are copied without the lock until at
+//most this many are left (or after this many passes)
+#define LEDGER_MAX_LOCKED_COPY    16
+#define LEDGER_MAX_COPY_PASSES    4
+
+enum {LEDGER_SIZE_PHONE = 12};
+
+/**
+ * @brief Account ledger for all users of all meters served by the Utility.
+ *
+ * Accounts are held in RAM and are indexed by a hash table keyed by
+ * (meter ID, user index) for O(1) lookups. Every change is appended to a log
+ * file in flash (LittleFS) which is replayed on startup. When the log gets
+ * too large, it is compacted into one record per account (plus the most
+ * recent recharge records). The compacted log is written to a temporary file
+ * which atomically replaces the log once complete. Compaction works from a
+ * copy of the accounts, so updates aren't blocked while the files are
+ * written; records appended meanwhile are carried over to the new log.
+ *
+ * All public methods are thread-safe.
+*/
+class Ledger
+{
+  public:
+    typedef struct
+    {
+      uint16_t meterId;
+      uint8_t userIndex;
+      uint8_t isDirty; //balance not yet persisted
+      char phoneNum[LEDGER_SIZE_PHONE];
+      uint32_t balance; //mL
+      uint32_t totalRecharged; //units (L)
+      uint32_t lastRecharge; //units (L)
+      uint32_t lastTxnId; //meter transaction of the last recharge (0: none)
+    }account_t;
+
+  private:
+    enum RecordType
+    {
+      REC_BALANCE = 1,
+      REC_PHONE,
+      REC_RECHARGE,
+      REC_ACCOUNT
+    };
+    typedef struct
+    {
+      uint8_t type;
+      uint8_t userIndex;
+      uint16_t meterId;
+      uint32_t value1;
+      uint32_t value2;
+      uint32_t value3; //REC_ACCOUNT only
+      uint32_t value4; //REC_ACCOUNT only
+      char phoneNum[LEDGER_SIZE_PHONE];
+      uint32_t checksum;
+    }record_t; //flash log record
+
+    fs::FS* fsPtr;
+    const char* path;
+    char tmpPath[32]; //new log during compaction
+    SemaphoreHandle_t mutex;
+    account_t* accounts;
+    uint16_t* index; //account position + 1 (0 = empty slot)
+    uint16_t maxAccounts;
+    uint16_t numOfAccounts;
+    uint16_t indexMask;
+    uint32_t logSize; //bytes of valid records in the log
+    bool isLogValid; //false: the log ends with a corrupted record (no appends)
+    bool isCompacting;
+
+    static uint32_t Key(uint16_t meterId,uint8_t userIndex);
+    static uint32_t Checksum(const record_t* record);
+    static bool WriteRecord(File& file,record_t* record);
+    uint16_t Slot(uint32_t key);
+    account_t* Find(uint16_t meterId,uint8_t userIndex);
+    account_t* FindOrInsert(uint16_t meterId,uint8_t userIndex);
+    bool AppendRecord(File& file,record_t* record);
+    void ApplyRecord(const record_t* record);
+    void Recover(void);
+    void Replay(void);
+    bool CopyRecords(File& file,uint32_t start,uint32_t end);
+    bool Compact(void);
+
+  public:
+    Ledger(fs::FS* fsPtr,
+           const char* path = "/ledger.log",
+           uint16_t maxAccounts = LEDGER_MAX_ACCOUNTS);
+    bool Begin(void);
+    bool GetAccount(uint16_t meterId,uint8_t userIndex,account_t* accountPtr);
+    bool UpdateBalance(uint16_t meterId,uint8_t userIndex,uint32_t balance);
+    bool UpdatePhone(uint16_t meterId,uint8_t userIndex,const char* phoneNum);
+    bool RecordRecharge(uint16_t meterId,uint8_t userIndex,uint32_t units,
+                        uint32_t txnId = 0);
+    uint16_t GetRechargeHistory(uint16_t meterId,uint8_t userIndex,
+                                uint32_t* history,uint16_t maxEntries);
+    void Flush(void);
+    uint16_t GetNumOfAccounts(void);
+};
@@ -0,0 +1,8 @@
+#pragma once
+
+//Log level of each module (LOG_LEVEL_NONE removes its statements)
+#define LOG_LEVEL_APP       LOG_LEVEL_INFO
+#define LOG_LEVEL_METER     LOG_LEVEL_INFO
+#define LOG_LEVEL_MQTT      LOG_LEVEL_INFO
+
+#define LOG_BUFFER_SIZE     32 //records
@@ -0,0 +1,170 @@
+#include <Arduino.h>
+#include <string.h>
+#include "notifier.h"
+#include "numfmt.h"
+
+/**
+ * @brief Finds the entry of a user (created if it doesn't exist). Must be
+ * called with the mutex held.
+ * @return The entry, or NULL if the table is full.
+*/
+Notifier::entry_t* Notifier::FindOrInsert(uint16_t meterId,uint8_t userIndex)
+{
+  entry_t* freeEntry = NULL;
+  for(uint16_t i = 0; i < capacity; i++)
+  {
+    if(!entries[i].isInUse)
+    {
+      if(freeEntry == NULL)
+      {
+        freeEntry = &entries[i];
+      }
+    }
+    else if(entries[i].meterId == meterId && entries[i].userIndex == userIndex)
+    {
+      return &entries[i];
+    }
+  }
+  if(freeEntry != NULL)
+  {
+    memset(freeEntry,0,sizeof(entry_t));
+    freeEntry->meterId = meterId;
+    freeEntry->userIndex = userIndex;
+    freeEntry->isInUse = true;
+  }
+  return freeEntry;
+}
+
+/**
+ * @brief Creates the notifier.
+ * @param capacity: Max number of users (of all meters).
+ * @param lowBalance: Balance (mL) below which the balance is low.
+ * @param leakPeriodMillis: Duration of continuous consumption that is 
+ * reported as a possible leak.
+ * @param flowGapMillis: Max time between readings with consumption for the
+ * consumption to be continuous.
+ * @param minIntervalMillis: Min time between notifications of a user.
+*/
+Notifier::Notifier(uint16_t capacity,
+                   uint32_t lowBalance,
+                   uint32_t leakPeriodMillis,
+                   uint32_t flowGapMillis,
+                   uint32_t minIntervalMillis)
+{
+  //Initialize private variables
+  mutex = xSemaphoreCreateMutex();
+  entries = new entry_t[capacity];
+  memset(entries,0,capacity * sizeof(entry_t));
+  this->capacity = capacity;
+  next = 0;
+  this->lowBalance = lowBalance;
+  leakPeriod = leakPeriodMillis;
+  flowGap = flowGapMillis;
+  minInterval = minIntervalMillis;
+  numOfEvents = 0;
+  numOfNotifications = 0;
+  numOfDropped = 0;
+}
+
+/**
+ * @brief Applies the rules to a new reading of a user.
+ * @param balance: Balance (mL) of the user.
+*/
+void Notifier::Update(uint16_t meterId,uint8_t userIndex,uint32_t balance)
+{
+  uint32_t currentTime = millis();
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  entry_t* entry = Notifier::FindOrInsert(meterId,userIndex);
+  if(entry == NULL)
+  {
+    numOfDropped++;
+    xSemaphoreGive(mutex);
+    return;
+  }
+  uint8_t conditions = 0;
+  if(balance == 0)
+  {
+    conditions |= NOTIFY_ZERO_BALANCE;
+  }
+  else if(balance < lowBalance)
+  {
+    conditions |= NOTIFY_LOW_BALANCE;
+  }
+  //Continuous consumption (readings with consumption no more than 'flowGap' apart)
+  if(entry->hasBalance && balance < entry->balance)
+  {
+    if(entry->flowStartTime == 0 || (currentTime - entry->lastFlowTime) > flowGap)
+    {
+      entry->flowStartTime = currentTime;
+    }
+    entry->lastFlowTime = currentTime;
+  }
+  else if(entry->flowStartTime != 0 && (currentTime - entry->lastFlowTime) > flowGap)
+  {
+    entry->flowStartTime = 0;
+  }
+  if(entry->flowStartTime != 0 && (currentTime - entry->flowStartTime) >= leakPeriod)
+  {
+    conditions |= NOTIFY_LEAK;
+  }
+  //Events are raised when their conditions become true (and dropped if they 
+  //clear before being handed out)
+  uint8_t newEvents = conditions & ~entry->activeEvents;
+  entry->pendingEvents = (entry->pendingEvents | newEvents) & conditions;
+  entry->activeEvents = conditions;
+  entry->balance = balance;
+  entry->hasBalance = true;
+  if(newEvents != 0)
+  {
+    numOfEvents++;
+  }
+  xSemaphoreGive(mutex);
+}
+
+/**
+ * @brief Gets the next user with events to be notified of (if the user
+ * hasn't been notified within the min interval). The events are cleared.
+ * @return true if 'notification' has been filled, false if otherwise.
+*/
+bool Notifier::GetNext(notification_t* notification)
+{
+  bool isFound = false;
+  uint32_t currentTime = millis();
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  for(uint16_t i = 0; i < capacity && !isFound; i++)
+  {
+    entry_t* entry = &entries[(next + i) % capacity];
+    if(entry->isInUse && entry->pendingEvents != 0 &&
+       (!entry->hasNotified || (currentTime - entry->lastNotifyTime) >= minInterval))
+    {
+      notification->meterId = entry->meterId;
+      notification->userIndex = entry->userIndex;
+      notification->events = entry->pendingEvents;
+      notification->balance = entry->balance;
+      entry->pendingEvents = 0;
+      entry->hasNotified = true;
+      entry->lastNotifyTime = currentTime;
+      next = (next + i + 1) % capacity;
+      numOfNotifications++;
+      isFound = true;
+    }
+  }
+  xSemaphoreGive(mutex);
+  return isFound;
+}
+
+/**
+ * @brief Gets the number of events raised, notifications handed out and
+ * readings dropped (table full) e.g. "events:12 notifications:9 dropped:0".
+ * @return Length of the report.
+*/
+size_t Notifier::GetReport(char* buffer,size_t bufferSize)
+{
+  StringBuilder report(buffer,bufferSize);
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  report.Append("events:").AppendUnsigned(numOfEvents)
+        .Append(" notifications:").AppendUnsigned(numOfNotifications)
+        .Append(" dropped:").AppendUnsigned(numOfDropped);
+  xSemaphoreGive(mutex);
+  return report.GetLength();
+}
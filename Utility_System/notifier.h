@@ -0,0 +1,73 @@
+#pragma once
+
+//Events (bit flags)
+enum NotifyEvent
+{
+  NOTIFY_LOW_BALANCE = 0x01,
+  NOTIFY_ZERO_BALANCE = 0x02, //the valve is closed
+  NOTIFY_LEAK = 0x04 //continuous consumption
+};
+
+//User to be notified
+typedef struct
+{
+  uint16_t meterId;
+  uint8_t userIndex;
+  uint8_t events;
+  uint32_t balance; //mL
+}notification_t;
+
+/**
+ * @brief Rule-driven notifications of the users of all meters.
+ *
+ * Each reading is checked against the rules (low balance, zero balance, 
+ * continuous consumption). An event is raised once when its condition 
+ * becomes true and again only after the condition has cleared (e.g. after a
+ * recharge). Events are held per user and handed out by GetNext() no more 
+ * than once per interval, so events raised in between are combined into one
+ * notification. Memory is fixed (one entry per user).
+ *
+ * All public methods are thread-safe.
+*/
+class Notifier
+{
+  private:
+    typedef struct
+    {
+      uint16_t meterId;
+      uint8_t userIndex;
+      uint8_t activeEvents; //conditions currently true
+      uint8_t pendingEvents; //raised but not yet handed out
+      bool isInUse;
+      bool hasNotified;
+      bool hasBalance; //at least one reading
+      uint32_t balance; //mL (last reading)
+      uint32_t flowStartTime; //millis (start of continuous consumption)
+      uint32_t lastFlowTime; //millis (last reading with consumption)
+      uint32_t lastNotifyTime; //millis
+    }entry_t;
+
+    SemaphoreHandle_t mutex;
+    entry_t* entries;
+    uint16_t capacity;
+    uint16_t next; //where GetNext() resumes (fairness)
+    uint32_t lowBalance;
+    uint32_t leakPeriod;
+    uint32_t flowGap;
+    uint32_t minInterval;
+    uint32_t numOfEvents;
+    uint32_t numOfNotifications;
+    uint32_t numOfDropped;
+
+    entry_t* FindOrInsert(uint16_t meterId,uint8_t userIndex);
+
+  public:
+    Notifier(uint16_t capacity,
+             uint32_t lowBalance,
+             uint32_t leakPeriodMillis,
+             uint32_t flowGapMillis,
+             uint32_t minIntervalMillis);
+    void Update(uint16_t meterId,uint8_t userIndex,uint32_t balance);
+    bool GetNext(notification_t* notification);
+    size_t GetReport(char* buffer,size_t bufferSize);
+};
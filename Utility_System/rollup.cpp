@@ -0,0 +1,171 @@
+#include <Arduino.h>
+#include <string.h>
+#include "rollup.h"
+#include "numfmt.h"
+
+/**
+ * @brief Finds the entry of a meter, or a free one (which is then assigned
+ * to the meter). Must be called with the lock held.
+*/
+Rollup::entry_t* Rollup::FindOrInsert(uint16_t meterId)
+{
+  entry_t* freeEntry = NULL; //unused entries are preferred to idle ones
+  for(uint16_t i = 0; i < capacity; i++)
+  {
+    if(entries[i].isInUse && entries[i].summary.meterId == meterId)
+    {
+      return &entries[i];
+    }
+    if(!entries[i].isInUse)
+    {
+      if(freeEntry == NULL || freeEntry->isInUse)
+      {
+        freeEntry = &entries[i];
+      }
+    }
+    else if(freeEntry == NULL && entries[i].summary.numOfReadings == 0)
+    {
+      freeEntry = &entries[i];
+    }
+  }
+  if(freeEntry != NULL)
+  {
+    memset(freeEntry,0,sizeof(entry_t));
+    freeEntry->summary.meterId = meterId;
+    freeEntry->isInUse = true;
+  }
+  return freeEntry;
+}
+
+/**
+ * @brief Creates the aggregates.
+ * @param capacity: Max number of meters.
+*/
+Rollup::Rollup(uint16_t capacity)
+{
+  //Initialize private variables
+  mux = portMUX_INITIALIZER_UNLOCKED;
+  entries = new entry_t[capacity];
+  memset(entries,0,capacity * sizeof(entry_t));
+  this->capacity = capacity;
+}
+
+/**
+ * @brief Adds a reading of a meter to its current interval. Increases in 
+ * balance (recharges) aren't consumption.
+ * @param balances: Balance (mL) of each user of the meter.
+ * @param timestamp: Unix time of the reading (0: unknown).
+ * @return true if successful, false if there's no room for the meter.
+*/
+bool Rollup::Add(uint16_t meterId,const uint32_t* balances,uint32_t timestamp)
+{
+  uint32_t currentTime = millis();
+  portENTER_CRITICAL(&mux);
+  entry_t* entry = Rollup::FindOrInsert(meterId);
+  if(entry != NULL)
+  {
+    summary_t* summary = &entry->summary;
+    bool hasPrevReading = (entry->lastTime != 0);
+    uint32_t elapsed = currentTime - entry->lastTime;
+    bool isRateValid = hasPrevReading && elapsed > 0;
+    for(uint8_t i = 0; i < ROLLUP_NUM_OF_USERS; i++)
+    {
+      user_t* user = &summary->users[i];
+      uint32_t consumed = 0;
+      if(hasPrevReading && balances[i] < user->balance)
+      {
+        consumed = user->balance - balances[i];
+      }
+      user->consumed += consumed;
+      user->balance = balances[i];
+      if(isRateValid)
+      {
+        uint32_t rate = (uint32_t)((60000ULL * consumed) / elapsed);
+        if(!entry->hasRate || rate < user->minRate)
+        {
+          user->minRate = rate;
+        }
+        if(!entry->hasRate || rate > user->maxRate)
+        {
+          user->maxRate = rate;
+        }
+      }
+    }
+    entry->hasRate |= isRateValid;
+    entry->lastTime = (currentTime != 0) ? currentTime : 1;
+    if(summary->numOfReadings == 0)
+    {
+      summary->firstTime = timestamp;
+    }
+    summary->lastTime = timestamp;
+    if(summary->numOfReadings < UINT16_MAX)
+    {
+      summary->numOfReadings++;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  return (entry != NULL);
+}
+
+/**
+ * @brief Takes the aggregates of the next meter that has had readings since
+ * it was last taken, and starts its next interval.
+ * @param cursor: Position to start from (0 for the first call). It is 
+ * updated for the next call.
+ * @return true if 'summary' has been filled, false if there are no more meters.
+*/
+bool Rollup::Take(uint16_t* cursor,summary_t* summary)
+{
+  bool isTaken = false;
+  portENTER_CRITICAL(&mux);
+  while(*cursor < capacity && !isTaken)
+  {
+    entry_t* entry = &entries[*cursor];
+    (*cursor)++;
+    if(entry->isInUse && entry->summary.numOfReadings > 0)
+    {
+      *summary = entry->summary;
+      //The last reading is the baseline of the next interval
+      entry->summary.numOfReadings = 0;
+      entry->hasRate = false;
+      for(uint8_t i = 0; i < ROLLUP_NUM_OF_USERS; i++)
+      {
+        entry->summary.users[i].consumed = 0;
+        entry->summary.users[i].minRate = 0;
+        entry->summary.users[i].maxRate = 0;
+      }
+      isTaken = true;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  return isTaken;
+}
+
+/**
+ * @brief Formats the aggregates of a meter as a message:
+ * "M<meter ID> N<readings> T<first>,<last> U<user>:<consumed>,<min rate>,<max rate>,<balance>"
+ * (one 'U' field per user). Volumes are in L (2dp), rates in mL/min. 'T' holds
+ * the Unix time of the first and last readings (omitted if unknown).
+ * @return Length of the message (excluding NULL), 0 if it doesn't fit.
+*/
+size_t Rollup::Format(const summary_t* summary,char* buffer,size_t bufferSize)
+{
+  StringBuilder message(buffer,bufferSize);
+  message.Append('M').AppendUnsigned(summary->meterId)
+         .Append(" N").AppendUnsigned(summary->numOfReadings);
+  if(summary->firstTime != 0 && summary->lastTime != 0)
+  {
+    message.Append(" T").AppendUnsigned(summary->firstTime).Append(',')
+           .AppendUnsigned(summary->lastTime);
+  }
+  for(uint8_t i = 0; i < ROLLUP_NUM_OF_USERS; i++)
+  {
+    const user_t& user = summary->users[i];
+    message.Append(" U").AppendUnsigned(i + 1).Append(':')
+           .AppendFixed(user.consumed / 10,2).Append(',')
+           .AppendUnsigned(user.minRate).Append(',')
+           .AppendUnsigned(user.maxRate).Append(',')
+           .AppendFixed(user.balance / 10,2);
+  }
+  return message.IsTruncated() ? 0 : message.GetLength();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#define ROLLUP_NUM_OF_USERS   3 //per meter
+
+/**
+ * @brief Per-meter, per-user aggregates of meter readings over an interval
+ * (consumption, min/max consumption rate, last balance).
+ *
+ * Readings are folded into fixed-size entries as they arrive, so publishing
+ * an interval only copies one entry per meter. Taking an entry starts its 
+ * next interval. When all entries are in use, readings from new meters are 
+ * dropped until an entry becomes free (no readings since it was last taken).
+ *
+ * All methods are thread-safe and never block (short critical sections).
+*/
+class Rollup
+{
+  public:
+    typedef struct
+    {
+      uint32_t consumed; //mL
+      uint32_t minRate; //mL/min
+      uint32_t maxRate; //mL/min
+      uint32_t balance; //mL (last reading)
+    }user_t;
+    typedef struct
+    {
+      uint16_t meterId;
+      uint16_t numOfReadings;
+      uint32_t firstTime; //Unix time of the first reading (0: unknown)
+      uint32_t lastTime; //Unix time of the last reading (0: unknown)
+      user_t users[ROLLUP_NUM_OF_USERS];
+    }summary_t;
+
+  private:
+    typedef struct
+    {
+      summary_t summary;
+      uint32_t lastTime; //millis (last reading)
+      bool hasRate; //at least one rate in the interval
+      bool isInUse;
+    }entry_t;
+    portMUX_TYPE mux;
+    entry_t* entries;
+    uint16_t capacity;
+
+    entry_t* FindOrInsert(uint16_t meterId);
+
+  public:
+    Rollup(uint16_t capacity);
+    bool Add(uint16_t meterId,const uint32_t* balances,uint32_t timestamp);
+    bool Take(uint16_t* cursor,summary_t* summary);
+    static size_t Format(const summary_t* summary,char* buffer,size_t bufferSize);
+};
@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include <string.h>
 #include "sim800l.h"
+#include "numfmt.h"
 
 /**
  * @brief Initialize SIM800L module.  
@@ -12,26 +13,72 @@ SIM800L::SIM800L(HardwareSerial* serial,
 {
   //Initialize private variables
   port = serial;
+  isTextMode = false;
+  prevSendTime = 0;
   port->begin(baudRate,SERIAL_8N1,simTx,simRx);
 }
 
+void SIM800L::SelectTextMode(void)
+{
+  port->write("AT+CMGF=1\r\n");
+  vTaskDelay(pdMS_TO_TICKS(250));
+  isTextMode = true;
+}
+
 /**
- * @brief Send SMS to specified phone number.
+ * @brief Reads the replies of the modem received so far.
+ * @return true if they include an error, false if otherwise.
+*/
+bool SIM800L::IsErrorReceived(void)
+{
+  const char* const error = "ERROR";
+  uint8_t numOfMatched = 0;
+  bool isError = false;
+  while(port->available() > 0)
+  {
+    char c = port->read();
+    numOfMatched = (c == error[numOfMatched]) ? (numOfMatched + 1) : ((c == error[0]) ? 1 : 0);
+    if(error[numOfMatched] == '\0')
+    {
+      isError = true;
+      numOfMatched = 0;
+    }
+  }
+  return isError;
+}
+
+/**
+ * @brief Send SMS to specified phone number. Text mode is selected before
+ * the first message, after an error (e.g. the modem has restarted and is
+ * back in PDU mode) and after SIM800L_IDLE_TIME without a message, so the
+ * messages of a batch (e.g. notifications) skip it.
 */
 void SIM800L::SendSMS(char* phoneNum,char* msg)
 {
   const uint8_t endOfMsgCmd = 26;
-  char atCmgsCmd[27] = "AT+CMGS=\"";
-  port->write("AT+CMGF=1\r\n");
-  vTaskDelay(pdMS_TO_TICKS(250));
-  strcat(atCmgsCmd,phoneNum);
-  strcat(atCmgsCmd,"\"\r\n");
+  char atCmgsCmd[32];
+  StringBuilder cmd(atCmgsCmd,sizeof(atCmgsCmd));
+  if(SIM800L::IsErrorReceived() || (millis() - prevSendTime) >= SIM800L_IDLE_TIME)
+  {
+    isTextMode = false;
+  }
+  if(!isTextMode)
+  {
+    SIM800L::SelectTextMode();
+  }
+  cmd.Append("AT+CMGS=\"").Append(phoneNum).Append("\"\r\n");
   port->write(atCmgsCmd);
   vTaskDelay(pdMS_TO_TICKS(250));
+  if(SIM800L::IsErrorReceived())
+  {//Not in text mode (the modem has restarted): selected and retried once
+    SIM800L::SelectTextMode();
+    port->write(atCmgsCmd);
+    vTaskDelay(pdMS_TO_TICKS(250));
+  }
   port->write(msg);
   port->write("\r\n");
   vTaskDelay(pdMS_TO_TICKS(250));
   port->write(endOfMsgCmd); //command termination
   vTaskDelay(pdMS_TO_TICKS(250));  
+  prevSendTime = millis();
 }
-
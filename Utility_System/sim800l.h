@@ -1,9 +1,15 @@
 #pragma once
 
+#define SIM800L_IDLE_TIME   60000 //millisecs without an SMS before text mode is selected again
+
 class SIM800L
 {
   private:
     HardwareSerial* port;
+    bool isTextMode; //kept by the modem until it restarts
+    uint32_t prevSendTime;
+    void SelectTextMode(void);
+    bool IsErrorReceived(void);
   public:
     SIM800L(HardwareSerial* serial,
             uint32_t baudRate = 9600,
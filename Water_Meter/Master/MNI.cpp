@@ -1,5 +1,7 @@
 #include <Arduino.h>
 #include "MNI.h"
+#include "log.h"
+#include "log_config.h"
 
 MNI::MNI(HardwareSerial* serial,
          uint32_t baudRate,
@@ -11,9 +13,24 @@ MNI::MNI(HardwareSerial* serial,
   port->begin(baudRate,SERIAL_8N1,serialRx,serialTx);    
 }
 
+/**
+ * @brief Computes an 8-bit (XOR) checksum of a frame.
+*/
+uint8_t MNI::Checksum(const void* dataBuffer,uint8_t dataSize)
+{
+  const uint8_t* buffer = (const uint8_t*)dataBuffer;
+  uint8_t checksum = 0;
+  for(uint8_t i = 0; i < dataSize; i++)
+  {
+    checksum ^= buffer[i];
+  }
+  return checksum;
+}
+
 bool MNI::IsReceiverReady(uint8_t expectedNumOfBytes)
 {
-  return (port->available() == expectedNumOfBytes);
+  //Frames have a fixed size so more than one frame may be waiting
+  return (port->available() >= expectedNumOfBytes);
 }
 
 void MNI::TransmitData(void* dataBuffer,uint8_t dataSize)
@@ -22,11 +39,8 @@ void MNI::TransmitData(void* dataBuffer,uint8_t dataSize)
   for(uint8_t i = 0; i < dataSize; i++)
   {
     port->write(txBuffer[i]);
-    //Debug
-    Serial.print(txBuffer[i]);
-    Serial.print(' ');
   } 
-  Serial.print("\n");  
+  LOG_DEBUG(MNI,"TX %ld bytes, first: 0x%02lx",dataSize,txBuffer[0]);
 }
 
 void MNI::ReceiveData(void* dataBuffer,uint8_t dataSize)
@@ -38,3 +52,25 @@ void MNI::ReceiveData(void* dataBuffer,uint8_t dataSize)
   }  
 }
 
+/**
+ * @brief Discards all received bytes (e.g. after a corrupted frame).
+*/
+void MNI::FlushReceiver(void)
+{
+  while(port->available() > 0)
+  {
+    port->read();
+  }
+}
+
+/**
+ * @brief Discards received bytes until the next byte is 'headerByte'
+ * (the start of a frame) or there's nothing left to read.
+*/
+void MNI::SkipUntil(uint8_t headerByte)
+{
+  while(port->available() > 0 && port->peek() != headerByte)
+  {
+    port->read();
+  }
+}
@@ -1,3 +1,5 @@
+#include <driver/gpio.h>
+#include <esp_sleep.h>
 #include <Preferences.h>
 #include <Wire.h>
 #include <LiquidCrystal_I2C.h> //Version 1.1.2
@@ -7,6 +9,19 @@
 #include "keypad.h"
 #include "hmi.h"
 #include "MNI.h"
+#include "snapshot.h"
+#include "otp_table.h"
+#include "history.h"
+#include "radiolink.h"
+#include "radiocrypt.h"
+#include "power.h"
+#include "memreport.h"
+#include "cpuprofiler.h"
+#include "latency.h"
+#include "synclock.h"
+#include "log.h"
+#include "log_config.h"
+#include "numfmt.h"
 
 /**
  * @brief Description of the storage of user-specific data in flash memory.
@@ -16,15 +31,94 @@
  * 1. All IDs are stored in memory locations with labels "0","1", and "2".
  * 2. All PINs are stored in memory locations with labels "3","4", and "5".
  * 3. All phone numbers are stored in memory locations with labels "6","7", and "8".
+ * 
+ * The meter's ID (used by the utility to identify the meter) is stored in the 
+ * memory location with label "M". It defaults to 1 if it has not been set.
+ * 
+ * The ID of the next recharge transaction (Master -> Node) is stored in the
+ * memory location with label "T".
+ * 
+ * The radio key of the meter (provisioned from the utility) is stored in the
+ * memory location with label "K". The frame counters reserved for the meter
+ * and the last counter received from the utility are stored in the memory
+ * locations with labels "N" and "U" respectively.
+ * 
+ * The consumption history of the users is stored in the memory location with
+ * label "H".
+ * 
+ * The ID of the last recharge command received from the cloud (via the 
+ * utility) is stored in the memory location with label "Q". The ID of the
+ * last one applied by the node is stored in the memory location with label "W".
+ * 
+ * The ID of the next recharge request (Master -> Utility) is stored in the
+ * memory location with label "I".
+ * 
+ * The memory location with label "B" is set after the first boot (the start-up
+ * message is only shown on the first boot).
 */
 
-//Node -> Master
-typedef struct
-{
-  float volume1;
-  float volume2;
-  float volume3;  
-}sensor_t; //mL
+/**
+ * @brief Time synchronisation.
+ * The master requests the time (UTC) from the utility periodically and keeps
+ * it (corrected for drift) between requests. Readings are timestamped by the
+ * master when the node's reply is received (within NODE_REPLY_TIMEOUT of the
+ * reading): the node's millis() stops while it sleeps, so it can't keep time.
+*/
+
+/**
+ * @brief Task wake-ups.
+ * The tasks don't poll: they block (so the CPU can light-sleep) until their
+ * next deadline or a notification from a wake source i.e. an item sent to
+ * their queues (SendToTask), data from the node (UART), a key press (keypad
+ * interrupt), a frame from the radio (NRF24_IRQ_PIN, the radio is polled
+ * every RADIO_POLL_PERIOD if it isn't connected) or a serial command.
+*/
+
+#define NODE_POLL_PERIOD      2500 //millisecs
+#define NODE_BOOT_POLL_PERIOD 250 //millisecs (until the node's first reply)
+#define TXN_RETRY_PERIOD      300 //millisecs (until the node acknowledges)
+#define TXN_MAX_ID            0xFFFFFF00UL //transaction IDs don't wrap
+#define CREDIT_MAX_UNITS      100000 //per cloud recharge (L), as CLOUD_MAX_UNITS (utility)
+#define HISTORY_FLUSH_PERIOD  900000 //millisecs (persists the consumption history)
+#define NODE_WAKE_BYTE        0xFF
+#define NODE_WAKE_DELAY       5 //millisecs (time taken by the node to wake up)
+#define NODE_REPLY_TIMEOUT    200 //millisecs
+#define NODE_RX_PIN           16 //Serial2 RX (wake-up on data from the node)
+#define CAL_QUEUE_LENGTH      4 //calibration frames (serial port -> node)
+#define NRF24_CE_PIN          15
+#define NRF24_CSN_PIN         5
+#define NRF24_IRQ_PIN         -1 //not connected (set to wake up on radio IRQ)
+#define TELEMETRY_PERIOD      5000 //millisecs (sensor data -> utility)
+#define RADIO_COUNTER_BLOCK   1000 //frame counters reserved in flash at a time
+#define TIME_SYNC_PERIOD      3600000 //millisecs between time requests (utility)
+#define TIME_RETRY_PERIOD     60000 //millisecs between time requests (not synced yet)
+#define TIME_MAX_RTT          1000 //millisecs (slower replies are ignored)
+#define RADIO_POLL_PERIOD     100 //millisecs (RX FIFO, when NRF24_IRQ_PIN isn't connected)
+#define RADIO_FAST_POLL_PERIOD 5 //millisecs (while a time reply is awaited)
+
+//Power management
+#define PM_MAX_FREQ           80 //MHz (HMI/radio busy)
+#define PM_MIN_FREQ           40 //MHz (idle)
+#define PM_IDLE_TIMEOUT       30000 //millisecs without key presses
+#define HMI_REFRESH_PERIOD    500 //millisecs (display update without key presses)
+
+//Task stack sizes (bytes): max usage (from the memory report) + margin
+#define APP_TASK_STACK        8192
+#define NODE_TASK_STACK       4096
+#define UTIL_TASK_STACK       4096
+#define MEM_REPORT_PERIOD     600000 //millisecs (also printed when 'm' is received)
+//Task placement: the HMI has core 1 to itself, UART (node) and SPI (radio)
+//work runs on core 0 (unused by WiFi on this device).
+#define APP_TASK_CORE         1
+#define APP_TASK_PRIORITY     2
+#define NODE_TASK_CORE        0
+#define NODE_TASK_PRIORITY    2
+#define UTIL_TASK_CORE        0
+#define UTIL_TASK_PRIORITY    1
+#define LOG_TASK_CORE         0
+#define LOG_TASK_PRIORITY     0 //prints buffered log records when nothing else runs
+#define CPU_PROFILER_TIMER    0 //hardware timer (CPU report printed when 'c' is received)
+#define CPU_PROFILER_WINDOW   10000 //millisecs sampled for a CPU report
 
 //Recharge -> Utility
 typedef struct
@@ -33,60 +127,405 @@ typedef struct
   uint32_t units;
 }recharge_util_t;
 
-//Master -> Utility
+//Recharge -> Utility task
 typedef struct
 {
   recharge_util_t recharge;
+  UserIndex userIndex;
+  uint32_t requestTime; //millis (latency statistics)
+}request_util_t;
+
+//Radio messages (encrypted into frames, see radiocrypt.h). The first byte
+//is the type. The meter ID is in the frame header.
+enum RadioMsgType
+{
+  RADIO_MSG_TELEMETRY = 1,
+  RADIO_MSG_RECHARGE,
+  RADIO_MSG_OTP,
+  RADIO_MSG_CREDIT,
+  RADIO_MSG_CREDIT_ACK,
+  RADIO_MSG_TIME_REQUEST,
+  RADIO_MSG_TIME,
+  RADIO_MSG_RECHARGE_ACK
+};
+
+//Outcome of a cloud recharge (credit_ack_t)
+enum CreditStatus
+{
+  CREDIT_APPLIED = 0, //applied by the node
+  CREDIT_REFUSED,     //never applied (invalid command)
+  CREDIT_UNKNOWN      //not applied now, may have been before (e.g. meter restarted)
+};
+
+//Node -> (HMI, Utility)
+typedef struct
+{
   sensor_t sensorData;
-}meter_util_t;
+  uint32_t timestamp; //Unix time of the reading (0: unknown)
+}reading_t;
+
+//Master -> Utility (every few seconds)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t linkQuality; //retries of the previous frame (0xFF: lost)
+  sensor_t sensorData;
+  uint32_t timestamp; //Unix time of the reading (0: unknown)
+}telemetry_util_t; //18 bytes (max plaintext)
+
+//Master -> Utility (recharge request)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex; //user requesting a recharge
+  uint8_t requestId; //new for every request (the same for a resent one)
+  char phoneNum[SIZE_PHONE - 1]; //not NULL-terminated
+  uint32_t units;
+}meter_util_t; //18 bytes (max plaintext)
+
+//Utility -> Master
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  char otp[SIZE_OTP];
+}otp_meter_t;
+
+//Utility -> Master (recharge from the cloud, no OTP needed)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  uint32_t units;
+  uint32_t commandId;
+}credit_meter_t;
+
+//Master -> Utility (request for the time)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+}time_request_t;
+
+//Utility -> Master (reply to a time request)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint32_t time; //Unix time (secs)
+  uint16_t milliseconds;
+}time_meter_t;
+
+//Master -> Utility (outcome of a cloud recharge)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  uint32_t commandId;
+  uint8_t status; //CreditStatus
+}credit_ack_t;
+
+//Master -> Utility (recharge with OTP applied by the node)
+typedef struct __attribute__((packed))
+{
+  uint8_t type;
+  uint8_t userIndex;
+  uint32_t units;
+  uint32_t txnId; //node transaction (the same for a resent report)
+}recharge_ack_t;
 
 //Recharge -> Node
 typedef struct
 {
   UserIndex userIndex;
   uint32_t units;
+  uint32_t verifyTime; //millis (latency statistics)
+  uint32_t commandId; //cloud recharge command (0: recharge with OTP)
 }recharge_node_t;
 
+//Stages of a recharge (latency statistics)
+enum RechargeStage
+{
+  STAGE_REQUEST = 0, //request entered -> received by the utility
+  STAGE_OTP,         //request entered -> OTP received from the utility
+  STAGE_NODE,        //OTP verified -> recharge applied by the node
+  NUM_OF_STAGES
+};
+const char* const stageNames[NUM_OF_STAGES] = {"Request","OTP","Node"};
+
 //Queues
 typedef struct
 {
-  QueueHandle_t nodeToGetUnits;
-  QueueHandle_t nodeToUtil;
   QueueHandle_t rechargeToUtil;
   QueueHandle_t rechargeToNode;  
-  QueueHandle_t utilToOtp;
-  QueueHandle_t otpToNode;
+  QueueHandle_t creditToUtil; //cloud recharges applied by the node
+  QueueHandle_t rechargeAckToUtil; //recharges with OTP applied by the node
+  QueueHandle_t calibrationToNode; //MNI_CALIBRATE frames
 }queue_t;
 
+const uint8_t numOfUsers = 3;
+//Recharges waiting for the node: one verified OTP per user (its OTP is 
+//consumed) and one cloud recharge (the utility sends them one at a time)
+const uint8_t rechargeQueueLength = numOfUsers + 1;
 queue_t queue;
-TaskHandle_t nodeTaskHandle;
+TaskHandle_t loopTaskHandle = NULL;
+TaskHandle_t nodeTaskHandle = NULL;
+TaskHandle_t utilTaskHandle = NULL;
+OtpTable otpTable(numOfUsers); //pending recharges (one per user)
+uint16_t meterId;
+LOG_DEFINE_BUFFER(LOG_BUFFER_SIZE);
+PowerManager power(PM_IDLE_TIMEOUT);
+Snapshot<reading_t> sensorSnapshot; //Node -> (HMI, Utility): latest sensor data
+SyncClock syncClock; //set by the utility (UTC)
 Preferences preferences; //for accessing ESP32 flash memory
+History history(&preferences); //consumption of each user
+
+MemReport memReport;
+RF24 nrf24(NRF24_CE_PIN,NRF24_CSN_PIN);
+RadioLink radioLink(&nrf24);
+RadioCrypto radioCrypto; //used by the Utility task only
+CpuProfiler cpuProfiler;
+LatencyStats latencyStats(stageNames,NUM_OF_STAGES);
 
 void setup() 
 {
+  //Statically allocated tasks and queues
+  static StackType_t appTaskStack[APP_TASK_STACK];
+  static StackType_t nodeTaskStack[NODE_TASK_STACK];
+  static StackType_t utilTaskStack[UTIL_TASK_STACK];
+  static StaticTask_t appTaskBuffer;
+  static StaticTask_t nodeTaskBuffer;
+  static StaticTask_t utilTaskBuffer;
+  static uint8_t rechargeToUtilStorage[numOfUsers * sizeof(request_util_t)];
+  static uint8_t rechargeToNodeStorage[rechargeQueueLength * sizeof(recharge_node_t)];
+  static StaticQueue_t rechargeToUtilBuffer;
+  static StaticQueue_t rechargeToNodeBuffer;
+  static uint8_t creditToUtilStorage[numOfUsers * sizeof(credit_ack_t)];
+  static StaticQueue_t creditToUtilBuffer;
+  static uint8_t rechargeAckToUtilStorage[numOfUsers * sizeof(recharge_ack_t)];
+  static StaticQueue_t rechargeAckToUtilBuffer;
+  static uint8_t calibrationToNodeStorage[CAL_QUEUE_LENGTH * sizeof(mni_request_t)];
+  static StaticQueue_t calibrationToNodeBuffer;
+  
   setCpuFrequencyMhz(80);
   Serial.begin(115200);
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  Serial.onReceive([](){NotifyTask(loopTaskHandle);});
+  Log::Begin(&Serial,LOG_TASK_PRIORITY,LOG_TASK_CORE);
   preferences.begin("S-Meter",false); 
-  queue.nodeToGetUnits = xQueueCreate(1,sizeof(sensor_t));
-  queue.nodeToUtil = xQueueCreate(1,sizeof(sensor_t));
-  queue.rechargeToUtil = xQueueCreate(1,sizeof(recharge_util_t));
-  queue.rechargeToNode = xQueueCreate(1,sizeof(recharge_node_t));
-  queue.utilToOtp = xQueueCreate(1,SIZE_OTP);
-  queue.otpToNode = xQueueCreate(1,sizeof(bool));
+  meterId = preferences.getUShort("M",1);
+  history.Begin();
+  power.Begin(PM_MAX_FREQ,PM_MIN_FREQ,true);
+  queue.rechargeToUtil = xQueueCreateStatic(numOfUsers,sizeof(request_util_t),
+                                            rechargeToUtilStorage,&rechargeToUtilBuffer);
+  queue.rechargeToNode = xQueueCreateStatic(rechargeQueueLength,sizeof(recharge_node_t),
+                                            rechargeToNodeStorage,&rechargeToNodeBuffer);
+  queue.creditToUtil = xQueueCreateStatic(numOfUsers,sizeof(credit_ack_t),
+                                          creditToUtilStorage,&creditToUtilBuffer);
+  queue.rechargeAckToUtil = xQueueCreateStatic(numOfUsers,sizeof(recharge_ack_t),
+                                               rechargeAckToUtilStorage,&rechargeAckToUtilBuffer);
+  queue.calibrationToNode = xQueueCreateStatic(CAL_QUEUE_LENGTH,sizeof(mni_request_t),
+                                               calibrationToNodeStorage,&calibrationToNodeBuffer);
   
-  if(queue.nodeToGetUnits != NULL && queue.nodeToUtil != NULL &&
-     queue.rechargeToUtil != NULL && queue.rechargeToNode != NULL &&
-     queue.utilToOtp != NULL && queue.otpToNode != NULL)
+  if(queue.rechargeToUtil != NULL && queue.rechargeToNode != NULL &&
+     queue.creditToUtil != NULL && queue.rechargeAckToUtil != NULL &&
+     queue.calibrationToNode != NULL)
   {
     Serial.println("Queues successfully created");
   }
-  xTaskCreatePinnedToCore(ApplicationTask,"",30000,NULL,2,NULL,1);
-  xTaskCreatePinnedToCore(NodeTask,"",25000,NULL,1,&nodeTaskHandle,1);
-  xTaskCreatePinnedToCore(UtilityTask,"",25000,NULL,1,NULL,1);
+  else
+  {
+    Serial.println("Queue creation failed");
+  }
+  TaskHandle_t appTaskHandle = 
+  xTaskCreateStaticPinnedToCore(ApplicationTask,"App",APP_TASK_STACK,NULL,APP_TASK_PRIORITY,
+                                appTaskStack,&appTaskBuffer,APP_TASK_CORE);
+  nodeTaskHandle = 
+  xTaskCreateStaticPinnedToCore(NodeTask,"Node",NODE_TASK_STACK,NULL,NODE_TASK_PRIORITY,
+                                nodeTaskStack,&nodeTaskBuffer,NODE_TASK_CORE);
+  utilTaskHandle = 
+  xTaskCreateStaticPinnedToCore(UtilityTask,"Util",UTIL_TASK_STACK,NULL,UTIL_TASK_PRIORITY,
+                                utilTaskStack,&utilTaskBuffer,UTIL_TASK_CORE);
+  if(!memReport.AddTask(appTaskHandle,APP_TASK_STACK) || 
+     !memReport.AddTask(nodeTaskHandle,NODE_TASK_STACK) ||
+     !memReport.AddTask(utilTaskHandle,UTIL_TASK_STACK))
+  {
+    Serial.println("Task creation failed");
+  }
+  cpuProfiler.AddTask(appTaskHandle);
+  cpuProfiler.AddTask(nodeTaskHandle);
+  cpuProfiler.AddTask(utilTaskHandle);
+  cpuProfiler.AddTask(xTaskGetCurrentTaskHandle()); //loop
+  if(!cpuProfiler.Begin(CPU_PROFILER_TIMER))
+  {
+    Serial.println("CPU profiler failed");
+  }
 }
 
+/**
+ * @brief Prints the memory report periodically or when 'm' is received
+ * on the serial port. The CPU report covers a CPU_PROFILER_WINDOW started
+ * when it is requested.
+*/
 void loop() 
 {
+  static uint32_t prevReportTime = millis();
+  static uint32_t profilerStartTime = 0;
+  bool isMemReportRequested = false;
+  bool isCpuReportRequested = false;
+  bool isLinkReportRequested = false;
+  bool isLatencyReportRequested = false;
+  bool isPowerReportRequested = false;
+  while(Serial.available() > 0)
+  {
+    switch(Serial.read())
+    {
+      case 'm':
+        isMemReportRequested = true;
+        break;
+      case 'c':
+        isCpuReportRequested = true;
+        break;
+      case 'r':
+        isLinkReportRequested = true;
+        break;
+      case 'l':
+        isLatencyReportRequested = true;
+        break;
+      case 'p':
+        isPowerReportRequested = true;
+        break;
+      case 't':
+        Serial.print("Time: ");
+        Serial.print(syncClock.GetTime());
+        Serial.print(" drift(ppm): ");
+        Serial.println(syncClock.GetDriftPpm());
+        break;
+      case 'K':
+      {//K<32 hex digits>: stores the radio key issued by the utility
+        char keyStr[2 * RADIO_KEY_SIZE + 1] = {0};
+        uint8_t key[RADIO_KEY_SIZE];
+        Serial.readBytesUntil('\n',keyStr,sizeof(keyStr) - 1);
+        keyStr[strcspn(keyStr,"\r\n")] = '\0';
+        if(ParseHex(keyStr,key,sizeof(key)))
+        {
+          preferences.putBytes("K",key,sizeof(key));
+          Serial.println("Radio key stored, system will restart now");
+          Serial.flush();
+          esp_restart();
+        }
+        Serial.println("Invalid radio key");
+        break;
+      }
+      case 'C':
+      {//C<sensor>,<point>,<rate>,<K-factor> or C<sensor> (report): see MNI.h
+        char calStr[32] = {0};
+        mni_request_t calibration = {};
+        Serial.readBytesUntil('\n',calStr,sizeof(calStr) - 1);
+        calStr[strcspn(calStr,"\r\n")] = '\0';
+        if(!ParseCalibration(calStr,&calibration))
+        {
+          Serial.println("Invalid calibration point");
+        }
+        else if(!SendToTask(queue.calibrationToNode,&calibration,nodeTaskHandle))
+        {
+          Serial.println("Calibration queue full");
+        }
+        break;
+      }
+    }
+  }
+  if((millis() - prevReportTime) >= MEM_REPORT_PERIOD)
+  {
+    isMemReportRequested = true;
+    isCpuReportRequested = true;
+    isLinkReportRequested = true;
+    isLatencyReportRequested = true;
+    isPowerReportRequested = true;
+    prevReportTime = millis();
+  }
+  if(isMemReportRequested)
+  {
+    memReport.Report(Serial);
+  }
+  if(isCpuReportRequested && !cpuProfiler.IsRunning())
+  {
+    cpuProfiler.Start();
+    profilerStartTime = millis();
+  }
+  if(cpuProfiler.IsRunning() && (millis() - profilerStartTime) >= CPU_PROFILER_WINDOW)
+  {
+    char report[256];
+    cpuProfiler.GetReport(report,sizeof(report));
+    cpuProfiler.Stop();
+    Serial.print("CPU: ");
+    Serial.println(report);
+  }
+  if(isLinkReportRequested)
+  {
+    char report[128];
+    radioLink.GetReport(report,sizeof(report));
+    Serial.print("Radio: ");
+    Serial.print(report);
+    Serial.print(" crypto(us):");
+    Serial.println(radioCrypto.GetMeanMicros());
+  }
+  if(isLatencyReportRequested)
+  {
+    char report[192];
+    latencyStats.GetReport(report,sizeof(report));
+    Serial.print("Latency(ms): ");
+    Serial.println(report);
+  }
+  if(isPowerReportRequested)
+  {
+    char report[64];
+    power.GetReport(report,sizeof(report));
+    Serial.print("Power: ");
+    Serial.println(report);
+  }
+  //Sleeps until the next report or a serial command
+  uint32_t waitTime = TimeLeft(prevReportTime,MEM_REPORT_PERIOD);
+  if(cpuProfiler.IsRunning())
+  {
+    waitTime = min(waitTime,TimeLeft(profilerStartTime,CPU_PROFILER_WINDOW));
+  }
+  ulTaskNotifyTake(pdTRUE,pdMS_TO_TICKS(waitTime));
+}
+
+/**
+ * @brief Wakes up a task waiting for a notification (the tasks are created
+ * in setup(), they are only notified once their handle is set).
+*/
+static void NotifyTask(TaskHandle_t task)
+{
+  if(task != NULL)
+  {
+    xTaskNotifyGive(task);
+  }
+}
+
+/**
+ * @brief Sends an item to a queue and wakes up the task that reads it (the
+ * tasks wait for notifications, not on one of their queues).
+ * @return true if the item is queued, false if the queue is full.
+*/
+static bool SendToTask(QueueHandle_t queueHandle,const void* item,TaskHandle_t task)
+{
+  if(xQueueSend(queueHandle,item,0) != pdPASS)
+  {
+    return false;
+  }
+  NotifyTask(task);
+  return true;
+}
+
+/**
+ * @brief Gets the time left until a period (millisecs) started at startTime
+ * ends, 0 if it has ended.
+*/
+static uint32_t TimeLeft(uint32_t startTime,uint32_t period)
+{
+  uint32_t elapsed = millis() - startTime;
+  return (elapsed >= period) ? 0 : (period - elapsed);
 }
 
 /**
@@ -106,156 +545,683 @@ void ApplicationTask(void* pvParameters)
   hmi.RegisterCallback(StoreUserParam);
   hmi.RegisterCallback(HandleRecharge);
   hmi.RegisterCallback(VerifyOtp);
+  hmi.RegisterCallback(GetHistory);
   
-  //Startup message
+  //The Node task is already running (the LCD is initialized meanwhile)
   lcd.init();
   lcd.backlight();
-  lcd.print(" SMART WATER METER");
-  lcd.setCursor(0,1);
-  for(uint8_t i = 0; i < 20; i++)
-  {
-    lcd.print('-');
-  }
-  vTaskDelay(pdMS_TO_TICKS(1500));
-  lcd.setCursor(0,2);
-  lcd.print("STATUS: ");
-  lcd.setCursor(0,3);
-  lcd.print("INITIALIZING...");
-  vTaskDelay(pdMS_TO_TICKS(1500));
-  lcd.clear();
-  vTaskResume(nodeTaskHandle);
+  if(!preferences.getBool("B",false))
+  {//Startup message (first boot only)
+    lcd.print(" SMART WATER METER");
+    lcd.setCursor(0,1);
+    for(uint8_t i = 0; i < 20; i++)
+    {
+      lcd.print('-');
+    }
+    vTaskDelay(pdMS_TO_TICKS(1500));
+    lcd.setCursor(0,2);
+    lcd.print("STATUS: ");
+    lcd.setCursor(0,3);
+    lcd.print("INITIALIZING...");
+    vTaskDelay(pdMS_TO_TICKS(1500));
+    lcd.clear();
+    preferences.putBool("B",true);
+  }
+  uint32_t lastPressTime = keypad.GetLastPressTime();
     
   while(1)
   {
+    if(power.IsIdle())
+    {
+      //Backlight is off, wait for a key press (the CPU may light-sleep meanwhile)
+      if(keypad.WaitForKey(KEYPAD_NO_TIMEOUT))
+      {
+        keypad.GetChar(); //the key that wakes the HMI is ignored
+        lastPressTime = keypad.GetLastPressTime();
+        power.NotifyActivity();
+        lcd.backlight();
+      }
+      continue;
+    }
     hmi.Start(); 
-    vTaskDelay(pdMS_TO_TICKS(50));
+    if(keypad.GetLastPressTime() != lastPressTime)
+    {
+      lastPressTime = keypad.GetLastPressTime();
+      power.NotifyActivity();
+    }
+    if(power.Update())
+    {
+      lcd.noBacklight();
+      continue;
+    }
+    keypad.WaitForKey(HMI_REFRESH_PERIOD);
+  }
+}
+
+/**
+ * @brief Sends a request (poll or recharge transaction) to the node.
+*/
+static void SendToNode(MNI& mni,mni_request_t* request)
+{
+  //The node may be asleep, the first byte wakes it up (and is discarded)
+  uint8_t wakeByte = NODE_WAKE_BYTE;
+  mni.TransmitData(&wakeByte,sizeof(wakeByte));
+  vTaskDelay(pdMS_TO_TICKS(NODE_WAKE_DELAY));
+  request->header = MNI_HEADER;
+  request->checksum = 0;
+  request->checksum = MNI::Checksum(request,sizeof(mni_request_t));
+  mni.TransmitData(request,sizeof(mni_request_t));
+}
+
+/**
+ * @brief Sends a request to the node and keeps the UART clocked (no light sleep)
+ * until the reply arrives or times out.
+*/
+static void SendToNodeAndAwaitReply(MNI& mni,mni_request_t* request,
+                                    bool& isAwaitingReply,uint32_t& requestTime)
+{
+  if(!isAwaitingReply)
+  {
+    power.AcquireBusy();
+    isAwaitingReply = true;
+  }
+  SendToNode(mni,request);
+  requestTime = millis();
+}
+
+/**
+ * @brief Parses a calibration command from the serial port.
+ * @param str: "<sensor>,<point>,<rate>,<K-factor>" to set a point of a sensor's
+ * calibration table or "<sensor>" to request a report (sensors: 1 - 3).
+ * @param request: MNI_CALIBRATE frame (see MNI.h)
+ * @return true if the command is valid, false if otherwise.
+*/
+static bool ParseCalibration(char* str,mni_request_t* request)
+{
+  const uint8_t maxNumOfFields = 4;
+  uint32_t fields[maxNumOfFields];
+  uint8_t numOfFields = 0;
+  char* field = str;
+  while(field != NULL && numOfFields < maxNumOfFields)
+  {
+    char* separator = strchr(field,',');
+    if(separator != NULL)
+    {
+      *separator = '\0';
+    }
+    if(!ParseUnsigned(field,&fields[numOfFields]))
+    {
+      return false;
+    }
+    numOfFields++;
+    field = (separator != NULL) ? separator + 1 : NULL;
+  }
+  if(field != NULL || (numOfFields != 1 && numOfFields != maxNumOfFields) ||
+     fields[0] < 1 || fields[0] > numOfUsers)
+  {
+    return false;
+  }
+  request->type = MNI_CALIBRATE;
+  request->userIndex = fields[0] - 1;
+  if(numOfFields == 1)
+  {
+    request->txnId = MNI_CAL_REPORT;
+    return true;
+  }
+  if(fields[1] >= MNI_CAL_REPORT || fields[2] > UINT16_MAX || fields[3] > UINT16_MAX)
+  {
+    return false;
+  }
+  request->txnId = fields[1];
+  request->units = (fields[2] << 16) | fields[3];
+  return true;
+}
+
+/**
+ * @brief Prints a sensor's calibration (MNI_CAL_INFO frame from the node).
+*/
+static void LogCalibration(const mni_cal_info_t* info)
+{
+  if(info->pointIndex == 0)
+  {
+    LOG_INFO(NODE,"Sensor %ld: %lu pulses, %ld p/s, %ld cal points",info->userIndex,
+             info->totalPulses,info->rate,info->numOfPoints);
+  }
+  if(info->pointIndex < info->numOfPoints)
+  {
+    LOG_INFO(NODE,"Sensor %ld point %ld: %ld p/s, %ld uL",info->userIndex,info->pointIndex,
+             info->pointRate,info->pointKFactor);
   }
 }
 
 /**
  * @brief Handles communication between the master and node.
  * NB: Master + Node = Meter
+ * 
+ * Verified recharges are sent to the node as transactions with unique IDs.
+ * A transaction is sent immediately and is resent until the node acknowledges
+ * it (by reporting its ID as the last one applied). The node applies each
+ * transaction only once, so resending it is safe. Replies are framed like
+ * requests (header + checksum): a corrupted reply is dropped, so it can't
+ * acknowledge a transaction or move the transaction IDs.
+ * 
+ * The task runs from boot (in parallel with the LCD initialization) and polls
+ * the node every NODE_BOOT_POLL_PERIOD until it replies, so the readings are
+ * available as soon as the node has restarted.
 */
 void NodeTask(void* pvParameters)
 {
-  vTaskSuspend(NULL);
   static MNI mni(&Serial2);
   recharge_node_t rechargeToNode = {};
-  sensor_t sensorData = {};
-
-  const uint8_t numOfUsers = 3;
-  uint32_t units[numOfUsers] = {0}; //Array of recharged units
-  const uint8_t txBufferSize = sizeof(units);  
-  const uint8_t rxBufferSize = sizeof(sensorData);
-   
-  mni.TransmitData(units,txBufferSize); //Initial request for sensor data from the node  
-  bool isOtpCorrect = false;
-  uint32_t prevTime = millis();
+  mni_request_t poll = {};
+  mni_request_t txn = {};
+  mni_request_t calibration = {};
+  mni_reply_t reply = {};
+  reading_t reading = {};
+  bool isTxnPending = false;
+  uint32_t txnVerifyTime = 0;
+  credit_ack_t creditAck = {};
+  bool isCreditAckPending = false; //not yet taken by the Utility task
+  bool isNodeSynced = false; //true after the first reply from the node
+  uint32_t nextTxnId = preferences.getULong("T",1);
+  bool isAwaitingReply = false; //busy (PM) lock held
+  uint32_t requestTime = 0;
+  
+  //Unsolicited data from the node also wakes the CPU from light sleep
+  gpio_wakeup_enable((gpio_num_t)NODE_RX_PIN,GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  Serial2.onReceive([](){NotifyTask(nodeTaskHandle);});
+  
+  poll.type = MNI_POLL;
+  //Initial request for sensor data from the node  
+  SendToNodeAndAwaitReply(mni,&poll,isAwaitingReply,requestTime);
+  uint32_t prevPollTime = millis();
+  uint32_t prevTxnTime = 0;
+  uint32_t prevFlushTime = millis();
     
   while(1)
   {
-    if((millis() - prevTime) >= 2500)
+    //Start a new transaction for the next verified recharge (if any)
+    if(isNodeSynced && !isTxnPending && !isCreditAckPending &&
+       xQueueReceive(queue.rechargeToNode,&rechargeToNode,0) == pdPASS)
     {
-      for(uint8_t i = 0; i < numOfUsers; i++)
+      LOG_INFO(NODE,"Recharge for user %ld: %lu units",rechargeToNode.userIndex,rechargeToNode.units);
+      txn.type = MNI_RECHARGE;
+      txn.userIndex = rechargeToNode.userIndex;
+      txn.units = rechargeToNode.units;
+      txn.txnId = nextTxnId;
+      txnVerifyTime = rechargeToNode.verifyTime;
+      creditAck.type = RADIO_MSG_CREDIT_ACK;
+      creditAck.userIndex = rechargeToNode.userIndex;
+      creditAck.commandId = rechargeToNode.commandId;
+      creditAck.status = CREDIT_APPLIED;
+      nextTxnId++;
+      preferences.putULong("T",nextTxnId);
+      isTxnPending = true;
+      SendToNodeAndAwaitReply(mni,&txn,isAwaitingReply,requestTime);
+      prevTxnTime = millis();
+    }
+    if(isTxnPending && (millis() - prevTxnTime) >= TXN_RETRY_PERIOD)
+    {
+      SendToNodeAndAwaitReply(mni,&txn,isAwaitingReply,requestTime);
+      prevTxnTime = millis();
+    }
+    else if(!isTxnPending && 
+            xQueueReceive(queue.calibrationToNode,&calibration,0) == pdPASS)
+    {//The node replies with its sensor data (as for a poll)
+      SendToNodeAndAwaitReply(mni,&calibration,isAwaitingReply,requestTime);
+      prevPollTime = millis();
+    }
+    else if(!isTxnPending && 
+            (millis() - prevPollTime) >= (isNodeSynced ? NODE_POLL_PERIOD : NODE_BOOT_POLL_PERIOD))
+    {
+      SendToNodeAndAwaitReply(mni,&poll,isAwaitingReply,requestTime);
+      prevPollTime = millis();
+    }
+    if(isAwaitingReply && (millis() - requestTime) >= NODE_REPLY_TIMEOUT)
+    {
+      power.ReleaseBusy();
+      isAwaitingReply = false;
+    }
+    
+    //Decode data received from node (corrupted replies are dropped)
+    mni.SkipUntil(MNI_HEADER);
+    bool isReplyValid = false;
+    if(mni.IsReceiverReady(sizeof(reply)))
+    {
+      mni.ReceiveData(&reply,sizeof(reply));
+      uint8_t checksum = reply.checksum;
+      reply.checksum = 0;
+      isReplyValid = (reply.header == MNI_HEADER && 
+                      checksum == MNI::Checksum(&reply,sizeof(reply)));
+      if(!isReplyValid)
       {
-        units[i] = 0;
+        LOG_WARN(NODE,"Bad reply (type %ld)",reply.type);
+        mni.FlushReceiver(); //resynchronize (the next request gets a new reply)
       }
-      if(xQueueReceive(queue.otpToNode,&isOtpCorrect,0) == pdPASS)
+    }
+    if(isReplyValid && reply.type == MNI_CAL_INFO)
+    {//Follows the reply to a calibration request
+      mni_cal_info_t info;
+      memcpy(&info,&reply,sizeof(info));
+      LogCalibration(&info);
+    }
+    else if(isReplyValid)
+    {
+      LOG_DEBUG(NODE,"Volumes (mL): %ld %ld %ld, last txn: %lu",lround(reply.sensorData.volume1),
+                lround(reply.sensorData.volume2),lround(reply.sensorData.volume3),reply.lastTxnId);
+      //Publish latest sensor data to all readers (HMI, Utility task)
+      reading.sensorData = reply.sensorData;
+      reading.timestamp = syncClock.GetTime(); //0 until the utility's time is received
+      sensorSnapshot.Write(reading);
+      const float balances[] = {reply.sensorData.volume1,reply.sensorData.volume2,
+                                reply.sensorData.volume3};
+      history.Update(balances,reading.timestamp);
+      //Transaction IDs must always be greater than the last one seen by the node
+      //(IDs near the end of the range can't be followed and are ignored)
+      if(reply.lastTxnId >= nextTxnId && reply.lastTxnId < TXN_MAX_ID)
       {
-        Serial.println("OTP-Node RX PASS\n");
+        nextTxnId = reply.lastTxnId + 1;
+        preferences.putULong("T",nextTxnId);
       }
-      if(xQueueReceive(queue.rechargeToNode,&rechargeToNode,0) == pdPASS)
+      if(!isNodeSynced)
       {
-        Serial.println("Request-Node RX PASS\n");   
+        LOG_INFO(NODE,"First reply %lu ms after boot",millis());
+        isNodeSynced = true;
       }
-      if(isOtpCorrect)
+      //The table follows the reply to a calibration request (busy until the timeout)
+      if(isAwaitingReply && reply.type != MNI_CALIBRATE && !mni.IsReceiverReady(sizeof(reply)))
       {
-        units[rechargeToNode.userIndex] = rechargeToNode.units;
-        isOtpCorrect = false;
+        power.ReleaseBusy();
+        isAwaitingReply = false;
       }
-      mni.TransmitData(units,txBufferSize);
-      prevTime = millis();
-    }
-    
-    //Decode data received from node
-    if(mni.IsReceiverReady(rxBufferSize))
-    {
-      mni.ReceiveData(&sensorData,rxBufferSize);
-      //Debug
-      Serial.print("User1 volume: ");
-      Serial.println(sensorData.volume1); 
-      Serial.print("User2 volume: ");
-      Serial.println(sensorData.volume2); 
-      Serial.print("User3 volume: ");
-      Serial.println(sensorData.volume3);
-      //Place sensor data in appropriate Queue(s)
-      if(xQueueSend(queue.nodeToGetUnits,&sensorData,0) == pdPASS)
+      if(isTxnPending && reply.lastTxnId == txn.txnId)
       {
-        Serial.println("--Data successfully sent to 'GetUnits' callback\n");
+        isTxnPending = false;
+        latencyStats.Record(STAGE_NODE,txnVerifyTime);
+        if(creditAck.commandId != 0)
+        {//Recorded here: the Utility task answers resent credits from it
+          preferences.putULong("W",creditAck.commandId);
+          isCreditAckPending = true;
+        }
+        else
+        {//The utility records the recharge
+          recharge_ack_t rechargeAck = {RADIO_MSG_RECHARGE_ACK,(uint8_t)txn.userIndex,
+                                        txn.units,txn.txnId};
+          if(!SendToTask(queue.rechargeAckToUtil,&rechargeAck,utilTaskHandle))
+          {
+            LOG_ERROR(NODE,"Recharge-Util TX FAIL");
+          }
+        }
+        LOG_INFO(NODE,"Recharge acknowledged, ID: %lu",txn.txnId);
       }
-      if(xQueueSend(queue.nodeToUtil,&sensorData,0) == pdPASS)
+    }
+    //Cloud recharges applied by the node are passed on until the Utility task takes them
+    if(isCreditAckPending)
+    {
+      isCreditAckPending = !SendToTask(queue.creditToUtil,&creditAck,utilTaskHandle);
+      if(isCreditAckPending)
       {
-        Serial.println("--Data successfully sent to Utility task\n");
-      }      
+        LOG_WARN(NODE,"Credit-Util TX FAIL (retried)");
+      }
+    }
+    if((millis() - prevFlushTime) >= HISTORY_FLUSH_PERIOD)
+    {
+      history.Flush();
+      prevFlushTime = millis();
+    }
+    
+    //Sleeps until the next deadline, a request or data from the node
+    uint32_t waitTime = TimeLeft(prevFlushTime,HISTORY_FLUSH_PERIOD);
+    if(isTxnPending)
+    {
+      waitTime = min(waitTime,TimeLeft(prevTxnTime,TXN_RETRY_PERIOD));
+    }
+    else if(isCreditAckPending)
+    {
+      waitTime = min(waitTime,(uint32_t)TXN_RETRY_PERIOD);
+    }
+    else if(uxQueueMessagesWaiting(queue.calibrationToNode) > 0 ||
+            (isNodeSynced && uxQueueMessagesWaiting(queue.rechargeToNode) > 0))
+    {
+      waitTime = 0; //e.g. queued while a transaction was pending
+    }
+    else
+    {
+      waitTime = min(waitTime,TimeLeft(prevPollTime,isNodeSynced ? NODE_POLL_PERIOD : 
+                                                                   NODE_BOOT_POLL_PERIOD));
+    }
+    if(isAwaitingReply)
+    {
+      waitTime = min(waitTime,TimeLeft(requestTime,NODE_REPLY_TIMEOUT));
+    }
+    if(mni.IsReceiverReady(sizeof(reply)))
+    {
+      waitTime = 0;
+    }
+    ulTaskNotifyTake(pdTRUE,pdMS_TO_TICKS(waitTime));
+  }
+}
+
+/**
+ * @brief Gets the counter of the next frame sent to the utility. Counters 
+ * are reserved in flash in blocks so they are never reused after a restart.
+*/
+static uint32_t NextTxCounter(void)
+{
+  static uint32_t counter = 0;
+  static uint32_t reservedUntil = 0;
+  if(counter == 0)
+  {
+    counter = preferences.getULong("N",1);
+    reservedUntil = counter;
+  }
+  if(counter >= reservedUntil)
+  {
+    reservedUntil = counter + RADIO_COUNTER_BLOCK;
+    preferences.putULong("N",reservedUntil);
+  }
+  return counter++;
+}
+
+/**
+ * @brief Encrypts a message and sends it to the utility. After repeated 
+ * failures, the other radio profiles are tried (the utility may have changed
+ * channel/data rate).
+ * @return true if the utility received the frame, false if otherwise.
+*/
+static bool SendToUtility(const void* message,uint8_t messageSize)
+{
+  radio_frame_t frame;
+  if(!radioCrypto.Seal(RADIO_UPLINK,meterId,NextTxCounter(),message,messageSize,&frame))
+  {
+    return false;
+  }
+  power.AcquireBusy();
+  bool isDelivered = radioLink.Write(&frame,sizeof(frame)); 
+  if(!isDelivered && 
+     (radioLink.GetConsecutiveFailures() % RADIO_RECOVERY_FAILURES) == 0)
+  {
+    isDelivered = radioLink.Recover(&frame,sizeof(frame));
+    if(isDelivered)
+    {
+      preferences.putUChar("R",radioLink.GetProfile());
+      LOG_WARN(UTIL,"Radio profile changed to %ld",radioLink.GetProfile());
     }
   }
+  power.ReleaseBusy();
+  return isDelivered;
+}
+
+/**
+ * @brief Passes a recharge from the cloud to the Node task. The utility 
+ * resends it until the meter replies with its outcome, so each command is 
+ * applied only once. A command newer than the last one received is applied.
+ * For a resent command, the reply is:
+ * - CREDIT_APPLIED if it is the last one applied by the node.
+ * - none if it is still waiting for the node (the reply is sent when the 
+ * node applies it).
+ * - CREDIT_UNKNOWN otherwise, e.g. it was waiting for the node when the meter
+ * restarted. It won't be applied, but the node may have applied it before
+ * the restart (the cloud has to check the balance before a new command).
+ * The ID of the last command applied by the node is written to flash by the 
+ * Node task, so it is known here even if its acknowledgement hasn't been
+ * passed on yet.
+ * @param lastCreditId: ID of the last command received.
+ * @param isCreditQueued: true if the last command received is waiting for 
+ * the node.
+*/
+static void HandleCredit(const credit_meter_t* creditFromUtil,uint32_t& lastCreditId,
+                         bool& isCreditQueued)
+{
+  credit_ack_t creditAck = {RADIO_MSG_CREDIT_ACK,creditFromUtil->userIndex,
+                            creditFromUtil->commandId,CREDIT_APPLIED};
+  if(creditFromUtil->commandId <= lastCreditId)
+  {
+    uint32_t lastAppliedCreditId = preferences.getULong("W",0);
+    if(lastAppliedCreditId == lastCreditId)
+    {
+      isCreditQueued = false;
+    }
+    if(creditFromUtil->commandId == lastCreditId && isCreditQueued)
+    {
+      return;
+    }
+    if(creditFromUtil->commandId != lastAppliedCreditId)
+    {
+      creditAck.status = CREDIT_UNKNOWN;
+    }
+    SendToUtility(&creditAck,sizeof(creditAck));
+    return;
+  }
+  if(creditFromUtil->userIndex >= numOfUsers || creditFromUtil->units == 0 ||
+     creditFromUtil->units > CREDIT_MAX_UNITS)
+  {
+    LOG_WARN(UTIL,"Invalid recharge command %lu",creditFromUtil->commandId);
+    creditAck.status = CREDIT_REFUSED;
+    SendToUtility(&creditAck,sizeof(creditAck));
+    return;
+  }
+  recharge_node_t rechargeToNode = {};
+  rechargeToNode.userIndex = (UserIndex)creditFromUtil->userIndex;
+  rechargeToNode.units = creditFromUtil->units;
+  rechargeToNode.verifyTime = millis();
+  rechargeToNode.commandId = creditFromUtil->commandId;
+  if(!SendToTask(queue.rechargeToNode,&rechargeToNode,nodeTaskHandle))
+  {
+    LOG_ERROR(UTIL,"Credit-Node TX FAIL");
+    return; //resent by the utility
+  }
+  lastCreditId = creditFromUtil->commandId;
+  preferences.putULong("Q",lastCreditId);
+  isCreditQueued = true;
+  LOG_INFO(UTIL,"Cloud recharge for user %ld: %lu units",creditFromUtil->userIndex,
+           creditFromUtil->units);
+}
+
+/**
+ * @brief Radio IRQ (low level, also a light sleep wake-up source). The IRQ
+ * stays low until the frame is read, so the interrupt is disabled until the 
+ * Utility task has emptied the RX FIFO. Not in IRAM: gpio_intr_disable() runs
+ * from flash (as does the core's GPIO ISR).
+*/
+static void RadioISR(void)
+{
+  BaseType_t isTaskWoken = pdFALSE;
+  gpio_intr_disable((gpio_num_t)NRF24_IRQ_PIN);
+  vTaskNotifyGiveFromISR(utilTaskHandle,&isTaskWoken);
+  if(isTaskWoken == pdTRUE)
+  {
+    portYIELD_FROM_ISR();
+  }
 }
 
 /**
  * @brief Handles communication between the meter and utility
  * system.
+ * 
+ * Frames are encrypted and authenticated with the meter's radio key. Frames
+ * from the utility are only accepted if their counter is greater than that
+ * of the last one accepted (replays are dropped).
 */
 void UtilityTask(void* pvParameters)
 {
-  const uint8_t chipEn = 15;
-  const uint8_t chipSel = 5; 
   const byte addr[][6] = {"00001","00002"};
-  static RF24 nrf24(chipEn,chipSel);
-  static meter_util_t meterToUtil;
+  telemetry_util_t telemetry = {};
+  meter_util_t rechargeToUtil[numOfUsers] = {}; //latest request of each user
+  bool isRequestPending[numOfUsers] = {false};
+  uint8_t nextRequestId = preferences.getUChar("I",1);
+  request_util_t request = {};
+  uint32_t requestTime[numOfUsers] = {0};
+  uint8_t key[RADIO_KEY_SIZE];
   
-  nrf24.begin();
+  if(preferences.getBytes("K",key,sizeof(key)) != sizeof(key) || 
+     !radioCrypto.SetKey(key))
+  {
+    LOG_ERROR(UTIL,"No radio key (send 'K' + key from the utility)");
+  }
+  memset(key,0,sizeof(key));
+  uint32_t lastRxCounter = preferences.getULong("U",0);
+  uint32_t lastCreditId = preferences.getULong("Q",0);
+  bool isCreditQueued = false; //lost if the meter restarts
+  credit_ack_t creditAck = {};
+  recharge_ack_t rechargeAck = {};
+  bool isAckPending = false;
+  time_request_t timeRequest = {RADIO_MSG_TIME_REQUEST};
+  uint32_t timeRequestTime = 0; //last request sent (round trip)
+  bool isTimeRequested = false;
+  uint32_t timeAttemptTime = 0; //last request sent or attempted
+  bool isTimeAttempted = false;
+  telemetry.type = RADIO_MSG_TELEMETRY;
+  //Start with the profile (channel/data rate) last used with the utility
+  if(!radioLink.Begin(preferences.getUChar("R",0),meterId))
+  {
+    LOG_ERROR(UTIL,"Radio not responding");
+  }
   nrf24.openWritingPipe(addr[1]);
   nrf24.openReadingPipe(1,addr[0]);
-  nrf24.setPALevel(RF24_PA_MAX);
+  nrf24.startListening();
+  if(NRF24_IRQ_PIN >= 0)
+  {//Wake up (from light sleep too) when a packet is received
+    nrf24.maskIRQ(true,true,false);
+    attachInterrupt(NRF24_IRQ_PIN,RadioISR,ONLOW_WE);
+    esp_sleep_enable_gpio_wakeup();
+  }
   uint32_t prevTime = millis();
   
   while(1)
   {
-    if(xQueueReceive(queue.nodeToUtil,&meterToUtil.sensorData,0) == pdPASS)
+    if(xQueueReceive(queue.rechargeToUtil,&request,0) == pdPASS)
+    {//Replaces the user's previous request (if still pending)
+      meter_util_t& pending = rechargeToUtil[request.userIndex];
+      pending.type = RADIO_MSG_RECHARGE;
+      pending.userIndex = request.userIndex;
+      pending.requestId = nextRequestId;
+      memcpy(pending.phoneNum,request.recharge.phoneNum,sizeof(pending.phoneNum));
+      pending.units = request.recharge.units;
+      nextRequestId = (nextRequestId == 0xFF) ? 1 : (nextRequestId + 1);
+      preferences.putUChar("I",nextRequestId);
+      isRequestPending[request.userIndex] = true;
+      requestTime[request.userIndex] = request.requestTime;
+      LOG_INFO(UTIL,"Recharge request for user %ld: %lu units",request.userIndex,
+               request.recharge.units);
+    }
+    
+    if((millis() - prevTime) >= TELEMETRY_PERIOD)
     {
-      Serial.println("Node-Util RX PASS\n");
+      //Latest sensor data from the Node task (if any has been received)
+      reading_t reading = {};
+      sensorSnapshot.Read(reading);
+      telemetry.sensorData = reading.sensorData;
+      telemetry.timestamp = reading.timestamp;
+      telemetry.linkQuality = radioLink.GetLinkQuality();
+      SendToUtility(&telemetry,sizeof(telemetry));
+      //Recharge requests are resent until the utility receives them
+      for(uint8_t i = 0; i < numOfUsers; i++)
+      {
+        if(isRequestPending[i] && SendToUtility(&rechargeToUtil[i],sizeof(meter_util_t)))
+        {
+          isRequestPending[i] = false;
+          latencyStats.Record(STAGE_REQUEST,requestTime[i]);
+        }
+      }
+      if(isAckPending && SendToUtility(&rechargeAck,sizeof(rechargeAck)))
+      {
+        isAckPending = false;
+      }
+      prevTime = millis();
     }
-    if(xQueueReceive(queue.rechargeToUtil,&meterToUtil.recharge,0) == pdPASS)
+    //Requests that can't be sent are retried after TIME_RETRY_PERIOD too
+    uint32_t timePeriod = (isTimeRequested && syncClock.IsSynced()) ? TIME_SYNC_PERIOD : 
+                                                                      TIME_RETRY_PERIOD;
+    if(!isTimeAttempted || (millis() - timeAttemptTime) >= timePeriod)
     {
-      Serial.println("Request-Util RX PASS\n");
+      isTimeAttempted = true;
+      timeAttemptTime = millis();
+      isTimeRequested = SendToUtility(&timeRequest,sizeof(timeRequest));
+      if(isTimeRequested)
+      {
+        timeRequestTime = timeAttemptTime;
+      }
     }
-    
-    if((millis() - prevTime) >= 5000)
+    //Cloud recharges are acknowledged as soon as the node applies them
+    if(xQueueReceive(queue.creditToUtil,&creditAck,0) == pdPASS)
     {
-      nrf24.stopListening();
-      nrf24.write(&meterToUtil,sizeof(meterToUtil)); 
-      nrf24.startListening();
-      memset(meterToUtil.recharge.phoneNum,'\0',SIZE_PHONE);
-      meterToUtil.recharge.units = 0;
-      prevTime = millis();
+      isCreditQueued = false;
+      SendToUtility(&creditAck,sizeof(creditAck));
+    }
+    //Applied recharges with OTP are reported until the utility receives them
+    if(!isAckPending && xQueueReceive(queue.rechargeAckToUtil,&rechargeAck,0) == pdPASS)
+    {
+      isAckPending = !SendToUtility(&rechargeAck,sizeof(rechargeAck));
     }
     
-    if(nrf24.available())
+    radio_frame_t frame;
+    uint8_t message[RADIO_MAX_PLAINTEXT];
+    bool isFrameRead = radioLink.Read(&frame,sizeof(frame));
+    //Frames for other meters are ignored
+    if(isFrameRead && frame.meterId == meterId)
     {
-      char otp[SIZE_OTP] = {0};
-      //Discard old OTP (if any) before sending the new one
-      if(xQueueReceive(queue.utilToOtp,otp,0) == pdPASS)
+      if(frame.counter <= lastRxCounter || 
+         !radioCrypto.Open(RADIO_DOWNLINK,&frame,message))
       {
-        Serial.println("Previous OTP discarded\n");
+        LOG_WARN(UTIL,"Frame rejected (counter: %lu)",frame.counter);
       }
-      nrf24.read(otp,SIZE_OTP); //new OTP
-      Serial.print("OTP = ");
-      Serial.println(otp);
-      if(xQueueSend(queue.utilToOtp,otp,0) == pdPASS)
+      else
       {
-        Serial.println("Util-OTP TX PASS\n");
+        lastRxCounter = frame.counter;
+        preferences.putULong("U",lastRxCounter);
+        if(message[0] == RADIO_MSG_CREDIT)
+        {
+          credit_meter_t creditFromUtil;
+          memcpy(&creditFromUtil,message,sizeof(creditFromUtil));
+          HandleCredit(&creditFromUtil,lastCreditId,isCreditQueued);
+        }
+        else if(message[0] == RADIO_MSG_TIME)
+        {//Corrected by half the round trip (request -> reply)
+          time_meter_t timeFromUtil;
+          memcpy(&timeFromUtil,message,sizeof(timeFromUtil));
+          uint32_t roundTrip = millis() - timeRequestTime;
+          if(isTimeRequested && roundTrip <= TIME_MAX_RTT && timeFromUtil.milliseconds < 1000)
+          {
+            uint32_t milliseconds = timeFromUtil.milliseconds + roundTrip / 2;
+            syncClock.Sync(timeFromUtil.time + milliseconds / 1000,milliseconds % 1000);
+            LOG_INFO(UTIL,"Time: %lu, drift: %ld ppm",syncClock.GetTime(),syncClock.GetDriftPpm());
+          }
+        }
+        else if(message[0] == RADIO_MSG_OTP) //new OTP
+        {
+          otp_meter_t otpFromUtil;
+          memcpy(&otpFromUtil,message,sizeof(otpFromUtil));
+          otpFromUtil.otp[SIZE_OTP - 1] = '\0';
+          if(otpTable.SetOtp(meterId,otpFromUtil.userIndex,otpFromUtil.otp))
+          {
+            latencyStats.Record(STAGE_OTP,requestTime[otpFromUtil.userIndex]);
+            LOG_INFO(UTIL,"OTP received for user %ld",otpFromUtil.userIndex);
+          }
+        }
       }
     }
+    
+    //Sleeps until the next deadline, a request or a frame
+    timePeriod = (isTimeRequested && syncClock.IsSynced()) ? TIME_SYNC_PERIOD : TIME_RETRY_PERIOD;
+    uint32_t waitTime = min(TimeLeft(prevTime,TELEMETRY_PERIOD),TimeLeft(timeAttemptTime,timePeriod));
+    if(NRF24_IRQ_PIN < 0)
+    {//The round trip of a time request is measured to the poll that reads the reply
+      bool isTimeReplyDue = isTimeRequested && (millis() - timeRequestTime) < TIME_MAX_RTT;
+      waitTime = min(waitTime,(uint32_t)(isTimeReplyDue ? RADIO_FAST_POLL_PERIOD : RADIO_POLL_PERIOD));
+    }
+    else if(!isFrameRead)
+    {//RX FIFO empty: the next frame raises the IRQ
+      gpio_intr_enable((gpio_num_t)NRF24_IRQ_PIN);
+    }
+    if(isFrameRead || uxQueueMessagesWaiting(queue.rechargeToUtil) > 0 || 
+       uxQueueMessagesWaiting(queue.creditToUtil) > 0 ||
+       (!isAckPending && uxQueueMessagesWaiting(queue.rechargeAckToUtil) > 0))
+    {
+      waitTime = 0;
+    }
+    ulTaskNotifyTake(pdTRUE,pdMS_TO_TICKS(waitTime));
   }
 }
 
@@ -271,7 +1237,6 @@ void UtilityTask(void* pvParameters)
 */
 UserIndex ValidateLogin(char* id,uint8_t idSize,char* pin,uint8_t pinSize)
 {     
-  const uint8_t numOfUsers = 3;
   const UserIndex indexArray[numOfUsers] = {USER1,USER2,USER3};
   UserIndex userIndex = USER_UNKNOWN;
   
@@ -286,9 +1251,7 @@ UserIndex ValidateLogin(char* id,uint8_t idSize,char* pin,uint8_t pinSize)
     preferences.getBytes(flashLoc,pinFlash,pinSize);
     if(!strcmp(id,idFlash) && !strcmp(pin,pinFlash))
     {
-      Serial.println("SUCCESS");
-      Serial.print("Details found at index: ");
-      Serial.println(i);
+      LOG_INFO(APP,"Login: user %ld",i);
       userIndex = indexArray[i];
       break;
     }
@@ -334,12 +1297,12 @@ void GetUnits(UserIndex userIndex,float* volumePtr)
     Serial.println("Could not get available units (or volume of water)");
     return; //invalid index
   }  
-  sensor_t sensorData = {};
-  if(xQueueReceive(queue.nodeToGetUnits,&sensorData,0) != pdPASS)
+  reading_t reading = {};
+  if(!sensorSnapshot.Read(reading))
   {
-    return;
+    return; //No data from the node yet
   }
-  Serial.println("Node-GetUnits RX PASS");
+  const sensor_t& sensorData = reading.sensorData;
   switch(userIndex)
   {
     case USER1:
@@ -421,28 +1384,28 @@ bool HandleRecharge(UserIndex userIndex,uint32_t unitsRequired)
     return false; //invalid index
   }   
   bool isSentToUtil = false; 
-  bool isSentToNode = false;
+  bool isPending = false;
   char flashLoc[2] = {0};
   flashLoc[0] = '6' + userIndex; //to get phone number's location in flash memory
-  recharge_util_t rechargeToUtil = {};
-  recharge_node_t rechargeToNode = {};
+  request_util_t rechargeToUtil = {};
   
-  preferences.getBytes(flashLoc,rechargeToUtil.phoneNum,SIZE_PHONE);
-  rechargeToUtil.units = unitsRequired;
-  rechargeToNode.userIndex = userIndex;
-  rechargeToNode.units = unitsRequired;
+  preferences.getBytes(flashLoc,rechargeToUtil.recharge.phoneNum,SIZE_PHONE);
+  rechargeToUtil.recharge.units = unitsRequired;
+  rechargeToUtil.userIndex = userIndex;
+  rechargeToUtil.requestTime = millis();
   
-  if(xQueueSend(queue.rechargeToUtil,&rechargeToUtil,0) == pdPASS)
+  //The recharge waits (in the OTP table) for its OTP from the utility
+  isPending = otpTable.Add(meterId,userIndex,unitsRequired);
+  if(isPending && SendToTask(queue.rechargeToUtil,&rechargeToUtil,utilTaskHandle))
   {
     isSentToUtil = true;
-    Serial.println("Request-Util TX PASS\n");
+    LOG_DEBUG(APP,"Request-Util TX PASS");
   }
-  if(xQueueSend(queue.rechargeToNode,&rechargeToNode,0) == pdPASS)
-  {
-    isSentToNode = true;
-    Serial.println("Request-Node TX PASS\n");
+  else if(isPending)
+  {//No OTP will come for it
+    otpTable.Remove(meterId,userIndex);
   }
-  return (isSentToUtil && isSentToNode);  
+  return (isPending && isSentToUtil);  
 }
 
 /**
@@ -450,8 +1413,9 @@ bool HandleRecharge(UserIndex userIndex,uint32_t unitsRequired)
  * enters an OTP (via the HMI) in order to recharge. It  
  * checks the correctness of the OTP.
  * 
- * If the user enters a wrong OTP, the user will have to
- * make a new request and enter a new OTP as the old one
+ * Each user has a pending OTP which expires after some time.
+ * If the user enters a wrong OTP too many times, the user will 
+ * have to make a new request and enter a new OTP as the old one
  * would no longer be valid.
  * 
  * @return true if OTP entered by the user is correct.
@@ -464,22 +1428,47 @@ bool VerifyOtp(UserIndex userIndex,char* otpEnteredByUser)
     Serial.println("OTP Verification Error: Invalid user");
     return false; //invalid index
   }
-  bool isOtpCorrect = false;  
-  char otp[SIZE_OTP] = {0};
-  
-  if(xQueueReceive(queue.utilToOtp,otp,0) == pdPASS)
+  //The OTP is only consumed if the recharge can be passed to the node
+  if(uxQueueSpacesAvailable(queue.rechargeToNode) == 0)
   {
-    Serial.println("Util-OTP RX PASS\n");  
+    LOG_ERROR(APP,"Recharge-Node queue full");
+    return false;
   }
-  if(!strcmp(otpEnteredByUser,otp))
+  recharge_node_t rechargeToNode = {};
+  rechargeToNode.userIndex = userIndex;
+  rechargeToNode.verifyTime = millis();
+  OtpTable::Status status = otpTable.Verify(meterId,userIndex,otpEnteredByUser,
+                                            &rechargeToNode.units);
+  LOG_INFO(APP,"OTP status for user %ld: %ld",userIndex,status);
+  if(status != OtpTable::OTP_VALID)
   {
-    isOtpCorrect = true;
-    Serial.println("OTP: Correct");
+    return false;
   }
-  if(xQueueSend(queue.otpToNode,&isOtpCorrect,0) == pdPASS)
+  if(!SendToTask(queue.rechargeToNode,&rechargeToNode,nodeTaskHandle))
   {
-    Serial.println("OTP-Node TX PASS\n");
+    LOG_ERROR(APP,"Recharge-Node TX FAIL");
+    return false;
   }
-  return isOtpCorrect;
+  return true;
 }
 
+/**
+ * @brief Callback function that is called when the HMI displays the 
+ * consumption history of a user.
+ * 
+ * @param userIndex: To determine the user whose information is required.
+ * @param period: Hours, days or months.
+ * @param volumes: Buffer to store the consumption (mL) of each period, 
+ * starting with the current one.
+ * @param maxNumOfPeriods: Size of the 'volumes' buffer.
+ * @return Number of periods stored in 'volumes'.
+*/
+uint8_t GetHistory(UserIndex userIndex,HistoryPeriod period,
+                   uint32_t* volumes,uint8_t maxNumOfPeriods)
+{
+  if(userIndex == USER_UNKNOWN)
+  {
+    return 0; //invalid index
+  }
+  return history.Get(userIndex,period,volumes,maxNumOfPeriods);
+}
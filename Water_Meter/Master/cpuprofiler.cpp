@@ -0,0 +1,207 @@
+#include <Arduino.h>
+#include "cpuprofiler.h"
+
+CpuProfiler* CpuProfiler::instance = NULL;
+
+/**
+ * @brief Adds a sample to the slot of the task running on a core.
+*/
+void IRAM_ATTR CpuProfiler::Sample(uint8_t core,TaskHandle_t runningTask)
+{
+  for(uint8_t i = 0; i < numOfTasks; i++)
+  {
+    if(slots[i].handle == runningTask)
+    {
+      slots[i].samples++;
+      return;
+    }
+  }
+  slot_t* idle = &slots[CPU_PROFILER_MAX_TASKS + 2 * core];
+  if(idle->handle == runningTask)
+  {
+    idle->samples++;
+  }
+  else
+  {
+    slots[CPU_PROFILER_MAX_TASKS + 2 * core + 1].samples++; //other
+  }
+}
+
+void IRAM_ATTR CpuProfiler::SampleISR(void)
+{
+  CpuProfiler* profiler = CpuProfiler::instance;
+  portENTER_CRITICAL_ISR(&profiler->mux);
+  profiler->ticks++;
+  for(uint8_t core = 0; core < NUM_OF_CORES; core++)
+  {
+    profiler->Sample(core,xTaskGetCurrentTaskHandleForCPU(core));
+  }
+  portEXIT_CRITICAL_ISR(&profiler->mux);
+}
+
+CpuProfiler::CpuProfiler(void)
+{
+  //Initialize private variables
+  memset(slots,0,sizeof(slots));
+  ticks = 0;
+  prevTicks = 0;
+  numOfTasks = 0;
+  mux = portMUX_INITIALIZER_UNLOCKED;
+  timer = NULL;
+  apbLock = NULL;
+  isRunning = false;
+}
+
+/**
+ * @brief Registers a task to be profiled. Must be called before Begin().
+ * @return true if registered, false if there's no space left (or invalid handle).
+*/
+bool CpuProfiler::AddTask(TaskHandle_t handle)
+{
+  if(handle == NULL || numOfTasks == CPU_PROFILER_MAX_TASKS || timer != NULL)
+  {
+    return false;
+  }
+  slots[numOfTasks].handle = handle;
+  BaseType_t affinity = xTaskGetAffinity(handle);
+  slots[numOfTasks].core = (affinity < NUM_OF_CORES) ? affinity : NUM_OF_CORES;
+  numOfTasks++;
+  return true;
+}
+
+/**
+ * @brief Sets up the timer (sampling starts with Start()).
+ * @param timerNum: Hardware timer to use (0 to 3).
+ * @return true if successful, false if otherwise.
+*/
+bool CpuProfiler::Begin(uint8_t timerNum)
+{
+  if(CpuProfiler::instance != NULL)
+  {
+    return false;
+  }
+  for(uint8_t core = 0; core < NUM_OF_CORES; core++)
+  {
+    slots[CPU_PROFILER_MAX_TASKS + 2 * core].handle = xTaskGetIdleTaskHandleForCPU(core);
+    slots[CPU_PROFILER_MAX_TASKS + 2 * core].core = core;
+    slots[CPU_PROFILER_MAX_TASKS + 2 * core + 1].core = core;
+  }
+  CpuProfiler::instance = this;
+  timer = timerBegin(timerNum,80,true); //1MHz (80MHz APB / 80)
+  if(timer == NULL)
+  {
+    CpuProfiler::instance = NULL;
+    return false;
+  }
+  timerAttachInterrupt(timer,CpuProfiler::SampleISR,true);
+  timerAlarmWrite(timer,1000000 / CPU_PROFILER_SAMPLE_RATE,true);
+  if(esp_pm_lock_create(ESP_PM_APB_FREQ_MAX,0,"profiler",&apbLock) != ESP_OK)
+  {
+    apbLock = NULL; //fixed APB frequency
+  }
+  return true;
+}
+
+/**
+ * @brief Starts a measurement window: the next report covers the time from
+ * now until it is requested.
+*/
+void CpuProfiler::Start(void)
+{
+  if(timer == NULL || isRunning)
+  {
+    return;
+  }
+  if(apbLock != NULL)
+  {
+    esp_pm_lock_acquire(apbLock);
+  }
+  portENTER_CRITICAL(&mux);
+  for(uint8_t i = 0; i < sizeof(slots) / sizeof(slots[0]); i++)
+  {
+    slots[i].prevSamples = slots[i].samples;
+  }
+  prevTicks = ticks;
+  portEXIT_CRITICAL(&mux);
+  timerAlarmEnable(timer);
+  isRunning = true;
+}
+
+/**
+ * @brief Ends the measurement window (lets the CPU light-sleep again).
+*/
+void CpuProfiler::Stop(void)
+{
+  if(!isRunning)
+  {
+    return;
+  }
+  timerAlarmDisable(timer);
+  if(apbLock != NULL)
+  {
+    esp_pm_lock_release(apbLock);
+  }
+  isRunning = false;
+}
+
+bool CpuProfiler::IsRunning(void)
+{
+  return isRunning;
+}
+
+/**
+ * @brief Writes the CPU usage of each task since Start() or the previous 
+ * report e.g.
+ * "App(1):2.5% Node(0):0.4% IDLE(0):99.1% OTHER(0):0.5% IDLE(1):97.0% ..."
+ * Usage is a percentage of one core. The core is shown as '*' for tasks
+ * that aren't pinned.
+ * @return Length of the report (excluding NULL).
+*/
+size_t CpuProfiler::GetReport(char* buffer,size_t bufferSize)
+{
+  const uint8_t numOfSlots = sizeof(slots) / sizeof(slots[0]);
+  uint32_t delta[numOfSlots] = {0};
+  uint32_t numOfTicks;
+  
+  portENTER_CRITICAL(&mux);
+  for(uint8_t i = 0; i < numOfSlots; i++)
+  {
+    delta[i] = slots[i].samples - slots[i].prevSamples;
+    slots[i].prevSamples = slots[i].samples;
+  }
+  numOfTicks = ticks - prevTicks;
+  prevTicks = ticks;
+  portEXIT_CRITICAL(&mux);
+
+  size_t len = 0;
+  buffer[0] = '\0';
+  for(uint8_t i = 0; i < numOfSlots && len < bufferSize; i++)
+  {
+    if(i >= numOfTasks && i < CPU_PROFILER_MAX_TASKS)
+    {
+      continue; //unused slot
+    }
+    const char* name;
+    if(i < numOfTasks)
+    {
+      name = pcTaskGetTaskName(slots[i].handle);
+    }
+    else
+    {
+      name = ((i - CPU_PROFILER_MAX_TASKS) % 2 == 0) ? "IDLE" : "OTHER";
+    }
+    char core = (slots[i].core < NUM_OF_CORES) ? ('0' + slots[i].core) : '*';
+    float usage = (numOfTicks > 0) ? (100.0 * delta[i] / numOfTicks) : 0.0;
+    int written = snprintf(buffer + len,bufferSize - len,"%s(%c):%.1f%% ",name,core,usage);
+    if(written < 0)
+    {
+      break;
+    }
+    len += written;
+  }
+  if(len >= bufferSize)
+  {
+    len = bufferSize - 1; //truncated
+  }
+  return len;
+}
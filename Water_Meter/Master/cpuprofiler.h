@@ -0,0 +1,56 @@
+#pragma once
+
+#include <esp_pm.h>
+
+#define CPU_PROFILER_MAX_TASKS    8
+#define CPU_PROFILER_SAMPLE_RATE  1000 //Hz
+
+/**
+ * @brief Sampling CPU profiler.
+ *
+ * A hardware timer interrupt records the task running on each core at a
+ * fixed rate. The share of samples taken by each registered task (and the
+ * idle tasks) gives its CPU usage. Unlike FreeRTOS run-time stats, this
+ * doesn't require a custom build of the ESP32 core.
+ *
+ * The timer is clocked by the APB, which power management slows down when
+ * idle (and stops in light sleep), and its interrupts would keep waking the
+ * CPU. So sampling only runs between Start() and Stop() (a measurement 
+ * window), with the APB held at its max frequency (no light sleep meanwhile).
+ *
+ * Only one profiler can exist.
+*/
+class CpuProfiler
+{
+  private:
+    enum {NUM_OF_CORES = 2};
+    typedef struct
+    {
+      TaskHandle_t handle;
+      uint8_t core;
+      uint32_t samples;
+      uint32_t prevSamples;
+    }slot_t;
+    //Registered tasks, followed by the idle task and 'other' tasks of each core
+    slot_t slots[CPU_PROFILER_MAX_TASKS + 2 * NUM_OF_CORES];
+    uint8_t numOfTasks;
+    uint32_t ticks; //each tick samples both cores
+    uint32_t prevTicks;
+    portMUX_TYPE mux;
+    hw_timer_t* timer;
+    esp_pm_lock_handle_t apbLock; //NULL if power management isn't available
+    bool isRunning;
+    static CpuProfiler* instance;
+
+    void Sample(uint8_t core,TaskHandle_t runningTask);
+    static void SampleISR(void);
+
+  public:
+    CpuProfiler(void);
+    bool AddTask(TaskHandle_t handle);
+    bool Begin(uint8_t timerNum = 0);
+    void Start(void);
+    void Stop(void);
+    bool IsRunning(void);
+    size_t GetReport(char* buffer,size_t bufferSize);
+};
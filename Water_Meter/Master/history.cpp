@@ -0,0 +1,229 @@
+#include <Arduino.h>
+#include <string.h>
+#include <time.h>
+#include "history.h"
+
+/**
+ * @brief Must be called with the lock held (the start is moved by Update()).
+ * @param now: millis() (read before taking the lock).
+*/
+uint32_t History::GetCurrentHour(uint32_t now)
+{
+  return startHour + (now - startTime) / HISTORY_MILLIS_PER_HOUR;
+}
+
+/**
+ * @brief Gets the local day (days since 1970-01-01) of an hour.
+*/
+uint32_t History::GetDay(uint32_t hour)
+{
+  if(utcOffset < 0 && hour < (uint32_t)-utcOffset)
+  {//hours of operation only
+    return 0;
+  }
+  return (hour + utcOffset) / HISTORY_HOURS_PER_DAY;
+}
+
+/**
+ * @brief Gets the local calendar month (months since January 1970) of an hour.
+*/
+uint32_t History::GetMonth(uint32_t hour)
+{
+  time_t time = (time_t)History::GetDay(hour) * HISTORY_HOURS_PER_DAY * HISTORY_SECS_PER_HOUR;
+  struct tm date;
+  gmtime_r(&time,&date);
+  return (date.tm_year - 70) * 12 + date.tm_mon;
+}
+
+/**
+ * @brief Clears the buckets of the periods after 'prev' up to 'current' (all
+ * of them at once if the ring has been gone round).
+*/
+static void ClearBuckets(uint32_t (*buckets)[HISTORY_NUM_OF_USERS],uint8_t numOfBuckets,
+                         uint32_t prev,uint32_t current)
+{
+  if((current - prev) >= numOfBuckets)
+  {
+    memset(buckets,0,numOfBuckets * sizeof(buckets[0]));
+    return;
+  }
+  for(uint32_t period = prev + 1; period <= current; period++)
+  {
+    memset(buckets[period % numOfBuckets],0,sizeof(buckets[0]));
+  }
+}
+
+/**
+ * @brief Moves the current hour forward, clearing the buckets of the hours,
+ * days and months entered (at most one pass over the history, however long
+ * the jump). Must be called with the lock held.
+*/
+void History::AdvanceTo(uint32_t hour)
+{
+  if(hour <= store.hour)
+  {
+    return;
+  }
+  ClearBuckets(store.hourly,HISTORY_NUM_OF_HOURS,store.hour,hour);
+  ClearBuckets(store.daily,HISTORY_NUM_OF_DAYS,
+               History::GetDay(store.hour),History::GetDay(hour));
+  ClearBuckets(store.monthly,HISTORY_NUM_OF_MONTHS,
+               History::GetMonth(store.hour),History::GetMonth(hour));
+  store.hour = hour;
+}
+
+/**
+ * @brief Creates the history.
+ * @param prefsPtr: Flash storage (must have been opened for writing).
+ * @param key: Location of the history in 'prefsPtr'.
+ * @param utcOffset: Local time - UTC (hours), for the days and months.
+*/
+History::History(Preferences* prefsPtr,const char* key,int8_t utcOffset)
+{
+  //Initialize private variables
+  this->prefsPtr = prefsPtr;
+  this->key = key;
+  this->utcOffset = utcOffset;
+  mutex = xSemaphoreCreateMutex();
+  memset(&store,0,sizeof(store));
+  memset(&persisted,0,sizeof(persisted));
+  memset(prevBalance,0,sizeof(prevBalance));
+  hasBalance = false;
+  isDirty = false;
+  startHour = 0;
+  startTime = 0;
+}
+
+/**
+ * @brief Loads the history from flash. An empty history is started if there's
+ * none (or if its layout has changed).
+*/
+void History::Begin(void)
+{
+  if(prefsPtr->getBytesLength(key) != sizeof(store) ||
+     prefsPtr->getBytes(key,&store,sizeof(store)) != sizeof(store))
+  {
+    memset(&store,0,sizeof(store));
+  }
+  persisted = store;
+  startHour = store.hour;
+  startTime = millis();
+}
+
+/**
+ * @brief Adds the consumption since the previous call to the current buckets.
+ * Increases in balance (recharges) aren't consumption.
+ * @param balances: Balance (mL) of each user.
+ * @param timestamp: Unix time of the reading (0: unknown).
+*/
+void History::Update(const float* balances,uint32_t timestamp)
+{
+  uint32_t hour;
+  uint32_t now = millis();
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  if(timestamp != 0)
+  {//Also followed between readings
+    hour = timestamp / HISTORY_SECS_PER_HOUR;
+    startHour = hour;
+    startTime = now - (timestamp % HISTORY_SECS_PER_HOUR) * 1000;
+  }
+  else
+  {
+    hour = History::GetCurrentHour(now);
+  }
+  History::AdvanceTo(hour);
+  uint32_t day = History::GetDay(store.hour);
+  uint32_t month = History::GetMonth(store.hour);
+  for(uint8_t i = 0; i < HISTORY_NUM_OF_USERS; i++)
+  {
+    if(!hasBalance || balances[i] > prevBalance[i])
+    {
+      prevBalance[i] = balances[i];
+      continue;
+    }
+    //Whole mL only, the remainder is carried to the next sample
+    uint32_t consumed = (uint32_t)(prevBalance[i] - balances[i]);
+    if(consumed == 0)
+    {
+      continue;
+    }
+    prevBalance[i] -= consumed;
+    store.hourly[store.hour % HISTORY_NUM_OF_HOURS][i] += consumed;
+    store.daily[day % HISTORY_NUM_OF_DAYS][i] += consumed;
+    store.monthly[month % HISTORY_NUM_OF_MONTHS][i] += consumed;
+    isDirty = true;
+  }
+  hasBalance = true;
+  xSemaphoreGive(mutex);
+}
+
+/**
+ * @brief Gets the consumption of a user over the most recent periods.
+ * @param volumes: Stores the consumption (mL) of each period, starting with 
+ * the current one.
+ * @param maxNumOfPeriods: Size of the 'volumes' buffer.
+ * @return Number of periods stored in 'volumes'.
+*/
+uint8_t History::Get(uint8_t userIndex,HistoryPeriod period,
+                     uint32_t* volumes,uint8_t maxNumOfPeriods)
+{
+  if(userIndex >= HISTORY_NUM_OF_USERS)
+  {
+    return 0;
+  }
+  uint32_t now = millis();
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  History::AdvanceTo(History::GetCurrentHour(now));
+  uint32_t current;
+  uint8_t numOfBuckets;
+  const uint32_t (*buckets)[HISTORY_NUM_OF_USERS];
+  switch(period)
+  {
+    case HISTORY_HOURLY:
+      current = store.hour;
+      numOfBuckets = HISTORY_NUM_OF_HOURS;
+      buckets = store.hourly;
+      break;
+    case HISTORY_DAILY:
+      current = History::GetDay(store.hour);
+      numOfBuckets = HISTORY_NUM_OF_DAYS;
+      buckets = store.daily;
+      break;
+    default:
+      current = History::GetMonth(store.hour);
+      numOfBuckets = HISTORY_NUM_OF_MONTHS;
+      buckets = store.monthly;
+      break;
+  }
+  uint8_t numOfPeriods = 0;
+  while(numOfPeriods < maxNumOfPeriods && numOfPeriods < numOfBuckets &&
+        numOfPeriods <= current)
+  {
+    volumes[numOfPeriods] = buckets[(current - numOfPeriods) % numOfBuckets][userIndex];
+    numOfPeriods++;
+  }
+  xSemaphoreGive(mutex);
+  return numOfPeriods;
+}
+
+/**
+ * @brief Persists the history (if it has changed since the last call).
+ * Should be called periodically.
+*/
+void History::Flush(void)
+{
+  uint32_t now = millis();
+  xSemaphoreTake(mutex,portMAX_DELAY);
+  History::AdvanceTo(History::GetCurrentHour(now));
+  bool isChanged = isDirty || (persisted.hour != store.hour);
+  if(isChanged)
+  {
+    persisted = store;
+    isDirty = false;
+  }
+  xSemaphoreGive(mutex);
+  if(isChanged)
+  {
+    prefsPtr->putBytes(key,&persisted,sizeof(persisted));
+  }
+}
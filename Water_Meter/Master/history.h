@@ -0,0 +1,78 @@
+#pragma once
+
+#include <Preferences.h>
+
+#define HISTORY_NUM_OF_USERS      3
+//Number of buckets kept for each period
+#define HISTORY_NUM_OF_HOURS      24
+#define HISTORY_NUM_OF_DAYS       31
+#define HISTORY_NUM_OF_MONTHS     12
+#define HISTORY_HOURS_PER_DAY     24
+#define HISTORY_UTC_OFFSET        1 //hours, local time - UTC (WAT)
+#define HISTORY_MILLIS_PER_HOUR   3600000UL
+#define HISTORY_SECS_PER_HOUR     3600
+
+enum HistoryPeriod
+{
+  HISTORY_HOURLY = 0,
+  HISTORY_DAILY,
+  HISTORY_MONTHLY
+};
+
+/**
+ * @brief Consumption history of the users of a meter.
+ *
+ * Consumption (decrease in balance between samples) is added to the current
+ * hourly, daily and monthly buckets as it happens, so reading the history 
+ * never scans raw samples. Each period is a ring of buckets that is cleared 
+ * when time moves into it. The buckets are persisted in flash (one blob) by
+ * Flush().
+ * 
+ * Hours are Unix (UTC) hours once readings are timestamped; until then (and 
+ * between readings) time is counted from the last known hour in hours of 
+ * operation (the time the meter is off isn't counted). Days and months are
+ * local calendar days and months (UTC + utcOffset hours), so the current day
+ * starts at local midnight and the current month on the 1st. NB: The first 
+ * timestamped reading moves a history kept in hours of operation far forward,
+ * which clears it.
+ *
+ * All public methods are thread-safe (mutex, Flush() must only be called by
+ * one task).
+*/
+class History
+{
+  private:
+    typedef struct
+    {
+      uint32_t hour; //index of the current hour
+      uint32_t hourly[HISTORY_NUM_OF_HOURS][HISTORY_NUM_OF_USERS]; //mL
+      uint32_t daily[HISTORY_NUM_OF_DAYS][HISTORY_NUM_OF_USERS];
+      uint32_t monthly[HISTORY_NUM_OF_MONTHS][HISTORY_NUM_OF_USERS];
+    }store_t;
+
+    Preferences* prefsPtr;
+    const char* key;
+    SemaphoreHandle_t mutex;
+    store_t store;
+    store_t persisted; //copy being written to flash
+    float prevBalance[HISTORY_NUM_OF_USERS];
+    bool hasBalance;
+    bool isDirty;
+    uint32_t startHour;
+    uint32_t startTime;
+    int8_t utcOffset;
+
+    uint32_t GetCurrentHour(uint32_t now);
+    uint32_t GetDay(uint32_t hour);
+    uint32_t GetMonth(uint32_t hour);
+    void AdvanceTo(uint32_t hour);
+
+  public:
+    History(Preferences* prefsPtr,const char* key = "H",
+            int8_t utcOffset = HISTORY_UTC_OFFSET);
+    void Begin(void);
+    void Update(const float* balances,uint32_t timestamp = 0);
+    uint8_t Get(uint8_t userIndex,HistoryPeriod period,
+                uint32_t* volumes,uint8_t maxNumOfPeriods);
+    void Flush(void);
+};
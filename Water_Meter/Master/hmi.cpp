@@ -4,27 +4,7 @@
 #include <LiquidCrystal_I2C.h> //Version 1.1.2
 #include "keypad.h"
 #include "hmi.h"
-
-/**
- * @brief Converts a string to an integer.
- * e.g.
- * "932" to 932:
- * '9' - '0' = 9
- * '3' - '0' = 3
- * '2' - '0' = 2
- * 9 x 10^2 + 3 x 10^1 + 2 x 10^0 = 932.
-*/
-void StringToInteger(char* stringPtr,uint32_t* integerPtr)
-{
-  *integerPtr = 0;
-  uint8_t len = strlen(stringPtr);
-  uint32_t j = 1;
-  for(uint8_t i = 0; i < len; i++)
-  {
-    *integerPtr += ((stringPtr[len - i - 1] - '0') * j);
-    j *= 10;
-  }
-}
+#include "numfmt.h"
 
 /**
  * @brief Configures parameters (e.g. user ID, pin, phone number).
@@ -62,6 +42,7 @@ void HMI::SetParam(uint8_t col,uint8_t row,
     switch(key)
     {
       case '\0':
+        keypadPtr->WaitForKey(KEYPAD_NO_TIMEOUT); //no key pressed, sleep until one is
         break;
       case '#':
         return;
@@ -183,6 +164,9 @@ void HMI::DisplayInstructions(void)
     char key = keypadPtr->GetChar();
     switch(key)
     {
+      case '\0':
+        keypadPtr->WaitForKey(KEYPAD_NO_TIMEOUT); //no key pressed, sleep until one is
+        break;
       case '#':
         lcdPtr->clear();
         return;
@@ -430,7 +414,7 @@ void HMI::StateFunc_UserMenu1(void)
   lcdPtr->setCursor(unitsColumn,ROW1);
   lcdPtr->print((volume / 1000.0),2); //display units(or volume in litres) in 2dp
   lcdPtr->print("L    "); //some spaces (4) to clear possible leftovers from previous display
-  HMI::DisplayPageNumber(ROW4,PAGE1,PAGE3);
+  HMI::DisplayPageNumber(ROW4,PAGE1,PAGE4);
                      
   char key = keypadPtr->GetChar();
   switch(key)
@@ -461,8 +445,9 @@ void HMI::StateFunc_UserMenu1(void)
         case ROW2:
           if(strcmp(reqBuff,""))
           {
-            StringToInteger(reqBuff,&request);
-            requestSent = HandleRecharge(userIndex,request);
+            //Keys other than digits (e.g. 'A') make the request invalid
+            requestSent = ParseUnsigned(reqBuff,&request) && 
+                          HandleRecharge(userIndex,request);
             memset(reqBuff,'\0',SIZE_REQUEST); 
             HMI::ClearParamDisplay(reqColumn,ROW2,strlen(reqBuff));
             if(requestSent)
@@ -501,6 +486,7 @@ void HMI::StateFunc_UserMenu2(void)
   uint8_t idColumn = strlen(heading2);
   uint8_t pinColumn = strlen(heading3);
   char infoToDisplayAfterSave[10] = {0};
+  StringBuilder info(infoToDisplayAfterSave,sizeof(infoToDisplayAfterSave));
   bool isIdSaved = false;
   bool isPinSaved = false;
   
@@ -509,7 +495,7 @@ void HMI::StateFunc_UserMenu2(void)
                   currentRow.userMenu2); 
   HMI::DisplayParam(idColumn,ROW2,id);
   HMI::DisplayParam(pinColumn,ROW3,pin,true);                  
-  HMI::DisplayPageNumber(ROW4,PAGE2,PAGE3);
+  HMI::DisplayPageNumber(ROW4,PAGE2,PAGE4);
   
   char key = keypadPtr->GetChar();
   switch(key)
@@ -542,11 +528,11 @@ void HMI::StateFunc_UserMenu2(void)
       isPinSaved = StoreUserParam(userIndex,PIN,pin,SIZE_PIN);
       if(isIdSaved)
       {
-        strcat(infoToDisplayAfterSave,"-ID");
+        info.Append("-ID");
       }
       if(isPinSaved)
       {
-        strcat(infoToDisplayAfterSave,"-PIN");
+        info.Append("-PIN");
       }
       if(isIdSaved || isPinSaved)
       {
@@ -568,7 +554,7 @@ void HMI::StateFunc_UserMenu3(void)
                   heading3,heading4,
                   currentRow.userMenu3); 
   HMI::DisplayParam(phoneColumn,ROW2,phoneNum);
-  HMI::DisplayPageNumber(ROW4,PAGE3,PAGE3); 
+  HMI::DisplayPageNumber(ROW4,PAGE3,PAGE4); 
   
   char key = keypadPtr->GetChar();
   switch(key)
@@ -582,6 +568,9 @@ void HMI::StateFunc_UserMenu3(void)
     case 'C':
       HMI::ChangeStateTo(ST_USER_MENU2);
       break;
+    case 'D':
+      HMI::ChangeStateTo(ST_USER_MENU4);
+      break;
     case '#':
       switch(currentRow.userMenu3)
       {
@@ -602,6 +591,69 @@ void HMI::StateFunc_UserMenu3(void)
   }   
 }
 
+/**
+ * @brief Displays the consumption of the user over the most recent days
+ * (or months). The history is precomputed so the page updates instantly.
+ * A/B scroll to newer/older periods, # switches between days and months.
+*/
+void HMI::StateFunc_UserMenu4(void)
+{
+  const uint8_t numOfRows = 3;
+  uint32_t volumes[HISTORY_NUM_OF_DAYS] = {0};
+  uint8_t numOfPeriods = GetHistory(userIndex,historyPeriod,volumes,HISTORY_NUM_OF_DAYS);
+  
+  for(uint8_t row = ROW1; row < numOfRows; row++)
+  {
+    char line[21] = {0};
+    StringBuilder text(line,sizeof(line));
+    uint8_t i = historyOffset + row;
+    if(i < numOfPeriods)
+    {
+      if(i == 0)
+      {
+        text.Append((historyPeriod == HISTORY_DAILY) ? "TODAY" : "THIS MONTH");
+      }
+      else
+      {
+        text.Append((historyPeriod == HISTORY_DAILY) ? "DAY -" : "MONTH -").AppendUnsigned(i);
+      }
+      //Volume in litres (2dp)
+      text.Append(": ").AppendFixed(volumes[i] / 10,2).Append('L');
+    }
+    while(text.GetLength() < 20)
+    {
+      text.Append(' '); //clears leftovers from the previous display
+    }
+    lcdPtr->setCursor(0,row);
+    lcdPtr->print(line);
+  }
+  HMI::DisplayPageNumber(ROW4,PAGE4,PAGE4);
+  
+  char key = keypadPtr->GetChar();
+  switch(key)
+  {
+    case 'A':
+      if(historyOffset > 0)
+      {
+        historyOffset--;
+      }
+      break;
+    case 'B':
+      if((historyOffset + numOfRows) < numOfPeriods)
+      {
+        historyOffset++;
+      }
+      break;  
+    case 'C':
+      HMI::ChangeStateTo(ST_USER_MENU3);
+      break;
+    case '#':
+      historyPeriod = (historyPeriod == HISTORY_DAILY) ? HISTORY_MONTHLY : HISTORY_DAILY;
+      historyOffset = 0;
+      break;
+  }   
+}
+
 HMI::HMI(LiquidCrystal_I2C* lcdPtr,Keypad* keypadPtr)
 {
   //Initialize private variables
@@ -625,6 +677,8 @@ HMI::HMI(LiquidCrystal_I2C* lcdPtr,Keypad* keypadPtr)
   memset(otpBuff,'\0',SIZE_OTP);
   userIndex = USER_UNKNOWN; 
   volume = 0;
+  historyPeriod = HISTORY_DAILY;
+  historyOffset = 0;
 }
 
 void HMI::Start(void)
@@ -645,6 +699,9 @@ void HMI::Start(void)
       break;
     case ST_USER_MENU3:
       HMI::StateFunc_UserMenu3();
+      break;
+    case ST_USER_MENU4:
+      HMI::StateFunc_UserMenu4();
       break;            
   }
 }
@@ -685,3 +742,9 @@ void HMI::RegisterCallback(bool(*VerifyOtp)(UserIndex,char*))
   this->VerifyOtp = VerifyOtp;   
 }
 
+void HMI::RegisterCallback(uint8_t(*GetHistory)(UserIndex,HistoryPeriod,uint32_t*,uint8_t))
+{
+  Serial.println("Registered {GetHistory} callback");
+  this->GetHistory = GetHistory;   
+}
+
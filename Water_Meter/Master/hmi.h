@@ -1,5 +1,7 @@
 #pragma once   
 
+#include "history.h"
+
 enum UserIndex
 {
   USER1 = 0,
@@ -21,7 +23,8 @@ class HMI
       ST_LOGIN_MENU, 
       ST_USER_MENU1,
       ST_USER_MENU2,
-      ST_USER_MENU3
+      ST_USER_MENU3,
+      ST_USER_MENU4
     };
     enum Row {ROW1, ROW2, ROW3, ROW4};
     enum Page {PAGE1 = 1, PAGE2, PAGE3, PAGE4};
@@ -56,6 +59,8 @@ class HMI
     char otpBuff[SIZE_OTP];
     UserIndex userIndex;
     float volume;
+    HistoryPeriod historyPeriod; //displayed on the history page
+    uint8_t historyOffset; //periods before the first one displayed
 
     //Function pointer(s) for callback(s)
     UserIndex(*ValidateLogin)(char*,uint8_t,char*,uint8_t); 
@@ -64,6 +69,7 @@ class HMI
     bool(*StoreUserParam)(UserIndex,UserParam,char*,uint8_t);
     bool(*HandleRecharge)(UserIndex,uint32_t);
     bool(*VerifyOtp)(UserIndex,char*);
+    uint8_t(*GetHistory)(UserIndex,HistoryPeriod,uint32_t*,uint8_t);
 		
     //Methods
     void SetParam(uint8_t col,uint8_t row,
@@ -93,6 +99,7 @@ class HMI
     void StateFunc_UserMenu1(void);
     void StateFunc_UserMenu2(void);
     void StateFunc_UserMenu3(void);
+    void StateFunc_UserMenu4(void);
     
   public:
     HMI(LiquidCrystal_I2C* lcdPtr,Keypad* keypadPtr);
@@ -103,5 +110,6 @@ class HMI
     void RegisterCallback(bool(*StoreUserParam)(UserIndex,UserParam,char*,uint8_t));
     void RegisterCallback(bool(*HandleRecharge)(UserIndex,uint32_t));
     void RegisterCallback(bool(*VerifyOtp)(UserIndex,char*));
+    void RegisterCallback(uint8_t(*GetHistory)(UserIndex,HistoryPeriod,uint32_t*,uint8_t));
 };
 
@@ -1,4 +1,6 @@
 #include <Arduino.h>
+#include <driver/gpio.h>
+#include <esp_sleep.h>
 #include "keypad.h"
 
 const char keypadMatrix[NUMBER_OF_ROWS][NUMBER_OF_COLUMNS] =
@@ -58,6 +60,8 @@ Keypad::Keypad(uint8_t* pRowPins,uint8_t* pColPins)
   //Initialize private variables
   pRow = pRowPins;
   pCol = pColPins;
+  lastPressTime = 0;
+  waitingTask = NULL;
   for(uint8_t i = 0; i < NUMBER_OF_ROWS; i++)
   {
     for(uint8_t j = 0; j < NUMBER_OF_COLUMNS; j++)
@@ -92,6 +96,7 @@ char Keypad::GetChar(void)
       if(Keypad::IsDebounced(j) && !pinPrevPressed[i][j])
       {
         pinPrevPressed[i][j] = true;
+        lastPressTime = millis();
         return keypadMatrix[i][j];
       }
       else if(!Keypad::IsDebounced(j) && pinPrevPressed[i][j])
@@ -102,3 +107,103 @@ char Keypad::GetChar(void)
   }
   return '\0';
 }
+
+/*
+ * @brief Gets the time (millis) at which a key was last pressed
+*/
+uint32_t Keypad::GetLastPressTime(void)
+{
+  return lastPressTime;
+}
+
+/*
+ * @brief Checks if a key was pressed at the last scan (its release hasn't
+ * been seen by GetChar() yet).
+*/
+bool Keypad::IsAnyKeyHeld(void)
+{
+  for(uint8_t i = 0; i < NUMBER_OF_ROWS; i++)
+  {
+    for(uint8_t j = 0; j < NUMBER_OF_COLUMNS; j++)
+    {
+      if(pinPrevPressed[i][j])
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/*
+ * @brief Checks if any key is pressed (only valid while all rows are low).
+*/
+bool Keypad::IsAnyKeyPressed(void)
+{
+  for(uint8_t i = 0; i < NUMBER_OF_COLUMNS; i++)
+  {
+    if(digitalRead(pCol[i]) == LOW)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * @brief Column interrupt (low level, also a light sleep wake-up source).
+ * The columns stay low while the key is held, so their interrupts are
+ * disabled until the next wait. Not in IRAM: gpio_intr_disable() runs from 
+ * flash (as does the core's GPIO ISR).
+*/
+void Keypad::KeyISR(void* arg)
+{
+  Keypad* keypad = (Keypad*)arg;
+  BaseType_t isTaskWoken = pdFALSE;
+  for(uint8_t i = 0; i < NUMBER_OF_COLUMNS; i++)
+  {
+    gpio_intr_disable((gpio_num_t)keypad->pCol[i]);
+  }
+  vTaskNotifyGiveFromISR(keypad->waitingTask,&isTaskWoken);
+  if(isTaskWoken == pdTRUE)
+  {
+    portYIELD_FROM_ISR();
+  }
+}
+
+/*
+ * @brief Blocks the calling task (so the CPU can idle or light-sleep) until
+ * a key is pressed or the timeout expires. All rows are driven low so that
+ * pressing any key pulls its column low and raises an interrupt. 
+ * Returns at once while a key is held (GetChar() must see it released before
+ * the same key can be read again).
+ * Uses the calling task's notification.
+ * @param timeoutMillis: max wait or KEYPAD_NO_TIMEOUT
+ * @return true if a key is pressed (or held), false if the timeout expired.
+*/
+bool Keypad::WaitForKey(uint32_t timeoutMillis)
+{
+  if(Keypad::IsAnyKeyHeld())
+  {
+    return true;
+  }
+  waitingTask = xTaskGetCurrentTaskHandle();
+  ulTaskNotifyTake(pdTRUE,0); //clears a notification left by the previous wait
+  for(uint8_t i = 0; i < NUMBER_OF_ROWS; i++)
+  {
+    digitalWrite(pRow[i],LOW);
+  }
+  for(uint8_t i = 0; i < NUMBER_OF_COLUMNS; i++)
+  {
+    attachInterruptArg(pCol[i],Keypad::KeyISR,this,ONLOW_WE);
+  }
+  esp_sleep_enable_gpio_wakeup();
+  TickType_t timeout = (timeoutMillis == KEYPAD_NO_TIMEOUT) ? portMAX_DELAY : 
+                                                              pdMS_TO_TICKS(timeoutMillis);
+  bool isPressed = Keypad::IsAnyKeyPressed() || (ulTaskNotifyTake(pdTRUE,timeout) > 0);
+  for(uint8_t i = 0; i < NUMBER_OF_COLUMNS; i++)
+  {
+    detachInterrupt(pCol[i]); //also disables the wake-up
+  }
+  return isPressed;
+}
@@ -2,6 +2,7 @@
 
 #define NUMBER_OF_ROWS      4
 #define NUMBER_OF_COLUMNS   4
+#define KEYPAD_NO_TIMEOUT   0xFFFFFFFF //WaitForKey() waits until a key is pressed
 
 class Keypad
 {
@@ -9,11 +10,18 @@ class Keypad
     uint8_t* pRow;
     uint8_t* pCol;
     bool pinPrevPressed[NUMBER_OF_ROWS][NUMBER_OF_COLUMNS];
+    uint32_t lastPressTime;
+    TaskHandle_t waitingTask; //notified by KeyISR()
     void SelectRow(uint8_t pinIndex);
     bool IsDebounced(uint8_t pinIndex);
+    bool IsAnyKeyHeld(void);
+    bool IsAnyKeyPressed(void);
+    static void KeyISR(void* arg);
     
   public:
     Keypad(uint8_t* pRowPins,uint8_t* pColPins);
     char GetChar(void);
+    uint32_t GetLastPressTime(void);
+    bool WaitForKey(uint32_t timeoutMillis);
 };
 
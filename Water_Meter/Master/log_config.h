@@ -0,0 +1,9 @@
+#pragma once
+
+//Log level of each module (LOG_LEVEL_NONE removes its statements)
+#define LOG_LEVEL_APP       LOG_LEVEL_INFO
+#define LOG_LEVEL_NODE      LOG_LEVEL_INFO
+#define LOG_LEVEL_UTIL      LOG_LEVEL_INFO
+#define LOG_LEVEL_MNI       LOG_LEVEL_WARN
+
+#define LOG_BUFFER_SIZE     32 //records
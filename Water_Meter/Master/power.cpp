@@ -0,0 +1,187 @@
+#include <Arduino.h>
+#include <esp_pm.h>
+#include "power.h"
+#include "numfmt.h"
+
+PowerManager::PowerManager(uint32_t idleTimeoutMillis)
+{
+  //Initialize private variables
+  activeLock = NULL;
+  awakeLock = NULL;
+  busyLock = NULL;
+  busyAwakeLock = NULL;
+  mux = portMUX_INITIALIZER_UNLOCKED;
+  idleTimeout = idleTimeoutMillis;
+  lastActivityTime = 0;
+  isIdle = true;
+  isEnabled = false;
+  startTime = 0;
+  activeStartTime = 0;
+  activeMillis = 0;
+  busyStartTime = 0;
+  busyMillis = 0;
+  numOfBursts = 0;
+  busyDepth = 0;
+}
+
+/**
+ * @brief Configures dynamic frequency scaling (and light sleep) and creates
+ * the PM locks. The system starts in the active state.
+ * @return true if power management is enabled, false if it isn't supported
+ * by the build (all other methods then do nothing).
+*/
+bool PowerManager::Begin(uint16_t maxFreqMhz,uint16_t minFreqMhz,bool enableLightSleep)
+{
+  esp_pm_config_esp32_t config = {};
+  config.max_freq_mhz = maxFreqMhz;
+  config.min_freq_mhz = minFreqMhz;
+  config.light_sleep_enable = enableLightSleep;
+  esp_err_t err = esp_pm_configure(&config);
+  if(err == ESP_ERR_NOT_SUPPORTED && enableLightSleep)
+  {//Build without tickless idle: frequency scaling only
+    Serial.println("PM: light sleep not supported");
+    config.light_sleep_enable = false;
+    err = esp_pm_configure(&config);
+  }
+  if(err != ESP_OK ||
+     esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX,0,"active",&activeLock) != ESP_OK ||
+     esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP,0,"awake",&awakeLock) != ESP_OK ||
+     esp_pm_lock_create(ESP_PM_APB_FREQ_MAX,0,"busy",&busyLock) != ESP_OK ||
+     esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP,0,"busyAwake",&busyAwakeLock) != ESP_OK)
+  {
+    Serial.println("PM: not available");
+    return false;
+  }
+  isEnabled = true;
+  startTime = millis();
+  PowerManager::NotifyActivity();
+  return true;
+}
+
+/**
+ * @brief Records user activity and leaves the idle state (if idle).
+*/
+void PowerManager::NotifyActivity(void)
+{
+  if(!isEnabled)
+  {
+    return;
+  }
+  bool wasIdle;
+  portENTER_CRITICAL(&mux);
+  lastActivityTime = millis();
+  wasIdle = isIdle;
+  if(wasIdle)
+  {
+    activeStartTime = lastActivityTime;
+  }
+  isIdle = false;
+  portEXIT_CRITICAL(&mux);
+  if(wasIdle)
+  {
+    esp_pm_lock_acquire(activeLock);
+    esp_pm_lock_acquire(awakeLock);
+  }
+}
+
+/**
+ * @brief Enters the idle state if there has been no activity for the idle
+ * timeout. Should be called periodically.
+ * @return true if the idle state has just been entered, false if otherwise.
+*/
+bool PowerManager::Update(void)
+{
+  if(!isEnabled)
+  {
+    return false;
+  }
+  bool hasBecomeIdle = false;
+  portENTER_CRITICAL(&mux);
+  if(!isIdle && (millis() - lastActivityTime) >= idleTimeout)
+  {
+    isIdle = true;
+    hasBecomeIdle = true;
+    activeMillis += millis() - activeStartTime;
+  }
+  portEXIT_CRITICAL(&mux);
+  if(hasBecomeIdle)
+  {
+    esp_pm_lock_release(awakeLock);
+    esp_pm_lock_release(activeLock);
+  }
+  return hasBecomeIdle;
+}
+
+bool PowerManager::IsIdle(void)
+{
+  return (isEnabled && isIdle);
+}
+
+/**
+ * @brief Holds the APB/CPU clock and prevents light sleep during a short burst
+ * of work (e.g. SPI/UART transfers). Calls can be nested and must be balanced
+ * by calls to ReleaseBusy().
+*/
+void PowerManager::AcquireBusy(void)
+{
+  if(isEnabled)
+  {
+    esp_pm_lock_acquire(busyLock);
+    esp_pm_lock_acquire(busyAwakeLock);
+    portENTER_CRITICAL(&mux);
+    if(busyDepth == 0)
+    {
+      busyStartTime = millis();
+      numOfBursts++;
+    }
+    busyDepth++;
+    portEXIT_CRITICAL(&mux);
+  }
+}
+
+void PowerManager::ReleaseBusy(void)
+{
+  if(isEnabled)
+  {
+    portENTER_CRITICAL(&mux);
+    if(busyDepth > 0)
+    {
+      busyDepth--;
+      if(busyDepth == 0)
+      {
+        busyMillis += millis() - busyStartTime;
+      }
+    }
+    portEXIT_CRITICAL(&mux);
+    esp_pm_lock_release(busyAwakeLock);
+    esp_pm_lock_release(busyLock);
+  }
+}
+
+/**
+ * @brief Reports the share of time (since Begin) spent active (user activity:
+ * max frequency, no light sleep) and busy (bursts of work), and the number of
+ * bursts. The rest of the time is spent at the min frequency or in light sleep.
+ * Multiplied by the current drawn in each state, these give the average power.
+*/
+size_t PowerManager::GetReport(char* buffer,size_t bufferSize)
+{
+  portENTER_CRITICAL(&mux);
+  uint32_t currentTime = millis();
+  uint32_t elapsed = currentTime - startTime;
+  uint32_t active = activeMillis + (isIdle ? 0 : (currentTime - activeStartTime));
+  uint32_t busy = busyMillis + ((busyDepth > 0) ? (currentTime - busyStartTime) : 0);
+  uint32_t bursts = numOfBursts;
+  portEXIT_CRITICAL(&mux);
+  StringBuilder report(buffer,bufferSize);
+  if(!isEnabled || elapsed == 0)
+  {
+    report.Append("n/a");
+    return report.GetLength();
+  }
+  report.Append("active:").AppendFixed(10000ULL * active / elapsed,2)
+        .Append("% busy:").AppendFixed(10000ULL * busy / elapsed,2)
+        .Append("% bursts:").AppendUnsigned(bursts)
+        .Append(" secs:").AppendUnsigned(elapsed / 1000);
+  return report.GetLength();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <esp_pm.h>
+
+/**
+ * @brief Activity-driven power management (ESP-IDF PM locks).
+ *
+ * While the user is active (key presses within the idle timeout), the CPU is
+ * held at its max frequency and light sleep is prevented. Once idle, the locks
+ * are released so the CPU runs at its min frequency and (if supported by the
+ * build) enters light sleep whenever all tasks are blocked.
+ * Short bursts of work (radio, Node communication) hold a separate 'busy' lock
+ * which keeps the max frequency and prevents light sleep until released.
+*/
+class PowerManager
+{
+  private:
+    esp_pm_lock_handle_t activeLock; //CPU max frequency (user activity)
+    esp_pm_lock_handle_t awakeLock; //no light sleep (user activity)
+    esp_pm_lock_handle_t busyLock; //APB max frequency + no light sleep (bursts)
+    esp_pm_lock_handle_t busyAwakeLock;
+    portMUX_TYPE mux;
+    uint32_t idleTimeout;
+    uint32_t lastActivityTime;
+    bool isIdle;
+    bool isEnabled;
+    //Residency (average power = sum of the time in each state x its current)
+    uint32_t startTime; //millis (Begin)
+    uint32_t activeStartTime;
+    uint32_t activeMillis; //completed active periods
+    uint32_t busyStartTime;
+    uint32_t busyMillis; //completed bursts
+    uint32_t numOfBursts;
+    uint8_t busyDepth; //nested AcquireBusy() calls
+
+  public:
+    PowerManager(uint32_t idleTimeoutMillis);
+    bool Begin(uint16_t maxFreqMhz,uint16_t minFreqMhz,bool enableLightSleep);
+    void NotifyActivity(void);
+    bool Update(void);
+    bool IsIdle(void);
+    void AcquireBusy(void);
+    void ReleaseBusy(void);
+    size_t GetReport(char* buffer,size_t bufferSize);
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <string.h>
+
+#define SNAPSHOT_MAX_SPINS    16 //retries before a reader blocks (writer preempted)
+
+/**
+ * @brief Latest-value store protected by a sequence lock (seqlock).
+ *
+ * A single writer (e.g. the Node task) publishes new values while any number
+ * of readers (HMI callbacks, Utility task etc.) take consistent copies of the
+ * most recent value without blocking and without queues.
+ *
+ * The sequence counter is odd while a write is in progress and even otherwise.
+ * A reader retries its copy if the counter was odd or changed during the copy.
+ * The counter also serves as a version number: it increases by 2 for every
+ * published value, so readers can tell whether they have seen a value before.
+ *
+ * A reader that keeps finding a write in progress (e.g. it has preempted the
+ * writer on the same core) blocks for a tick so that the writer can finish,
+ * whatever the priorities of the tasks.
+ *
+ * NB: Only ONE task may call Write(). Readers can be in any task/core, but
+ * not in an ISR.
+*/
+template <typename T>
+class Snapshot
+{
+  private:
+    std::atomic<uint32_t> sequence;
+    T data;
+
+  public:
+    Snapshot(void)
+    {
+      sequence.store(0,std::memory_order_relaxed);
+      memset(&data,0,sizeof(T));
+    }
+
+    /**
+     * @brief Publishes a new value (single writer only).
+    */
+    void Write(const T& newData)
+    {
+      uint32_t seq = sequence.load(std::memory_order_relaxed);
+      sequence.store(seq + 1,std::memory_order_relaxed); //odd: write in progress
+      std::atomic_thread_fence(std::memory_order_release);
+      memcpy(&data,&newData,sizeof(T));
+      sequence.store(seq + 2,std::memory_order_release); //even: write complete
+    }
+
+    /**
+     * @brief Copies the latest consistent value.
+     * @param dataOut: Buffer to store the copy.
+     * @param versionPtr: (optional) Stores the version of the copied value.
+     * @return true if a value has been published at least once.
+     *         false if nothing has been written yet ('dataOut' is untouched).
+    */
+    bool Read(T& dataOut,uint32_t* versionPtr = NULL) const
+    {
+      T copy;
+      uint32_t seqStart;
+      uint32_t seqEnd;
+      uint8_t numOfSpins = 0;
+      do
+      {
+        if(numOfSpins < SNAPSHOT_MAX_SPINS)
+        {
+          numOfSpins++;
+        }
+        else
+        {//The writer may be preempted by this task: let it run
+          vTaskDelay(1);
+        }
+        seqStart = sequence.load(std::memory_order_acquire);
+        if(seqStart & 1)
+        {
+          seqEnd = seqStart;
+          continue; //writer busy, try again
+        }
+        memcpy(&copy,(const void*)&data,sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        seqEnd = sequence.load(std::memory_order_relaxed);
+      }while((seqStart & 1) || (seqStart != seqEnd));
+
+      if(seqStart == 0)
+      {
+        return false;
+      }
+      dataOut = copy;
+      if(versionPtr != NULL)
+      {
+        *versionPtr = seqStart >> 1;
+      }
+      return true;
+    }
+
+    /**
+     * @brief Reads the value only if it is newer than 'lastVersion'.
+     * @param dataOut: Buffer to store the copy.
+     * @param lastVersion: Version last seen by the caller (updated on success).
+     * @return true if a newer value was copied, false if otherwise.
+    */
+    bool ReadIfNewer(T& dataOut,uint32_t& lastVersion) const
+    {
+      if(Version() == lastVersion)
+      {
+        return false;
+      }
+      T copy;
+      uint32_t version = 0;
+      if(!Read(copy,&version) || version == lastVersion)
+      {
+        return false;
+      }
+      dataOut = copy;
+      lastVersion = version;
+      return true;
+    }
+
+    /**
+     * @brief Gets the version of the latest published value (0 = none yet).
+    */
+    uint32_t Version(void) const
+    {
+      return sequence.load(std::memory_order_acquire) >> 1;
+    }
+};
@@ -0,0 +1,109 @@
+#include <Arduino.h>
+#include "synclock.h"
+
+#if defined(__AVR__)
+#define SYNC_LOCK()     uint8_t oldSREG = SREG; noInterrupts()
+#define SYNC_UNLOCK()   SREG = oldSREG
+#else
+#define SYNC_LOCK()     portENTER_CRITICAL(&mux)
+#define SYNC_UNLOCK()   portEXIT_CRITICAL(&mux)
+#endif
+
+SyncClock::SyncClock(void)
+{
+  //Initialize private variables
+  syncTime = 0;
+  syncMillis = 0;
+  syncLocal = 0;
+  refTime = 0;
+  refMillis = 0;
+  refLocal = 0;
+  driftPpm = 0;
+  isSynced = false;
+#if !defined(__AVR__)
+  mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+}
+
+/**
+ * @brief Sets the clock to the time of the source (and updates the drift
+ * estimate if the baseline is long enough).
+ * @param time: Source time (Unix time, secs).
+ * @param milliseconds: Source time (millisecs part).
+*/
+void SyncClock::Sync(uint32_t time,uint16_t milliseconds)
+{
+  uint32_t localTime = millis();
+  SYNC_LOCK();
+  if(!isSynced)
+  {
+    refTime = time;
+    refMillis = milliseconds;
+    refLocal = localTime;
+  }
+  else
+  {
+    uint32_t localElapsed = localTime - refLocal;
+    if(localElapsed >= SYNC_MIN_BASELINE)
+    {
+      int64_t sourceElapsed = (int64_t)((int32_t)(time - refTime)) * 1000 +
+                              ((int32_t)milliseconds - refMillis);
+      int64_t drift = (sourceElapsed - localElapsed) * 1000000 / localElapsed;
+      bool isDriftValid = (drift >= -SYNC_MAX_DRIFT_PPM && drift <= SYNC_MAX_DRIFT_PPM);
+      if(isDriftValid)
+      {
+        driftPpm = drift;
+      }
+      if(!isDriftValid || localElapsed >= SYNC_MAX_BASELINE)
+      {//Start a new baseline
+        refTime = time;
+        refMillis = milliseconds;
+        refLocal = localTime;
+      }
+    }
+  }
+  syncTime = time;
+  syncMillis = milliseconds;
+  syncLocal = localTime;
+  isSynced = true;
+  SYNC_UNLOCK();
+}
+
+/**
+ * @brief Gets the current time.
+ * @param millisPtr: (optional) Stores the millisecs part of the time.
+ * @return Unix time (secs), 0 if the clock has never been synced.
+*/
+uint32_t SyncClock::GetTime(uint16_t* millisPtr)
+{
+  uint32_t localTime = millis();
+  SYNC_LOCK();
+  if(!isSynced)
+  {
+    SYNC_UNLOCK();
+    if(millisPtr != NULL)
+    {
+      *millisPtr = 0;
+    }
+    return 0;
+  }
+  uint32_t elapsed = localTime - syncLocal;
+  uint64_t totalMillis = syncMillis + elapsed + (int64_t)elapsed * driftPpm / 1000000;
+  uint32_t time = syncTime + totalMillis / 1000;
+  SYNC_UNLOCK();
+  if(millisPtr != NULL)
+  {
+    *millisPtr = totalMillis % 1000;
+  }
+  return time;
+}
+
+int32_t SyncClock::GetDriftPpm(void)
+{
+  return driftPpm;
+}
+
+bool SyncClock::IsSynced(void)
+{
+  return isSynced;
+}
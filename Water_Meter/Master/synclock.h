@@ -0,0 +1,39 @@
+#pragma once
+
+#define SYNC_MIN_BASELINE     600000UL //millisecs between the syncs used to estimate drift
+#define SYNC_MAX_BASELINE     864000000UL //millisecs (10 days, a new baseline is started)
+#define SYNC_MAX_DRIFT_PPM    20000 //larger estimates are discarded (time source jumped)
+
+/**
+ * @brief Wall clock (UTC, Unix time) kept in step with a time source by
+ * periodic syncs.
+ *
+ * Between syncs the time is extrapolated from millis(), corrected for the
+ * drift of the local oscillator. The drift is estimated from the time elapsed
+ * (source vs local) since a reference sync at least SYNC_MIN_BASELINE earlier,
+ * so it gets more accurate as the baseline grows. Integer arithmetic only.
+ *
+ * All methods are thread-safe (short critical sections) on the ESP32.
+*/
+class SyncClock
+{
+  private:
+    uint32_t syncTime; //source time at the last sync (secs)
+    uint16_t syncMillis; //source time at the last sync (millisecs part)
+    uint32_t syncLocal; //millis() at the last sync
+    uint32_t refTime; //reference sync (drift estimation)
+    uint16_t refMillis;
+    uint32_t refLocal;
+    int32_t driftPpm; //local clock slower (+) or faster (-) than the source
+    bool isSynced;
+#if !defined(__AVR__)
+    portMUX_TYPE mux;
+#endif
+
+  public:
+    SyncClock(void);
+    void Sync(uint32_t time,uint16_t milliseconds);
+    uint32_t GetTime(uint16_t* millisPtr = NULL);
+    int32_t GetDriftPpm(void);
+    bool IsSynced(void);
+};
@@ -1,34 +1,213 @@
 #include <Arduino.h>
 #include "FlowSensor.h"
 
-FlowSensor::FlowSensor(uint8_t pin)
+FlowSensor::FlowSensor(uint8_t pin,uint16_t sampleRate)
 {
+  //Initialize private variables
   this->pin = pin;
   this->isPrevHigh = false;
-  this->volume = 0.0;
+  this->volume = 0;
+  this->microLitres = 0;
+  this->calibration.numOfPoints = 0;
+  this->sampleRate = sampleRate;
+  this->numOfSamples = 0;
+  this->numOfPulses = 0;
+  this->rate = 0;
+  this->totalPulses = 0;
+  FlowSensor::SetKFactor(FLOW_DEFAULT_K_FACTOR);
   pinMode(this->pin,INPUT);
 }
 
-void FlowSensor::UpdateVolume(uint32_t volume)
+void FlowSensor::SetKFactor(uint16_t kFactor)
 {
-  this->volume += volume;
+  this->kFactor = kFactor;
+  kMilli = kFactor / 1000;
+  kMicro = kFactor % 1000;
 }
 
-float FlowSensor::GetVolume(void)
+/**
+ * @brief Deducts a volume. The volume stops at 0 (no negative balance).
+*/
+void FlowSensor::Deduct(uint32_t milliLitres,uint16_t microLitres)
 {
-  //Deduct 2.1mL if a pulse is detected
-  if(digitalRead(pin) && !isPrevHigh)
+  if(this->microLitres < microLitres)
   {
-    volume -= 2.1;
-    if(lround(volume) < 0)
+    this->microLitres += 1000;
+    milliLitres++;
+  }
+  this->microLitres -= microLitres;
+  if(volume < milliLitres)
+  {
+    volume = 0;
+    this->microLitres = 0;
+  }
+  else
+  {
+    volume -= milliLitres;
+  }
+}
+
+/**
+ * @brief Adds a volume. The volume stops at FLOW_MAX_VOLUME (doesn't wrap).
+*/
+void FlowSensor::Add(uint32_t milliLitres,uint16_t microLitres)
+{
+  this->microLitres += microLitres;
+  if(this->microLitres >= 1000)
+  {
+    this->microLitres -= 1000;
+    milliLitres++;
+  }
+  if(volume >= FLOW_MAX_VOLUME || milliLitres > FLOW_MAX_VOLUME - volume)
+  {
+    volume = FLOW_MAX_VOLUME;
+    this->microLitres = 0;
+  }
+  else
+  {
+    volume += milliLitres;
+  }
+}
+
+/**
+ * @brief Checks that a calibration table has at most FLOW_CAL_MAX_POINTS,
+ * strictly increasing rates and non-zero K-factors.
+*/
+bool FlowSensor::IsValid(const calibration_t* calibration)
+{
+  if(calibration->numOfPoints > FLOW_CAL_MAX_POINTS)
+  {
+    return false;
+  }
+  for(uint8_t i = 0; i < calibration->numOfPoints; i++)
+  {
+    if(calibration->points[i].kFactor == 0 ||
+       (i > 0 && calibration->points[i].rate <= calibration->points[i - 1].rate))
     {
-      volume = 0;
+      return false;
     }
+  }
+  return true;
+}
+
+/**
+ * @brief Replaces the calibration table (takes effect from the next window).
+ * @return true if the table is valid, false if otherwise (the table in use
+ * is kept).
+*/
+bool FlowSensor::SetCalibration(const calibration_t* calibration)
+{
+  if(!FlowSensor::IsValid(calibration))
+  {
+    return false;
+  }
+  this->calibration = *calibration;
+  return true;
+}
+
+void FlowSensor::GetCalibration(calibration_t* calibration)
+{
+  *calibration = this->calibration;
+}
+
+/**
+ * @brief Looks up the K-factor for a pulse rate (linear interpolation
+ * between the points of the calibration table, clamped at both ends).
+ * @return K-factor in microlitres per pulse.
+*/
+uint16_t FlowSensor::GetKFactor(uint16_t rate)
+{
+  const cal_point_t* points = calibration.points;
+  uint8_t numOfPoints = calibration.numOfPoints;
+  if(numOfPoints == 0)
+  {
+    return FLOW_DEFAULT_K_FACTOR;
+  }
+  if(rate <= points[0].rate)
+  {
+    return points[0].kFactor;
+  }
+  for(uint8_t i = 1; i < numOfPoints; i++)
+  {
+    if(rate <= points[i].rate)
+    {
+      int32_t deltaK = (int32_t)points[i].kFactor - points[i - 1].kFactor;
+      int32_t deltaRate = points[i].rate - points[i - 1].rate;
+      return points[i - 1].kFactor + deltaK * (rate - points[i - 1].rate) / deltaRate;
+    }
+  }
+  return points[numOfPoints - 1].kFactor;
+}
+
+/**
+ * @brief Adds a volume (mL) e.g. a recharge. Saturates at FLOW_MAX_VOLUME.
+*/
+void FlowSensor::UpdateVolume(uint32_t volume)
+{
+  FlowSensor::Add(volume,0);
+}
+
+/**
+ * @brief Samples the sensor (to be called 'sampleRate' times per second).
+ * Deducts the K-factor in use if a pulse is detected.
+*/
+void FlowSensor::Sample(void)
+{
+  if(digitalRead(pin) && !isPrevHigh)
+  {
+    FlowSensor::Deduct(kMilli,kMicro);
+    numOfPulses++;
+    totalPulses++;
     isPrevHigh = true;
   }
   else if(!digitalRead(pin) && isPrevHigh)
   {
     isPrevHigh = false;
   }
-  return volume;
+  numOfSamples++;
+  if(numOfSamples < sampleRate)
+  {
+    return;
+  }
+  //End of window: correct this window's pulses to the K-factor for its rate
+  rate = numOfPulses;
+  uint16_t newKFactor = FlowSensor::GetKFactor(rate);
+  if(newKFactor > kFactor)
+  {
+    uint32_t correction = (uint32_t)numOfPulses * (newKFactor - kFactor);
+    FlowSensor::Deduct(correction / 1000,correction % 1000);
+  }
+  else if(newKFactor < kFactor && (volume > 0 || microLitres > 0))
+  {//not refunded once the balance is exhausted (the valve is closed)
+    uint32_t correction = (uint32_t)numOfPulses * (kFactor - newKFactor);
+    FlowSensor::Add(correction / 1000,correction % 1000);
+  }
+  FlowSensor::SetKFactor(newKFactor);
+  numOfSamples = 0;
+  numOfPulses = 0;
+}
+
+/**
+ * @brief Returns the volume (rounded to the nearest mL).
+ * NB: Call with interrupts disabled if Sample() is called by an ISR.
+*/
+uint32_t FlowSensor::GetVolume(void)
+{
+  return volume + ((microLitres >= 500) ? 1 : 0);
+}
+
+/**
+ * @brief Returns the pulse rate measured over the last window.
+*/
+uint16_t FlowSensor::GetRate(void)
+{
+  return rate;
+}
+
+/**
+ * @brief Returns the number of pulses since power-up (calibration).
+*/
+uint32_t FlowSensor::GetTotalPulses(void)
+{
+  return totalPulses;
 }
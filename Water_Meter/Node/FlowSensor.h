@@ -1,14 +1,62 @@
 #pragma once
 
+#define FLOW_CAL_MAX_POINTS     4 //points in a calibration table
+#define FLOW_DEFAULT_K_FACTOR   2100 //microlitres per pulse (uncalibrated)
+#define FLOW_MAX_VOLUME         4000000000UL //mL (additions saturate)
+
+//Point of a calibration table
+typedef struct
+{
+  uint16_t rate; //pulses per second
+  uint16_t kFactor; //microlitres per pulse at this rate
+}cal_point_t;
+
+//Piecewise-linear K-factor against pulse rate (rates strictly increasing)
+typedef struct
+{
+  uint8_t numOfPoints; //0: uncalibrated (FLOW_DEFAULT_K_FACTOR)
+  cal_point_t points[FLOW_CAL_MAX_POINTS];
+}calibration_t;
+
+/**
+ * @brief Flow sensor with a flow-rate-dependent K-factor (volume per pulse).
+ *
+ * The sensor is sampled periodically by Sample(). Every pulse deducts the
+ * K-factor in use from the volume. The pulse rate is measured over windows
+ * of one second; at the end of each window the K-factor for the measured
+ * rate is looked up in the calibration table and the pulses of the window
+ * are corrected to it. Only integer arithmetic is used (volume in mL plus a
+ * remainder in microlitres).
+*/
 class FlowSensor
 {
   private:
     uint8_t pin;
     bool isPrevHigh;
-    float volume; //in mL
-    
+    uint32_t volume; //in mL
+    uint16_t microLitres; //fraction of a mL (0-999)
+    calibration_t calibration;
+    uint16_t kFactor; //in use (microlitres per pulse)
+    uint16_t kMilli; //kFactor / 1000
+    uint16_t kMicro; //kFactor % 1000
+    uint16_t sampleRate; //samples per second
+    uint16_t numOfSamples; //in the current window
+    uint16_t numOfPulses; //in the current window
+    uint16_t rate; //of the last window (pulses per second)
+    uint32_t totalPulses;
+    void SetKFactor(uint16_t kFactor);
+    void Deduct(uint32_t milliLitres,uint16_t microLitres);
+    void Add(uint32_t milliLitres,uint16_t microLitres);
+
   public:
-    FlowSensor(uint8_t pin);
+    FlowSensor(uint8_t pin,uint16_t sampleRate);
+    static bool IsValid(const calibration_t* calibration);
+    bool SetCalibration(const calibration_t* calibration);
+    void GetCalibration(calibration_t* calibration);
+    uint16_t GetKFactor(uint16_t rate);
     void UpdateVolume(uint32_t volume);
-    float GetVolume(void);
+    void Sample(void);
+    uint32_t GetVolume(void);
+    uint16_t GetRate(void);
+    uint32_t GetTotalPulses(void);
 };
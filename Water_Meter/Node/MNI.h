@@ -1,5 +1,77 @@
 #pragma once
 
+#define MNI_HEADER    0xA5 //first byte of every frame (both directions)
+
+enum MniFrameType
+{
+  MNI_POLL = 0, //request for sensor data
+  MNI_RECHARGE, //recharge transaction (also requests sensor data)
+  MNI_CALIBRATE, //sets a point of a sensor's calibration table (see below)
+  MNI_CAL_INFO   //Node -> Master: a sensor's calibration table (see below)
+};
+
+/**
+ * MNI_CALIBRATE frame: 'userIndex' is the sensor, 'txnId' is the index of the
+ * point and 'units' holds the point as (rate << 16) | kFactor, with the rate 
+ * in pulses per second and the K-factor in microlitres per pulse.
+ * Setting point 'i' truncates the table to i + 1 points (so points are set 
+ * in order of increasing rate, starting at 0). A K-factor of 0 truncates the
+ * table to 'i' points (point 0 with a K-factor of 0 clears the table).
+ * MNI_CAL_REPORT as the index only reports the table.
+ * After its reply, the node sends the sensor's table and pulse count (as 
+ * changed by the request) in MNI_CAL_INFO frames, one per point (one without
+ * a point if the table is empty), which the master prints.
+*/
+#define MNI_CAL_REPORT  0xFF
+
+//Node -> Master
+typedef struct
+{
+  float volume1;
+  float volume2;
+  float volume3;  
+}sensor_t; //mL
+
+//Master -> Node
+typedef struct
+{
+  uint8_t header;
+  uint8_t type;
+  uint8_t userIndex;
+  uint8_t checksum; //of the whole frame with this field set to 0
+  uint32_t txnId; //unique, increasing ID of a recharge transaction
+  uint32_t units;
+}mni_request_t;
+
+//Node -> Master (reply to every request)
+typedef struct
+{
+  uint8_t header;
+  uint8_t type; //of the request
+  uint8_t reserved; //0
+  uint8_t checksum; //of the whole frame with this field set to 0
+  sensor_t sensorData;
+  uint32_t lastTxnId; //ID of the last recharge applied by the node
+}mni_reply_t;
+
+//Node -> Master (after the reply to MNI_CALIBRATE)
+typedef struct
+{
+  uint8_t header;
+  uint8_t type; //MNI_CAL_INFO
+  uint8_t userIndex; //sensor
+  uint8_t checksum; //of the whole frame with this field set to 0
+  uint8_t pointIndex;
+  uint8_t numOfPoints; //in the table (0: uncalibrated, no point in this frame)
+  uint16_t rate; //of the last window (pulses per second)
+  uint32_t totalPulses; //since power-up
+  uint16_t pointRate; //pulses per second
+  uint16_t pointKFactor; //microlitres per pulse
+  uint32_t reserved; //0
+}mni_cal_info_t;
+
+static_assert(sizeof(mni_cal_info_t) == sizeof(mni_reply_t),"MNI replies have one size");
+
 //MNI: Master-Node-Interface
 //Handles serial communication between Master (ESP32) and the Node(Nano)
 
@@ -10,7 +82,10 @@ class MNI
     
   public:
     MNI(SoftwareSerial* serial,uint32_t baudRate = 9600);
+    static uint8_t Checksum(const void* dataBuffer,uint8_t dataSize);
     bool IsReceiverReady(uint8_t expectedNumOfBytes);
     void TransmitData(void* dataBuffer,uint8_t dataSize);
-    void ReceiveData(void* dataBuffer,uint8_t dataSize);    
+    void ReceiveData(void* dataBuffer,uint8_t dataSize);
+    void FlushReceiver(void);
+    void SkipUntil(uint8_t headerByte);    
 };
@@ -1,24 +1,60 @@
+#include <avr/sleep.h>
 #include <SoftwareSerial.h>
 #include <SPI.h>
 #include <SD.h>
+#include <EEPROM.h>
 #include "MNI.h"
 #include "FlowSensor.h"
+#include "numfmt.h"
+#include "log.h"
+#include "log_config.h"
 
 /**
  * @brief Description of the node.
  * 
  * Receives a 'request-to-send' from the Master. It sends the available units
  * or volume for the 3 users to the master.
+ * Recharges are received as transactions with unique (increasing) IDs. A 
+ * transaction is applied only once and its ID is stored in the SD card, so 
+ * that a resent (or replayed) transaction doesn't add units twice. Every 
+ * reply to the master carries the ID of the last transaction applied, which
+ * acknowledges the transaction.
  * Stores the readings in an SD card (periodically) to prevent loss of data if  
- * a power outage occurs.  
+ * a power outage occurs. The readings and the ID of the last transaction are
+ * stored together in a single binary snapshot, so that they can be restored
+ * (and the valves driven accordingly) within milliseconds of a restart.
+ * 
+ * The node has no wall clock: millis() stops while it sleeps in power-down
+ * mode, so a clock kept from it would fall behind by the time spent asleep. 
+ * The master timestamps each reading when it receives the reply.
  * 
  * NB: When water flows through the flow sensors, they generate pulses. The sensors 
- * output roughly 482 pulses per litre. For every pulse detected, 2.1mL of water must 
- * have flown through the sensor.
+ * output roughly 482 pulses per litre i.e. 2.1mL of water flows through the sensor
+ * per pulse. The volume per pulse (K-factor) varies with the flow rate, so each 
+ * sensor has a calibration table of K-factors against pulse rate. The tables are
+ * set by the master (MNI_CALIBRATE frames) and stored in the EEPROM. Uncalibrated
+ * sensors use 2.1mL per pulse.
  * 
  * Type of solenoid valve used: Normally Open (NO)
+ * 
+ * Power saving: the sensors are sampled by a timer interrupt only while water 
+ * flows. When there has been no flow for a while (and all readings have been 
+ * stored), the node stops the timer and sleeps. A pulse from any flow sensor
+ * (pin change interrupt) or a byte from the master wakes it up. The master 
+ * sends a wake-up byte before every frame since the first byte received 
+ * while sleeping may be lost.
 */
 
+#define NODE_SLEEP_MODE       SLEEP_MODE_PWR_DOWN //or SLEEP_MODE_IDLE
+#define NODE_FLOW_TIMEOUT     2000 //millisecs without flow before sleeping
+#define NODE_WAKE_WINDOW      50 //millisecs awake after each wake-up
+#define NODE_LOG_PERIOD       10000 //millisecs without flow before storing readings
+#define NODE_DEBUG_BAUD       115200 //debug log (see log_config.h)
+#define NODE_SAMPLE_RATE      1667 //flow sensor samples per second (timer 1)
+#define NODE_CAL_MAGIC        0xCA //marks a calibration record in the EEPROM
+#define NODE_STATE_FILE       "state.bin" //snapshot of the node's state (SD card)
+#define NODE_STATE_SLOTS      2 //written in turn (one is always intact)
+
 enum User
 {
   USER1 = 0,
@@ -26,13 +62,6 @@ enum User
   USER3
 };
 
-typedef struct
-{
-  float volume1;
-  float volume2;
-  float volume3;
-}sensor_t; //mL
-
 namespace Pin
 {
   const uint8_t flowSensor1 = 3;
@@ -46,69 +75,44 @@ namespace Pin
   const uint8_t chipSelect = 10;
 };
 
+LOG_DEFINE_BUFFER(LOG_BUFFER_SIZE);
+
 //Master-Node-Interface 
 SoftwareSerial nodeSerial(Pin::nodeRx,Pin::nodeTx);
 MNI mni(&nodeSerial);
 
 //Flow sensors
-static FlowSensor flowSensor1(Pin::flowSensor1);
-static FlowSensor flowSensor2(Pin::flowSensor2);
-static FlowSensor flowSensor3(Pin::flowSensor3);
-
-//Current readings of the flow sensors (in mL)
-static volatile sensor_t sensorData;
+static FlowSensor flowSensor1(Pin::flowSensor1,NODE_SAMPLE_RATE);
+static FlowSensor flowSensor2(Pin::flowSensor2,NODE_SAMPLE_RATE);
+static FlowSensor flowSensor3(Pin::flowSensor3,NODE_SAMPLE_RATE);
 
 const uint8_t numOfUsers = 3;
-static bool hasVolumeChanged[numOfUsers];
-static bool noFlow[numOfUsers];
-static bool prevLogTime[numOfUsers];
+static FlowSensor* const flowSensor[numOfUsers] = {&flowSensor1,&flowSensor2,&flowSensor3};
 
-/**
- * @brief Converts a string to an integer.
- * e.g.
- * "932" to 932:
- * '9' - '0' = 9
- * '3' - '0' = 3
- * '2' - '0' = 2
- * 9 x 10^2 + 3 x 10^1 + 2 x 10^0 = 932.
-*/
-static void StringToInteger(char* stringPtr,uint32_t* integerPtr)
+//Snapshot of the node's state (as stored on the SD card)
+typedef struct
 {
-  *integerPtr = 0;
-  uint8_t len = strlen(stringPtr);
-  uint32_t j = 1;
-  for(uint8_t i = 0; i < len; i++)
-  {
-    *integerPtr += ((stringPtr[len - i - 1] - '0') * j);
-    j *= 10;
-  }
-}
+  uint32_t sequence; //increases with every snapshot (the latest slot is used)
+  uint32_t volumes[numOfUsers]; //mL
+  uint32_t lastTxnId;
+  uint8_t checksum; //of the snapshot with this field set to 0
+}state_t;
 
-/**
- * @brief Converts an integer to a string.
-*/
-static void IntegerToString(uint32_t integer,char* stringPtr)
+//Calibration table of a flow sensor (as stored in the EEPROM)
+typedef struct
 {
-  if(integer == 0)
-  {  
-    stringPtr[0] = '0';
-    return;
-  }
-  uint32_t integerCopy = integer;
-  uint8_t numOfDigits = 0;
+  uint8_t magic;
+  uint8_t checksum; //of the record with this field set to 0
+  calibration_t calibration;
+}cal_record_t;
 
-  while(integerCopy > 0)
-  {
-    integerCopy /= 10;
-    numOfDigits++;
-  }
-  while(integer > 0)
-  {
-    stringPtr[numOfDigits - 1] = '0' + (integer % 10);
-    integer /= 10;
-    numOfDigits--;
-  }
-}
+static bool hasVolumeChanged[numOfUsers];
+static bool noFlow[numOfUsers];
+static uint32_t prevLogTime[numOfUsers];
+static uint32_t lastFlowTime; //last time a volume changed (any user)
+static uint32_t oldApproxVolume[numOfUsers]; //previous volume (mL) of each user
+static uint32_t lastTxnId; //ID of the last recharge transaction applied
+static uint32_t stateSequence; //of the last snapshot stored
 
 /**
  * @brief Initialize hardware timer 1.
@@ -123,20 +127,39 @@ static void TimerInit(void)
 }
 
 /**
- * @brief Writes data to a file stored in an SD card
- * @param path: path to the file to be written
- * @param message: data to be written to the file
- * @return None
+ * @brief Puts the node to sleep until a flow sensor pulse or an MNI byte
+ * arrives. The sampling timer is stopped while sleeping.
+ * The node doesn't sleep if an MNI byte arrived since the caller checked
+ * (the check and the sleep instruction are atomic: 'sei' takes effect after
+ * the next instruction, so a pending interrupt wakes the CPU at once).
 */
-static void SD_WriteFile(const char* path,const char* message)
+static void Sleep(void)
 {
-  static File file;
-  file = SD.open(path,FILE_WRITE | O_TRUNC);
-  if(file)
+  const uint8_t sensorPins = (1<<PCINT19)|(1<<PCINT20)|(1<<PCINT21); //pins 3,4,5
+  //NB: PCINT2 is shared with the MNI (SoftwareSerial RX on pin 6). Its ISR 
+  //(in the SoftwareSerial library) ignores changes on the sensor pins.
+  PCMSK2 |= sensorPins; //any change from here on wakes the CPU
+  PCICR |= (1<<PCIE2);
+  set_sleep_mode(NODE_SLEEP_MODE);
+  
+  noInterrupts();
+  TIMSK1 &= ~(1<<OCIE1A); //stop sampling
+  //Last samples: a change since the last timer tick is counted now
+  flowSensor1.Sample();
+  flowSensor2.Sample();
+  flowSensor3.Sample();
+  if(!mni.IsReceiverReady(1))
   {
-    file.print(message); 
+    sleep_enable();
+    interrupts();
+    sleep_cpu(); //wakes up here
+    sleep_disable();
   }
-  file.close();
+  interrupts();
+  
+  PCMSK2 &= ~sensorPins;
+  TCNT1 = 0;
+  TIMSK1 |= (1<<OCIE1A); //resume sampling (a pulse will be counted by the ISR)
 }
 
 /*
@@ -187,114 +210,377 @@ static uint32_t GetUnitsFromSD(User user)
       SD_ReadFile("user3.txt",fileBuff,buffLen);
       break;
   }
-  StringToInteger(fileBuff,&approxVolume);
+  ParseUnsigned(fileBuff,&approxVolume); //stays 0 if the file is missing or corrupted
   return approxVolume;
 }
 
 /**
- * @brief Store user's units (or volume) on the SD card
+ * @brief Loads the node's state (balances and last transaction ID) from the 
+ * snapshot on the SD card. The latest valid slot is used.
+ * @return true if successful, false if there's no valid snapshot.
 */
-static void PutUnitsIntoSD(User user,uint32_t* approxVolumePtr)
+static bool LoadState(state_t* state)
 {
-  const uint8_t buffLen = 15;
-  char fileBuff[buffLen + 1] = {0};
-  
-  IntegerToString(approxVolumePtr[user],fileBuff);
-  switch(user)
+  state_t slots[NODE_STATE_SLOTS];
+  File file = SD.open(NODE_STATE_FILE,FILE_READ);
+  if(!file)
   {
-    case USER1:
-      SD_WriteFile("user1.txt",fileBuff);
-      break;
-    case USER2:
-      SD_WriteFile("user2.txt",fileBuff);
-      break;
-    case USER3: 
-      SD_WriteFile("user3.txt",fileBuff);
+    return false;
+  }
+  int numOfBytes = file.read(slots,sizeof(slots));
+  file.close();
+  bool isLoaded = false;
+  for(uint8_t i = 0; i < NODE_STATE_SLOTS; i++)
+  {
+    if(numOfBytes < (int)((i + 1) * sizeof(state_t)))
+    {
       break;
+    }
+    uint8_t checksum = slots[i].checksum;
+    slots[i].checksum = 0;
+    if(slots[i].sequence != 0 && //not written yet
+       checksum == MNI::Checksum(&slots[i],sizeof(state_t)) &&
+       (!isLoaded || (int32_t)(slots[i].sequence - state->sequence) > 0))
+    {
+      *state = slots[i];
+      isLoaded = true;
+    }
   }
+  return isLoaded;
 }
 
 /**
- * @brief Monitor the flow of water and control it by driving the solenoid
- * valve appropriately.
+ * @brief Loads the node's state from the text files of earlier versions
+ * (one per user). They had no transactions, so the last ID is 0.
 */
-static void MonitorAndControlFlow(User user,uint32_t* oldApproxVolumePtr)
+static void LoadLegacyState(state_t* state)
 {
-  uint8_t valvePin;
-  uint32_t newApproxVolume;
+  const User user[numOfUsers] = {USER1,USER2,USER3};
+  memset(state,0,sizeof(state_t));
+  for(uint8_t i = 0; i < numOfUsers; i++)
+  {
+    state->volumes[i] = GetUnitsFromSD(user[i]);
+  }
+}
+
+/**
+ * @brief Stores the node's state (balances and last transaction ID) on the SD
+ * card. Slots are written in turn, so a power outage during a write leaves 
+ * the previous snapshot intact.
+ * @param approxVolumePtr: Volume (mL) of each user.
+*/
+static void StoreState(const uint32_t* approxVolumePtr)
+{
+  state_t state = {};
+  stateSequence++;
+  state.sequence = stateSequence;
+  memcpy(state.volumes,approxVolumePtr,sizeof(state.volumes));
+  state.lastTxnId = lastTxnId;
+  state.checksum = MNI::Checksum(&state,sizeof(state));
+  File file = SD.open(NODE_STATE_FILE,O_RDWR | O_CREAT);
+  if(!file)
+  {
+    LOG_ERROR(NODE,"State not stored");
+    return;
+  }
+  while(file.size() < NODE_STATE_SLOTS * sizeof(state))
+  {//New file: all slots must exist (seeking past the end fails)
+    file.seek(file.size());
+    file.write((uint8_t)0);
+  }
+  file.seek((stateSequence % NODE_STATE_SLOTS) * sizeof(state));
+  file.write((const uint8_t*)&state,sizeof(state));
+  file.close();
+}
+
+/**
+ * @brief Loads the calibration table of each flow sensor from the EEPROM.
+ * Sensors without a valid record stay uncalibrated.
+*/
+static void LoadCalibration(void)
+{
+  for(uint8_t i = 0; i < numOfUsers; i++)
+  {
+    cal_record_t record;
+    EEPROM.get(i * sizeof(record),record);
+    uint8_t checksum = record.checksum;
+    record.checksum = 0;
+    if(record.magic != NODE_CAL_MAGIC || checksum != MNI::Checksum(&record,sizeof(record)) ||
+       !flowSensor[i]->SetCalibration(&record.calibration))
+    {
+      LOG_WARN(NODE,"Sensor %ld: uncalibrated",i);
+    }
+  }
+}
+
+/**
+ * @brief Stores the calibration table of a flow sensor in the EEPROM.
+*/
+static void StoreCalibration(uint8_t sensorIndex,const calibration_t* calibration)
+{
+  cal_record_t record = {};
+  record.magic = NODE_CAL_MAGIC;
+  record.calibration = *calibration;
+  record.checksum = MNI::Checksum(&record,sizeof(record));
+  EEPROM.put(sensorIndex * sizeof(record),record); //writes changed bytes only
+}
+
+/**
+ * @brief Handles an MNI_CALIBRATE frame (see MNI.h).
+*/
+static void HandleCalibration(const mni_request_t* request)
+{
+  if(request->userIndex >= numOfUsers)
+  {
+    return;
+  }
+  FlowSensor* sensor = flowSensor[request->userIndex];
+  calibration_t calibration;
+  noInterrupts(); //the timer ISR uses the table
+  sensor->GetCalibration(&calibration);
+  interrupts();
   
+  if(request->txnId == MNI_CAL_REPORT)
+  {
+    return; //sent by SendCalibration()
+  }
+  if(request->txnId >= FLOW_CAL_MAX_POINTS || request->txnId > calibration.numOfPoints)
+  {
+    LOG_WARN(NODE,"Bad cal point %lu",request->txnId);
+    return;
+  }
+  uint8_t pointIndex = request->txnId;
+  cal_point_t point = {(uint16_t)(request->units >> 16),(uint16_t)(request->units & 0xFFFF)};
+  if(point.kFactor == 0)
+  {
+    calibration.numOfPoints = pointIndex;
+  }
+  else
+  {
+    calibration.points[pointIndex] = point;
+    calibration.numOfPoints = pointIndex + 1;
+  }
+  noInterrupts();
+  bool isValid = sensor->SetCalibration(&calibration);
+  interrupts();
+  if(!isValid)
+  {
+    LOG_WARN(NODE,"Bad cal point %lu",request->txnId);
+    return;
+  }
+  StoreCalibration(request->userIndex,&calibration);
+  LOG_INFO(NODE,"Sensor %ld: %ld cal points",request->userIndex,calibration.numOfPoints);
+}
+
+/**
+ * @brief Sends a sensor's calibration table and pulse count to the master
+ * (MNI_CAL_INFO frames, see MNI.h).
+*/
+static void SendCalibration(uint8_t userIndex)
+{
+  FlowSensor* sensor = flowSensor[userIndex];
+  calibration_t calibration;
+  mni_cal_info_t info = {};
+  noInterrupts(); //the timer ISR uses the table and counts the pulses
+  sensor->GetCalibration(&calibration);
+  info.totalPulses = sensor->GetTotalPulses();
+  info.rate = sensor->GetRate();
+  interrupts();
+  info.header = MNI_HEADER;
+  info.type = MNI_CAL_INFO;
+  info.userIndex = userIndex;
+  info.numOfPoints = calibration.numOfPoints;
+  //One frame per point (one without a point if the table is empty)
+  uint8_t numOfFrames = (calibration.numOfPoints > 0) ? calibration.numOfPoints : 1;
+  for(uint8_t i = 0; i < numOfFrames; i++)
+  {
+    info.pointIndex = i;
+    if(i < calibration.numOfPoints)
+    {
+      info.pointRate = calibration.points[i].rate;
+      info.pointKFactor = calibration.points[i].kFactor;
+    }
+    info.checksum = 0;
+    info.checksum = MNI::Checksum(&info,sizeof(info));
+    mni.TransmitData(&info,sizeof(info));
+  }
+}
+
+/**
+ * @brief Returns a user's volume (in mL).
+*/
+static uint32_t GetVolume(User user)
+{
+  noInterrupts(); //the timer ISR updates the volume
+  uint32_t volume = flowSensor[user]->GetVolume();
+  interrupts();
+  return volume;
+}
+
+/**
+ * @brief Add recharged units (in L) to a user's volume (in mL).
+ * The new volume is stored immediately (together with the transaction ID) so
+ * the recharge survives a power outage and is never applied twice.
+*/
+static void ApplyRecharge(User user,uint32_t units,uint32_t* approxVolumePtr)
+{
+  noInterrupts(); //the timer ISR also updates the volume
+  uint32_t volume = (units < FLOW_MAX_VOLUME / 1000) ? (units * 1000) : FLOW_MAX_VOLUME;
+  flowSensor[user]->UpdateVolume(volume); //saturates (doesn't wrap)
+  approxVolumePtr[user] = flowSensor[user]->GetVolume();
+  interrupts();
+  StoreState(approxVolumePtr);
+}
+
+/**
+ * @brief Drives a user's solenoid valve: open while the user has volume left.
+*/
+static void DriveValve(User user,uint32_t approxVolume)
+{
+  uint8_t valvePin;
   switch(user)
   {
     case USER1:
       valvePin = Pin::solenoidValve1;
-      newApproxVolume = lround(sensorData.volume1);
       break;
     case USER2:
       valvePin = Pin::solenoidValve2;
-      newApproxVolume = lround(sensorData.volume2);
       break;
     case USER3:
       valvePin = Pin::solenoidValve3;
-      newApproxVolume = lround(sensorData.volume3);
       break;
   }
+  if(approxVolume > 0)
+  {
+    digitalWrite(valvePin,LOW); //turn valve on
+  }
+  else
+  {
+    digitalWrite(valvePin,HIGH); //turn valve off
+  }
+}
+
+/**
+ * @brief Monitor the flow of water and control it by driving the solenoid
+ * valve appropriately.
+*/
+static void MonitorAndControlFlow(User user,uint32_t* oldApproxVolumePtr)
+{
+  uint32_t newApproxVolume = GetVolume(user);
   if(newApproxVolume != oldApproxVolumePtr[user])
   {
     oldApproxVolumePtr[user] = newApproxVolume;
     hasVolumeChanged[user] = true;
     noFlow[user] = false;
     prevLogTime[user] = millis();
+    lastFlowTime = millis();
   }
   else
   {
     noFlow[user] = true;
   }
-  if(newApproxVolume > 0)
-  {
-    digitalWrite(valvePin,LOW); //turn valve on
-  }
-  else
-  {
-    digitalWrite(valvePin,HIGH); //turn valve off
-  }
+  DriveValve(user,newApproxVolume);
 }
 
+/**
+ * @brief Fast start: the balances are restored (from a single snapshot) and
+ * the valves are driven before anything else is initialized.
+*/
 void setup() 
 {
-  if(SD.begin(Pin::chipSelect))
+  const User user[numOfUsers] = {USER1,USER2,USER3};
+  //Valves are normally open: LOW is the same state as unpowered
+  pinMode(Pin::solenoidValve1,OUTPUT);
+  pinMode(Pin::solenoidValve2,OUTPUT);
+  pinMode(Pin::solenoidValve3,OUTPUT);  
+  bool isSdFound = SD.begin(Pin::chipSelect);
+  if(isSdFound)
   { 
-    const User user[numOfUsers] = {USER1,USER2,USER3};
-    uint32_t prevVolume[numOfUsers] = {0,0,0};
+    state_t state;
+    bool isStateLoaded = LoadState(&state);
+    if(!isStateLoaded)
+    {//First start after an update (or a new card)
+      LoadLegacyState(&state);
+    }
+    stateSequence = state.sequence;
+    lastTxnId = state.lastTxnId;
     for(uint8_t i = 0; i < numOfUsers; i++)
     {
-      prevVolume[i] = GetUnitsFromSD(user[i]);
-      delay(250);
+      flowSensor[i]->UpdateVolume(state.volumes[i]);
+      oldApproxVolume[i] = flowSensor[i]->GetVolume();
+      DriveValve(user[i],oldApproxVolume[i]);
     }
-    flowSensor1.UpdateVolume(prevVolume[USER1]);
-    flowSensor2.UpdateVolume(prevVolume[USER2]);
-    flowSensor3.UpdateVolume(prevVolume[USER3]);
-  }  
-  pinMode(Pin::solenoidValve1,OUTPUT);
-  pinMode(Pin::solenoidValve2,OUTPUT);
-  pinMode(Pin::solenoidValve3,OUTPUT);  
+    if(!isStateLoaded)
+    {
+      StoreState(oldApproxVolume);
+    }
+  }
+  else
+  {
+    for(uint8_t i = 0; i < numOfUsers; i++)
+    {
+      DriveValve(user[i],0);
+    }
+  }
+  uint32_t valveTime = millis(); //since reset (the bootloader's time isn't counted)
+  
+  Serial.begin(NODE_DEBUG_BAUD);
+  Log::Begin(&Serial);
+  if(!isSdFound)
+  {
+    LOG_ERROR(NODE,"SD card not found");
+  }
+  LOG_INFO(NODE,"Valves set %lu ms after reset",valveTime); //NODE: INFO to measure (log_config.h)
+  LoadCalibration();
+  ADCSRA = 0; //ADC isn't used (saves power while sleeping)
   TimerInit();  
 }
 
 void loop() 
 {
   const User user[numOfUsers] = {USER1,USER2,USER3};
-  static uint32_t oldApproxVolume[numOfUsers]; //Array of previous value of units (or volumes) consumed
-  uint32_t rechargedUnits[numOfUsers] = {0}; //Array of recharged units
-  const uint8_t rxBufferSize = sizeof(rechargedUnits);
+  static uint32_t wakeTime; //time of the last wake-up
+  mni_request_t request = {};
+  mni_reply_t reply = {};
   
-  if(mni.IsReceiverReady(rxBufferSize))
+  mni.SkipUntil(MNI_HEADER); //drop wake-up bytes (and noise)
+  if(mni.IsReceiverReady(sizeof(request)))
   {
-    //Receive recharged units and convert from L to mL
-    mni.ReceiveData(rechargedUnits,rxBufferSize);   
-    flowSensor1.UpdateVolume(rechargedUnits[USER1] * 1000);
-    flowSensor2.UpdateVolume(rechargedUnits[USER2] * 1000);
-    flowSensor3.UpdateVolume(rechargedUnits[USER3] * 1000);   
-    mni.TransmitData(&sensorData,sizeof(sensorData));
+    mni.ReceiveData(&request,sizeof(request));
+    uint8_t checksum = request.checksum;
+    request.checksum = 0;
+    if(request.header != MNI_HEADER || 
+       checksum != MNI::Checksum(&request,sizeof(request)))
+    {
+      LOG_WARN(NODE,"Bad frame (type %ld)",request.type);
+      mni.FlushReceiver(); //resynchronize (the master will resend)
+      return;
+    }
+    //Apply a recharge transaction only once
+    if(request.type == MNI_RECHARGE && request.txnId > lastTxnId &&
+       request.userIndex < numOfUsers)
+    {
+      lastTxnId = request.txnId;
+      ApplyRecharge(user[request.userIndex],request.units,oldApproxVolume);
+      LOG_INFO(NODE,"Txn %lu: %lu units to user %ld",request.txnId,request.units,
+               request.userIndex);
+    }
+    else if(request.type == MNI_CALIBRATE)
+    {
+      HandleCalibration(&request);
+    }
+    reply.header = MNI_HEADER;
+    reply.type = request.type;
+    reply.sensorData.volume1 = GetVolume(USER1);
+    reply.sensorData.volume2 = GetVolume(USER2);
+    reply.sensorData.volume3 = GetVolume(USER3);
+    reply.lastTxnId = lastTxnId;
+    reply.checksum = MNI::Checksum(&reply,sizeof(reply));
+    mni.TransmitData(&reply,sizeof(reply));
+    if(request.type == MNI_CALIBRATE && request.userIndex < numOfUsers)
+    {
+      SendCalibration(request.userIndex);
+    }
   }
 
   for(uint8_t i = 0; i < numOfUsers; i++)
@@ -302,19 +588,33 @@ void loop()
     MonitorAndControlFlow(user[i],oldApproxVolume);
     if(hasVolumeChanged[i] && noFlow[i])
     {
-      if((millis() - prevLogTime[i]) >= 10000)
+      if((millis() - prevLogTime[i]) >= NODE_LOG_PERIOD)
       {
-        PutUnitsIntoSD(user[i],oldApproxVolume);
+        StoreState(oldApproxVolume);
         hasVolumeChanged[i] = false;
         prevLogTime[i] = millis();  
       }
     }     
   }
+  
+  Log::Process(); //one record per loop (keeps the loop short)
+  
+  //Sleep if water isn't flowing, all readings are stored and the MNI is quiet
+  bool isLogPending = hasVolumeChanged[USER1] || hasVolumeChanged[USER2] || 
+                      hasVolumeChanged[USER3];
+  if(!isLogPending && !mni.IsReceiverReady(1) && Log::IsEmpty() &&
+     (millis() - lastFlowTime) >= NODE_FLOW_TIMEOUT &&
+     (millis() - wakeTime) >= NODE_WAKE_WINDOW)
+  {
+    Serial.flush(); //finish printing the log
+    Sleep();
+    wakeTime = millis();
+  }
 }
 
 ISR(TIMER1_COMPA_vect)
 {
-  sensorData.volume1 = flowSensor1.GetVolume();
-  sensorData.volume2 = flowSensor2.GetVolume();
-  sensorData.volume3 = flowSensor3.GetVolume();
+  flowSensor1.Sample();
+  flowSensor2.Sample();
+  flowSensor3.Sample();
 }
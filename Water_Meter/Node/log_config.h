@@ -0,0 +1,7 @@
+#pragma once
+
+//Log level of each module (LOG_LEVEL_NONE removes its statements)
+#define LOG_LEVEL_NODE      LOG_LEVEL_WARN //INFO while measuring e.g. the reset-to-valve time
+#define LOG_LEVEL_MNI       LOG_LEVEL_NONE
+
+#define LOG_BUFFER_SIZE     4 //records (kept small: RAM)
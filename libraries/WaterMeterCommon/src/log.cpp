@@ -0,0 +1,169 @@
+#include <Arduino.h>
+#include "log.h"
+
+#define LOG_TASK_STACK    3072
+
+volatile uint8_t Log::head = 0;
+volatile uint8_t Log::count = 0;
+volatile uint16_t Log::numOfDropped = 0;
+Print* Log::output = NULL;
+#if !defined(__AVR__)
+portMUX_TYPE Log::mux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t Log::drainTaskHandle = NULL;
+#endif
+
+#if defined(__AVR__)
+#define LOG_LOCK()     uint8_t oldSREG = SREG; noInterrupts()
+#define LOG_UNLOCK()   SREG = oldSREG
+#define LOG_SNPRINTF   snprintf_P
+#else
+#define LOG_LOCK()     portENTER_CRITICAL(&mux)
+#define LOG_UNLOCK()   portEXIT_CRITICAL(&mux)
+#define LOG_SNPRINTF   snprintf
+#endif
+
+/**
+ * @brief Copies a record into the ring buffer (never blocks).
+*/
+void Log::Push(uint8_t level,const char* module,const char* format,
+               const long* args,uint8_t numOfArgs)
+{
+  uint32_t timestamp = millis();
+  bool wasEmpty = false;
+  LOG_LOCK();
+  if(count < bufferSize)
+  {
+    uint8_t tail = (count < bufferSize - head) ? (head + count) : (head + count - bufferSize);
+    record_t* record = &buffer[tail];
+    record->timestamp = timestamp;
+    record->module = module;
+    record->format = format;
+    record->level = level;
+    for(uint8_t i = 0; i < LOG_MAX_ARGS; i++)
+    {
+      record->args[i] = (i < numOfArgs) ? args[i] : 0;
+    }
+    wasEmpty = (count == 0);
+    count++;
+  }
+  else
+  {
+    numOfDropped++;
+  }
+  LOG_UNLOCK();
+#if !defined(__AVR__)
+  if(wasEmpty && drainTaskHandle != NULL)
+  {
+    xTaskNotifyGive(drainTaskHandle);
+  }
+#else
+  (void)wasEmpty;
+#endif
+}
+
+#if defined(__AVR__)
+/**
+ * @brief Sets the output of the log. Log::Process() must then be called
+ * (e.g. from loop()) to print the buffered records.
+*/
+void Log::Begin(Print* output)
+{
+  Log::output = output;
+}
+#else
+void Log::DrainTask(void* pvParameters)
+{
+  while(1)
+  {
+    while(Log::Process())
+    {
+    }
+    ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+  }
+}
+
+/**
+ * @brief Sets the output of the log and starts the task that prints
+ * the buffered records.
+ * @return true if successful, false if otherwise.
+*/
+bool Log::Begin(Print* output,UBaseType_t priority,BaseType_t core)
+{
+  static StackType_t drainTaskStack[LOG_TASK_STACK];
+  static StaticTask_t drainTaskBuffer;
+  Log::output = output;
+  drainTaskHandle = 
+  xTaskCreateStaticPinnedToCore(Log::DrainTask,"Log",LOG_TASK_STACK,NULL,priority,
+                                drainTaskStack,&drainTaskBuffer,core);
+  if(drainTaskHandle != NULL)
+  {
+    xTaskNotifyGive(drainTaskHandle); //print records written before Begin()
+  }
+  return (drainTaskHandle != NULL);
+}
+#endif
+
+/**
+ * @brief Formats and prints the oldest record (and reports dropped records).
+ * @return true if a record was printed, false if the buffer is empty.
+*/
+bool Log::Process(void)
+{
+  if(output == NULL)
+  {
+    return false;
+  }
+  record_t record;
+  uint16_t dropped;
+  bool isEmpty;
+  LOG_LOCK();
+  isEmpty = (count == 0);
+  if(!isEmpty)
+  {
+    record = buffer[head];
+    head = (head + 1 < bufferSize) ? (head + 1) : 0;
+    count--;
+  }
+  dropped = numOfDropped;
+  numOfDropped = 0;
+  LOG_UNLOCK();
+
+  if(dropped > 0)
+  {
+    output->print("[LOG] dropped: ");
+    output->println(dropped);
+  }
+  if(isEmpty)
+  {
+    return false;
+  }
+  static const char levelChar[] = "?EWID";
+  char line[LOG_LINE_SIZE];
+#if LOG_MAX_ARGS > 4
+#error "LOG_MAX_ARGS must not exceed 4"
+#endif
+  long a[4] = {0};
+  for(uint8_t i = 0; i < LOG_MAX_ARGS; i++)
+  {
+    a[i] = record.args[i];
+  }
+  LOG_SNPRINTF(line,sizeof(line),record.format,a[0],a[1],a[2],a[3]);
+  output->print('[');
+  output->print(record.timestamp);
+  output->print("][");
+  output->print(levelChar[(record.level <= LOG_LEVEL_DEBUG) ? record.level : 0]);
+  output->print("][");
+#if defined(__AVR__)
+  output->print((const __FlashStringHelper*)record.module);
+#else
+  output->print(record.module);
+#endif
+  output->print("] ");
+  output->println(line);
+  return true;
+}
+
+bool Log::IsEmpty(void)
+{
+  return (count == 0);
+}
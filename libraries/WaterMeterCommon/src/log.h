@@ -0,0 +1,124 @@
+#pragma once
+
+/**
+ * @brief Leveled logging with deferred output.
+ *
+ * Usage: LOG_INFO(MODULE,"format",args...) where MODULE has a level defined
+ * as LOG_LEVEL_MODULE in the sketch's log_config.h (included after log.h by
+ * each file that logs). Statements above their module's level compile to 
+ * nothing. The sketch defines the ring buffer once: LOG_DEFINE_BUFFER(size).
+ * Enabled statements only copy a compact record (timestamp, level, pointers
+ * to the module name and format, and up to LOG_MAX_ARGS integer arguments)
+ * into a ring buffer. Formatting and printing are done later by Log::Process()
+ * (from a low-priority task on the ESP32, from loop() on the AVR).
+ *
+ * NB: Arguments are integers stored as 'long' (use %ld, %lu, %lx). Floats 
+ * don't compile, convert them explicitly (e.g. lround()). The compiler checks
+ * the format against the arguments as stored (a dead printf-like call).
+ * Records written when the buffer is full are dropped (and counted).
+*/
+
+#define LOG_LEVEL_NONE    0
+#define LOG_LEVEL_ERROR   1
+#define LOG_LEVEL_WARN    2
+#define LOG_LEVEL_INFO    3
+#define LOG_LEVEL_DEBUG   4
+
+//Same for all the sketches of an architecture (the library is built once)
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define LOG_STR(str)      PSTR(str) //kept in flash
+#define LOG_MAX_ARGS      3 //kept small (RAM)
+#define LOG_LINE_SIZE     48
+#else
+#define LOG_STR(str)      (str)
+#define LOG_MAX_ARGS      4
+#define LOG_LINE_SIZE     96
+#endif
+
+//Ring buffer of the sketch (defined in one file, at most 255 records)
+#define LOG_DEFINE_BUFFER(numOfRecords) \
+  Log::record_t Log::buffer[(numOfRecords)]; \
+  const uint8_t Log::bufferSize = (numOfRecords)
+
+//Format and arguments as stored (LOG_MAX_ARGS at most)
+#define LOG_ARGS_SELECT(_0,_1,_2,_3,_4,name,...) name
+#define LOG_ARGS(...) \
+  LOG_ARGS_SELECT(__VA_ARGS__,LOG_ARGS_4,LOG_ARGS_3,LOG_ARGS_2,LOG_ARGS_1,LOG_ARGS_0,)(__VA_ARGS__)
+#define LOG_ARGS_0(f)         f
+#define LOG_ARGS_1(f,a)       f,Log::Arg(a)
+#define LOG_ARGS_2(f,a,b)     f,Log::Arg(a),Log::Arg(b)
+#define LOG_ARGS_3(f,a,b,c)   f,Log::Arg(a),Log::Arg(b),Log::Arg(c)
+#define LOG_ARGS_4(f,a,b,c,d) f,Log::Arg(a),Log::Arg(b),Log::Arg(c),Log::Arg(d)
+
+#define LOG_AT(level,module,format,...) \
+  do \
+  { \
+    if((level) <= LOG_LEVEL_##module) \
+    { \
+      Log::Write((level),LOG_STR(#module),LOG_STR(format),##__VA_ARGS__); \
+    } \
+    if(false) \
+    { \
+      Log::CheckFormat(LOG_ARGS(format,##__VA_ARGS__)); \
+    } \
+  }while(0)
+
+#define LOG_ERROR(module,format,...) LOG_AT(LOG_LEVEL_ERROR,module,format,##__VA_ARGS__)
+#define LOG_WARN(module,format,...)  LOG_AT(LOG_LEVEL_WARN,module,format,##__VA_ARGS__)
+#define LOG_INFO(module,format,...)  LOG_AT(LOG_LEVEL_INFO,module,format,##__VA_ARGS__)
+#define LOG_DEBUG(module,format,...) LOG_AT(LOG_LEVEL_DEBUG,module,format,##__VA_ARGS__)
+
+class Log
+{
+  private:
+    typedef struct
+    {
+      uint32_t timestamp; //millis
+      const char* module;
+      const char* format;
+      long args[LOG_MAX_ARGS];
+      uint8_t level;
+    }record_t;
+    static record_t buffer[]; //LOG_DEFINE_BUFFER()
+    static const uint8_t bufferSize;
+    static volatile uint8_t head;
+    static volatile uint8_t count;
+    static volatile uint16_t numOfDropped;
+    static Print* output;
+#if !defined(__AVR__)
+    static portMUX_TYPE mux;
+    static TaskHandle_t drainTaskHandle;
+    static void DrainTask(void* pvParameters);
+#endif
+
+    static void Push(uint8_t level,const char* module,const char* format,
+                     const long* args,uint8_t numOfArgs);
+
+  public:
+#if defined(__AVR__)
+    static void Begin(Print* output);
+#else
+    static bool Begin(Print* output,UBaseType_t priority,BaseType_t core);
+#endif
+    static bool Process(void);
+    static bool IsEmpty(void);
+
+    //Arguments as stored in a record (integers only)
+    static long Arg(int value) {return value;}
+    static unsigned long Arg(unsigned int value) {return value;}
+    static long Arg(long value) {return value;}
+    static unsigned long Arg(unsigned long value) {return value;}
+    static void Arg(float value) = delete;
+    static void Arg(double value) = delete;
+    //Never called (see LOG_AT): lets the compiler check the format
+    __attribute__((format(printf,1,2))) static void CheckFormat(const char* format,...) {}
+
+    template<typename... Args>
+    static void Write(uint8_t level,const char* module,const char* format,Args... args)
+    {
+      static_assert(sizeof...(args) <= LOG_MAX_ARGS,"Too many log arguments");
+      const long argBuffer[] = {0,(long)Log::Arg(args)...}; //leading 0: no empty arrays
+      Log::Push(level,module,format,argBuffer + 1,sizeof...(args));
+    }
+};
@@ -0,0 +1,336 @@
+#include <Arduino.h>
+#include <string.h>
+#include <ctype.h>
+#include "numfmt.h"
+
+static const uint32_t powerOf10[NUMFMT_MAX_DECIMALS + 1] = 
+{
+  1,10,100,1000,10000,100000,1000000,10000000,100000000,1000000000
+};
+
+//Max length of a fixed-point value: "-" + 10 digits + "." + 9 decimals
+#define NUMFMT_MAX_FIXED_LEN  (1 + 10 + 1 + NUMFMT_MAX_DECIMALS)
+
+//Fixed-point value split for formatting
+typedef struct
+{
+  uint32_t integerPart;
+  uint32_t fractionalPart;
+  uint8_t decimalPlaces;
+  bool isNegative;
+  uint8_t len; //as text (excluding NULL)
+}fixed_t;
+
+/**
+ * @brief Gets the number of decimal digits of a value (at least 1).
+*/
+static uint8_t CountDigits(uint32_t value)
+{
+  uint8_t numOfDigits = 1;
+  while(numOfDigits < 10 && value >= powerOf10[numOfDigits])
+  {
+    numOfDigits++;
+  }
+  return numOfDigits;
+}
+
+/**
+ * @brief Writes the last 'numOfDigits' decimal digits of a value (leading
+ * zeros included) backwards, ending just before 'end'.
+ * The digits are written in place: copying them from a scratch buffer right
+ * after writing them byte by byte is slower (stalled loads).
+*/
+static void WriteDigits(uint32_t value,uint8_t numOfDigits,char* end)
+{
+  for(uint8_t i = 0; i < numOfDigits; i++)
+  {
+    *--end = '0' + (value % 10);
+    value /= 10;
+  }
+}
+
+/**
+ * @brief Splits a fixed-point value (decimalPlaces <= NUMFMT_MAX_DECIMALS).
+*/
+static void SplitFixed(int32_t value,uint8_t decimalPlaces,fixed_t* fixed)
+{
+  uint32_t magnitude = (value < 0) ? (0 - (uint32_t)value) : (uint32_t)value;
+  fixed->integerPart = magnitude / powerOf10[decimalPlaces];
+  fixed->fractionalPart = magnitude % powerOf10[decimalPlaces];
+  fixed->decimalPlaces = decimalPlaces;
+  fixed->isNegative = (value < 0);
+  fixed->len = fixed->isNegative + CountDigits(fixed->integerPart) + 
+               ((decimalPlaces > 0) ? (1 + decimalPlaces) : 0);
+}
+
+/**
+ * @brief Writes a fixed-point value (fixed->len chars, no NULL).
+*/
+static void WriteFixed(const fixed_t* fixed,char* dest)
+{
+  char* end = dest + fixed->len;
+  if(fixed->decimalPlaces > 0)
+  {
+    WriteDigits(fixed->fractionalPart,fixed->decimalPlaces,end);
+    end -= fixed->decimalPlaces + 1;
+    *end = '.';
+  }
+  if(fixed->isNegative)
+  {
+    *dest++ = '-';
+  }
+  WriteDigits(fixed->integerPart,end - dest,end);
+}
+
+/**
+ * @brief Converts an unsigned integer to a (NULL-terminated) decimal string.
+ * @return Length of the string, 0 if it doesn't fit in the buffer.
+*/
+size_t FormatUnsigned(uint32_t value,char* buffer,size_t bufferSize)
+{
+  uint8_t numOfDigits = CountDigits(value);
+  if(bufferSize == 0)
+  {
+    return 0;
+  }
+  if(numOfDigits >= bufferSize)
+  {
+    buffer[0] = '\0';
+    return 0;
+  }
+  WriteDigits(value,numOfDigits,buffer + numOfDigits);
+  buffer[numOfDigits] = '\0';
+  return numOfDigits;
+}
+
+/**
+ * @brief Converts a fixed-point value (scaled by 10^decimalPlaces) to a
+ * decimal string e.g. (-5,2) gives "-0.05".
+ * @return Length of the string, 0 if it doesn't fit in the buffer 
+ * (or decimalPlaces > NUMFMT_MAX_DECIMALS).
+*/
+size_t FormatFixed(int32_t value,uint8_t decimalPlaces,char* buffer,size_t bufferSize)
+{
+  if(bufferSize == 0)
+  {
+    return 0;
+  }
+  buffer[0] = '\0';
+  if(decimalPlaces > NUMFMT_MAX_DECIMALS)
+  {
+    return 0;
+  }
+  fixed_t fixed;
+  SplitFixed(value,decimalPlaces,&fixed);
+  if(fixed.len >= bufferSize)
+  {
+    return 0;
+  }
+  WriteFixed(&fixed,buffer);
+  buffer[fixed.len] = '\0';
+  return fixed.len;
+}
+
+/**
+ * @brief Converts a decimal string (digits only) to an unsigned integer.
+ * @return true if successful, false if the string is empty, contains 
+ * a non-digit or overflows (the value is left unchanged).
+*/
+bool ParseUnsigned(const char* str,uint32_t* valuePtr)
+{
+  if(str == NULL || str[0] == '\0')
+  {
+    return false;
+  }
+  uint32_t value = 0;
+  for(const char* ptr = str; *ptr != '\0'; ptr++)
+  {
+    if(*ptr < '0' || *ptr > '9')
+    {
+      return false;
+    }
+    uint8_t digit = *ptr - '0';
+    if(value > (UINT32_MAX - digit) / 10)
+    {
+      return false; //overflow
+    }
+    value = value * 10 + digit;
+  }
+  *valuePtr = value;
+  return true;
+}
+
+/**
+ * @brief Converts bytes to a (NULL-terminated) string of hex digits.
+ * @return Length of the string, 0 if it doesn't fit in the buffer.
+*/
+size_t FormatHex(const uint8_t* data,size_t dataSize,char* buffer,size_t bufferSize)
+{
+  const char hexDigits[] = "0123456789abcdef";
+  if(bufferSize == 0)
+  {
+    return 0;
+  }
+  if(2 * dataSize >= bufferSize)
+  {
+    buffer[0] = '\0';
+    return 0;
+  }
+  for(size_t i = 0; i < dataSize; i++)
+  {
+    buffer[2 * i] = hexDigits[data[i] >> 4];
+    buffer[2 * i + 1] = hexDigits[data[i] & 0x0F];
+  }
+  buffer[2 * dataSize] = '\0';
+  return 2 * dataSize;
+}
+
+/**
+ * @brief Converts a string of exactly 2 * dataSize hex digits to bytes.
+ * @return true if successful, false if otherwise (data is left unchanged).
+*/
+bool ParseHex(const char* str,uint8_t* data,size_t dataSize)
+{
+  if(str == NULL || strlen(str) != 2 * dataSize)
+  {
+    return false;
+  }
+  for(size_t i = 0; i < 2 * dataSize; i++)
+  {
+    if(!isxdigit((unsigned char)str[i]))
+    {
+      return false;
+    }
+  }
+  for(size_t i = 0; i < dataSize; i++)
+  {
+    char byteStr[3] = {str[2 * i],str[2 * i + 1],'\0'};
+    data[i] = strtoul(byteStr,NULL,16);
+  }
+  return true;
+}
+
+StringBuilder::StringBuilder(char* buffer,size_t bufferSize)
+{
+  //Initialize private variables
+  this->buffer = buffer;
+  size = bufferSize;
+  StringBuilder::Clear();
+}
+
+/**
+ * @brief Appends 'count' chars (as many as fit) and the NULL.
+*/
+StringBuilder& StringBuilder::AppendChars(const char* chars,size_t count)
+{
+  if(size == 0)
+  {
+    isTruncated = isTruncated || (count > 0);
+    return *this;
+  }
+  size_t space = size - 1 - len;
+  if(count > space)
+  {
+    count = space;
+    isTruncated = true;
+  }
+  memcpy(buffer + len,chars,count);
+  len += count;
+  buffer[len] = '\0';
+  return *this;
+}
+
+StringBuilder& StringBuilder::Append(const char* str)
+{
+  return StringBuilder::AppendChars(str,strlen(str));
+}
+
+StringBuilder& StringBuilder::Append(char c)
+{
+  return StringBuilder::AppendChars(&c,1);
+}
+
+StringBuilder& StringBuilder::AppendUnsigned(uint32_t value)
+{
+  uint8_t numOfDigits = CountDigits(value);
+  if(len + numOfDigits >= size)
+  {//doesn't fit: as many digits as fit
+    char digits[10];
+    WriteDigits(value,numOfDigits,digits + numOfDigits);
+    return StringBuilder::AppendChars(digits,numOfDigits);
+  }
+  WriteDigits(value,numOfDigits,buffer + len + numOfDigits);
+  len += numOfDigits;
+  buffer[len] = '\0';
+  return *this;
+}
+
+/**
+ * @brief Appends a fixed-point value (scaled by 10^decimalPlaces).
+*/
+StringBuilder& StringBuilder::AppendFixed(int32_t value,uint8_t decimalPlaces)
+{
+  if(decimalPlaces > NUMFMT_MAX_DECIMALS)
+  {
+    isTruncated = true;
+    return *this;
+  }
+  fixed_t fixed;
+  SplitFixed(value,decimalPlaces,&fixed);
+  if(len + fixed.len >= size)
+  {//doesn't fit: as many chars as fit
+    char text[NUMFMT_MAX_FIXED_LEN];
+    WriteFixed(&fixed,text);
+    return StringBuilder::AppendChars(text,fixed.len);
+  }
+  WriteFixed(&fixed,buffer + len);
+  len += fixed.len;
+  buffer[len] = '\0';
+  return *this;
+}
+
+/**
+ * @brief Appends a float rounded to a number of decimal places. Values
+ * that can't be represented as fixed-point (32-bit) mark the builder as 
+ * truncated.
+*/
+StringBuilder& StringBuilder::AppendFloat(float value,uint8_t decimalPlaces)
+{
+  if(decimalPlaces > NUMFMT_MAX_DECIMALS)
+  {
+    isTruncated = true;
+    return *this;
+  }
+  float scaled = value * powerOf10[decimalPlaces];
+  if(!(scaled > -2147483648.0f && scaled < 2147483648.0f)) //also rejects NaN
+  {
+    isTruncated = true;
+    return *this;
+  }
+  return StringBuilder::AppendFixed(lroundf(scaled),decimalPlaces);
+}
+
+void StringBuilder::Clear(void)
+{
+  len = 0;
+  isTruncated = false;
+  if(size > 0)
+  {
+    buffer[0] = '\0';
+  }
+}
+
+const char* StringBuilder::GetString(void)
+{
+  return buffer;
+}
+
+size_t StringBuilder::GetLength(void)
+{
+  return len;
+}
+
+bool StringBuilder::IsTruncated(void)
+{
+  return isTruncated;
+}
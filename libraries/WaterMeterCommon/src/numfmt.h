@@ -0,0 +1,46 @@
+#pragma once
+
+/**
+ * @brief Bounds-checked number formatting and parsing.
+ *
+ * Formatting functions never write past 'bufferSize' (including the NULL).
+ * If the result doesn't fit, the buffer is left empty and 0 is returned.
+ * Fixed-point values are integers scaled by 10^decimalPlaces
+ * e.g. FormatFixed(1234,2,...) gives "12.34".
+*/
+
+#define NUMFMT_MAX_DECIMALS   9
+
+size_t FormatUnsigned(uint32_t value,char* buffer,size_t bufferSize);
+size_t FormatFixed(int32_t value,uint8_t decimalPlaces,char* buffer,size_t bufferSize);
+bool ParseUnsigned(const char* str,uint32_t* valuePtr);
+size_t FormatHex(const uint8_t* data,size_t dataSize,char* buffer,size_t bufferSize);
+bool ParseHex(const char* str,uint8_t* data,size_t dataSize);
+
+/**
+ * @brief Builds a string in a caller-provided buffer in a single pass
+ * (each append continues from the current end instead of searching for it).
+ * Appends that don't fit are truncated and the builder is marked as such;
+ * the string is always NULL-terminated.
+*/
+class StringBuilder
+{
+  private:
+    char* buffer;
+    size_t size;
+    size_t len;
+    bool isTruncated;
+    StringBuilder& AppendChars(const char* chars,size_t count);
+
+  public:
+    StringBuilder(char* buffer,size_t bufferSize);
+    StringBuilder& Append(const char* str);
+    StringBuilder& Append(char c);
+    StringBuilder& AppendUnsigned(uint32_t value);
+    StringBuilder& AppendFixed(int32_t value,uint8_t decimalPlaces);
+    StringBuilder& AppendFloat(float value,uint8_t decimalPlaces);
+    void Clear(void);
+    const char* GetString(void);
+    size_t GetLength(void);
+    bool IsTruncated(void);
+};
@@ -0,0 +1,89 @@
+#include <Arduino.h>
+#include <string.h>
+#include "latency.h"
+#include "numfmt.h"
+
+uint32_t LatencyStats::Percentile(const uint32_t* sorted,uint8_t size,uint8_t percent)
+{
+  uint8_t rank = (percent * size + 99) / 100; //nearest rank (1-based)
+  return sorted[(rank > 0) ? (rank - 1) : 0];
+}
+
+/**
+ * @brief Creates the statistics.
+ * @param names: Name of each stage (used in the report).
+ * @param numOfStages: Number of stages (and names).
+*/
+LatencyStats::LatencyStats(const char* const* names,uint8_t numOfStages)
+{
+  //Initialize private variables
+  mux = portMUX_INITIALIZER_UNLOCKED;
+  stages = new stage_t[numOfStages];
+  memset(stages,0,numOfStages * sizeof(stage_t));
+  this->names = names;
+  this->numOfStages = numOfStages;
+}
+
+/**
+ * @brief Records the latency of a stage.
+ * @param startTime: Time (millis) at which the operation started.
+*/
+void LatencyStats::Record(uint8_t stage,uint32_t startTime)
+{
+  if(stage >= numOfStages)
+  {
+    return;
+  }
+  uint32_t latency = millis() - startTime;
+  portENTER_CRITICAL(&mux);
+  stage_t* stagePtr = &stages[stage];
+  stagePtr->samples[stagePtr->numOfSamples % LATENCY_MAX_SAMPLES] = latency;
+  stagePtr->numOfSamples++;
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * @brief Gets the latency report of all stages with samples e.g.
+ * "OTP:12 50%:120 90%:310 99%:450 max:452" (millisecs, the first number is
+ * the total number of samples).
+ * @return Length of the report.
+*/
+size_t LatencyStats::GetReport(char* buffer,size_t bufferSize)
+{
+  StringBuilder report(buffer,bufferSize);
+  for(uint8_t i = 0; i < numOfStages; i++)
+  {
+    uint32_t sorted[LATENCY_MAX_SAMPLES];
+    uint32_t numOfSamples;
+    portENTER_CRITICAL(&mux);
+    numOfSamples = stages[i].numOfSamples;
+    memcpy(sorted,stages[i].samples,sizeof(sorted));
+    portEXIT_CRITICAL(&mux);
+    if(numOfSamples == 0)
+    {
+      continue;
+    }
+    uint8_t size = (numOfSamples < LATENCY_MAX_SAMPLES) ? numOfSamples : LATENCY_MAX_SAMPLES;
+    //Insertion sort (small number of samples)
+    for(uint8_t j = 1; j < size; j++)
+    {
+      uint32_t sample = sorted[j];
+      uint8_t k = j;
+      for(; k > 0 && sorted[k - 1] > sample; k--)
+      {
+        sorted[k] = sorted[k - 1];
+      }
+      sorted[k] = sample;
+    }
+    if(report.GetLength() > 0)
+    {
+      report.Append(' ');
+    }
+    report.Append(names[i]).Append(':').AppendUnsigned(numOfSamples)
+          .Append(" 50%:").AppendUnsigned(LatencyStats::Percentile(sorted,size,50))
+          .Append(" 90%:").AppendUnsigned(LatencyStats::Percentile(sorted,size,90))
+          .Append(" 99%:").AppendUnsigned(LatencyStats::Percentile(sorted,size,99))
+          .Append(" max:").AppendUnsigned(sorted[size - 1]);
+  }
+  return report.GetLength();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#define LATENCY_MAX_SAMPLES   64 //most recent samples kept per stage
+
+/**
+ * @brief Latency percentiles of the stages of a multi-step operation 
+ * (e.g. the stages of a recharge).
+ *
+ * The most recent samples of each stage are kept in a ring, so the report 
+ * reflects current behaviour and memory use is fixed. Percentiles are 
+ * computed (nearest rank) when a report is requested.
+ *
+ * Record() is thread-safe and never blocks (short critical section).
+*/
+class LatencyStats
+{
+  private:
+    typedef struct
+    {
+      uint32_t samples[LATENCY_MAX_SAMPLES]; //millisecs
+      uint32_t numOfSamples; //total recorded
+    }stage_t;
+    portMUX_TYPE mux;
+    stage_t* stages;
+    const char* const* names;
+    uint8_t numOfStages;
+
+    static uint32_t Percentile(const uint32_t* sorted,uint8_t size,uint8_t percent);
+
+  public:
+    LatencyStats(const char* const* names,uint8_t numOfStages);
+    void Record(uint8_t stage,uint32_t startTime);
+    size_t GetReport(char* buffer,size_t bufferSize);
+};
@@ -0,0 +1,56 @@
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include "memreport.h"
+
+MemReport::MemReport(void)
+{
+  //Initialize private variables
+  numOfTasks = 0;
+}
+
+/**
+ * @brief Registers a task whose stack usage should be reported.
+ * @param handle: Handle of the task.
+ * @param stackSize: Size of the task's stack in bytes.
+ * @return true if registered, false if there's no space left (or invalid handle).
+*/
+bool MemReport::AddTask(TaskHandle_t handle,uint32_t stackSize)
+{
+  if(handle == NULL || numOfTasks == MEM_REPORT_MAX_TASKS)
+  {
+    return false;
+  }
+  tasks[numOfTasks].handle = handle;
+  tasks[numOfTasks].stackSize = stackSize;
+  numOfTasks++;
+  return true;
+}
+
+/**
+ * @brief Prints the memory report to an output (e.g. Serial) e.g.
+ * TASK   STACK  MAX USED  FREE(MIN)
+ * App    8192   3120      5072
+ * HEAP free: 182000, min free: 175000, largest block: 110580
+*/
+void MemReport::Report(Print& output)
+{
+  output.println("TASK\tSTACK\tMAX USED\tFREE(MIN)");
+  for(uint8_t i = 0; i < numOfTasks; i++)
+  {
+    //NB: On the ESP32, stack sizes and high-water marks are in bytes
+    uint32_t minFree = uxTaskGetStackHighWaterMark(tasks[i].handle);
+    output.print(pcTaskGetTaskName(tasks[i].handle));
+    output.print('\t');
+    output.print(tasks[i].stackSize);
+    output.print('\t');
+    output.print(tasks[i].stackSize - minFree);
+    output.print("\t\t");
+    output.println(minFree);
+  }
+  output.print("HEAP free: ");
+  output.print(heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  output.print(", min free: ");
+  output.print(heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+  output.print(", largest block: ");
+  output.println(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
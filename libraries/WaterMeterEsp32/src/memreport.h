@@ -0,0 +1,24 @@
+#pragma once
+
+#define MEM_REPORT_MAX_TASKS    8
+
+/**
+ * @brief Runtime memory report: stack high-water mark of each registered task,
+ * current/minimum free heap, and largest free heap block.
+*/
+class MemReport
+{
+  private:
+    typedef struct
+    {
+      TaskHandle_t handle;
+      uint32_t stackSize; //bytes
+    }task_t;
+    task_t tasks[MEM_REPORT_MAX_TASKS];
+    uint8_t numOfTasks;
+
+  public:
+    MemReport(void);
+    bool AddTask(TaskHandle_t handle,uint32_t stackSize);
+    void Report(Print& output);
+};
@@ -0,0 +1,214 @@
+#include <Arduino.h>
+#include <string.h>
+#include "otp_table.h"
+
+/**
+ * @brief Compares two OTPs in constant time (i.e. the time taken doesn't
+ * depend on how many characters match).
+*/
+bool OtpTable::IsEqual(const char* otp1,const char* otp2)
+{
+  uint8_t diff = 0;
+  for(uint8_t i = 0; i < SIZE_OTP_ENTRY; i++)
+  {
+    diff |= (otp1[i] ^ otp2[i]);
+  }
+  return (diff == 0);
+}
+
+bool OtpTable::IsExpired(const entry_t* entry,uint32_t currentTime)
+{
+  return ((currentTime - entry->createdTime) >= lifetime);
+}
+
+OtpTable::entry_t* OtpTable::Find(uint16_t meterId,uint8_t userIndex)
+{
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    if(entries[i].isInUse && entries[i].meterId == meterId &&
+       entries[i].userIndex == userIndex)
+    {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Creates the table.
+ * @param capacity: Max number of pending OTPs.
+ * @param lifetimeMillis: Time after which a pending OTP expires.
+ * @param maxAttempts: Max number of verification attempts per OTP.
+*/
+OtpTable::OtpTable(uint8_t capacity,uint32_t lifetimeMillis,uint8_t maxAttempts)
+{
+  //Initialize private variables
+  mux = portMUX_INITIALIZER_UNLOCKED;
+  entries = new entry_t[capacity];
+  memset(entries,0,capacity * sizeof(entry_t));
+  this->capacity = capacity;
+  lifetime = lifetimeMillis;
+  this->maxAttempts = maxAttempts;
+}
+
+/**
+ * @brief Adds a pending recharge for a user (without an OTP). An existing
+ * entry for the same user is replaced. If the table is full, an expired
+ * entry (or the oldest one) is evicted.
+ * @param requestId: (optional) ID of the request, returned by Get().
+ * @return true if the entry was added, false if otherwise.
+*/
+bool OtpTable::Add(uint16_t meterId,uint8_t userIndex,uint32_t units,uint32_t requestId)
+{
+  uint32_t currentTime = millis();
+  portENTER_CRITICAL(&mux);
+  entry_t* entry = OtpTable::Find(meterId,userIndex);
+  if(entry == NULL)
+  {
+    entry_t* oldest = NULL;
+    for(uint8_t i = 0; i < capacity; i++)
+    {
+      if(!entries[i].isInUse || OtpTable::IsExpired(&entries[i],currentTime))
+      {
+        entry = &entries[i];
+        break;
+      }
+      if(oldest == NULL ||
+         (currentTime - entries[i].createdTime) > (currentTime - oldest->createdTime))
+      {
+        oldest = &entries[i];
+      }
+    }
+    if(entry == NULL)
+    {
+      entry = oldest;
+    }
+  }
+  if(entry != NULL)
+  {
+    memset(entry,0,sizeof(entry_t));
+    entry->meterId = meterId;
+    entry->userIndex = userIndex;
+    entry->attemptsLeft = maxAttempts;
+    entry->units = units;
+    entry->requestId = requestId;
+    entry->createdTime = currentTime;
+    entry->isInUse = true;
+  }
+  portEXIT_CRITICAL(&mux);
+  return (entry != NULL);
+}
+
+/**
+ * @brief Sets the OTP of a pending recharge and restarts its lifetime.
+ * @return true if successful, false if there's no pending recharge for the user.
+*/
+bool OtpTable::SetOtp(uint16_t meterId,uint8_t userIndex,const char* otp)
+{
+  portENTER_CRITICAL(&mux);
+  entry_t* entry = OtpTable::Find(meterId,userIndex);
+  if(entry != NULL)
+  {
+    memset(entry->otp,'\0',SIZE_OTP_ENTRY);
+    strncpy(entry->otp,otp,SIZE_OTP_ENTRY - 1);
+    entry->attemptsLeft = maxAttempts;
+    entry->createdTime = millis();
+  }
+  portEXIT_CRITICAL(&mux);
+  return (entry != NULL);
+}
+
+/**
+ * @brief Gets a copy of an unexpired pending recharge.
+ * @return true if found, false if otherwise.
+*/
+bool OtpTable::Get(uint16_t meterId,uint8_t userIndex,entry_t* entryPtr)
+{
+  bool isFound = false;
+  portENTER_CRITICAL(&mux);
+  entry_t* entry = OtpTable::Find(meterId,userIndex);
+  if(entry != NULL && !OtpTable::IsExpired(entry,millis()))
+  {
+    *entryPtr = *entry;
+    isFound = true;
+  }
+  portEXIT_CRITICAL(&mux);
+  return isFound;
+}
+
+/**
+ * @brief Verifies an OTP entered by a user. The entry is removed if the OTP
+ * is valid, has expired, or if the user has run out of attempts.
+ * @param unitsPtr: Stores the units of the recharge if the OTP is valid.
+ * @return Status of the verification.
+*/
+OtpTable::Status OtpTable::Verify(uint16_t meterId,uint8_t userIndex,
+                                  const char* otp,uint32_t* unitsPtr)
+{
+  char otpEntered[SIZE_OTP_ENTRY] = {0};
+  strncpy(otpEntered,otp,SIZE_OTP_ENTRY - 1);
+  Status status;
+
+  portENTER_CRITICAL(&mux);
+  entry_t* entry = OtpTable::Find(meterId,userIndex);
+  if(entry == NULL || entry->otp[0] == '\0')
+  {
+    status = OTP_NOT_FOUND;
+  }
+  else if(OtpTable::IsExpired(entry,millis()))
+  {
+    entry->isInUse = false;
+    status = OTP_EXPIRED;
+  }
+  else if(OtpTable::IsEqual(entry->otp,otpEntered))
+  {
+    *unitsPtr = entry->units;
+    entry->isInUse = false;
+    status = OTP_VALID;
+  }
+  else
+  {
+    entry->attemptsLeft--;
+    if(entry->attemptsLeft == 0)
+    {
+      entry->isInUse = false;
+      status = OTP_LOCKED;
+    }
+    else
+    {
+      status = OTP_INVALID;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  return status;
+}
+
+void OtpTable::Remove(uint16_t meterId,uint8_t userIndex)
+{
+  portENTER_CRITICAL(&mux);
+  entry_t* entry = OtpTable::Find(meterId,userIndex);
+  if(entry != NULL)
+  {
+    entry->isInUse = false;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+/**
+ * @brief Gets the number of unexpired pending recharges.
+*/
+uint8_t OtpTable::GetNumOfPending(void)
+{
+  uint8_t count = 0;
+  uint32_t currentTime = millis();
+  portENTER_CRITICAL(&mux);
+  for(uint8_t i = 0; i < capacity; i++)
+  {
+    if(entries[i].isInUse && !OtpTable::IsExpired(&entries[i],currentTime))
+    {
+      count++;
+    }
+  }
+  portEXIT_CRITICAL(&mux);
+  return count;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+enum {SIZE_OTP_ENTRY = 11}; //includes NULL
+
+/**
+ * @brief Table of pending OTPs (one per recharge request) keyed by
+ * meter ID and user index.
+ *
+ * Each entry expires after a fixed lifetime and allows a bounded number of
+ * verification attempts. OTPs are compared in constant time.
+ * All methods are thread-safe and never block (short critical sections).
+*/
+class OtpTable
+{
+  public:
+    enum Status
+    {
+      OTP_VALID = 0,
+      OTP_INVALID,   //wrong OTP (attempts left)
+      OTP_LOCKED,    //wrong OTP (no attempts left, entry removed)
+      OTP_EXPIRED,
+      OTP_NOT_FOUND
+    };
+    typedef struct
+    {
+      uint16_t meterId;
+      uint8_t userIndex;
+      uint8_t attemptsLeft;
+      uint32_t units;
+      uint32_t requestId; //set by the caller (e.g. to recognise resent requests)
+      uint32_t createdTime; //millis
+      char otp[SIZE_OTP_ENTRY];
+      bool isInUse;
+    }entry_t;
+
+  private:
+    portMUX_TYPE mux;
+    entry_t* entries;
+    uint8_t capacity;
+    uint32_t lifetime;
+    uint8_t maxAttempts;
+
+    static bool IsEqual(const char* otp1,const char* otp2);
+    bool IsExpired(const entry_t* entry,uint32_t currentTime);
+    entry_t* Find(uint16_t meterId,uint8_t userIndex);
+
+  public:
+    OtpTable(uint8_t capacity,
+             uint32_t lifetimeMillis = 300000,
+             uint8_t maxAttempts = 3);
+    bool Add(uint16_t meterId,uint8_t userIndex,uint32_t units,uint32_t requestId = 0);
+    bool SetOtp(uint16_t meterId,uint8_t userIndex,const char* otp);
+    bool Get(uint16_t meterId,uint8_t userIndex,entry_t* entryPtr);
+    Status Verify(uint16_t meterId,uint8_t userIndex,
+                  const char* otp,uint32_t* unitsPtr);
+    void Remove(uint16_t meterId,uint8_t userIndex);
+    uint8_t GetNumOfPending(void);
+};
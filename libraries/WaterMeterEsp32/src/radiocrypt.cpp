@@ -0,0 +1,181 @@
+#include <Arduino.h>
+#include <string.h>
+#include <mbedtls/ccm.h>
+#include <mbedtls/md.h>
+#include "radiocrypt.h"
+
+#define RADIO_NONCE_SIZE    13
+
+void RadioCrypto::MakeNonce(RadioDirection direction,const radio_frame_t* frame,uint8_t* nonce)
+{
+  memset(nonce,0,RADIO_NONCE_SIZE);
+  memcpy(nonce,&frame->meterId,sizeof(frame->meterId));
+  nonce[2] = direction;
+  memcpy(&nonce[3],&frame->counter,sizeof(frame->counter));
+}
+
+RadioCrypto::RadioCrypto(void)
+{
+  //Initialize private variables
+  mbedtls_ccm_init(&ccm);
+  hasKey = false;
+  numOfOps = 0;
+  totalMicros = 0;
+}
+
+RadioCrypto::~RadioCrypto(void)
+{
+  mbedtls_ccm_free(&ccm);
+}
+
+/**
+ * @brief Derives the key of a meter from the site key 
+ * (first 16 bytes of HMAC-SHA256(siteKey,"meter" + meterId)).
+ * @return true if successful, false if otherwise.
+*/
+bool RadioCrypto::DeriveKey(const uint8_t* siteKey,uint16_t meterId,uint8_t* key)
+{
+  uint8_t input[7] = {'m','e','t','e','r'};
+  uint8_t digest[32];
+  memcpy(&input[5],&meterId,sizeof(meterId));
+  const mbedtls_md_info_t* sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  if(mbedtls_md_hmac(sha256,siteKey,RADIO_KEY_SIZE,input,sizeof(input),digest) != 0)
+  {
+    return false;
+  }
+  memcpy(key,digest,RADIO_KEY_SIZE);
+  memset(digest,0,sizeof(digest));
+  return true;
+}
+
+bool RadioCrypto::SetKey(const uint8_t* key)
+{
+  hasKey = (mbedtls_ccm_setkey(&ccm,MBEDTLS_CIPHER_ID_AES,key,RADIO_KEY_SIZE * 8) == 0);
+  return hasKey;
+}
+
+/**
+ * @brief Encrypts and authenticates a message into a frame.
+ * @param counter: Must be greater than the counter of the sender's previous frame.
+ * @return true if successful, false if otherwise (no key or message too long).
+*/
+bool RadioCrypto::Seal(RadioDirection direction,uint16_t meterId,uint32_t counter,
+                       const void* message,uint8_t messageSize,radio_frame_t* frame)
+{
+  if(!hasKey || messageSize > RADIO_MAX_PLAINTEXT)
+  {
+    return false;
+  }
+  uint32_t startTime = micros();
+  uint8_t plaintext[RADIO_MAX_PLAINTEXT] = {0};
+  uint8_t nonce[RADIO_NONCE_SIZE];
+  memcpy(plaintext,message,messageSize);
+  frame->meterId = meterId;
+  frame->counter = counter;
+  RadioCrypto::MakeNonce(direction,frame,nonce);
+  int err = mbedtls_ccm_encrypt_and_tag(&ccm,RADIO_MAX_PLAINTEXT,nonce,RADIO_NONCE_SIZE,
+                                        (const uint8_t*)frame,RADIO_HEADER_SIZE,
+                                        plaintext,frame->ciphertext,
+                                        frame->tag,RADIO_TAG_SIZE);
+  totalMicros += micros() - startTime;
+  numOfOps++;
+  return (err == 0);
+}
+
+/**
+ * @brief Authenticates and decrypts a frame (replays must be checked 
+ * separately with the frame's counter).
+ * @param message: Buffer of RADIO_MAX_PLAINTEXT bytes.
+ * @return true if the frame is authentic, false if otherwise.
+*/
+bool RadioCrypto::Open(RadioDirection direction,const radio_frame_t* frame,void* message)
+{
+  if(!hasKey)
+  {
+    return false;
+  }
+  uint32_t startTime = micros();
+  uint8_t nonce[RADIO_NONCE_SIZE];
+  RadioCrypto::MakeNonce(direction,frame,nonce);
+  int err = mbedtls_ccm_auth_decrypt(&ccm,RADIO_MAX_PLAINTEXT,nonce,RADIO_NONCE_SIZE,
+                                     (const uint8_t*)frame,RADIO_HEADER_SIZE,
+                                     frame->ciphertext,(uint8_t*)message,
+                                     frame->tag,RADIO_TAG_SIZE);
+  totalMicros += micros() - startTime;
+  numOfOps++;
+  return (err == 0);
+}
+
+/**
+ * @brief Gets the mean time taken to seal/open a frame.
+*/
+uint32_t RadioCrypto::GetMeanMicros(void)
+{
+  return (numOfOps > 0) ? (totalMicros / numOfOps) : 0;
+}
+
+ReplayGuard::entry_t* ReplayGuard::Find(uint16_t meterId)
+{
+  for(uint16_t i = 0; i < capacity; i++)
+  {
+    if(entries[i].isInUse && entries[i].meterId == meterId)
+    {
+      return &entries[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @param capacity: Max number of senders tracked.
+*/
+ReplayGuard::ReplayGuard(uint16_t capacity)
+{
+  //Initialize private variables
+  entries = new entry_t[capacity];
+  memset(entries,0,capacity * sizeof(entry_t));
+  this->capacity = capacity;
+  next = 0;
+}
+
+bool ReplayGuard::IsKnown(uint16_t meterId)
+{
+  return (ReplayGuard::Find(meterId) != NULL);
+}
+
+/**
+ * @return true if the counter is greater than the last one accepted from 
+ * the sender (or the sender is unknown), false if otherwise.
+*/
+bool ReplayGuard::IsFresh(uint16_t meterId,uint32_t counter)
+{
+  entry_t* entry = ReplayGuard::Find(meterId);
+  return (entry == NULL || counter > entry->lastCounter);
+}
+
+/**
+ * @brief Records the counter of an authentic frame.
+*/
+void ReplayGuard::Accept(uint16_t meterId,uint32_t counter)
+{
+  entry_t* entry = ReplayGuard::Find(meterId);
+  if(entry == NULL)
+  {
+    for(uint16_t i = 0; i < capacity; i++)
+    {
+      if(!entries[i].isInUse)
+      {
+        entry = &entries[i];
+        break;
+      }
+    }
+    if(entry == NULL)
+    {
+      entry = &entries[next];
+      next = (next + 1) % capacity;
+    }
+    entry->meterId = meterId;
+    entry->isInUse = true;
+  }
+  entry->lastCounter = counter;
+}
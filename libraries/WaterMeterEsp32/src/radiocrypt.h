@@ -0,0 +1,80 @@
+#pragma once
+
+#include <mbedtls/ccm.h>
+
+#define RADIO_KEY_SIZE          16 //AES-128
+#define RADIO_TAG_SIZE          8
+#define RADIO_PAYLOAD_SIZE      32 //nRF24 max payload
+#define RADIO_HEADER_SIZE       6
+#define RADIO_MAX_PLAINTEXT     (RADIO_PAYLOAD_SIZE - RADIO_HEADER_SIZE - RADIO_TAG_SIZE)
+
+enum RadioDirection
+{
+  RADIO_UPLINK = 0, //master -> utility
+  RADIO_DOWNLINK    //utility -> master
+};
+
+//Encrypted frame (always RADIO_PAYLOAD_SIZE bytes)
+typedef struct __attribute__((packed))
+{
+  uint16_t meterId; //selects the key
+  uint32_t counter; //never reused by a sender (nonce and replay protection)
+  uint8_t ciphertext[RADIO_MAX_PLAINTEXT];
+  uint8_t tag[RADIO_TAG_SIZE];
+}radio_frame_t;
+
+/**
+ * @brief AES-128-CCM framing of radio messages (hardware AES through mbedtls).
+ *
+ * The header (meter ID, counter) is authenticated but not encrypted. The
+ * 13-byte nonce is made from the meter ID, the direction and the counter,
+ * so a key never encrypts two frames with the same nonce as long as each 
+ * sender uses increasing counters. Messages are padded to RADIO_MAX_PLAINTEXT.
+ * Each meter has its own key, derived by the utility from a site key.
+*/
+class RadioCrypto
+{
+  private:
+    mbedtls_ccm_context ccm;
+    bool hasKey;
+    uint32_t numOfOps;
+    uint32_t totalMicros;
+
+    static void MakeNonce(RadioDirection direction,const radio_frame_t* frame,uint8_t* nonce);
+
+  public:
+    RadioCrypto(void);
+    ~RadioCrypto(void);
+    static bool DeriveKey(const uint8_t* siteKey,uint16_t meterId,uint8_t* key);
+    bool SetKey(const uint8_t* key);
+    bool Seal(RadioDirection direction,uint16_t meterId,uint32_t counter,
+              const void* message,uint8_t messageSize,radio_frame_t* frame);
+    bool Open(RadioDirection direction,const radio_frame_t* frame,void* message);
+    uint32_t GetMeanMicros(void);
+};
+
+/**
+ * @brief Last counter accepted from each sender. Frames whose counter isn't
+ * greater are replays (or reordered) and must be dropped.
+*/
+class ReplayGuard
+{
+  private:
+    typedef struct
+    {
+      uint16_t meterId;
+      bool isInUse;
+      uint32_t lastCounter;
+    }entry_t;
+    entry_t* entries;
+    uint16_t capacity;
+    uint16_t next; //replaced when full (round robin)
+
+    entry_t* Find(uint16_t meterId);
+
+  public:
+    ReplayGuard(uint16_t capacity);
+    bool IsKnown(uint16_t meterId);
+    bool IsFresh(uint16_t meterId,uint32_t counter);
+    void Accept(uint16_t meterId,uint32_t counter);
+};
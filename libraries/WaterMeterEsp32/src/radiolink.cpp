@@ -0,0 +1,437 @@
+#include <Arduino.h>
+#include <nRF24L01.h>
+#include <RF24.h> //Version 1.4.6
+#include "radiolink.h"
+#include "numfmt.h"
+
+typedef struct
+{
+  uint8_t channel;
+  rf24_datarate_e dataRate;
+}profile_t;
+
+//Profile 0 matches the library defaults (channel 76, 1Mbps)
+static const profile_t profiles[RADIO_NUM_OF_PROFILES] = 
+{
+  {76,RF24_1MBPS},{76,RF24_250KBPS},
+  {100,RF24_1MBPS},{100,RF24_250KBPS},
+  {40,RF24_1MBPS},{40,RF24_250KBPS}
+};
+
+void RadioLink::ApplyProfile(uint8_t profile)
+{
+  this->profile = profile % RADIO_NUM_OF_PROFILES;
+  radio->setChannel(profiles[this->profile].channel);
+  radio->setDataRate(profiles[this->profile].dataRate);
+  //An ACK (without payload) takes longer at 250kbps: min. retry delay is 500us
+  minRetryDelay = ((profiles[this->profile].dataRate == RF24_250KBPS) ? 1 : 0) + retryStagger;
+  RadioLink::ApplyPeer(&peers[0]);
+}
+
+void RadioLink::ApplyPeer(const peer_t* peer)
+{
+  uint8_t retryDelay = minRetryDelay + peer->retryBackoff;
+  if(retryDelay > RADIO_MAX_RETRY_DELAY)
+  {
+    retryDelay = RADIO_MAX_RETRY_DELAY;
+  }
+  radio->setPALevel(peer->paLevel);
+  radio->setRetries(retryDelay,15); //delay in 250us steps
+}
+
+RadioLink::peer_t* RadioLink::FindPeer(uint16_t peerId)
+{
+  for(uint8_t i = 0; i < RADIO_MAX_PEERS; i++)
+  {
+    if(peers[i].id == peerId)
+    {
+      return &peers[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Adds a peer (replaces the least recently written one if the table
+ * is full, never the default peer).
+*/
+RadioLink::peer_t* RadioLink::AddPeer(uint16_t peerId)
+{
+  peer_t* peer = &peers[1];
+  for(uint8_t i = 1; i < RADIO_MAX_PEERS; i++)
+  {
+    if(peers[i].id == RADIO_DEFAULT_PEER)
+    {//free slot
+      peer = &peers[i];
+      break;
+    }
+    if(peers[i].lastWrite < peer->lastWrite)
+    {
+      peer = &peers[i];
+    }
+  }
+  memset(peer,0,sizeof(peer_t));
+  peer->id = peerId;
+  peer->paLevel = RF24_PA_MAX; //start reliable, then step down
+  return peer;
+}
+
+/**
+ * @brief Adapts the PA level and the retry delay of a peer to the outcome
+ * of a write. Retries raise the PA first; retries at max PA are more likely
+ * collisions than a weak signal, so the retry delay is lengthened instead.
+ * Runs of first-attempt deliveries shorten the delay or lower the PA.
+*/
+void RadioLink::AdaptLink(peer_t* peer,bool isDelivered,uint8_t arc)
+{
+  int16_t sample = (isDelivered ? arc : 15) * 16;
+  peer->meanArc += (sample - peer->meanArc) / 16;
+  if(!isDelivered || arc >= RADIO_ARC_STEP_UP)
+  {
+    peer->cleanWrites = 0;
+    if(peer->paLevel < RF24_PA_MAX)
+    {
+      peer->paLevel++;
+    }
+    else if(peer->meanArc >= RADIO_ARC_BACKOFF * 16 && 
+            peer->retryBackoff < RADIO_MAX_RETRY_DELAY)
+    {
+      peer->retryBackoff = peer->retryBackoff * 2 + 1;
+      peer->meanArc = 0; //judge the new delay on its own
+    }
+    return;
+  }
+  if(arc > 0 || peer->cleanWrites == 0xFF)
+  {
+    return;
+  }
+  peer->cleanWrites++;
+  if(peer->retryBackoff > 0)
+  {
+    if(peer->cleanWrites >= RADIO_BACKOFF_DECAY)
+    {
+      peer->retryBackoff /= 2;
+      peer->cleanWrites = 0;
+    }
+  }
+  else if(peer->cleanWrites >= RADIO_PA_STEP_DOWN && peer->paLevel > RF24_PA_MIN)
+  {
+    peer->paLevel--;
+    peer->cleanWrites = 0;
+  }
+}
+
+bool RadioLink::WriteOnce(peer_t* peer,const void* data,uint8_t size)
+{
+  if(radio->testRPD())
+  {
+    stats.numOfBusyWrites++; //strong signal on the channel while listening
+  }
+  radio->stopListening();
+  bool isDelivered = radio->write(data,size);
+  uint8_t arc = radio->getARC();
+  radio->startListening();
+  
+  stats.numOfWrites++;
+  stats.numOfRetries += arc;
+  peer->numOfWrites++;
+  peer->numOfRetries += arc;
+  peer->lastWrite = stats.numOfWrites;
+  if(!isDelivered)
+  {
+    stats.numOfFailures++;
+    peer->numOfFailures++;
+  }
+  lastArc = isDelivered ? arc : 0xFF;
+  return isDelivered;
+}
+
+RadioLink::RadioLink(RF24* radio)
+{
+  //Initialize private variables
+  this->radio = radio;
+  memset(&stats,0,sizeof(stats));
+  memset(peers,0,sizeof(peers));
+  for(uint8_t i = 0; i < RADIO_MAX_PEERS; i++)
+  {
+    peers[i].id = RADIO_DEFAULT_PEER;
+    peers[i].paLevel = RF24_PA_MAX;
+  }
+  profile = 0;
+  minRetryDelay = 0;
+  retryStagger = 0;
+  lastArc = 0;
+  consecutiveFailures = 0;
+}
+
+/**
+ * @brief Initializes the radio (pipes must be opened by the caller).
+ * @param profile: Channel/data rate profile (0 to RADIO_NUM_OF_PROFILES - 1).
+ * @param nodeId: Staggers the retry delay of different nodes.
+ * @return true if the radio responds, false if otherwise.
+*/
+bool RadioLink::Begin(uint8_t profile,uint8_t nodeId)
+{
+  if(!radio->begin())
+  {
+    return false;
+  }
+  retryStagger = nodeId % 4;
+  RadioLink::ApplyProfile(profile);
+  return true;
+}
+
+/**
+ * @brief Writes a packet to a peer and updates the statistics, the PA level
+ * and the retry delay of the peer. A failed write is repeated while that
+ * raises the PA level. The radio is left listening.
+ * @param peerId: Peer (e.g. meter ID) if several are written to.
+ * @return true if acknowledged, false if otherwise.
+*/
+bool RadioLink::Write(const void* data,uint8_t size,uint16_t peerId)
+{
+  peer_t* peer = RadioLink::FindPeer(peerId);
+  if(peer == NULL)
+  {
+    peer = RadioLink::AddPeer(peerId);
+  }
+  bool isDelivered;
+  uint8_t paLevel;
+  do
+  {
+    paLevel = peer->paLevel;
+    RadioLink::ApplyPeer(peer);
+    isDelivered = RadioLink::WriteOnce(peer,data,size);
+    RadioLink::AdaptLink(peer,isDelivered,lastArc);
+  }while(!isDelivered && peer->paLevel > paLevel);
+  if(peer != &peers[0])
+  {
+    RadioLink::ApplyPeer(&peers[0]); //ACKs are sent at the default PA level
+  }
+  if(isDelivered)
+  {
+    consecutiveFailures = 0;
+  }
+  else if(consecutiveFailures < 0xFF)
+  {
+    consecutiveFailures++;
+  }
+  return isDelivered;
+}
+
+/**
+ * @brief Looks for the hub by writing a packet once with each profile
+ * (starting after the current one). Should be called after 
+ * RADIO_RECOVERY_FAILURES consecutive failures.
+ * @return true if a profile delivered the packet (it is kept), false if
+ * otherwise (the original profile is restored).
+*/
+bool RadioLink::Recover(const void* data,uint8_t size)
+{
+  uint8_t originalProfile = profile;
+  stats.numOfRecoveries++;
+  peers[0].paLevel = RF24_PA_MAX;
+  for(uint8_t i = 1; i < RADIO_NUM_OF_PROFILES; i++)
+  {
+    RadioLink::ApplyProfile(originalProfile + i);
+    if(RadioLink::WriteOnce(&peers[0],data,size))
+    {
+      consecutiveFailures = 0;
+      return true;
+    }
+  }
+  RadioLink::ApplyProfile(originalProfile);
+  return false;
+}
+
+/**
+ * @brief Reads a packet if one is available.
+ * @return true if a packet was read, false if otherwise.
+*/
+bool RadioLink::Read(void* data,uint8_t size)
+{
+  if(!radio->available())
+  {
+    return false;
+  }
+  radio->read(data,size);
+  stats.numOfReads++;
+  return true;
+}
+
+/**
+ * @brief Records whether a carrier is present on the channel (interference
+ * or traffic). Should be called periodically while listening.
+*/
+void RadioLink::SampleCarrier(void)
+{
+  stats.numOfCarrierSamples++;
+  if(radio->testRPD())
+  {
+    stats.numOfCarrierHits++;
+  }
+}
+
+/**
+ * @brief Finds the profile whose channel has the fewest carrier detections
+ * (sampled over a few milliseconds per channel). The current profile is 
+ * restored afterwards.
+ * @param isLowRate: true to return the 250kbps profile of the quietest channel.
+*/
+uint8_t RadioLink::FindQuietestProfile(bool isLowRate)
+{
+  const uint8_t numOfSamples = 20;
+  uint8_t bestProfile = 0;
+  uint8_t leastHits = 0xFF;
+  uint8_t originalProfile = profile;
+  
+  for(uint8_t i = 0; i < RADIO_NUM_OF_PROFILES; i++)
+  {
+    if((profiles[i].dataRate == RF24_250KBPS) != isLowRate)
+    {
+      continue;
+    }
+    radio->stopListening();
+    radio->setChannel(profiles[i].channel);
+    radio->startListening();
+    uint8_t hits = 0;
+    for(uint8_t j = 0; j < numOfSamples; j++)
+    {
+      delayMicroseconds(200); //RPD needs 170us of listening
+      hits += radio->testRPD();
+      radio->stopListening(); //restart listening to clear RPD
+      radio->startListening();
+    }
+    if(hits < leastHits)
+    {
+      leastHits = hits;
+      bestProfile = i;
+    }
+  }
+  radio->stopListening();
+  RadioLink::ApplyProfile(originalProfile);
+  radio->startListening();
+  return bestProfile;
+}
+
+void RadioLink::SetProfile(uint8_t profile)
+{
+  radio->stopListening();
+  RadioLink::ApplyProfile(profile);
+  radio->startListening();
+}
+
+uint8_t RadioLink::GetProfile(void)
+{
+  return profile;
+}
+
+/**
+ * @brief Gets the retries of the last write (0xFF if it failed). Nodes 
+ * report this to the hub, which uses it to choose the data rate.
+*/
+uint8_t RadioLink::GetLinkQuality(void)
+{
+  return lastArc;
+}
+
+uint8_t RadioLink::GetConsecutiveFailures(void)
+{
+  return consecutiveFailures;
+}
+
+/**
+ * @brief Records the link quality a peer reported (retries of its previous
+ * packet, 0xFF if it was lost).
+*/
+void RadioLink::ReportQuality(uint16_t peerId,uint8_t arc)
+{
+  peer_t* peer = RadioLink::FindPeer(peerId);
+  if(peer == NULL)
+  {
+    peer = RadioLink::AddPeer(peerId);
+  }
+  peer->reportedArc = arc;
+}
+
+/**
+ * @brief Gets the state and statistics of a peer.
+ * @return true if the peer is known, false if otherwise.
+*/
+bool RadioLink::GetPeer(uint16_t peerId,peer_t* peerPtr)
+{
+  peer_t* peer = RadioLink::FindPeer(peerId);
+  if(peer == NULL)
+  {
+    return false;
+  }
+  *peerPtr = *peer;
+  return true;
+}
+
+void RadioLink::GetStats(stats_t* statsPtr)
+{
+  *statsPtr = stats;
+}
+
+/**
+ * @brief Writes a summary of the link e.g.
+ * "ch:76 rate:0 pa:2 tx:120 fail:3 arc:0.41 busy:2 rx:118 scan:0 rpd:1.50%"
+ * (arc: mean retries per write, rpd: share of carrier samples).
+ * @return Length of the summary (excluding NULL).
+*/
+size_t RadioLink::GetReport(char* buffer,size_t bufferSize)
+{
+  stats_t s = stats; //word-sized fields (a torn read only skews the report)
+  StringBuilder report(buffer,bufferSize);
+  report.Append("ch:").AppendUnsigned(profiles[profile].channel)
+        .Append(" rate:").AppendUnsigned(profiles[profile].dataRate)
+        .Append(" pa:").AppendUnsigned(peers[0].paLevel)
+        .Append(" tx:").AppendUnsigned(s.numOfWrites)
+        .Append(" fail:").AppendUnsigned(s.numOfFailures)
+        .Append(" arc:").AppendFixed((s.numOfWrites > 0) ? 
+                                     (100ULL * s.numOfRetries / s.numOfWrites) : 0,2)
+        .Append(" busy:").AppendUnsigned(s.numOfBusyWrites)
+        .Append(" rx:").AppendUnsigned(s.numOfReads)
+        .Append(" scan:").AppendUnsigned(s.numOfRecoveries)
+        .Append(" rpd:").AppendFixed((s.numOfCarrierSamples > 0) ? 
+                                     (10000ULL * s.numOfCarrierHits / s.numOfCarrierSamples) : 0,2)
+        .Append('%');
+  return report.GetLength();
+}
+
+/**
+ * @brief Writes one line per peer e.g.
+ * "id:12 pa:1 delay:0 arc:0.25 tx:40 fail:0 up:1" (delay: retry backoff in
+ * 250us steps, arc: mean retries per write, up: quality the peer reported).
+ * Peers that don't fit are left out.
+ * @return Length of the report (excluding NULL).
+*/
+size_t RadioLink::GetPeerReport(char* buffer,size_t bufferSize)
+{
+  StringBuilder report(buffer,bufferSize);
+  for(uint8_t i = 0; i < RADIO_MAX_PEERS; i++)
+  {
+    peer_t peer = peers[i];
+    if(peer.id == RADIO_DEFAULT_PEER && peer.numOfWrites == 0)
+    {
+      continue;
+    }
+    size_t len = report.GetLength();
+    report.Append("id:").AppendUnsigned(peer.id)
+          .Append(" pa:").AppendUnsigned(peer.paLevel)
+          .Append(" delay:").AppendUnsigned(peer.retryBackoff)
+          .Append(" arc:").AppendFixed((peer.numOfWrites > 0) ? 
+                                       (100ULL * peer.numOfRetries / peer.numOfWrites) : 0,2)
+          .Append(" tx:").AppendUnsigned(peer.numOfWrites)
+          .Append(" fail:").AppendUnsigned(peer.numOfFailures)
+          .Append(" up:").AppendUnsigned(peer.reportedArc)
+          .Append('\n');
+    if(report.IsTruncated())
+    {
+      buffer[len] = '\0'; //drop the partial line
+      return len;
+    }
+  }
+  return report.GetLength();
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#define RADIO_NUM_OF_PROFILES     6
+#define RADIO_RECOVERY_FAILURES   3 //consecutive failed writes (at max PA) before a scan
+#define RADIO_PA_STEP_DOWN        20 //consecutive first-attempt deliveries before lowering PA
+#define RADIO_ARC_STEP_UP         3 //retries (of a delivered packet) that raise PA
+#define RADIO_ARC_BACKOFF         2 //mean retries (at max PA) that lengthen the retry delay
+#define RADIO_BACKOFF_DECAY       200 //first-attempt deliveries before shortening the delay
+#define RADIO_MAX_RETRY_DELAY     15 //250us steps (nRF24 ARD register)
+#define RADIO_MAX_PEERS           16 //peers with their own PA level and statistics
+#define RADIO_DEFAULT_PEER        0xFFFF //peer of writes without an ID
+
+/**
+ * @brief nRF24 link layer with statistics and adaptation.
+ *
+ * Each write records the auto-retransmit count (ARC), delivery failures and
+ * whether a carrier was detected (RPD) while listening beforehand.
+ * The transmitter adapts on its own, separately for each peer (the hub
+ * writes to meters at different distances):
+ * - PA level: lowered after a run of first-attempt deliveries, raised on
+ *   retries or failures (the lowest power that still delivers).
+ * - Retry delay: chosen for the data rate and staggered by node ID so that
+ *   nodes whose packets collide don't retry in lockstep. If the mean ARC
+ *   stays high at max PA (collisions rather than a weak signal), the delay
+ *   is lengthened; it shrinks again after a long run of first-attempt
+ *   deliveries. Retry count is max.
+ * A write that fails is repeated (at most once per PA step) if the PA level
+ * was raised, so probing a lower level doesn't cost a packet.
+ * The radio ACKs received packets at the PA level of the default peer, which
+ * is restored after writing to another peer.
+ * Channel and data rate must match at both ends so they come from a table of
+ * profiles known to both. The hub (utility) picks the profile (quietest
+ * channel, lower rate if links are poor) and nodes (masters) find it by
+ * scanning the profiles after repeated failures (Recover()).
+*/
+class RadioLink
+{
+  public:
+    typedef struct
+    {
+      uint32_t numOfWrites;
+      uint32_t numOfFailures;
+      uint32_t numOfRetries; //sum of ARC
+      uint32_t numOfBusyWrites; //carrier detected before writing
+      uint32_t numOfReads;
+      uint32_t numOfRecoveries; //profile scans
+      uint32_t numOfCarrierSamples;
+      uint32_t numOfCarrierHits;
+    }stats_t;
+
+    typedef struct
+    {
+      uint16_t id;
+      uint8_t paLevel;
+      uint8_t retryBackoff; //added to the retry delay (250us steps)
+      uint8_t meanArc; //moving average (x16, failures count as 15)
+      uint8_t reportedArc; //link quality reported by the peer (0xFF: lost)
+      uint8_t cleanWrites; //consecutive first-attempt deliveries
+      uint32_t lastWrite; //stats.numOfWrites at the last write (replacement)
+      uint32_t numOfWrites;
+      uint32_t numOfFailures;
+      uint32_t numOfRetries;
+    }peer_t;
+
+  private:
+    RF24* radio;
+    stats_t stats;
+    peer_t peers[RADIO_MAX_PEERS]; //[0]: default peer
+    uint8_t profile;
+    uint8_t minRetryDelay; //for the data rate, staggered by node ID
+    uint8_t retryStagger;
+    uint8_t lastArc;
+    uint8_t consecutiveFailures;
+
+    void ApplyProfile(uint8_t profile);
+    void ApplyPeer(const peer_t* peer);
+    peer_t* FindPeer(uint16_t peerId);
+    peer_t* AddPeer(uint16_t peerId);
+    void AdaptLink(peer_t* peer,bool isDelivered,uint8_t arc);
+    bool WriteOnce(peer_t* peer,const void* data,uint8_t size);
+
+  public:
+    RadioLink(RF24* radio);
+    bool Begin(uint8_t profile,uint8_t nodeId);
+    bool Write(const void* data,uint8_t size,uint16_t peerId = RADIO_DEFAULT_PEER);
+    bool Recover(const void* data,uint8_t size);
+    bool Read(void* data,uint8_t size);
+    void SampleCarrier(void);
+    uint8_t FindQuietestProfile(bool isLowRate);
+    void SetProfile(uint8_t profile);
+    uint8_t GetProfile(void);
+    uint8_t GetLinkQuality(void);
+    uint8_t GetConsecutiveFailures(void);
+    void ReportQuality(uint16_t peerId,uint8_t arc);
+    bool GetPeer(uint16_t peerId,peer_t* peerPtr);
+    void GetStats(stats_t* statsPtr);
+    size_t GetReport(char* buffer,size_t bufferSize);
+    size_t GetPeerReport(char* buffer,size_t bufferSize);
+};
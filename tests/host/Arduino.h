@@ -0,0 +1,112 @@
+#pragma once
+/*
+ * Host (Linux) stand-in for the parts of the Arduino/ESP32 core used by the
+ * modules under test. Time is simulated: the tests set it with SetMillis()
+ * and AdvanceMillis(). FreeRTOS primitives map to std::mutex/yield (a test
+ * running on simulated time can make vTaskDelay() advance it instead).
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <mutex>
+#include <thread>
+
+typedef uint8_t byte;
+
+#define HIGH    1
+#define LOW     0
+#define INPUT   0
+#define OUTPUT  1
+
+//Simulated time
+extern uint32_t hostMillis;
+extern uint32_t hostMicros;
+static inline uint32_t millis(void) { return hostMillis; }
+static inline uint32_t micros(void) { return hostMicros; }
+static inline void SetMillis(uint32_t ms) { hostMillis = ms; hostMicros = ms * 1000; }
+static inline void AdvanceMillis(uint32_t ms) { SetMillis(hostMillis + ms); }
+static inline void delay(uint32_t ms) { AdvanceMillis(ms); }
+static inline void delayMicroseconds(uint32_t us) { hostMicros += us; }
+
+//Simulated GPIO (tests drive the pins)
+extern uint8_t hostPins[64];
+static inline void pinMode(uint8_t pin,uint8_t mode) { (void)pin; (void)mode; }
+static inline int digitalRead(uint8_t pin) { return hostPins[pin]; }
+static inline void digitalWrite(uint8_t pin,uint8_t val) { hostPins[pin] = val; }
+
+//FreeRTOS
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef std::recursive_mutex* SemaphoreHandle_t;
+#define pdTRUE          1
+#define pdFALSE         0
+#define pdPASS          1
+#define portMAX_DELAY   0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) (ms)
+extern void (*hostDelayHook)(uint32_t ms);
+static inline void vTaskDelay(TickType_t ticks)
+{
+  if(hostDelayHook != NULL)
+  {
+    hostDelayHook(ticks);
+    return;
+  }
+  std::this_thread::yield();
+}
+#define taskYIELD() std::this_thread::yield()
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void) { return new std::recursive_mutex; }
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t m,TickType_t ticks) { (void)ticks; m->lock(); return pdTRUE; }
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t m) { m->unlock(); return pdTRUE; }
+
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;
+typedef struct { int dummy; } StaticTask_t;
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+static inline void xTaskNotifyGive(TaskHandle_t task) { (void)task; }
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear,TickType_t ticks) { return 0; }
+static inline TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function,const char* name,
+  uint32_t stackSize,void* parameters,UBaseType_t priority,StackType_t* stack,
+  StaticTask_t* task,BaseType_t core) { return NULL; } //tasks aren't run on the host
+
+//Critical sections: one global lock (the modules only use them for short sections)
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+extern std::recursive_mutex hostCriticalLock;
+#define portENTER_CRITICAL(mux) do{ (void)(mux); hostCriticalLock.lock(); }while(0)
+#define portEXIT_CRITICAL(mux) do{ (void)(mux); hostCriticalLock.unlock(); }while(0)
+
+//Serial (stdout)
+class Print
+{
+  public:
+    virtual ~Print(void) {}
+    virtual size_t write(uint8_t c) { return fwrite(&c,1,1,stdout); }
+    virtual size_t write(const uint8_t* buf,size_t size) { return fwrite(buf,1,size,stdout); }
+    size_t write(const char* str) { return write((const uint8_t*)str,strlen(str)); }
+    size_t print(const char* str) { return write((const uint8_t*)str,strlen(str)); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long n) { return printf("%ld",n); }
+    size_t print(unsigned long n) { return printf("%lu",n); }
+    size_t print(int n) { return print((long)n); }
+    size_t print(unsigned int n) { return print((unsigned long)n); }
+    size_t print(double n,int digits = 2) { return printf("%.*f",digits,n); }
+    size_t println(void) { return print("\n"); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    size_t printf(const char* format,...) __attribute__((format(printf,2,3)));
+};
+
+#define SERIAL_8N1  0x800001c
+
+class HardwareSerial : public Print
+{
+  public:
+    void begin(uint32_t baud) { (void)baud; }
+    void begin(uint32_t baud,uint32_t config,int8_t rxPin = -1,int8_t txPin = -1) { (void)baud; }
+    virtual int available(void) { return 0; }
+    virtual int read(void) { return -1; }
+};
+
+extern HardwareSerial Serial;
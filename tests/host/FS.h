@@ -0,0 +1,111 @@
+#pragma once
+/*
+ * In-memory stand-in for the ESP32 filesystem API (LittleFS). Writes can be
+ * made to fail after a number of bytes (full flash / power loss), and reads
+ * and writes can be slowed down to the speed of flash. Thread-safe (one lock
+ * for the filesystem, as LittleFS).
+*/
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs
+{
+typedef std::vector<uint8_t> data_t;
+
+inline std::recursive_mutex fsLock;
+inline uint32_t fsAccessDelayUs = 0; //per read/write call
+
+static inline void FsAccessDelay(void)
+{
+  if(fsAccessDelayUs != 0)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(fsAccessDelayUs));
+  }
+}
+
+class File
+{
+  private:
+    std::shared_ptr<data_t> data;
+    size_t position;
+    size_t* writeBudget;
+
+  public:
+    File(void) : position(0), writeBudget(NULL) {}
+    File(std::shared_ptr<data_t> data,size_t position,size_t* writeBudget) :
+      data(data), position(position), writeBudget(writeBudget) {}
+    operator bool(void) const { return (data != NULL); }
+    size_t read(uint8_t* buf,size_t size)
+    {
+      std::lock_guard<std::recursive_mutex> lock(fsLock);
+      FsAccessDelay();
+      size_t n = std::min(size,data->size() - position);
+      memcpy(buf,data->data() + position,n);
+      position += n;
+      return n;
+    }
+    size_t write(const uint8_t* buf,size_t size)
+    {
+      std::lock_guard<std::recursive_mutex> lock(fsLock);
+      FsAccessDelay();
+      size_t n = std::min(size,*writeBudget);
+      *writeBudget -= n;
+      if(data->size() < position + n)
+      {
+        data->resize(position + n);
+      }
+      memcpy(data->data() + position,buf,n);
+      position += n;
+      return n;
+    }
+    int available(void) { std::lock_guard<std::recursive_mutex> lock(fsLock); return data->size() - position; }
+    bool seek(size_t pos) { std::lock_guard<std::recursive_mutex> lock(fsLock); position = std::min(pos,data->size()); return true; }
+    size_t size(void) { std::lock_guard<std::recursive_mutex> lock(fsLock); return data->size(); }
+    void close(void) { std::lock_guard<std::recursive_mutex> lock(fsLock); data.reset(); }
+};
+
+class FS
+{
+  public:
+    std::map<std::string,std::shared_ptr<data_t>> files;
+    size_t writeBudget = SIZE_MAX; //bytes that can still be written
+
+    File open(const char* path,const char* mode)
+    {
+      std::lock_guard<std::recursive_mutex> lock(fsLock);
+      auto it = files.find(path);
+      if(mode[0] == 'r')
+      {
+        return (it == files.end()) ? File() : File(it->second,0,&writeBudget);
+      }
+      if(it == files.end() || mode[0] == 'w')
+      {
+        files[path] = std::make_shared<data_t>();
+      }
+      std::shared_ptr<data_t> data = files[path];
+      return File(data,(mode[0] == 'a') ? data->size() : 0,&writeBudget);
+    }
+    bool exists(const char* path) { std::lock_guard<std::recursive_mutex> lock(fsLock); return files.count(path) > 0; }
+    bool remove(const char* path) { std::lock_guard<std::recursive_mutex> lock(fsLock); return files.erase(path) > 0; }
+    bool rename(const char* from,const char* to)
+    {
+      std::lock_guard<std::recursive_mutex> lock(fsLock);
+      auto it = files.find(from);
+      if(it == files.end())
+      {
+        return false;
+      }
+      files[to] = it->second; //replaces 'to' (as LittleFS does)
+      files.erase(from);
+      return true;
+    }
+};
+}
+
+using fs::FS;
+using fs::File;
@@ -0,0 +1,61 @@
+#pragma once
+/*
+ * In-memory fake of the ESP32 Preferences (NVS) library for host tests.
+*/
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class Preferences
+{
+  private:
+    std::map<std::string,std::vector<uint8_t>> values;
+
+    template<typename T> size_t Put(const char* key,T value)
+    {
+      return putBytes(key,&value,sizeof(value));
+    }
+    template<typename T> T Get(const char* key,T defaultValue)
+    {
+      T value;
+      return (getBytes(key,&value,sizeof(value)) == sizeof(value)) ? value : defaultValue;
+    }
+
+  public:
+    uint32_t numOfWrites = 0;
+
+    bool begin(const char* name,bool isReadOnly = false) {return true;}
+    void end(void) {}
+    bool clear(void) {values.clear(); return true;}
+    bool remove(const char* key) {return values.erase(key) > 0;}
+    bool isKey(const char* key) {return values.count(key) > 0;}
+    size_t putBytes(const char* key,const void* value,size_t len)
+    {
+      values[key].assign((const uint8_t*)value,(const uint8_t*)value + len);
+      numOfWrites++;
+      return len;
+    }
+    size_t getBytesLength(const char* key)
+    {
+      return isKey(key) ? values[key].size() : 0;
+    }
+    size_t getBytes(const char* key,void* buf,size_t maxLen)
+    {
+      size_t len = getBytesLength(key);
+      if(len == 0 || len > maxLen)
+      {
+        return 0;
+      }
+      memcpy(buf,values[key].data(),len);
+      return len;
+    }
+    size_t putUChar(const char* key,uint8_t value) {return Put(key,value);}
+    size_t putUShort(const char* key,uint16_t value) {return Put(key,value);}
+    size_t putULong(const char* key,uint32_t value) {return Put(key,value);}
+    size_t putLong(const char* key,int32_t value) {return Put(key,value);}
+    uint8_t getUChar(const char* key,uint8_t defaultValue = 0) {return Get(key,defaultValue);}
+    uint16_t getUShort(const char* key,uint16_t defaultValue = 0) {return Get(key,defaultValue);}
+    uint32_t getULong(const char* key,uint32_t defaultValue = 0) {return Get(key,defaultValue);}
+    int32_t getLong(const char* key,int32_t defaultValue = 0) {return Get(key,defaultValue);}
+};
@@ -0,0 +1,59 @@
+#pragma once
+/*
+ * Fake nRF24 radio for host tests. write() repeats transmission attempts
+ * (1 + retry count at most) whose outcome is decided by the 'attempt' hook
+ * set by the test, from the current settings (PA level, retry delay...).
+*/
+#include <Arduino.h>
+
+typedef enum {RF24_PA_MIN = 0,RF24_PA_LOW,RF24_PA_HIGH,RF24_PA_MAX,RF24_PA_ERROR} rf24_pa_dbm_e;
+typedef enum {RF24_1MBPS = 0,RF24_2MBPS,RF24_250KBPS} rf24_datarate_e;
+
+class RF24
+{
+  public:
+    uint8_t channel = 76;
+    rf24_datarate_e dataRate = RF24_1MBPS;
+    uint8_t paLevel = RF24_PA_MAX;
+    uint8_t retryDelay = 5;
+    uint8_t retryCount = 15;
+    uint8_t arc = 0;
+    bool isListening = false;
+    bool isCarrier = false; //testRPD()
+    bool (*attempt)(const RF24* radio) = NULL; //NULL: always delivered
+    uint8_t rxData[32];
+    bool isRxPending = false;
+
+    RF24(uint16_t cePin,uint16_t csnPin) {}
+    bool begin(void) {return true;}
+    void setChannel(uint8_t channel) {this->channel = channel;}
+    bool setDataRate(rf24_datarate_e dataRate) {this->dataRate = dataRate; return true;}
+    void setRetries(uint8_t delay,uint8_t count) {retryDelay = delay; retryCount = count;}
+    void setPALevel(uint8_t level,bool lnaEnable = true) {paLevel = level;}
+    bool testRPD(void) {return isCarrier;}
+    void stopListening(void) {isListening = false;}
+    void startListening(void) {isListening = true;}
+    void openWritingPipe(const uint8_t* address) {}
+    void openReadingPipe(uint8_t number,const uint8_t* address) {}
+    uint8_t getARC(void) {return arc;}
+    bool write(const void* buf,uint8_t len)
+    {
+      for(arc = 0; ; arc++)
+      {
+        if(attempt == NULL || attempt(this))
+        {
+          return true;
+        }
+        if(arc == retryCount)
+        {
+          return false;
+        }
+      }
+    }
+    bool available(void) {return isRxPending;}
+    void read(void* buf,uint8_t len)
+    {
+      memcpy(buf,rxData,(len < sizeof(rxData)) ? len : sizeof(rxData));
+      isRxPending = false;
+    }
+};
@@ -0,0 +1,23 @@
+#include <Arduino.h>
+#include <stdarg.h>
+
+uint32_t hostMillis = 0;
+uint32_t hostMicros = 0;
+uint8_t hostPins[64];
+std::recursive_mutex hostCriticalLock;
+void (*hostDelayHook)(uint32_t ms) = NULL;
+HardwareSerial Serial;
+
+size_t Print::printf(const char* format,...)
+{
+  char buf[256];
+  va_list args;
+  va_start(args,format);
+  int len = vsnprintf(buf,sizeof(buf),format,args);
+  va_end(args);
+  if(len < 0)
+  {
+    return 0;
+  }
+  return write((const uint8_t*)buf,(len < (int)sizeof(buf)) ? len : sizeof(buf) - 1);
+}
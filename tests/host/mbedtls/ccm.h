@@ -0,0 +1,32 @@
+#pragma once
+/*
+ * Declarations of the mbedtls 2.28 CCM API used by radiocrypt.cpp (the host
+ * has the library, libmbedcrypto.so.7, but not its headers). The context is
+ * opaque here: big enough for the library's own struct.
+*/
+#include <stddef.h>
+
+typedef struct
+{
+  alignas(8) unsigned char opaque[256];
+}mbedtls_ccm_context;
+
+#define MBEDTLS_CIPHER_ID_AES   2 //mbedtls_cipher_id_t
+
+extern "C"
+{
+void mbedtls_ccm_init(mbedtls_ccm_context* ctx);
+void mbedtls_ccm_free(mbedtls_ccm_context* ctx);
+int mbedtls_ccm_setkey(mbedtls_ccm_context* ctx,int cipher,const unsigned char* key,
+                       unsigned int keybits);
+int mbedtls_ccm_encrypt_and_tag(mbedtls_ccm_context* ctx,size_t length,
+                                const unsigned char* iv,size_t iv_len,
+                                const unsigned char* add,size_t add_len,
+                                const unsigned char* input,unsigned char* output,
+                                unsigned char* tag,size_t tag_len);
+int mbedtls_ccm_auth_decrypt(mbedtls_ccm_context* ctx,size_t length,
+                             const unsigned char* iv,size_t iv_len,
+                             const unsigned char* add,size_t add_len,
+                             const unsigned char* input,unsigned char* output,
+                             const unsigned char* tag,size_t tag_len);
+}
@@ -0,0 +1,17 @@
+#pragma once
+/*
+ * Declarations of the mbedtls 2.28 message digest API used by radiocrypt.cpp
+ * (see ccm.h).
+*/
+#include <stddef.h>
+
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+#define MBEDTLS_MD_SHA256   6 //mbedtls_md_type_t
+
+extern "C"
+{
+const mbedtls_md_info_t* mbedtls_md_info_from_type(int md_type);
+int mbedtls_md_hmac(const mbedtls_md_info_t* md_info,const unsigned char* key,size_t keylen,
+                    const unsigned char* input,size_t ilen,unsigned char* output);
+}
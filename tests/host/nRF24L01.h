@@ -0,0 +1,2 @@
+#pragma once
+//Register definitions are not needed by the fake radio (see RF24.h)
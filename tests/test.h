@@ -0,0 +1,30 @@
+#pragma once
+/*
+ * Minimal test harness for the host unit tests.
+ * CHECK() records a failure and carries on; TEST_RESULT() is main()'s exit code.
+*/
+#include <stdio.h>
+#include <chrono>
+
+extern int testFailures;
+
+#define CHECK(cond) \
+  do{ if(!(cond)){ testFailures++; \
+    printf("%s:%d: CHECK failed: %s\n",__FILE__,__LINE__,#cond); } }while(0)
+
+#define CHECK_EQ(a,b) \
+  do{ long long _a = (long long)(a); long long _b = (long long)(b); \
+    if(_a != _b){ testFailures++; \
+    printf("%s:%d: CHECK_EQ failed: %s == %lld, expected %lld\n",__FILE__,__LINE__,#a,_a,_b); } }while(0)
+
+#define TEST_RESULT() \
+  (printf("%s: %s\n",__FILE__,testFailures ? "FAILED" : "passed"),testFailures ? 1 : 0)
+
+int testFailures = 0;
+
+//Wall-clock nanoseconds (benchmarks)
+static inline double NowNs(void)
+{
+  return std::chrono::duration<double,std::nano>(
+         std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,310 @@
+/*
+ * Tests of the cloud recharge commands (cloudcmd.cpp): parsing and
+ * authentication, and the table of credits awaiting the reply of meters.
+*/
+#include <Arduino.h>
+#include <string>
+#include <mbedtls/md.h>
+#include "test.h"
+#include "cloudcmd.h"
+
+static const uint8_t key[CLOUD_KEY_SIZE] = {0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15};
+
+static bool Parse(const std::string& command,cloud_recharge_t* recharge)
+{
+  return CloudCommand::ParseRecharge(command.c_str(),command.size(),key,recharge);
+}
+
+//Signs a command (HMAC-SHA256, as the cloud does)
+static std::string Sign(const std::string& text)
+{
+  uint8_t signature[CLOUD_SIGNATURE_SIZE];
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),key,sizeof(key),
+                  (const uint8_t*)text.c_str(),text.size(),signature);
+  std::string command = text + ",";
+  for(uint8_t byte : signature)
+  {
+    char hex[3];
+    snprintf(hex,sizeof(hex),"%02x",byte);
+    command += hex;
+  }
+  return command;
+}
+
+static void TestParse(void)
+{
+  cloud_recharge_t recharge = {};
+  //Known answer (Python: hmac.new(bytes(range(16)),b"1001,513,2,250",sha256))
+  CHECK(Parse("1001,513,2,250,44c626df3dec99e857f27a3a21e334d3a3f86eeaad17b4292e38ceb49709c570",
+              &recharge));
+  CHECK_EQ(recharge.commandId,1001);
+  CHECK_EQ(recharge.meterId,513);
+  CHECK_EQ(recharge.userIndex,1); //users are numbered from 1
+  CHECK_EQ(recharge.units,250);
+  CHECK(Parse("1001,513,2,250,44C626DF3DEC99E857F27A3A21E334D3A3F86EEAAD17B4292E38CEB49709C570",
+              &recharge));
+  //Tampered command or signature, wrong key
+  CHECK(!Parse("1001,513,2,251,44c626df3dec99e857f27a3a21e334d3a3f86eeaad17b4292e38ceb49709c570",
+               &recharge));
+  CHECK(!Parse("1001,513,2,250,44c626df3dec99e857f27a3a21e334d3a3f86eeaad17b4292e38ceb49709c571",
+               &recharge));
+  CHECK(!Parse("1001,513,2,250,44c626df3dec99e857f27a3a21e334d3a3f86eeaad17b4292e38ceb49709c5",
+               &recharge));
+  const uint8_t otherKey[CLOUD_KEY_SIZE] = {1};
+  std::string command = Sign("1001,513,2,250");
+  CHECK(!CloudCommand::ParseRecharge(command.c_str(),command.size(),otherKey,&recharge));
+  //Authentic but malformed
+  CHECK(Parse(Sign("4294967295,65535,255,100000"),&recharge));
+  CHECK_EQ(recharge.commandId,4294967295UL);
+  CHECK_EQ(recharge.userIndex,254);
+  CHECK_EQ(recharge.units,CLOUD_MAX_UNITS);
+  CHECK(!Parse(Sign("1001,513,2,100001"),&recharge)); //more than CLOUD_MAX_UNITS
+  CHECK(!Parse(Sign("1001,513,2,4294967295"),&recharge));
+  CHECK(!Parse(Sign("0,513,2,250"),&recharge)); //command IDs start at 1
+  CHECK(!Parse(Sign("1001,65536,2,250"),&recharge));
+  CHECK(!Parse(Sign("1001,513,0,250"),&recharge));
+  CHECK(!Parse(Sign("1001,513,256,250"),&recharge));
+  CHECK(!Parse(Sign("1001,513,2,0"),&recharge));
+  CHECK(!Parse(Sign("1001,513,2"),&recharge));
+  CHECK(!Parse(Sign("1001,513,2,250,1"),&recharge));
+  CHECK(!Parse(Sign("1001,513,2,25x"),&recharge));
+  CHECK(!Parse(Sign("1001,513,,250"),&recharge));
+  CHECK(!Parse(Sign("1001,513,2,4294967296"),&recharge));
+  CHECK(!Parse("",&recharge));
+  CHECK(!Parse("1001",&recharge));
+  //Longer than CLOUD_MAX_COMMAND_SIZE (the payload isn't NULL-terminated)
+  std::string longCommand = Sign("1001,513,2,250" + std::string(60,'0'));
+  CHECK(longCommand.size() > CLOUD_MAX_COMMAND_SIZE);
+  CHECK(!Parse(longCommand,&recharge));
+  std::string payload = Sign("7,1,1,5");
+  CHECK(CloudCommand::ParseRecharge((payload + "garbage").c_str(),payload.size(),key,&recharge));
+  CHECK_EQ(recharge.units,5);
+}
+
+static cloud_recharge_t Credit(uint32_t commandId,uint16_t meterId)
+{
+  cloud_recharge_t recharge = {commandId,meterId,0,10};
+  return recharge;
+}
+
+static void TestRetries(void)
+{
+  SetMillis(0xFFFFF000); //millis() wraps during the test
+  CreditTable credits(4);
+  cloud_recharge_t recharge = Credit(5,1);
+  CHECK(credits.Add(&recharge));
+  //Sent immediately, then every CREDIT_RETRY_PERIOD
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,5);
+  CHECK(!credits.TakeDue(&recharge));
+  AdvanceMillis(CREDIT_RETRY_PERIOD - 1);
+  CHECK(!credits.TakeDue(&recharge));
+  AdvanceMillis(1);
+  CHECK(credits.TakeDue(&recharge));
+  CHECK(!credits.TakeTimedOut(&recharge));
+  //Reported as pending once, then resent every CREDIT_SLOW_RETRY_PERIOD
+  AdvanceMillis(CREDIT_TIMEOUT - CREDIT_RETRY_PERIOD);
+  CHECK(credits.TakeTimedOut(&recharge));
+  CHECK_EQ(recharge.commandId,5);
+  CHECK(!credits.TakeTimedOut(&recharge));
+  CHECK_EQ(credits.GetNumOfPending(),1);
+  AdvanceMillis(CREDIT_RETRY_PERIOD);
+  CHECK(!credits.TakeDue(&recharge));
+  AdvanceMillis(CREDIT_SLOW_RETRY_PERIOD - CREDIT_RETRY_PERIOD);
+  CHECK(credits.TakeDue(&recharge));
+  //A pending credit is removed by the meter's reply (or when it expires)
+  AdvanceMillis(CREDIT_EXPIRY - CREDIT_TIMEOUT - CREDIT_SLOW_RETRY_PERIOD - 1);
+  CHECK(credits.TakeDue(&recharge));
+  CHECK(!credits.TakeExpired(&recharge));
+  uint32_t receivedTime = 0;
+  CHECK(!credits.Remove(2,5,&recharge));
+  CHECK(credits.Remove(1,5,&recharge,&receivedTime));
+  CHECK_EQ(receivedTime,0xFFFFF000);
+  CHECK_EQ(recharge.units,10);
+  CHECK(!credits.Remove(1,5,&recharge)); //reply to a resent credit
+  CHECK_EQ(credits.GetNumOfPending(),0);
+  CHECK(!credits.TakeDue(&recharge));
+}
+
+/**
+ * Slow retries stop at CREDIT_EXPIRY (final status), and a meter can't hold
+ * more than CREDIT_MAX_PER_METER entries of the table.
+*/
+static void TestExpiry(void)
+{
+  SetMillis(0xFFFF0000); //millis() wraps during the test
+  CreditTable credits(CREDIT_MAX_PER_METER + 2);
+  cloud_recharge_t recharge;
+  for(uint32_t id = 1; id <= CREDIT_MAX_PER_METER; id++)
+  {
+    recharge = Credit(id,4);
+    CHECK(credits.Add(&recharge));
+  }
+  recharge = Credit(CREDIT_MAX_PER_METER + 1,4);
+  CHECK(!credits.Add(&recharge));
+  CHECK(!credits.IsFull()); //other meters aren't blocked
+  recharge = Credit(CREDIT_MAX_PER_METER + 2,5);
+  CHECK(credits.Add(&recharge));
+  //Retried, reported as pending, then slowly retried until CREDIT_EXPIRY
+  uint32_t numOfSent = 0;
+  uint32_t numOfTimedOut = 0;
+  for(uint32_t t = 0; t < CREDIT_EXPIRY; t += 1000)
+  {
+    while(credits.TakeTimedOut(&recharge))
+    {
+      numOfTimedOut++;
+    }
+    while(credits.TakeDue(&recharge))
+    {
+      numOfSent += (recharge.meterId == 4) ? 1 : 0;
+    }
+    CHECK(!credits.TakeExpired(&recharge));
+    AdvanceMillis(1000);
+  }
+  CHECK_EQ(numOfTimedOut,CREDIT_MAX_PER_METER + 1);
+  CHECK_EQ(numOfSent,CREDIT_TIMEOUT / CREDIT_RETRY_PERIOD + 
+                     (CREDIT_EXPIRY - CREDIT_TIMEOUT) / CREDIT_SLOW_RETRY_PERIOD);
+  uint8_t numOfExpired = 0;
+  while(credits.TakeExpired(&recharge))
+  {
+    numOfExpired++;
+  }
+  CHECK_EQ(numOfExpired,CREDIT_MAX_PER_METER + 1);
+  CHECK_EQ(credits.GetNumOfPending(),0);
+  CHECK(!credits.TakeDue(&recharge));
+  CHECK(!credits.Remove(4,1,&recharge)); //late reply
+  recharge = Credit(CREDIT_MAX_PER_METER + 3,4);
+  CHECK(credits.Add(&recharge));
+}
+
+static void TestOneAtATime(void)
+{
+  SetMillis(1000);
+  CreditTable credits(4);
+  cloud_recharge_t recharges[] = {Credit(12,1),Credit(10,1),Credit(11,2),Credit(13,1)};
+  for(cloud_recharge_t& recharge : recharges)
+  {
+    CHECK(credits.Add(&recharge));
+  }
+  CHECK(credits.IsFull());
+  CHECK(!credits.Add(&recharges[0]));
+  //The oldest credit of each meter is sent, meters in parallel
+  cloud_recharge_t recharge;
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,10);
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,11);
+  CHECK(!credits.TakeDue(&recharge));
+  //The next one of meter 1 follows the reply (even if it's pending)
+  AdvanceMillis(CREDIT_TIMEOUT);
+  uint8_t numOfTimedOut = 0;
+  while(credits.TakeTimedOut(&recharge))
+  {
+    numOfTimedOut++;
+  }
+  CHECK_EQ(numOfTimedOut,4);
+  CHECK(!credits.TakeDue(&recharge));
+  AdvanceMillis(CREDIT_SLOW_RETRY_PERIOD - CREDIT_TIMEOUT);
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,10);
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,11);
+  CHECK(!credits.TakeDue(&recharge));
+  CHECK(credits.Remove(1,10,&recharge));
+  CHECK(!credits.IsFull());
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,12);
+  CHECK(!credits.TakeDue(&recharge));
+  CHECK(credits.Remove(1,12,&recharge));
+  CHECK(credits.TakeDue(&recharge));
+  CHECK_EQ(recharge.commandId,13);
+}
+
+/**
+ * The meters (modelled on HandleCredit() in Master.ino) apply the commands
+ * newer than the last one they received, and reply when their node applies
+ * one or to a resent one. The nodes are offline for longer than
+ * CREDIT_TIMEOUT and a quarter of the replies are lost: every credit must be
+ * applied exactly once, and reported once as pending and once as applied.
+*/
+static void TestOfflineNode(void)
+{
+  const uint32_t numOfCredits = 20;
+  const uint16_t numOfMeters = 7; //up to CREDIT_MAX_PER_METER credits each
+  CreditTable credits(numOfCredits);
+  uint8_t numOfApplied[numOfCredits + 1] = {0};
+  uint8_t numOfPending[numOfCredits + 1] = {0};
+  uint8_t numOfReplies[numOfCredits + 1] = {0};
+  uint32_t lastCreditId[numOfMeters + 1] = {0};
+  uint32_t lastAppliedId[numOfMeters + 1] = {0};
+  uint32_t queuedId[numOfMeters + 1] = {0}; //waiting for the node
+  uint32_t seed = 7;
+  auto Reply = [&](uint16_t meterId,uint32_t commandId)
+  {
+    seed = seed * 1103515245 + 12345;
+    cloud_recharge_t recharge;
+    if(((seed >> 16) % 4) != 0 && credits.Remove(meterId,commandId,&recharge))
+    {
+      numOfReplies[commandId]++;
+    }
+  };
+  SetMillis(0);
+  for(uint32_t id = 1; id <= numOfCredits; id++)
+  {
+    cloud_recharge_t recharge = Credit(id,1 + id % numOfMeters);
+    CHECK(credits.Add(&recharge));
+  }
+  for(uint32_t t = 0; t < 3600000; t += 100)
+  {
+    SetMillis(t);
+    cloud_recharge_t recharge;
+    while(credits.TakeTimedOut(&recharge))
+    {
+      numOfPending[recharge.commandId]++;
+    }
+    for(uint16_t meterId = 1; meterId <= numOfMeters; meterId++)
+    {
+      if(t >= 120000 && queuedId[meterId] != 0)
+      {
+        numOfApplied[queuedId[meterId]]++;
+        lastAppliedId[meterId] = queuedId[meterId];
+        queuedId[meterId] = 0;
+        Reply(meterId,lastAppliedId[meterId]);
+      }
+    }
+    while(credits.TakeDue(&recharge))
+    {
+      uint16_t meterId = recharge.meterId;
+      if(recharge.commandId > lastCreditId[meterId])
+      {
+        lastCreditId[meterId] = recharge.commandId;
+        queuedId[meterId] = recharge.commandId;
+      }
+      else if(recharge.commandId == lastAppliedId[meterId])
+      {
+        Reply(meterId,recharge.commandId);
+      }
+      else
+      {
+        CHECK_EQ(recharge.commandId,queuedId[meterId]); //not overtaken
+      }
+    }
+  }
+  for(uint32_t id = 1; id <= numOfCredits; id++)
+  {
+    CHECK_EQ(numOfApplied[id],1);
+    CHECK_EQ(numOfPending[id],1);
+    CHECK_EQ(numOfReplies[id],1);
+  }
+  CHECK_EQ(credits.GetNumOfPending(),0);
+}
+
+int main(void)
+{
+  TestParse();
+  TestRetries();
+  TestOneAtATime();
+  TestExpiry();
+  TestOfflineNode();
+  return TEST_RESULT();
+}
@@ -0,0 +1,157 @@
+/*
+ * Tests of the flow sensor (FlowSensor.cpp, Node): calibration tables,
+ * volume accounting (saturating at FLOW_MAX_VOLUME), and the volume error at
+ * different flow rates for a sensor whose K-factor depends on the flow rate.
+ *
+ * The sensor curve is a model of a YF-S201 type Hall-effect sensor (about
+ * 2.0 mL per pulse at high flow, more at low flow where the rotor slips),
+ * shaped like published characterisations. It isn't a bench measurement:
+ * replace SensorK() with measured points when they are available.
+*/
+#include <Arduino.h>
+#include <math.h>
+#include "test.h"
+#include "FlowSensor.h"
+
+#define SAMPLE_RATE   1667 //NODE_SAMPLE_RATE
+#define SENSOR_PIN    4
+
+//Sensor model: true K-factor (microlitres per pulse) at a pulse rate
+static double SensorK(double rate)
+{
+  return 2000 + 1200 * exp(-rate / 12);
+}
+
+static void TestTables(void)
+{
+  FlowSensor sensor(SENSOR_PIN,SAMPLE_RATE);
+  CHECK_EQ(sensor.GetKFactor(10),FLOW_DEFAULT_K_FACTOR); //uncalibrated
+  calibration_t calibration = {3,{{5,2800},{15,2400},{60,2000}}};
+  CHECK(sensor.SetCalibration(&calibration));
+  CHECK_EQ(sensor.GetKFactor(0),2800); //clamped
+  CHECK_EQ(sensor.GetKFactor(5),2800);
+  CHECK_EQ(sensor.GetKFactor(10),2600);
+  CHECK_EQ(sensor.GetKFactor(15),2400);
+  CHECK_EQ(sensor.GetKFactor(24),2320);
+  CHECK_EQ(sensor.GetKFactor(60),2000);
+  CHECK_EQ(sensor.GetKFactor(65535),2000);
+  //Invalid tables are rejected (the table in use is kept)
+  calibration_t bad = {2,{{10,2100},{10,2200}}};
+  CHECK(!FlowSensor::IsValid(&bad));
+  bad = {2,{{10,2100},{5,2200}}};
+  CHECK(!FlowSensor::IsValid(&bad));
+  bad = {1,{{10,0}}};
+  CHECK(!FlowSensor::IsValid(&bad));
+  bad = {FLOW_CAL_MAX_POINTS + 1,{}};
+  CHECK(!sensor.SetCalibration(&bad));
+  calibration_t current;
+  sensor.GetCalibration(&current);
+  CHECK_EQ(current.numOfPoints,3);
+  calibration_t empty = {};
+  CHECK(FlowSensor::IsValid(&empty));
+}
+
+/**
+ * Runs water through the sensor at a constant pulse rate (50% duty cycle),
+ * sampled as by the node's timer.
+ * @return Volume (mL) deducted by the sensor. 'trueVolume' is the volume that
+ * flowed according to the sensor model.
+*/
+static double Flow(FlowSensor& sensor,double rate,uint32_t seconds,double* trueVolume)
+{
+  uint32_t startVolume = sensor.GetVolume();
+  uint32_t startPulses = sensor.GetTotalPulses();
+  for(uint32_t i = 0; i < seconds * SAMPLE_RATE; i++)
+  {
+    double phase = fmod(i * rate / SAMPLE_RATE,1.0);
+    hostPins[SENSOR_PIN] = (phase < 0.5) ? HIGH : LOW;
+    sensor.Sample();
+  }
+  *trueVolume = (sensor.GetTotalPulses() - startPulses) * SensorK(rate) / 1000;
+  return startVolume - (double)sensor.GetVolume();
+}
+
+static void TestAccuracy(void)
+{
+  const double rates[] = {3,5,8,12,20,30,45,60,80};
+  //Calibrated at 4 rates (as a technician would, from the sensor model)
+  calibration_t calibration = {4,{}};
+  const uint16_t calRates[] = {5,15,30,60};
+  for(uint8_t i = 0; i < 4; i++)
+  {
+    calibration.points[i] = {calRates[i],(uint16_t)lround(SensorK(calRates[i]))};
+  }
+  printf("flow rate(p/s)  error uncalibrated  error calibrated\n");
+  double maxError = 0;
+  for(double rate : rates)
+  {
+    FlowSensor uncalibrated(SENSOR_PIN,SAMPLE_RATE);
+    FlowSensor calibrated(SENSOR_PIN,SAMPLE_RATE);
+    CHECK(calibrated.SetCalibration(&calibration));
+    uncalibrated.UpdateVolume(1000000);
+    calibrated.UpdateVolume(1000000);
+    double trueVolume;
+    double volume1 = Flow(uncalibrated,rate,60,&trueVolume);
+    double volume2 = Flow(calibrated,rate,60,&trueVolume);
+    double error1 = 100 * (volume1 - trueVolume) / trueVolume;
+    double error2 = 100 * (volume2 - trueVolume) / trueVolume;
+    printf("%14.0f  %17.1f%%  %15.2f%%\n",rate,error1,error2);
+    if(rate >= 5)
+    {//within the calibrated range
+      maxError = (fabs(error2) > maxError) ? fabs(error2) : maxError;
+    }
+  }
+  CHECK(maxError < 3.0);
+  //Variable flow: 2 -> 70 p/s over 10 min
+  FlowSensor sensor(SENSOR_PIN,SAMPLE_RATE);
+  CHECK(sensor.SetCalibration(&calibration));
+  sensor.UpdateVolume(1000000);
+  double totalTrue = 0;
+  double totalVolume = 0;
+  for(uint32_t second = 0; second < 600; second++)
+  {
+    double trueVolume;
+    totalVolume += Flow(sensor,2 + 68.0 * second / 600,1,&trueVolume);
+    totalTrue += trueVolume;
+  }
+  double error = 100 * (totalVolume - totalTrue) / totalTrue;
+  printf("ramp 2-70 p/s: %.1f L, error %.2f%%\n",totalTrue / 1000,error);
+  CHECK(fabs(error) < 2.0);
+}
+
+static void TestBalance(void)
+{
+  FlowSensor sensor(SENSOR_PIN,SAMPLE_RATE);
+  calibration_t calibration = {2,{{5,3000},{50,2000}}};
+  CHECK(sensor.SetCalibration(&calibration));
+  sensor.UpdateVolume(10);
+  //The balance stops at 0 and isn't refunded by the window's correction
+  double trueVolume;
+  Flow(sensor,50,2,&trueVolume);
+  CHECK_EQ(sensor.GetVolume(),0);
+  CHECK_EQ(sensor.GetRate(),50);
+  Flow(sensor,50,1,&trueVolume);
+  CHECK_EQ(sensor.GetVolume(),0);
+  //Sub-mL remainders accumulate (rounded to the nearest mL)
+  sensor.UpdateVolume(1000);
+  Flow(sensor,1,2,&trueVolume); //2 pulses at 3000 uL
+  CHECK_EQ(sensor.GetVolume(),994);
+  CHECK_EQ(sensor.GetTotalPulses(),152);
+  //Recharges saturate at FLOW_MAX_VOLUME (a wrapped balance would close the valve)
+  sensor.UpdateVolume(FLOW_MAX_VOLUME - 1000);
+  CHECK_EQ(sensor.GetVolume(),FLOW_MAX_VOLUME - 6);
+  sensor.UpdateVolume(4294967295UL);
+  CHECK_EQ(sensor.GetVolume(),FLOW_MAX_VOLUME);
+  sensor.UpdateVolume(1);
+  CHECK_EQ(sensor.GetVolume(),FLOW_MAX_VOLUME);
+  Flow(sensor,1,1,&trueVolume); //1 pulse at 3000 uL
+  CHECK_EQ(sensor.GetVolume(),FLOW_MAX_VOLUME - 3);
+}
+
+int main(void)
+{
+  TestTables();
+  TestAccuracy();
+  TestBalance();
+  return TEST_RESULT();
+}
@@ -0,0 +1,287 @@
+/*
+ * Tests of the consumption history (history.cpp) against a model that keeps
+ * every sample, with time jumps up to more than a year, the local calendar
+ * days and months, and a benchmark of long jumps against the previous 
+ * hour-by-hour advance.
+*/
+#include <Arduino.h>
+#include <Preferences.h>
+#include <map>
+#include <array>
+#include "test.h"
+#include "history.h"
+
+#define NUM_OF_STEPS    3000
+#define NUM_OF_RUNS     2000
+#define JAN_31_2024     1706659200UL //Unix time, 00:00 UTC
+
+typedef std::array<uint32_t,HISTORY_NUM_OF_USERS> volumes_t;
+
+static uint32_t seed = 1;
+
+static uint32_t Random(uint32_t range)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % range;
+}
+
+/**
+ * Period (hour, local day or local calendar month) of a Unix hour. The month 
+ * is counted through the days of each month, independently of gmtime().
+*/
+static uint32_t GetPeriod(uint32_t hour,uint8_t period)
+{
+  const uint8_t daysPerMonth[] = {31,28,31,30,31,30,31,31,30,31,30,31};
+  uint32_t day = (hour + HISTORY_UTC_OFFSET) / HISTORY_HOURS_PER_DAY;
+  if(period == HISTORY_HOURLY)
+  {
+    return hour;
+  }
+  if(period == HISTORY_DAILY)
+  {
+    return day;
+  }
+  uint32_t month = 0;
+  for(uint32_t year = 1970; ; year++)
+  {
+    for(uint8_t i = 0; i < 12; i++, month++)
+    {
+      bool isLeap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+      uint32_t numOfDays = daysPerMonth[i] + ((i == 1 && isLeap) ? 1 : 0);
+      if(day < numOfDays)
+      {
+        return month;
+      }
+      day -= numOfDays;
+    }
+  }
+}
+
+//Consumption of the periods ending at 'current'
+static void GetExpected(const std::map<uint32_t,volumes_t>& consumption,uint32_t current,
+                        uint8_t periodType,uint8_t userIndex,uint32_t* volumes,uint8_t num)
+{
+  memset(volumes,0,num * sizeof(uint32_t));
+  for(const auto& hour : consumption)
+  {
+    uint32_t period = GetPeriod(hour.first,periodType);
+    if(period <= current && (current - period) < num)
+    {
+      volumes[current - period] += hour.second[userIndex];
+    }
+  }
+}
+
+static bool IsMatch(History& history,const std::map<uint32_t,volumes_t>& consumption,
+                    uint32_t hour)
+{
+  const uint8_t numOfBuckets[] = 
+  {
+    HISTORY_NUM_OF_HOURS,HISTORY_NUM_OF_DAYS,HISTORY_NUM_OF_MONTHS
+  };
+  for(uint8_t period = HISTORY_HOURLY; period <= HISTORY_MONTHLY; period++)
+  {
+    for(uint8_t i = 0; i < HISTORY_NUM_OF_USERS; i++)
+    {
+      uint32_t volumes[HISTORY_NUM_OF_DAYS];
+      uint32_t expected[HISTORY_NUM_OF_DAYS];
+      uint32_t current = GetPeriod(hour,period);
+      uint8_t num = history.Get(i,(HistoryPeriod)period,volumes,HISTORY_NUM_OF_DAYS);
+      uint8_t expectedNum = (current + 1 < numOfBuckets[period]) ? 
+                            current + 1 : numOfBuckets[period];
+      GetExpected(consumption,current,period,i,expected,expectedNum);
+      if(num != expectedNum || memcmp(volumes,expected,num * sizeof(uint32_t)) != 0)
+      {
+        printf("Mismatch: hour %u, period %u, user %u\n",hour,period,i);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void TestAgainstModel(void)
+{
+  Preferences prefs;
+  History history(&prefs);
+  std::map<uint32_t,volumes_t> consumption;
+  float balances[HISTORY_NUM_OF_USERS] = {1000000,1000000,1000000};
+  uint32_t timestamp = 1700000000;
+  SetMillis(5000);
+  history.Begin();
+  history.Update(balances,timestamp); //baseline
+  bool isMatch = true;
+  for(uint32_t step = 0; step < NUM_OF_STEPS && isMatch; step++)
+  {
+    uint32_t jump;
+    uint32_t kind = Random(100);
+    if(kind < 70)
+    {
+      jump = Random(3 * HISTORY_SECS_PER_HOUR);
+    }
+    else if(kind < 90)
+    {
+      jump = Random(40 * HISTORY_SECS_PER_HOUR);
+    }
+    else if(kind < 98)
+    {
+      jump = Random(800 * HISTORY_SECS_PER_HOUR);
+    }
+    else
+    {
+      jump = Random(10000 * HISTORY_SECS_PER_HOUR);
+    }
+    timestamp += jump;
+    AdvanceMillis(jump * 1000);
+    volumes_t consumed;
+    for(uint8_t i = 0; i < HISTORY_NUM_OF_USERS; i++)
+    {
+      consumed[i] = Random(50);
+      balances[i] -= consumed[i];
+      if(Random(20) == 0)
+      {
+        balances[i] += 200; //recharge (not consumption)
+        consumed[i] = 0;
+      }
+    }
+    uint32_t hour = timestamp / HISTORY_SECS_PER_HOUR;
+    for(uint8_t i = 0; i < HISTORY_NUM_OF_USERS; i++)
+    {
+      consumption[hour][i] += consumed[i];
+    }
+    //Long jumps need a timestamp (millis() wraps), others may follow millis()
+    history.Update(balances,(jump > 40 * 24 * HISTORY_SECS_PER_HOUR || 
+                             Random(2)) ? timestamp : 0);
+    isMatch = IsMatch(history,consumption,hour);
+  }
+  CHECK(isMatch);
+
+  //Persisted and reloaded
+  history.Flush();
+  uint32_t numOfWrites = prefs.numOfWrites;
+  history.Flush();
+  CHECK_EQ(prefs.numOfWrites,numOfWrites); //unchanged
+  History reloaded(&prefs);
+  reloaded.Begin();
+  CHECK(IsMatch(reloaded,consumption,timestamp / HISTORY_SECS_PER_HOUR));
+  CHECK_EQ(reloaded.Get(HISTORY_NUM_OF_USERS,HISTORY_HOURLY,NULL,1),0);
+}
+
+/**
+ * "TODAY" and "THIS MONTH" start at local midnight and on the 1st: 23:30 UTC
+ * on the 31st of January is already the 1st of February in WAT (UTC+1).
+*/
+static void TestLocalCalendar(void)
+{
+  Preferences prefs;
+  History history(&prefs);
+  float balances[HISTORY_NUM_OF_USERS] = {1000,1000,1000};
+  uint32_t volumes[2];
+  SetMillis(5000);
+  history.Begin();
+  history.Update(balances,JAN_31_2024 + 12 * HISTORY_SECS_PER_HOUR); //baseline
+  balances[0] -= 100;
+  history.Update(balances,JAN_31_2024 + 22 * HISTORY_SECS_PER_HOUR + 1800); //23:30 WAT
+  CHECK_EQ(history.Get(0,HISTORY_DAILY,volumes,2),2);
+  CHECK_EQ(volumes[0],100);
+  CHECK_EQ(history.Get(0,HISTORY_MONTHLY,volumes,2),2);
+  CHECK_EQ(volumes[0],100);
+  balances[0] -= 20;
+  history.Update(balances,JAN_31_2024 + 23 * HISTORY_SECS_PER_HOUR + 1800); //00:30 WAT
+  CHECK_EQ(history.Get(0,HISTORY_DAILY,volumes,2),2);
+  CHECK_EQ(volumes[0],20);
+  CHECK_EQ(volumes[1],100);
+  CHECK_EQ(history.Get(0,HISTORY_MONTHLY,volumes,2),2);
+  CHECK_EQ(volumes[0],20); //February
+  CHECK_EQ(volumes[1],100); //January
+
+  //Leap day: the 29th of February is still February
+  balances[0] -= 5;
+  history.Update(balances,JAN_31_2024 + 29 * 24 * HISTORY_SECS_PER_HOUR + 1800);
+  CHECK_EQ(history.Get(0,HISTORY_MONTHLY,volumes,2),2);
+  CHECK_EQ(volumes[0],25);
+  balances[0] -= 7;
+  history.Update(balances,JAN_31_2024 + 30 * 24 * HISTORY_SECS_PER_HOUR - 1800); //1st of March WAT
+  CHECK_EQ(history.Get(0,HISTORY_MONTHLY,volumes,2),2);
+  CHECK_EQ(volumes[0],7);
+  CHECK_EQ(volumes[1],25);
+
+  //Offset west of UTC: 00:30 UTC on the 1st of February is still January
+  Preferences prefs2;
+  History west(&prefs2,"H",-5);
+  west.Begin();
+  balances[1] = 1000;
+  west.Update(balances,JAN_31_2024);
+  balances[1] -= 40;
+  west.Update(balances,JAN_31_2024 + 24 * HISTORY_SECS_PER_HOUR + 1800);
+  CHECK_EQ(west.Get(1,HISTORY_MONTHLY,volumes,2),2);
+  CHECK_EQ(volumes[0],40);
+  CHECK_EQ(west.Get(1,HISTORY_DAILY,volumes,2),2);
+  CHECK_EQ(volumes[0],40);
+}
+
+//Previous implementation: one step per hour, 30-day months from 1970 (UTC)
+#define OLD_DAYS_PER_MONTH  30
+typedef struct
+{
+  uint32_t hour;
+  uint32_t hourly[HISTORY_NUM_OF_HOURS][HISTORY_NUM_OF_USERS];
+  uint32_t daily[HISTORY_NUM_OF_DAYS][HISTORY_NUM_OF_USERS];
+  uint32_t monthly[HISTORY_NUM_OF_MONTHS][HISTORY_NUM_OF_USERS];
+}old_store_t;
+
+static void OldAdvanceTo(old_store_t& store,uint32_t hour)
+{
+  while(store.hour < hour)
+  {
+    store.hour++;
+    memset(store.hourly[store.hour % HISTORY_NUM_OF_HOURS],0,sizeof(store.hourly[0]));
+    if((store.hour % HISTORY_HOURS_PER_DAY) == 0)
+    {
+      uint32_t day = store.hour / HISTORY_HOURS_PER_DAY;
+      memset(store.daily[day % HISTORY_NUM_OF_DAYS],0,sizeof(store.daily[0]));
+      if((day % OLD_DAYS_PER_MONTH) == 0)
+      {
+        uint32_t month = day / OLD_DAYS_PER_MONTH;
+        memset(store.monthly[month % HISTORY_NUM_OF_MONTHS],0,sizeof(store.monthly[0]));
+      }
+    }
+  }
+}
+
+static void Benchmark(void)
+{
+  //Longest jump the previous version stepped through (just under a year)
+  const uint32_t jump = HISTORY_HOURS_PER_DAY * OLD_DAYS_PER_MONTH * 
+                        HISTORY_NUM_OF_MONTHS - 1;
+  static old_store_t store;
+  double start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    OldAdvanceTo(store,store.hour + jump);
+  }
+  double oldNs = (NowNs() - start) / NUM_OF_RUNS;
+
+  Preferences prefs;
+  History history(&prefs);
+  float balances[HISTORY_NUM_OF_USERS] = {1000,1000,1000};
+  uint32_t timestamp = 0;
+  history.Begin();
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    timestamp += jump * HISTORY_SECS_PER_HOUR;
+    history.Update(balances,timestamp);
+  }
+  double newNs = (NowNs() - start) / NUM_OF_RUNS;
+  printf("Advance by %u hours (ns, lock held): hour by hour %.0f, "
+         "bucket clearing %.0f\n",jump,oldNs,newNs);
+}
+
+int main(void)
+{
+  TestAgainstModel();
+  TestLocalCalendar();
+  Benchmark();
+  return TEST_RESULT();
+}
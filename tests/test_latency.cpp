@@ -0,0 +1,401 @@
+/*
+ * Tests of the latency statistics (latency.cpp), and a harness that measures
+ * the recharge path and the telemetry throughput on simulated time.
+ *
+ * The recharge path (keypad request -> master -> radio -> utility -> OTP by
+ * radio and SMS -> OTP verified -> node) runs through the firmware's modules:
+ * radio framing, link layer, OTP tables, SIM800L driver and LatencyStats.
+ * What the host can't run is modelled from the sketches' constants: task loop
+ * periods, nRF24 airtime, MNI bytes at 9600 baud. The reports have the
+ * firmware's format, so runs can be compared across revisions (the seed is
+ * fixed).
+*/
+#include <Arduino.h>
+#include <RF24.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include "test.h"
+#include "latency.h"
+#include "radiolink.h"
+#include "radiocrypt.h"
+#include "otp_table.h"
+#include "rollup.h"
+#include "sim800l.h"
+
+//Firmware constants (Master.ino, Utility_System.ino)
+#define TELEMETRY_PERIOD_US   5000000ULL //master: telemetry and pending requests
+#define MASTER_LOOP_US        10000ULL //master: Utility and Node tasks
+#define METER_LOOP_US         5000ULL //utility: Meter task (one frame per loop)
+#define APP_LOOP_US           10000ULL //utility: Application task
+#define NODE_WAKE_DELAY_US    5000ULL
+#define TXN_RETRY_PERIOD_US   300000ULL
+#define OTP_ATTEMPTS          3 //SendOtpToMeter()
+//Models
+#define AIRTIME_US            460 //TX settling + 32-byte payload at 1Mbps
+#define ACK_US                200 //RX settling + ACK
+#define MNI_BYTE_US           1042 //9600 baud, 8N1
+#define NODE_PROCESS_US       2000 //assumed (no hardware measurement)
+#define USER_DELAY_US         5000000ULL //OTP typed 5 s after the SMS (not measured)
+#define RX_FIFO_SIZE          3 //nRF24
+#define NUM_OF_RECHARGES      LATENCY_MAX_SAMPLES
+
+static uint64_t simMicros;
+static uint32_t seed = 42;
+
+static void SetTime(uint64_t time)
+{
+  simMicros = time;
+  hostMicros = (uint32_t)time;
+  hostMillis = (uint32_t)(time / 1000);
+}
+
+static void Advance(uint64_t duration)
+{
+  SetTime(simMicros + duration);
+}
+
+//Next time >= 'time' at which a task with this period and phase runs
+static uint64_t NextTick(uint64_t time,uint64_t period,uint64_t phase)
+{
+  if(time <= phase)
+  {
+    return phase;
+  }
+  return phase + ((time - phase + period - 1) / period) * period;
+}
+
+static uint32_t Random(uint32_t range)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % range;
+}
+
+static void TestPercentiles(void)
+{
+  const char* const names[] = {"A","B","C"};
+  LatencyStats stats(names,3);
+  char report[128];
+  CHECK_EQ(stats.GetReport(report,sizeof(report)),0);
+  SetTime(0);
+  for(uint32_t i = 1; i <= 100; i++)
+  {//the ring keeps 37..100
+    SetTime(i * 1000);
+    stats.Record(0,0);
+  }
+  SetTime(5000);
+  stats.Record(2,4);
+  stats.Record(3,0); //no such stage
+  stats.GetReport(report,sizeof(report));
+  CHECK(!strcmp(report,"A:100 50%:68 90%:94 99%:100 max:100 C:1 50%:1 90%:1 99%:1 max:1"));
+  size_t len = stats.GetReport(report,20); //truncated
+  CHECK_EQ(len,strlen(report));
+  CHECK(len < 20);
+}
+
+//Radio channel (per attempt): random loss and collisions with other senders
+static uint32_t lossPercent;
+static std::deque<std::pair<uint64_t,uint64_t>> onAir; //attempts of other senders
+static bool isArrival;
+static uint64_t arrivalTime;
+
+static bool Attempt(const RF24* radio)
+{
+  uint64_t start = simMicros;
+  Advance(AIRTIME_US);
+  bool isCollision = false;
+  for(const auto& interval : onAir)
+  {
+    if(interval.first < simMicros && interval.second > start)
+    {
+      isCollision = true;
+      break;
+    }
+  }
+  onAir.push_back({start,simMicros});
+  bool isDelivered = !isCollision && Random(100) >= lossPercent;
+  if(isDelivered)
+  {
+    isArrival = true;
+    arrivalTime = simMicros;
+  }
+  Advance(isDelivered ? ACK_US : (radio->retryDelay + 1) * 250ULL);
+  return isDelivered;
+}
+
+//SIM800L port (the driver only writes, its delays advance the time)
+class ModemSerial : public HardwareSerial
+{
+  public:
+    uint32_t numOfBytes = 0;
+    using Print::write;
+    size_t write(uint8_t c) override { numOfBytes++; return 1; }
+    size_t write(const uint8_t* buf,size_t size) override { numOfBytes += size; return size; }
+};
+
+//MNI exchange (master request, node reply) with frame loss
+static uint32_t mniLossPercent;
+
+static bool ExchangeWithNode(void)
+{
+  Advance(MNI_BYTE_US); //wake-up byte
+  Advance(NODE_WAKE_DELAY_US);
+  Advance(12 * MNI_BYTE_US); //sizeof(mni_request_t)
+  if(Random(100) < mniLossPercent)
+  {
+    return false;
+  }
+  Advance(NODE_PROCESS_US);
+  Advance(24 * MNI_BYTE_US); //sizeof(mni_reply_t)
+  return Random(100) >= mniLossPercent;
+}
+
+static void RunRecharges(const char* channel)
+{
+  const char* const masterNames[] = {"Request","OTP","Node"};
+  const char* const utilityNames[] = {"OTP","SMS"};
+  LatencyStats masterStats(masterNames,3);
+  LatencyStats utilityStats(utilityNames,2);
+  RF24 masterRadio(0,0);
+  RF24 hubRadio(0,0);
+  masterRadio.attempt = Attempt;
+  hubRadio.attempt = Attempt;
+  RadioLink masterLink(&masterRadio);
+  RadioLink hubLink(&hubRadio);
+  masterLink.Begin(0,1);
+  hubLink.Begin(0,0);
+  uint8_t key[RADIO_KEY_SIZE] = {1,2,3};
+  RadioCrypto masterCrypto;
+  RadioCrypto hubCrypto;
+  masterCrypto.SetKey(key);
+  hubCrypto.SetKey(key);
+  OtpTable masterOtps(3);
+  OtpTable hubOtps(8);
+  ModemSerial modemSerial;
+  SIM800L gsm(&modemSerial);
+  hostDelayHook = [](uint32_t ms){ Advance(ms * 1000ULL); };
+  onAir.clear();
+
+  uint64_t telemetryPhase = Random(TELEMETRY_PERIOD_US);
+  uint64_t masterPhase = Random(MASTER_LOOP_US);
+  uint64_t meterPhase = Random(METER_LOOP_US);
+  uint64_t appPhase = Random(APP_LOOP_US);
+  uint32_t counter = 0;
+  uint32_t numOfApplied = 0;
+  SetTime(10000000);
+  for(uint32_t n = 0; n < NUM_OF_RECHARGES; n++)
+  {
+    Advance(60000000 + Random(60000000)); //a recharge every 1-2 min
+    uint32_t requestTime = millis();
+    char message[RADIO_MAX_PLAINTEXT] = {2,0,1,'0','8','0'}; //type, user, request ID, phone...
+    char otp[] = "123456";
+    radio_frame_t frame;
+    //Master: pending requests are sent with the telemetry, resent until delivered
+    bool isDelivered = false;
+    while(!isDelivered)
+    {
+      SetTime(NextTick(simMicros,TELEMETRY_PERIOD_US,telemetryPhase));
+      masterCrypto.Seal(RADIO_UPLINK,1,++counter,message,sizeof(message),&frame);
+      isDelivered = masterLink.Write(&frame,sizeof(frame));
+      if(!isDelivered)
+      {
+        Advance(1);
+      }
+    }
+    masterStats.Record(0,requestTime);
+    //Utility: the Meter task reads the frame, replies with the OTP, then
+    //the Application task sends the SMS
+    SetTime(NextTick(arrivalTime,METER_LOOP_US,meterPhase));
+    uint32_t utilRequestTime = millis();
+    uint8_t plaintext[RADIO_MAX_PLAINTEXT];
+    CHECK(hubCrypto.Open(RADIO_UPLINK,&frame,plaintext));
+    hubOtps.Add(1,0,25,n);
+    hubOtps.SetOtp(1,0,otp);
+    isDelivered = false;
+    for(uint8_t i = 0; i < OTP_ATTEMPTS && !isDelivered; i++)
+    {
+      hubCrypto.Seal(RADIO_DOWNLINK,1,++counter,message,sizeof(message),&frame);
+      isDelivered = hubLink.Write(&frame,sizeof(frame),1);
+    }
+    uint64_t otpArrival = arrivalTime;
+    if(isDelivered)
+    {
+      utilityStats.Record(0,utilRequestTime);
+    }
+    SetTime(NextTick(simMicros,APP_LOOP_US,appPhase));
+    char phoneNum[] = "+2348012345678";
+    char sms[] = "OTP for a recharge of 25 units is: 123456";
+    gsm.SendSMS(phoneNum,sms);
+    utilityStats.Record(1,utilRequestTime);
+    uint64_t smsTime = simMicros;
+    if(!isDelivered)
+    {
+      continue; //the user can't verify the OTP (not on the meter)
+    }
+    //Master: the Utility task reads the OTP frame
+    SetTime(NextTick(otpArrival,MASTER_LOOP_US,masterPhase));
+    masterOtps.Add(1,0,25);
+    masterOtps.SetOtp(1,0,otp);
+    masterStats.Record(1,requestTime);
+    //The user types the OTP, the Node task sends the transaction to the node
+    //(resent every TXN_RETRY_PERIOD until acknowledged)
+    SetTime(std::max(simMicros,smsTime) + USER_DELAY_US);
+    uint32_t verifyTime = millis();
+    uint32_t units = 0;
+    CHECK(masterOtps.Verify(1,0,otp,&units) == OtpTable::OTP_VALID);
+    SetTime(NextTick(simMicros,MASTER_LOOP_US,masterPhase));
+    uint64_t txnTime = simMicros;
+    while(!ExchangeWithNode())
+    {
+      SetTime(NextTick(txnTime + TXN_RETRY_PERIOD_US,MASTER_LOOP_US,masterPhase));
+      txnTime = simMicros;
+    }
+    SetTime(NextTick(simMicros,MASTER_LOOP_US,masterPhase));
+    masterStats.Record(2,verifyTime);
+    numOfApplied++;
+  }
+  hostDelayHook = NULL;
+  CHECK(numOfApplied > NUM_OF_RECHARGES * 9 / 10);
+  CHECK(modemSerial.numOfBytes > 0);
+  char report[256];
+  masterStats.GetReport(report,sizeof(report));
+  printf("recharge channel=%s master(ms): %s\n",channel,report);
+  utilityStats.GetReport(report,sizeof(report));
+  printf("recharge channel=%s utility(ms): %s\n",channel,report);
+}
+
+static uint64_t Percentile(std::vector<uint64_t>& samples,uint8_t percent)
+{
+  if(samples.empty())
+  {
+    return 0;
+  }
+  std::sort(samples.begin(),samples.end());
+  size_t rank = (percent * samples.size() + 99) / 100;
+  return samples[(rank > 0) ? (rank - 1) : 0];
+}
+
+/**
+ * Telemetry from 'numOfMeters' masters (every TELEMETRY_PERIOD, random phase)
+ * for one minute. Attempts that overlap another sender's collide (charged
+ * to the later sender). The utility reads one frame per Meter task loop, a
+ * frame that finds the RX FIFO full is counted as an overflow.
+*/
+static void RunTelemetry(uint32_t numOfMeters)
+{
+  std::vector<RF24*> radios;
+  std::vector<RadioLink*> links;
+  std::vector<std::pair<uint64_t,uint32_t>> sends; //time, meter
+  for(uint32_t i = 0; i < numOfMeters; i++)
+  {
+    radios.push_back(new RF24(0,0));
+    radios[i]->attempt = Attempt;
+    links.push_back(new RadioLink(radios[i]));
+    links[i]->Begin(0,i);
+    uint64_t phase = Random(TELEMETRY_PERIOD_US);
+    for(uint64_t t = phase; t < 60000000ULL; t += TELEMETRY_PERIOD_US)
+    {
+      sends.push_back({t,i});
+    }
+  }
+  std::sort(sends.begin(),sends.end());
+  onAir.clear();
+  lossPercent = 0;
+  std::vector<uint64_t> arrivals;
+  uint32_t numOfRetries = 0;
+  uint32_t numOfFailures = 0;
+  uint8_t data[RADIO_PAYLOAD_SIZE] = {0};
+  for(const auto& send : sends)
+  {
+    SetTime(send.first);
+    while(!onAir.empty() && onAir.front().second + 100000 < simMicros)
+    {
+      onAir.pop_front();
+    }
+    isArrival = false;
+    if(links[send.second]->Write(data,sizeof(data)))
+    {
+      arrivals.push_back(arrivalTime);
+    }
+    else
+    {
+      numOfFailures++;
+    }
+    numOfRetries += (radios[send.second]->getARC() == 15) ? 16 : radios[send.second]->getARC();
+  }
+  //Utility: one frame per Meter task loop (plus the CPU time of the frame)
+  std::sort(arrivals.begin(),arrivals.end());
+  uint8_t key[RADIO_KEY_SIZE] = {1};
+  RadioCrypto crypto;
+  crypto.SetKey(key);
+  Rollup rollup(256);
+  radio_frame_t frame;
+  uint8_t message[RADIO_MAX_PLAINTEXT] = {1};
+  crypto.Seal(RADIO_UPLINK,1,1,message,sizeof(message),&frame);
+  std::vector<uint64_t> delays;
+  std::deque<uint64_t> fifo;
+  uint32_t numOfOverflows = 0;
+  uint64_t tick = 0;
+  size_t next = 0;
+  double cpuNs = 0;
+  while(next < arrivals.size() || !fifo.empty())
+  {
+    while(next < arrivals.size() && arrivals[next] <= tick)
+    {
+      if(fifo.size() < RX_FIFO_SIZE)
+      {
+        fifo.push_back(arrivals[next]);
+      }
+      else
+      {
+        numOfOverflows++;
+      }
+      next++;
+    }
+    if(!fifo.empty())
+    {
+      delays.push_back(tick - fifo.front());
+      fifo.pop_front();
+      const uint32_t balances[ROLLUP_NUM_OF_USERS] = {1000,2000,3000};
+      double start = NowNs();
+      crypto.Open(RADIO_UPLINK,&frame,message);
+      rollup.Add(delays.size() % numOfMeters,balances,0);
+      cpuNs += NowNs() - start;
+    }
+    tick += METER_LOOP_US;
+  }
+  uint32_t delivered = arrivals.size() - numOfOverflows;
+  printf("telemetry meters=%u offered/min=%zu delivered/min=%u retries/frame=%.2f "
+         "failed=%u overflow=%u queue(ms) 50%%:%.1f 99%%:%.1f cpu/frame(us):%.1f\n",
+         numOfMeters,sends.size(),delivered,(double)numOfRetries / sends.size(),
+         numOfFailures,numOfOverflows,Percentile(delays,50) / 1000.0,
+         Percentile(delays,99) / 1000.0,delays.empty() ? 0 : cpuNs / delays.size() / 1000);
+  if(numOfMeters <= 100)
+  {
+    CHECK_EQ(delivered,sends.size());
+  }
+  for(uint32_t i = 0; i < numOfMeters; i++)
+  {
+    delete links[i];
+    delete radios[i];
+  }
+}
+
+int main(void)
+{
+  TestPercentiles();
+  lossPercent = 0;
+  mniLossPercent = 0;
+  RunRecharges("clean");
+  lossPercent = 30;
+  mniLossPercent = 5;
+  RunRecharges("noisy");
+  const uint32_t meterCounts[] = {10,50,100,200,500,1000};
+  for(uint32_t numOfMeters : meterCounts)
+  {
+    RunTelemetry(numOfMeters);
+  }
+  return TEST_RESULT();
+}
@@ -0,0 +1,357 @@
+/*
+ * Tests of the account ledger (Utility_System/ledger.cpp) on an in-memory
+ * filesystem, plus a benchmark of insert and lookup throughput.
+*/
+#include <Arduino.h>
+#include <atomic>
+#include <thread>
+#include "test.h"
+#include "ledger.h"
+
+static void TestPersistence(void)
+{
+  fs::FS flash;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(ledger.UpdateBalance(7,0,5000));
+    CHECK(ledger.UpdatePhone(7,0,"08012345678"));
+    CHECK(ledger.RecordRecharge(7,0,20));
+    CHECK(ledger.RecordRecharge(7,0,30));
+    CHECK(ledger.UpdateBalance(9,2,100));
+    ledger.Flush();
+  }
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  CHECK_EQ(ledger.GetNumOfAccounts(),2);
+  Ledger::account_t account;
+  CHECK(ledger.GetAccount(7,0,&account));
+  CHECK_EQ(account.balance,5000);
+  CHECK_EQ(account.totalRecharged,50);
+  CHECK_EQ(account.lastRecharge,30);
+  CHECK(!strcmp(account.phoneNum,"08012345678"));
+  CHECK(ledger.GetAccount(9,2,&account));
+  CHECK_EQ(account.balance,100);
+  CHECK(!ledger.GetAccount(9,1,&account));
+  uint32_t history[4];
+  CHECK_EQ(ledger.GetRechargeHistory(7,0,history,4),2);
+  CHECK_EQ(history[0],20);
+  CHECK_EQ(history[1],30);
+}
+
+static void TestDuplicateRecharge(void)
+{
+  fs::FS flash;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(ledger.RecordRecharge(3,1,10,100));
+    CHECK(ledger.RecordRecharge(3,1,10,100)); //resent report: ignored
+    CHECK(ledger.RecordRecharge(3,1,10,101));
+  }
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  CHECK(ledger.RecordRecharge(3,1,10,101)); //still a duplicate after a restart
+  Ledger::account_t account;
+  CHECK(ledger.GetAccount(3,1,&account));
+  CHECK_EQ(account.totalRecharged,20);
+  CHECK_EQ(account.lastTxnId,101);
+}
+
+static void TestCorruptedLog(void)
+{
+  fs::FS flash;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(ledger.RecordRecharge(1,0,15));
+    CHECK(ledger.UpdateBalance(1,0,700));
+    ledger.Flush();
+  }
+  const uint8_t partial[] = {3,0,1,0,0xAA};
+  File file = flash.open("/ledger.log","a");
+  file.write(partial,sizeof(partial));
+  file.close();
+  size_t corruptedSize = flash.files["/ledger.log"]->size();
+
+  //Compaction fails (flash full): the old log is kept as it is
+  flash.writeBudget = 10;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(!flash.exists("/ledger.log.tmp"));
+    CHECK_EQ(flash.files["/ledger.log"]->size(),corruptedSize);
+  }
+  flash.writeBudget = SIZE_MAX;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(flash.files["/ledger.log"]->size() < corruptedSize);
+  }
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  Ledger::account_t account;
+  CHECK(ledger.GetAccount(1,0,&account));
+  CHECK_EQ(account.balance,700);
+  CHECK_EQ(account.totalRecharged,15);
+}
+
+static size_t LogSize(fs::FS& flash)
+{
+  return flash.exists("/ledger.log") ? flash.files["/ledger.log"]->size() : 0;
+}
+
+//Appends balance records (for another account) until the log is compacted
+static void GrowUntilCompacted(fs::FS& flash,Ledger& ledger)
+{
+  size_t prevSize = 0;
+  for(uint32_t i = 1; LogSize(flash) >= prevSize; i++)
+  {
+    prevSize = LogSize(flash);
+    CHECK(ledger.UpdateBalance(900,0,i));
+    ledger.Flush();
+  }
+}
+
+static void TestCompaction(void)
+{
+  fs::FS flash;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(ledger.RecordRecharge(5,0,25,300));
+    CHECK(ledger.UpdatePhone(5,0,"08011111111"));
+    CHECK(ledger.UpdateBalance(5,0,4000));
+    //Newer recharges of other meters push it out of the history kept
+    for(uint32_t i = 0; i < LEDGER_MAX_HISTORY + 100; i++)
+    {
+      CHECK(ledger.RecordRecharge(10 + i % 700,0,1,1 + i / 700));
+    }
+    GrowUntilCompacted(flash,ledger);
+    CHECK(LogSize(flash) < LEDGER_MAX_LOG_SIZE / 2);
+    //The last transaction survives compaction: a resent report is ignored
+    CHECK(ledger.RecordRecharge(5,0,25,300));
+  }
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  CHECK(ledger.RecordRecharge(5,0,25,300));
+  Ledger::account_t account;
+  CHECK(ledger.GetAccount(5,0,&account));
+  CHECK_EQ(account.totalRecharged,25);
+  CHECK_EQ(account.lastRecharge,25);
+  CHECK_EQ(account.lastTxnId,300);
+  CHECK_EQ(account.balance,4000);
+  CHECK(!strcmp(account.phoneNum,"08011111111"));
+  uint32_t history[4];
+  CHECK_EQ(ledger.GetRechargeHistory(5,0,history,4),0);
+  CHECK_EQ(ledger.GetRechargeHistory(709,0,history,4),3);
+}
+
+static void TestCorruptedRecord(void)
+{
+  fs::FS flash;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(ledger.RecordRecharge(1,0,10));
+    CHECK(ledger.RecordRecharge(1,0,20));
+    CHECK(ledger.RecordRecharge(1,0,30));
+  }
+  //Second record corrupted: the records after it were never replayed and 
+  //aren't kept (history and totals agree)
+  size_t recordSize = LogSize(flash) / 3;
+  (*flash.files["/ledger.log"])[recordSize + 8] ^= 0xFF;
+  //Compaction fails: nothing is appended after the corrupted record
+  flash.writeBudget = 0;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK_EQ(LogSize(flash),3 * recordSize);
+    CHECK(!ledger.RecordRecharge(1,0,5));
+    CHECK(!ledger.UpdatePhone(1,0,"08022222222"));
+    CHECK_EQ(LogSize(flash),3 * recordSize);
+    //Compacted by the next flush (the accounts hold the updates)
+    flash.writeBudget = SIZE_MAX;
+    ledger.Flush();
+  }
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  Ledger::account_t account;
+  CHECK(ledger.GetAccount(1,0,&account));
+  CHECK_EQ(account.totalRecharged,15);
+  CHECK_EQ(account.lastRecharge,5);
+  CHECK(!strcmp(account.phoneNum,"08022222222"));
+  uint32_t history[4];
+  CHECK_EQ(ledger.GetRechargeHistory(1,0,history,4),1);
+  CHECK_EQ(history[0],10);
+}
+
+/**
+ * Updates (as from the MeterTask, a recharge and a balance every ms) while
+ * another task compacts the log, on flash taking 'accessDelayUs' per
+ * read/write. The updates made during the compaction must be kept. Prints
+ * the longest time an update waited.
+*/
+static void TestConcurrentCompaction(uint32_t accessDelayUs)
+{
+  const uint16_t numOfMeters = 300;
+  uint32_t totals[numOfMeters + 1] = {0};
+  uint32_t balances[numOfMeters + 1] = {0};
+  fs::FS flash;
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  //Log just under the size that triggers a compaction
+  for(uint32_t i = 0; LogSize(flash) < LEDGER_MAX_LOG_SIZE - 100; i++)
+  {
+    uint16_t meterId = 1 + i % numOfMeters;
+    balances[meterId] = i;
+    CHECK(ledger.UpdateBalance(meterId,0,i));
+    ledger.Flush();
+  }
+  fs::fsAccessDelayUs = accessDelayUs;
+  std::atomic<bool> isDone(false);
+  for(uint16_t meterId = 1; meterId <= 4; meterId++)
+  {
+    balances[meterId]++;
+    CHECK(ledger.UpdateBalance(meterId,0,balances[meterId]));
+  }
+  double start = NowNs();
+  std::thread flushTask([&]{ ledger.Flush(); isDone = true; });
+  double maxWaitNs = 0;
+  uint32_t numOfUpdates = 0;
+  for(uint32_t txnId = 1; !isDone; txnId++)
+  {
+    uint16_t meterId = 1 + txnId % numOfMeters;
+    double updateStart = NowNs();
+    CHECK(ledger.RecordRecharge(meterId,0,txnId % 7 + 1,txnId));
+    balances[meterId] += 1000;
+    CHECK(ledger.UpdateBalance(meterId,0,balances[meterId]));
+    double waitNs = NowNs() - updateStart;
+    maxWaitNs = (waitNs > maxWaitNs) ? waitNs : maxWaitNs;
+    totals[meterId] += txnId % 7 + 1;
+    numOfUpdates++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  flushTask.join();
+  double compactionMs = (NowNs() - start) / 1e6;
+  fs::fsAccessDelayUs = 0;
+  CHECK(LogSize(flash) < LEDGER_MAX_LOG_SIZE - 100); //compacted
+  ledger.Flush();
+  Ledger reloaded(&flash);
+  CHECK(reloaded.Begin());
+  uint32_t numOfErrors = 0;
+  for(uint16_t meterId = 1; meterId <= numOfMeters; meterId++)
+  {
+    Ledger::account_t account;
+    if(!reloaded.GetAccount(meterId,0,&account) || account.totalRecharged != totals[meterId] ||
+       account.balance != balances[meterId])
+    {
+      numOfErrors++;
+    }
+  }
+  CHECK_EQ(numOfErrors,0);
+  printf("compaction (flash access %u us): %.0f ms, %u updates meanwhile, max update wait %.2f ms\n",
+         accessDelayUs,compactionMs,numOfUpdates,maxWaitNs / 1e6);
+}
+
+static void TestInterruptedCompaction(void)
+{
+  fs::FS flash;
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(ledger.RecordRecharge(2,2,40));
+  }
+  //Power lost while writing the new log: it is deleted
+  File tmp = flash.open("/ledger.log.tmp","w");
+  const uint8_t junk[] = {1,2,3};
+  tmp.write(junk,sizeof(junk));
+  tmp.close();
+  {
+    Ledger ledger(&flash);
+    CHECK(ledger.Begin());
+    CHECK(!flash.exists("/ledger.log.tmp"));
+    CHECK_EQ(ledger.GetNumOfAccounts(),1);
+  }
+  //Power lost between removing the log and the rename (earlier versions)
+  CHECK(flash.rename("/ledger.log","/ledger.log.tmp"));
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+  CHECK(flash.exists("/ledger.log"));
+  CHECK(!flash.exists("/ledger.log.tmp"));
+  Ledger::account_t account;
+  CHECK(ledger.GetAccount(2,2,&account));
+  CHECK_EQ(account.totalRecharged,40);
+}
+
+static void TestFull(void)
+{
+  fs::FS flash;
+  Ledger ledger(&flash,"/ledger.log",4);
+  CHECK(ledger.Begin());
+  for(uint8_t i = 0; i < 4; i++)
+  {
+    CHECK(ledger.UpdateBalance(i,0,i));
+  }
+  CHECK(!ledger.UpdateBalance(4,0,1));
+  CHECK_EQ(ledger.GetNumOfAccounts(),4);
+}
+
+static void Benchmark(void)
+{
+  const uint16_t numOfMeters = LEDGER_MAX_ACCOUNTS / 3;
+  const uint32_t numOfLookups = 1000000;
+  fs::FS flash;
+  Ledger ledger(&flash);
+  CHECK(ledger.Begin());
+
+  double start = NowNs();
+  for(uint16_t meterId = 1; meterId <= numOfMeters; meterId++)
+  {
+    for(uint8_t userIndex = 0; userIndex < 3; userIndex++)
+    {
+      ledger.UpdateBalance(meterId,userIndex,meterId * 1000 + userIndex);
+    }
+  }
+  double insertNs = (NowNs() - start) / (numOfMeters * 3);
+  CHECK_EQ(ledger.GetNumOfAccounts(),numOfMeters * 3);
+
+  Ledger::account_t account;
+  uint32_t numOfErrors = 0;
+  uint32_t seed = 1;
+  start = NowNs();
+  for(uint32_t i = 0; i < numOfLookups; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    uint16_t meterId = 1 + (seed >> 8) % numOfMeters;
+    uint8_t userIndex = (seed >> 4) % 3;
+    if(!ledger.GetAccount(meterId,userIndex,&account) ||
+       account.balance != (uint32_t)meterId * 1000 + userIndex)
+    {
+      numOfErrors++;
+    }
+  }
+  double lookupNs = (NowNs() - start) / numOfLookups;
+  CHECK_EQ(numOfErrors,0);
+
+  start = NowNs();
+  ledger.Flush();
+  double flushUs = (NowNs() - start) / 1000;
+  printf("%lu accounts: insert %.0f ns, lookup %.0f ns, flush %.0f us\n",
+         (unsigned long)ledger.GetNumOfAccounts(),insertNs,lookupNs,flushUs);
+}
+
+int main(void)
+{
+  TestPersistence();
+  TestDuplicateRecharge();
+  TestCorruptedLog();
+  TestCompaction();
+  TestCorruptedRecord();
+  TestConcurrentCompaction(0);
+  TestConcurrentCompaction(20);
+  TestInterruptedCompaction();
+  TestFull();
+  Benchmark();
+  return TEST_RESULT();
+}
@@ -0,0 +1,156 @@
+/*
+ * Tests of the deferred logger (libraries/WaterMeterCommon) and a comparison of
+ * hot-path timing with logging compiled out, deferred (ring buffer) and
+ * printed synchronously (as the firmware did before).
+*/
+#include <Arduino.h>
+#include "test.h"
+
+#define LOG_LEVEL_HOTOFF  LOG_LEVEL_NONE
+#define LOG_LEVEL_HOTON   LOG_LEVEL_DEBUG
+#define LOG_LEVEL_TEST    LOG_LEVEL_WARN
+#define LOG_BUFFER_SIZE   32 //records
+#include "log.h"
+
+LOG_DEFINE_BUFFER(LOG_BUFFER_SIZE);
+
+#define FRAME_SIZE        16
+#define NUM_OF_FRAMES     200000
+
+//Output that keeps the last line (or discards everything)
+class CapturePrint : public Print
+{
+  public:
+    char text[256];
+    size_t len = 0;
+    bool isDiscarding = false;
+    size_t write(uint8_t c) override
+    {
+      if(!isDiscarding && len < sizeof(text) - 1)
+      {
+        text[len++] = c;
+        text[len] = '\0';
+      }
+      return 1;
+    }
+    size_t write(const uint8_t* buf,size_t size) override
+    {
+      for(size_t i = 0; i < size; i++)
+      {
+        write(buf[i]);
+      }
+      return size;
+    }
+    void Clear(void) { len = 0; text[0] = '\0'; }
+};
+
+static CapturePrint output;
+static volatile uint8_t port[FRAME_SIZE]; //stands in for the UART
+
+//Arguments are stored as long: floats must be converted explicitly
+template<typename T> static constexpr auto IsLoggable(int) -> decltype(Log::Arg(T()),bool()) {return true;}
+template<typename T> static constexpr bool IsLoggable(...) {return false;}
+static_assert(IsLoggable<uint8_t>(0) && IsLoggable<int>(0) && IsLoggable<unsigned long>(0),
+              "integers are logged");
+static_assert(!IsLoggable<float>(0) && !IsLoggable<double>(0),"floats don't compile");
+
+static void TestLevels(void)
+{
+  long numOfEvaluations = 0;
+  LOG_DEBUG(HOTOFF,"%ld",++numOfEvaluations); //compiled out: never evaluated
+  LOG_INFO(TEST,"%ld",++numOfEvaluations); //above the module's level
+  CHECK_EQ(numOfEvaluations,0);
+  CHECK(Log::IsEmpty());
+  LOG_WARN(TEST,"Frame %ld of %lu",-3L,7UL);
+  CHECK(!Log::IsEmpty());
+  CHECK(!Log::Process()); //no output yet: the record is kept
+  SetMillis(1234);
+  Log::Begin(&output,0,0);
+  output.Clear();
+  CHECK(Log::Process());
+  CHECK(!strcmp(output.text,"[0][W][TEST] Frame -3 of 7\n"));
+  CHECK(Log::IsEmpty());
+  CHECK(!Log::Process());
+}
+
+static void TestOverflow(void)
+{
+  for(uint8_t i = 0; i < LOG_BUFFER_SIZE + 5; i++)
+  {
+    LOG_ERROR(TEST,"Record %ld",(long)i);
+  }
+  uint8_t numOfRecords = 0;
+  output.Clear();
+  while(Log::Process())
+  {
+    numOfRecords++;
+  }
+  CHECK_EQ(numOfRecords,LOG_BUFFER_SIZE);
+  CHECK(strstr(output.text,"[LOG] dropped: 5") != NULL);
+}
+
+//Hot path: sends a frame byte by byte (as MNI::TransmitData does)
+static void TransmitLogOff(const uint8_t* frame)
+{
+  for(uint8_t i = 0; i < FRAME_SIZE; i++)
+  {
+    port[i] = frame[i];
+  }
+  LOG_DEBUG(HOTOFF,"TX %ld bytes, first: 0x%02lx",(long)FRAME_SIZE,(long)frame[0]);
+}
+
+static void TransmitLogOn(const uint8_t* frame)
+{
+  for(uint8_t i = 0; i < FRAME_SIZE; i++)
+  {
+    port[i] = frame[i];
+  }
+  LOG_DEBUG(HOTON,"TX %ld bytes, first: 0x%02lx",(long)FRAME_SIZE,(long)frame[0]);
+}
+
+static void TransmitPrint(const uint8_t* frame)
+{//Before: every byte printed as it was sent
+  for(uint8_t i = 0; i < FRAME_SIZE; i++)
+  {
+    port[i] = frame[i];
+    output.print((unsigned int)frame[i]);
+    output.print(' ');
+  }
+  output.println();
+}
+
+static double Time(void (*transmit)(const uint8_t*))
+{
+  const uint8_t batchSize = LOG_BUFFER_SIZE / 2; //no record dropped
+  uint8_t frame[FRAME_SIZE] = {0xA5,1,2,3};
+  double total = 0;
+  for(uint32_t i = 0; i < NUM_OF_FRAMES; i += batchSize)
+  {
+    double start = NowNs();
+    for(uint8_t j = 0; j < batchSize; j++)
+    {
+      frame[1] = j;
+      transmit(frame);
+    }
+    total += NowNs() - start;
+    //The log task prints later (not part of the hot path)
+    while(Log::Process())
+    {
+    }
+  }
+  return total / NUM_OF_FRAMES;
+}
+
+int main(void)
+{
+  TestLevels();
+  TestOverflow();
+  output.isDiscarding = true;
+  double offNs = Time(TransmitLogOff);
+  double onNs = Time(TransmitLogOn);
+  double printNs = Time(TransmitPrint);
+  printf("Frame TX (ns): log off %.0f, log on (deferred) %.0f, printed %.0f\n",
+         offNs,onNs,printNs);
+  CHECK(offNs < printNs);
+  return TEST_RESULT();
+}
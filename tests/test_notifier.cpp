@@ -0,0 +1,395 @@
+/*
+ * Tests of the notification rules (notifier.cpp) and of the SIM800L driver
+ * (sim800l.cpp) on a fake modem, with the SMS throughput of a burst of
+ * notifications sent by the Application task.
+*/
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "test.h"
+#include "notifier.h"
+#include "sim800l.h"
+
+#define LOW_BALANCE   20000 //mL (as in Utility_System.ino)
+#define LEAK_PERIOD   7200000
+#define FLOW_GAP      600000
+#define MIN_INTERVAL  3600000
+#define BATCH_SIZE    4
+#define APP_LOOP      10 //millisecs
+
+static Notifier* NewNotifier(uint16_t capacity)
+{
+  return new Notifier(capacity,LOW_BALANCE,LEAK_PERIOD,FLOW_GAP,MIN_INTERVAL);
+}
+
+static void TestBalanceRules(void)
+{
+  SetMillis(1000);
+  Notifier* notifier = NewNotifier(8);
+  notification_t notification;
+  notifier->Update(7,1,50000);
+  CHECK(!notifier->GetNext(&notification));
+  notifier->Update(7,1,19999);
+  CHECK(notifier->GetNext(&notification));
+  CHECK_EQ(notification.meterId,7);
+  CHECK_EQ(notification.userIndex,1);
+  CHECK_EQ(notification.events,NOTIFY_LOW_BALANCE);
+  CHECK_EQ(notification.balance,19999);
+  //Raised once while the condition holds
+  notifier->Update(7,1,15000);
+  AdvanceMillis(MIN_INTERVAL);
+  CHECK(!notifier->GetNext(&notification));
+  //Zero balance replaces low balance
+  notifier->Update(7,1,0);
+  CHECK(notifier->GetNext(&notification));
+  CHECK_EQ(notification.events,NOTIFY_ZERO_BALANCE);
+  CHECK_EQ(notification.balance,0);
+  //Raised again after a recharge (the condition cleared)
+  notifier->Update(7,1,100000);
+  notifier->Update(7,1,10000);
+  CHECK(!notifier->GetNext(&notification)); //within the min interval
+  AdvanceMillis(MIN_INTERVAL);
+  CHECK(notifier->GetNext(&notification));
+  CHECK_EQ(notification.events,NOTIFY_LOW_BALANCE);
+  CHECK_EQ(notification.balance,10000);
+  char report[64];
+  notifier->GetReport(report,sizeof(report));
+  CHECK(!strcmp(report,"events:3 notifications:3 dropped:0"));
+}
+
+static void TestDrop(void)
+{
+  SetMillis(0xFFFFF000); //millis() wraps during the test
+  Notifier* notifier = NewNotifier(8);
+  notification_t notification;
+  notifier->Update(1,0,10000);
+  CHECK(notifier->GetNext(&notification));
+  //Pending events are dropped if their condition clears first
+  notifier->Update(1,0,0);
+  notifier->Update(1,0,50000); //recharged
+  AdvanceMillis(MIN_INTERVAL);
+  CHECK(!notifier->GetNext(&notification));
+  //Table full: the readings of other users are dropped
+  Notifier* small = NewNotifier(2);
+  small->Update(1,0,0);
+  small->Update(1,1,0);
+  small->Update(1,2,0);
+  small->Update(1,1,0);
+  char report[64];
+  small->GetReport(report,sizeof(report));
+  CHECK(!strcmp(report,"events:2 notifications:0 dropped:1"));
+}
+
+//Consumption of 1 L every 9 min (readings within the flow gap)
+static uint32_t Consume(Notifier* notifier,uint16_t meterId,uint32_t balance,uint32_t duration)
+{
+  for(uint32_t t = 0; t < duration; t += 540000)
+  {
+    AdvanceMillis(540000);
+    balance -= 1000;
+    notifier->Update(meterId,0,balance);
+  }
+  return balance;
+}
+
+static void TestLeak(void)
+{
+  SetMillis(0);
+  Notifier* notifier = NewNotifier(4);
+  notification_t notification;
+  //Raised 2 h after the first reading with consumption (15th reading)
+  notifier->Update(3,0,1000000);
+  uint32_t balance = Consume(notifier,3,1000000,14 * 540000);
+  CHECK(!notifier->GetNext(&notification));
+  balance = Consume(notifier,3,balance,540000);
+  CHECK(notifier->GetNext(&notification));
+  CHECK_EQ(notification.events,NOTIFY_LEAK);
+  //Readings without consumption: continuous consumption ends after the gap
+  AdvanceMillis(FLOW_GAP + 1);
+  notifier->Update(3,0,balance);
+  AdvanceMillis(MIN_INTERVAL);
+  balance = Consume(notifier,3,balance,LEAK_PERIOD / 2);
+  CHECK(!notifier->GetNext(&notification));
+  //Gaps longer than the flow gap: never continuous
+  notifier->Update(4,0,balance);
+  for(uint32_t t = 0; t < 3 * LEAK_PERIOD; t += FLOW_GAP + 1)
+  {
+    AdvanceMillis(FLOW_GAP + 1);
+    balance -= 1000;
+    notifier->Update(4,0,balance);
+  }
+  CHECK(!notifier->GetNext(&notification));
+  //Events raised together are combined into one notification
+  SetMillis(0);
+  notifier->Update(5,0,34000);
+  Consume(notifier,5,34000,15 * 540000); //19 L left
+  CHECK(notifier->GetNext(&notification));
+  CHECK_EQ(notification.events,NOTIFY_LEAK | NOTIFY_LOW_BALANCE);
+  CHECK(!notifier->GetNext(&notification));
+}
+
+static void TestFairness(void)
+{
+  SetMillis(0);
+  Notifier* notifier = NewNotifier(16);
+  for(uint16_t meterId = 1; meterId <= 5; meterId++)
+  {
+    notifier->Update(meterId,0,0);
+  }
+  //Each user is handed out once, in turn
+  notification_t notification;
+  uint32_t seen = 0;
+  for(uint8_t i = 0; i < 5; i++)
+  {
+    CHECK(notifier->GetNext(&notification));
+    seen |= 1 << notification.meterId;
+  }
+  CHECK_EQ(seen,0x3E);
+  CHECK(!notifier->GetNext(&notification));
+}
+
+/**
+ * Fake SIM800L: checks the AT commands written by the driver, replies to
+ * them and records the SMS sent. Text mode must be selected before the first
+ * one, and again after Reset() (the modem restarts in PDU mode, where 
+ * AT+CMGS="<number>" is an error).
+*/
+class FakeModem : public HardwareSerial
+{
+  public:
+    std::string line;
+    std::string phoneNum;
+    bool isTextMode = false;
+    bool isAwaitingText = false;
+    uint32_t numOfModeCmds = 0;
+    uint32_t numOfErrors = 0; //by the driver
+    uint32_t numOfRejected = 0; //AT+CMGS in PDU mode (ERROR replied)
+    std::string rx; //replies
+    std::vector<std::pair<std::string,std::string>> sent; //phone number, text
+    using Print::write;
+
+    void Reset(void)
+    {
+      isTextMode = false;
+      rx += "\r\nRDY\r\n";
+    }
+
+    int available(void) override
+    {
+      return rx.size();
+    }
+
+    int read(void) override
+    {
+      if(rx.empty())
+      {
+        return -1;
+      }
+      char c = rx[0];
+      rx.erase(0,1);
+      return c;
+    }
+
+    size_t write(const uint8_t* buf,size_t size) override
+    {
+      for(size_t i = 0; i < size; i++)
+      {
+        FakeModem::write(buf[i]);
+      }
+      return size;
+    }
+
+    size_t write(uint8_t c) override
+    {
+      if(c == 26) //Ctrl+Z: end of message
+      {
+        if(!isAwaitingText || line.size() < 2 || line.compare(line.size() - 2,2,"\r\n"))
+        {
+          numOfErrors++;
+        }
+        else
+        {
+          sent.push_back({phoneNum,line.substr(0,line.size() - 2)});
+          rx += "\r\n+CMGS: 1\r\n\r\nOK\r\n";
+        }
+        isAwaitingText = false;
+        line.clear();
+        return 1;
+      }
+      line += (char)c;
+      if(isAwaitingText || c != '\n')
+      {
+        return 1;
+      }
+      if(line == "AT+CMGF=1\r\n")
+      {
+        isTextMode = true;
+        numOfModeCmds++;
+        rx += "\r\nOK\r\n";
+      }
+      else if(line.rfind("AT+CMGS=\"",0) == 0 && !isTextMode)
+      {
+        numOfRejected++;
+        rx += "\r\nERROR\r\n";
+      }
+      else if(line.rfind("AT+CMGS=\"",0) == 0 &&
+              line.compare(line.size() - 3,3,"\"\r\n") == 0)
+      {
+        phoneNum = line.substr(9,line.size() - 12);
+        isAwaitingText = true;
+        rx += "> ";
+      }
+      else
+      {
+        numOfErrors++;
+      }
+      line.clear();
+      return 1;
+    }
+};
+
+static void TestModem(void)
+{
+  hostDelayHook = [](uint32_t ms){ AdvanceMillis(ms); };
+  FakeModem modem;
+  SIM800L gsm(&modem);
+  char phoneNum[] = "+2348012345678";
+  char message1[] = "OTP for a recharge of 25 units is: 123456";
+  char message2[] = "Water meter 7, user 2: Your balance is low (19.99 L).";
+  SetMillis(0);
+  gsm.SendSMS(phoneNum,message1);
+  uint32_t firstTime = millis();
+  gsm.SendSMS(phoneNum,message2);
+  CHECK_EQ(modem.numOfErrors,0);
+  CHECK_EQ(modem.numOfModeCmds,1);
+  CHECK_EQ(modem.sent.size(),2);
+  CHECK(modem.sent[0].first == phoneNum);
+  CHECK(modem.sent[0].second == message1);
+  CHECK(modem.sent[1].second == message2);
+  //Throughput (driver delays only, the network time isn't modelled)
+  const uint32_t numOfSms = 100;
+  uint32_t start = millis();
+  for(uint32_t i = 0; i < numOfSms; i++)
+  {
+    gsm.SendSMS(phoneNum,message2);
+  }
+  uint32_t batchTime = (millis() - start) / numOfSms;
+  start = millis();
+  for(uint32_t i = 0; i < numOfSms; i++)
+  {//Text mode selected before every SMS (as before)
+    SIM800L oldGsm(&modem);
+    oldGsm.SendSMS(phoneNum,message2);
+  }
+  uint32_t oldTime = (millis() - start) / numOfSms;
+  CHECK_EQ(modem.numOfErrors,0);
+  CHECK_EQ(modem.sent.size(),2 + 2 * numOfSms);
+  CHECK(batchTime < oldTime);
+  printf("sms first(ms):%u per SMS(ms): %u (text mode every SMS: %u) SMS/min: %u (%u)\n",
+         firstTime,batchTime,oldTime,60000 / batchTime,60000 / oldTime);
+
+  //Selected again after SIM800L_IDLE_TIME without an SMS
+  SIM800L idleGsm(&modem);
+  modem.numOfModeCmds = 0;
+  idleGsm.SendSMS(phoneNum,message1);
+  AdvanceMillis(SIM800L_IDLE_TIME - 2000); //SMS take 1 s
+  idleGsm.SendSMS(phoneNum,message1);
+  CHECK_EQ(modem.numOfModeCmds,1);
+  AdvanceMillis(SIM800L_IDLE_TIME);
+  idleGsm.SendSMS(phoneNum,message1);
+  CHECK_EQ(modem.numOfModeCmds,2);
+
+  //Modem restarted between two SMS of a batch: the SMS isn't lost
+  size_t numOfSent = modem.sent.size();
+  idleGsm.SendSMS(phoneNum,message1);
+  modem.Reset();
+  idleGsm.SendSMS(phoneNum,message2);
+  CHECK_EQ(modem.numOfModeCmds,3);
+  CHECK_EQ(modem.numOfRejected,1);
+  CHECK_EQ(modem.sent.size(),numOfSent + 2);
+  CHECK(modem.sent.back().second == message2);
+  idleGsm.SendSMS(phoneNum,message1);
+  CHECK_EQ(modem.numOfModeCmds,3);
+  //An error replied to the previous SMS selects text mode again too
+  modem.Reset();
+  modem.rx += "\r\nERROR\r\n";
+  idleGsm.SendSMS(phoneNum,message1);
+  CHECK_EQ(modem.numOfModeCmds,4);
+  CHECK_EQ(modem.numOfRejected,1);
+  CHECK_EQ(modem.numOfErrors,0);
+  hostDelayHook = NULL;
+}
+
+/**
+ * Application task (as in Utility_System.ino): after a reading in which 300
+ * users (100 meters) went low at once, notifications are sent in batches,
+ * while OTPs keep arriving every 20 s and must not wait behind the burst.
+*/
+static void TestBurst(uint8_t batchSize)
+{
+  hostDelayHook = [](uint32_t ms){ AdvanceMillis(ms); };
+  SetMillis(0);
+  FakeModem modem;
+  SIM800L gsm(&modem);
+  Notifier* notifier = NewNotifier(768);
+  char phoneNum[] = "+2348012345678";
+  char otp[] = "OTP for a recharge of 25 units is: 123456";
+  for(uint16_t meterId = 1; meterId <= 100; meterId++)
+  {
+    for(uint8_t userIndex = 0; userIndex < 3; userIndex++)
+    {
+      notifier->Update(meterId,userIndex,LOW_BALANCE - 1);
+    }
+  }
+  std::deque<uint32_t> otps;
+  uint32_t nextOtpTime = 5000;
+  uint32_t maxOtpWait = 0;
+  uint32_t numOfOtps = 0;
+  uint32_t drainTime = 0;
+  while(millis() < 600000)
+  {
+    while(millis() >= nextOtpTime)
+    {
+      otps.push_back(nextOtpTime);
+      nextOtpTime += 20000;
+    }
+    if(!otps.empty())
+    {
+      gsm.SendSMS(phoneNum,otp);
+      uint32_t wait = millis() - otps.front();
+      maxOtpWait = (wait > maxOtpWait) ? wait : maxOtpWait;
+      otps.pop_front();
+      numOfOtps++;
+    }
+    notification_t notification;
+    for(uint8_t i = 0; i < batchSize && otps.empty() && notifier->GetNext(&notification); i++)
+    {
+      char text[] = "Water meter 7, user 2: Your balance is low (19.99 L).";
+      gsm.SendSMS(phoneNum,text);
+      if(modem.sent.size() - numOfOtps == 300)
+      {
+        drainTime = millis();
+      }
+    }
+    AdvanceMillis(APP_LOOP);
+  }
+  CHECK_EQ(modem.numOfErrors,0);
+  CHECK_EQ(modem.sent.size() - numOfOtps,300);
+  CHECK(maxOtpWait <= batchSize * 750U + APP_LOOP + 1000);
+  printf("burst batch=%u notifications=300 drained(s):%.1f otps=%u max OTP wait(ms):%u\n",
+         batchSize,drainTime / 1000.0,numOfOtps,maxOtpWait);
+  hostDelayHook = NULL;
+}
+
+int main(void)
+{
+  TestBalanceRules();
+  TestDrop();
+  TestLeak();
+  TestFairness();
+  TestModem();
+  TestBurst(1);
+  TestBurst(BATCH_SIZE);
+  TestBurst(16);
+  return TEST_RESULT();
+}
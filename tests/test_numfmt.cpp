@@ -0,0 +1,268 @@
+/*
+ * Tests of the number formatting/parsing library (numfmt.cpp, shared by the
+ * three firmwares) and microbenchmarks against the functions it replaced.
+*/
+#include <Arduino.h>
+#include "test.h"
+#include "numfmt.h"
+
+#define NUM_OF_RUNS   1000000
+
+static void TestFormat(void)
+{
+  char buff[16];
+  CHECK_EQ(FormatUnsigned(0,buff,sizeof(buff)),1);
+  CHECK(!strcmp(buff,"0"));
+  CHECK_EQ(FormatUnsigned(4294967295UL,buff,sizeof(buff)),10);
+  CHECK(!strcmp(buff,"4294967295"));
+  CHECK_EQ(FormatUnsigned(12345,buff,5),0); //needs 6 bytes
+  CHECK(!strcmp(buff,""));
+  CHECK_EQ(FormatUnsigned(1234,buff,5),4);
+
+  CHECK_EQ(FormatFixed(1234,2,buff,sizeof(buff)),5);
+  CHECK(!strcmp(buff,"12.34"));
+  CHECK_EQ(FormatFixed(-5,2,buff,sizeof(buff)),5);
+  CHECK(!strcmp(buff,"-0.05"));
+  CHECK_EQ(FormatFixed(7,0,buff,sizeof(buff)),1);
+  CHECK(!strcmp(buff,"7"));
+  CHECK_EQ(FormatFixed(INT32_MIN,9,buff,sizeof(buff)),12);
+  CHECK(!strcmp(buff,"-2.147483648"));
+  CHECK_EQ(FormatFixed(1,10,buff,sizeof(buff)),0); //too many decimals
+  CHECK_EQ(FormatFixed(123456,2,buff,7),0); //"1234.56" needs 8 bytes
+
+  const uint8_t data[] = {0x00,0x7f,0xA5,0xff};
+  CHECK_EQ(FormatHex(data,sizeof(data),buff,sizeof(buff)),8);
+  CHECK(!strcmp(buff,"007fa5ff"));
+  CHECK_EQ(FormatHex(data,sizeof(data),buff,8),0);
+}
+
+static void TestParse(void)
+{
+  uint32_t value = 99;
+  CHECK(ParseUnsigned("0",&value));
+  CHECK_EQ(value,0);
+  CHECK(ParseUnsigned("4294967295",&value));
+  CHECK_EQ(value,4294967295UL);
+  value = 99;
+  CHECK(!ParseUnsigned("4294967296",&value)); //overflow
+  CHECK(!ParseUnsigned("",&value));
+  CHECK(!ParseUnsigned(NULL,&value));
+  CHECK(!ParseUnsigned("12a",&value));
+  CHECK(!ParseUnsigned("-1",&value));
+  CHECK(!ParseUnsigned("12\r",&value)); //line endings must be stripped first
+  CHECK_EQ(value,99);
+
+  uint8_t data[2] = {1,2};
+  CHECK(ParseHex("A5ff",data,sizeof(data)));
+  CHECK_EQ(data[0],0xA5);
+  CHECK_EQ(data[1],0xFF);
+  CHECK(!ParseHex("a5f",data,sizeof(data)));
+  CHECK(!ParseHex("a5fg",data,sizeof(data)));
+  CHECK(!ParseHex("a5ff0",data,sizeof(data)));
+  CHECK_EQ(data[0],0xA5);
+}
+
+static void TestBuilder(void)
+{
+  char buff[24];
+  StringBuilder builder(buff,sizeof(buff));
+  builder.Append("U").AppendUnsigned(1).Append(':').AppendFixed(-125,2)
+         .Append(',').AppendFloat(2.005f,1);
+  CHECK(!strcmp(builder.GetString(),"U1:-1.25,2.0"));
+  CHECK_EQ(builder.GetLength(),12);
+  CHECK(!builder.IsTruncated());
+  builder.AppendFloat(NAN,2);
+  CHECK(builder.IsTruncated());
+  CHECK(!strcmp(buff,"U1:-1.25,2.0"));
+  builder.Clear();
+  CHECK(!builder.IsTruncated());
+  builder.Append("0123456789").Append("0123456789").Append("0123456789");
+  CHECK(builder.IsTruncated());
+  CHECK_EQ(builder.GetLength(),sizeof(buff) - 1);
+  CHECK_EQ(strlen(buff),sizeof(buff) - 1);
+  char tiny[1];
+  StringBuilder empty(tiny,sizeof(tiny));
+  empty.Append("x");
+  CHECK(empty.IsTruncated());
+  CHECK(!strcmp(tiny,""));
+}
+
+//Functions replaced by the library (as they were in the firmwares)
+static void OldIntegerToString(uint32_t integer,char* stringPtr)
+{
+  if(integer == 0)
+  {  
+    stringPtr[0] = '0';
+    return;
+  }
+  uint32_t integerCopy = integer;
+  uint8_t numOfDigits = 0;
+  while(integerCopy > 0)
+  {
+    integerCopy /= 10;
+    numOfDigits++;
+  }
+  while(integer > 0)
+  {
+    stringPtr[numOfDigits - 1] = '0' + (integer % 10);
+    integer /= 10;
+    numOfDigits--;
+  }
+}
+
+static void OldFloatToString(float floatPt,char* stringPtr,uint8_t decimalPlaces)
+{
+  uint32_t multiplier = 1;
+  for(uint8_t i = 0; i < decimalPlaces; i++)
+  {
+    multiplier *= 10;
+  }  
+  uint32_t floatAsInt = lround(floatPt * multiplier);
+  char quotientBuff[20] = {0};
+  char remainderBuff[20] = {0};
+  OldIntegerToString((floatAsInt / multiplier),quotientBuff);
+  OldIntegerToString((floatAsInt % multiplier),remainderBuff);
+  strcat(stringPtr,quotientBuff);
+  strcat(stringPtr,".");
+  uint8_t remainderLen = strlen(remainderBuff);
+  while(remainderLen < decimalPlaces)
+  {
+    strcat(stringPtr,"0");
+    remainderLen++;
+  }  
+  strcat(stringPtr,remainderBuff);
+}
+
+static void OldStringToInteger(char* stringPtr,uint32_t* integerPtr)
+{
+  *integerPtr = 0;
+  uint8_t len = strlen(stringPtr);
+  uint32_t j = 1;
+  for(uint8_t i = 0; i < len; i++)
+  {
+    *integerPtr += ((stringPtr[len - i - 1] - '0') * j);
+    j *= 10;
+  }
+}
+
+//MQTT payload of a reading, before (strcat into a static buffer) and after
+static void OldPayload(const float* volumes,char* dataToPublish)
+{
+  char volumeBuff[3][20];
+  for(uint8_t i = 0; i < 3; i++)
+  {
+    memset(volumeBuff[i],0,sizeof(volumeBuff[i]));
+    OldFloatToString(volumes[i] / 1000,volumeBuff[i],2);
+  }
+  memset(dataToPublish,'\0',strlen(dataToPublish));
+  strcat(dataToPublish,"USER1: ");
+  strcat(dataToPublish,volumeBuff[0]);
+  strcat(dataToPublish," L\n");
+  strcat(dataToPublish,"USER2: ");
+  strcat(dataToPublish,volumeBuff[1]);
+  strcat(dataToPublish," L\n");
+  strcat(dataToPublish,"USER3: ");
+  strcat(dataToPublish,volumeBuff[2]);
+  strcat(dataToPublish," L");
+}
+
+static void NewPayload(const float* volumes,char* dataToPublish,size_t size)
+{
+  StringBuilder payload(dataToPublish,size);
+  payload.Append("USER1: ").AppendFixed(lround(volumes[0] / 10),2).Append(" L\n")
+         .Append("USER2: ").AppendFixed(lround(volumes[1] / 10),2).Append(" L\n")
+         .Append("USER3: ").AppendFixed(lround(volumes[2] / 10),2).Append(" L");
+}
+
+static volatile uint32_t sink;
+
+static void Benchmark(void)
+{
+  char buff[128] = {0};
+  uint32_t value;
+  double start;
+
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    memset(buff,0,12);
+    OldIntegerToString(i * 2654435761UL,buff);
+    sink += buff[0];
+  }
+  double oldIntNs = (NowNs() - start) / NUM_OF_RUNS;
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    FormatUnsigned(i * 2654435761UL,buff,sizeof(buff));
+    sink += buff[0];
+  }
+  double newIntNs = (NowNs() - start) / NUM_OF_RUNS;
+
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    buff[0] = '\0';
+    OldFloatToString(i * 0.37f,buff,2);
+    sink += buff[0];
+  }
+  double oldFloatNs = (NowNs() - start) / NUM_OF_RUNS;
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    StringBuilder(buff,sizeof(buff)).AppendFloat(i * 0.37f,2);
+    sink += buff[0];
+  }
+  double newFloatNs = (NowNs() - start) / NUM_OF_RUNS;
+
+  char numStr[] = "4000000000";
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    numStr[9] = '0' + (i % 10);
+    OldStringToInteger(numStr,&value);
+    sink += value;
+  }
+  double oldParseNs = (NowNs() - start) / NUM_OF_RUNS;
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    numStr[9] = '0' + (i % 10);
+    ParseUnsigned(numStr,&value);
+    sink += value;
+  }
+  double newParseNs = (NowNs() - start) / NUM_OF_RUNS;
+
+  float volumes[3] = {123456.0f,0.0f,98765.4f};
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    volumes[1] = i;
+    OldPayload(volumes,buff);
+    sink += buff[8];
+  }
+  double oldPayloadNs = (NowNs() - start) / NUM_OF_RUNS;
+  char oldBuff[128];
+  strcpy(oldBuff,buff);
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    volumes[1] = i;
+    NewPayload(volumes,buff,sizeof(buff));
+    sink += buff[8];
+  }
+  double newPayloadNs = (NowNs() - start) / NUM_OF_RUNS;
+  CHECK(!strcmp(oldBuff,buff)); //same output
+
+  printf("ns per call (old -> new): integer %.0f -> %.0f, float %.0f -> %.0f, "
+         "parse %.0f -> %.0f, MQTT payload %.0f -> %.0f\n",oldIntNs,newIntNs,
+         oldFloatNs,newFloatNs,oldParseNs,newParseNs,oldPayloadNs,newPayloadNs);
+}
+
+int main(void)
+{
+  TestFormat();
+  TestParse();
+  TestBuilder();
+  Benchmark();
+  return TEST_RESULT();
+}
@@ -0,0 +1,132 @@
+/*
+ * Tests of the pending-OTP table (otp_table.cpp, shared by the Utility and
+ * the Master) and a simulation of a burst of recharges.
+*/
+#include <Arduino.h>
+#include "test.h"
+#include "otp_table.h"
+
+static void TestVerify(void)
+{
+  SetMillis(1000);
+  OtpTable table(4,60000,3);
+  uint32_t units = 0;
+  CHECK(table.Add(5,0,25,77));
+  CHECK_EQ(table.Verify(5,0,"1234",&units),OtpTable::OTP_NOT_FOUND); //no OTP yet
+  CHECK(table.SetOtp(5,0,"1234"));
+  CHECK(!table.SetOtp(5,1,"1234"));
+  OtpTable::entry_t entry;
+  CHECK(table.Get(5,0,&entry));
+  CHECK_EQ(entry.units,25);
+  CHECK_EQ(entry.requestId,77);
+  CHECK_EQ(table.Verify(5,0,"1235",&units),OtpTable::OTP_INVALID);
+  CHECK_EQ(table.Verify(5,0,"123",&units),OtpTable::OTP_INVALID);
+  CHECK_EQ(table.Verify(5,0,"1234",&units),OtpTable::OTP_VALID);
+  CHECK_EQ(units,25);
+  CHECK_EQ(table.Verify(5,0,"1234",&units),OtpTable::OTP_NOT_FOUND); //used once
+  CHECK_EQ(table.GetNumOfPending(),0);
+}
+
+static void TestLockAndExpiry(void)
+{
+  SetMillis(0xFFFFF000); //millis() wraps during the test
+  OtpTable table(4,60000,3);
+  uint32_t units = 0;
+  CHECK(table.Add(1,1,10));
+  CHECK(table.SetOtp(1,1,"9999"));
+  CHECK_EQ(table.Verify(1,1,"0000",&units),OtpTable::OTP_INVALID);
+  CHECK_EQ(table.Verify(1,1,"0000",&units),OtpTable::OTP_INVALID);
+  CHECK_EQ(table.Verify(1,1,"0000",&units),OtpTable::OTP_LOCKED);
+  CHECK_EQ(table.Verify(1,1,"9999",&units),OtpTable::OTP_NOT_FOUND);
+
+  CHECK(table.Add(1,2,10));
+  CHECK(table.SetOtp(1,2,"4321"));
+  AdvanceMillis(59999);
+  CHECK_EQ(table.GetNumOfPending(),1);
+  AdvanceMillis(1);
+  OtpTable::entry_t entry;
+  CHECK(!table.Get(1,2,&entry));
+  CHECK_EQ(table.GetNumOfPending(),0);
+  CHECK_EQ(table.Verify(1,2,"4321",&units),OtpTable::OTP_EXPIRED);
+}
+
+static void TestReplaceAndEvict(void)
+{
+  SetMillis(0);
+  OtpTable table(2,60000,3);
+  OtpTable::entry_t entry;
+  CHECK(table.Add(1,0,10,1));
+  CHECK(table.Add(1,0,20,2)); //same user: replaced
+  CHECK(table.Get(1,0,&entry));
+  CHECK_EQ(entry.units,20);
+  CHECK_EQ(entry.requestId,2);
+  AdvanceMillis(10);
+  CHECK(table.Add(2,0,30));
+  AdvanceMillis(10);
+  CHECK(table.Add(3,0,40)); //full: the oldest entry is evicted
+  CHECK(!table.Get(1,0,&entry));
+  CHECK(table.Get(2,0,&entry));
+  CHECK(table.Get(3,0,&entry));
+  table.Remove(2,0);
+  CHECK_EQ(table.GetNumOfPending(),1);
+}
+
+/**
+ * Burst: every user of 32 meters requests a recharge within a few seconds
+ * (the Utility's table holds all of them); the users then enter their OTPs
+ * (some mistyped once) over the next minutes.
+*/
+static void TestBurst(void)
+{
+  const uint8_t numOfMeters = 32;
+  const uint8_t numOfUsers = 3;
+  OtpTable table(numOfMeters * numOfUsers,300000,3);
+  char otps[numOfMeters][numOfUsers][SIZE_OTP_ENTRY];
+  uint32_t seed = 7;
+  SetMillis(5000);
+  for(uint8_t i = 0; i < numOfMeters; i++)
+  {
+    for(uint8_t j = 0; j < numOfUsers; j++)
+    {
+      seed = seed * 1103515245 + 12345;
+      snprintf(otps[i][j],SIZE_OTP_ENTRY,"%06lu",(unsigned long)((seed >> 8) % 1000000));
+      CHECK(table.Add(i + 1,j,i * 10 + j,seed));
+      CHECK(table.SetOtp(i + 1,j,otps[i][j]));
+      AdvanceMillis(20);
+    }
+  }
+  CHECK_EQ(table.GetNumOfPending(),numOfMeters * numOfUsers);
+  uint32_t numOfValid = 0;
+  double start = NowNs();
+  for(uint8_t i = 0; i < numOfMeters; i++)
+  {
+    for(uint8_t j = 0; j < numOfUsers; j++)
+    {
+      uint32_t units = 0;
+      AdvanceMillis(1000);
+      if(((i + j) % 4) == 0)
+      {
+        CHECK_EQ(table.Verify(i + 1,j,"000000x",&units),OtpTable::OTP_INVALID);
+      }
+      if(table.Verify(i + 1,j,otps[i][j],&units) == OtpTable::OTP_VALID &&
+         units == (uint32_t)(i * 10 + j))
+      {
+        numOfValid++;
+      }
+    }
+  }
+  double verifyNs = (NowNs() - start) / (numOfMeters * numOfUsers);
+  CHECK_EQ(numOfValid,numOfMeters * numOfUsers);
+  CHECK_EQ(table.GetNumOfPending(),0);
+  printf("Burst of %d recharges: all verified, %.0f ns per verification\n",
+         numOfMeters * numOfUsers,verifyNs);
+}
+
+int main(void)
+{
+  TestVerify();
+  TestLockAndExpiry();
+  TestReplaceAndEvict();
+  TestBurst();
+  return TEST_RESULT();
+}
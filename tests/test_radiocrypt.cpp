@@ -0,0 +1,140 @@
+/*
+ * Tests of the radio frame encryption (radiocrypt.cpp) against the host's
+ * mbedtls, and a benchmark of sealing/opening frames and deriving keys.
+*/
+#include <Arduino.h>
+#include "test.h"
+#include "radiocrypt.h"
+
+#define NUM_OF_RUNS   200000
+
+static const uint8_t siteKey[RADIO_KEY_SIZE] = 
+{
+  0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+};
+
+static void TestDeriveKey(void)
+{
+  //HMAC-SHA256(siteKey,"meter" + little-endian ID), first 16 bytes
+  const uint8_t expected1[RADIO_KEY_SIZE] = 
+  {
+    0x36,0xab,0x23,0xb4,0xe8,0x55,0x9c,0x99,0x4a,0xac,0x17,0x02,0x37,0xef,0x52,0x77
+  };
+  const uint8_t expected513[RADIO_KEY_SIZE] = 
+  {
+    0xd0,0x72,0xaa,0x10,0xc1,0x8c,0xbf,0x0d,0x1b,0x7c,0x69,0xb8,0x6f,0xf8,0x25,0xca
+  };
+  uint8_t key[RADIO_KEY_SIZE];
+  CHECK(RadioCrypto::DeriveKey(siteKey,1,key));
+  CHECK(!memcmp(key,expected1,sizeof(key)));
+  CHECK(RadioCrypto::DeriveKey(siteKey,513,key));
+  CHECK(!memcmp(key,expected513,sizeof(key)));
+}
+
+static void TestSealOpen(void)
+{
+  uint8_t key[RADIO_KEY_SIZE];
+  RadioCrypto::DeriveKey(siteKey,7,key);
+  RadioCrypto master;
+  RadioCrypto utility;
+  radio_frame_t frame;
+  const char message[] = "recharge 25";
+  uint8_t plaintext[RADIO_MAX_PLAINTEXT];
+
+  CHECK(!master.Seal(RADIO_UPLINK,7,1,message,sizeof(message),&frame)); //no key
+  CHECK(master.SetKey(key));
+  CHECK(utility.SetKey(key));
+  CHECK(!master.Seal(RADIO_UPLINK,7,1,message,RADIO_MAX_PLAINTEXT + 1,&frame));
+  CHECK(master.Seal(RADIO_UPLINK,7,1,message,sizeof(message),&frame));
+  CHECK_EQ(sizeof(frame),RADIO_PAYLOAD_SIZE);
+  CHECK_EQ(frame.meterId,7);
+  CHECK_EQ(frame.counter,1);
+  CHECK(memcmp(frame.ciphertext,message,sizeof(message)) != 0);
+  CHECK(utility.Open(RADIO_UPLINK,&frame,plaintext));
+  CHECK(!memcmp(plaintext,message,sizeof(message)));
+  CHECK_EQ(plaintext[RADIO_MAX_PLAINTEXT - 1],0); //zero padded
+
+  //Same message, next counter: different ciphertext
+  radio_frame_t nextFrame;
+  master.Seal(RADIO_UPLINK,7,2,message,sizeof(message),&nextFrame);
+  CHECK(memcmp(nextFrame.ciphertext,frame.ciphertext,sizeof(frame.ciphertext)) != 0);
+
+  //Wrong direction (reflected frame), tampered header, ciphertext or tag
+  CHECK(!utility.Open(RADIO_DOWNLINK,&frame,plaintext));
+  for(uint8_t i = 0; i < sizeof(frame); i++)
+  {
+    radio_frame_t tampered = frame;
+    ((uint8_t*)&tampered)[i] ^= 0x01;
+    CHECK(!utility.Open(RADIO_UPLINK,&tampered,plaintext));
+  }
+
+  //Another meter's key
+  uint8_t otherKey[RADIO_KEY_SIZE];
+  RadioCrypto::DeriveKey(siteKey,8,otherKey);
+  RadioCrypto other;
+  other.SetKey(otherKey);
+  CHECK(!other.Open(RADIO_UPLINK,&frame,plaintext));
+  CHECK(utility.GetMeanMicros() < 1000);
+}
+
+static void TestReplayGuard(void)
+{
+  ReplayGuard guard(2);
+  CHECK(!guard.IsKnown(1));
+  CHECK(guard.IsFresh(1,0));
+  guard.Accept(1,10);
+  CHECK(guard.IsKnown(1));
+  CHECK(!guard.IsFresh(1,10));
+  CHECK(!guard.IsFresh(1,9));
+  CHECK(guard.IsFresh(1,11));
+  guard.Accept(2,5);
+  guard.Accept(3,5); //full: replaces the oldest entry
+  CHECK(!guard.IsKnown(1));
+  CHECK(guard.IsKnown(2) && guard.IsKnown(3));
+  guard.Accept(2,6);
+  CHECK(!guard.IsFresh(2,6));
+}
+
+static volatile uint32_t sink;
+
+static void Benchmark(void)
+{
+  uint8_t key[RADIO_KEY_SIZE];
+  RadioCrypto crypto;
+  RadioCrypto::DeriveKey(siteKey,7,key);
+  crypto.SetKey(key);
+  radio_frame_t frame;
+  uint8_t message[RADIO_MAX_PLAINTEXT] = {1,2,3};
+
+  double start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    crypto.Seal(RADIO_UPLINK,7,i,message,sizeof(message),&frame);
+    sink += frame.tag[0];
+  }
+  double sealNs = (NowNs() - start) / NUM_OF_RUNS;
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    sink += crypto.Open(RADIO_UPLINK,&frame,message);
+  }
+  double openNs = (NowNs() - start) / NUM_OF_RUNS;
+  //The utility loads the meter's key before each frame
+  start = NowNs();
+  for(uint32_t i = 0; i < NUM_OF_RUNS; i++)
+  {
+    RadioCrypto::DeriveKey(siteKey,i,key);
+    sink += crypto.SetKey(key);
+  }
+  double keyNs = (NowNs() - start) / NUM_OF_RUNS;
+  printf("Frame (ns): seal %.0f, open %.0f, derive and set key %.0f\n",sealNs,openNs,keyNs);
+}
+
+int main(void)
+{
+  TestDeriveKey();
+  TestSealOpen();
+  TestReplayGuard();
+  Benchmark();
+  return TEST_RESULT();
+}
@@ -0,0 +1,201 @@
+/*
+ * Tests of the nRF24 link layer (radiolink.cpp) on a simulated noisy channel:
+ * per-peer PA levels at the hub, retry delay backoff under collisions.
+*/
+#include <Arduino.h>
+#include <RF24.h>
+#include "test.h"
+#include "radiolink.h"
+
+#define NEAR_METER    1
+#define FAR_METER     2
+
+//Channel model (per transmission attempt)
+static uint8_t requiredPa; //of the peer being written to
+static uint32_t lossPercent; //random loss (noise)
+static bool isInterferer; //another node retrying with a 250us delay
+static uint32_t seed = 12345;
+
+static uint32_t Random(uint32_t range)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % range;
+}
+
+static bool Attempt(const RF24* radio)
+{
+  if(radio->paLevel < requiredPa)
+  {
+    return Random(100) < 5; //below sensitivity
+  }
+  if(isInterferer && radio->retryDelay == 1 && Random(100) < 70)
+  {
+    return false; //retries collide in lockstep
+  }
+  return Random(100) >= lossPercent;
+}
+
+static RF24 nrf24(0,0);
+
+static bool WriteTo(RadioLink& link,uint16_t meterId,uint8_t pa)
+{
+  uint8_t data[32] = {0};
+  requiredPa = pa;
+  return link.Write(data,sizeof(data),meterId);
+}
+
+static void TestPeerPower(void)
+{
+  RadioLink link(&nrf24);
+  CHECK(link.Begin(0,0));
+  lossPercent = 2;
+  isInterferer = false;
+  uint32_t farFailures = 0;
+  for(uint32_t i = 0; i < 1000; i++)
+  {
+    WriteTo(link,NEAR_METER,RF24_PA_MIN);
+    bool isDelivered = WriteTo(link,FAR_METER,RF24_PA_HIGH);
+    CHECK_EQ(nrf24.paLevel,RF24_PA_MAX); //ACKs at the default level
+    if(i >= 500 && !isDelivered)
+    {
+      farFailures++;
+    }
+  }
+  RadioLink::peer_t nearPeer;
+  RadioLink::peer_t farPeer;
+  RadioLink::stats_t stats;
+  CHECK(link.GetPeer(NEAR_METER,&nearPeer));
+  CHECK(link.GetPeer(FAR_METER,&farPeer));
+  CHECK(!link.GetPeer(3,&farPeer) && link.GetPeer(FAR_METER,&farPeer));
+  link.GetStats(&stats);
+  CHECK_EQ(nearPeer.paLevel,RF24_PA_MIN);
+  CHECK(farPeer.paLevel >= RF24_PA_HIGH);
+  CHECK_EQ(farFailures,0);
+  CHECK_EQ(nearPeer.numOfWrites,1000);
+  CHECK_EQ(stats.numOfWrites,nearPeer.numOfWrites + farPeer.numOfWrites);
+  CHECK_EQ(stats.numOfRetries,nearPeer.numOfRetries + farPeer.numOfRetries);
+
+  //Previous behaviour: one PA level for all peers
+  RadioLink shared(&nrf24);
+  shared.Begin(0,0);
+  uint32_t sharedFailures = 0;
+  for(uint32_t i = 0; i < 1000; i++)
+  {
+    WriteTo(shared,RADIO_DEFAULT_PEER,RF24_PA_MIN);
+    if(!WriteTo(shared,RADIO_DEFAULT_PEER,RF24_PA_HIGH) && i >= 500)
+    {
+      sharedFailures++;
+    }
+  }
+  RadioLink::peer_t sharedPeer;
+  shared.GetPeer(RADIO_DEFAULT_PEER,&sharedPeer);
+  printf("Near and far meter, 2%% loss: mean retries per write %.2f "
+         "(one PA level: %.2f), writes for 2000 packets %u (one PA level: %u)\n",
+         (double)stats.numOfRetries / stats.numOfWrites,
+         (double)sharedPeer.numOfRetries / sharedPeer.numOfWrites,stats.numOfWrites,
+         sharedPeer.numOfWrites);
+  CHECK_EQ(sharedFailures,0);
+
+  //Peers reporting their link quality, more peers than the table holds
+  for(uint16_t id = 10; id < 10 + RADIO_MAX_PEERS; id++)
+  {
+    link.ReportQuality(id,1);
+  }
+  CHECK(link.GetPeer(NEAR_METER,&nearPeer)); //written peers are kept
+  CHECK(link.GetPeer(FAR_METER,&farPeer));
+  link.ReportQuality(FAR_METER,0xFF);
+  link.GetPeer(FAR_METER,&farPeer);
+  CHECK_EQ(farPeer.reportedArc,0xFF);
+  char report[256];
+  link.GetPeerReport(report,sizeof(report));
+  CHECK(!strncmp(report,"id:1 pa:0 ",10));
+  CHECK(strstr(report,"id:2 pa:") != NULL);
+  size_t len = link.GetPeerReport(report,60);
+  CHECK_EQ(len,strlen(report));
+  CHECK(len > 0 && report[len - 1] == '\n'); //no partial line
+}
+
+static void TestCollisionBackoff(void)
+{
+  RadioLink link(&nrf24);
+  link.Begin(0,1); //retry delay: 250us (as the interferer)
+  lossPercent = 5;
+  isInterferer = true;
+  uint32_t retries[3] = {0};
+  uint32_t failures = 0;
+  uint8_t maxDelay = 0;
+  for(uint32_t i = 0; i < 1500; i++)
+  {
+    if(!WriteTo(link,RADIO_DEFAULT_PEER,RF24_PA_MIN))
+    {
+      failures++;
+    }
+    retries[i / 500] += (nrf24.getARC() == 15) ? 16 : nrf24.getARC();
+    if(nrf24.retryDelay > maxDelay)
+    {
+      maxDelay = nrf24.retryDelay;
+    }
+  }
+  RadioLink::peer_t peer;
+  link.GetPeer(RADIO_DEFAULT_PEER,&peer);
+  CHECK(maxDelay > 1);
+  CHECK_EQ(failures,0);
+  //Previous behaviour: fixed retry delay
+  uint32_t fixedRetries = 0;
+  nrf24.setRetries(1,15);
+  for(uint32_t i = 0; i < 500; i++)
+  {
+    nrf24.write(&i,sizeof(i));
+    fixedRetries += (nrf24.getARC() == 15) ? 16 : nrf24.getARC();
+  }
+  CHECK(retries[2] * 4 < fixedRetries);
+  printf("Lockstep collisions: retries per write %.2f (fixed delay: %.2f), "
+         "max retry delay %u x 250us\n",(retries[1] + retries[2]) / 1000.0,
+         fixedRetries / 500.0,maxDelay);
+
+  //Collisions stop: the delay returns to the minimum, then the PA steps down
+  isInterferer = false;
+  lossPercent = 0;
+  for(uint32_t i = 0; i < 500; i++)
+  {
+    WriteTo(link,RADIO_DEFAULT_PEER,RF24_PA_MIN);
+  }
+  link.GetPeer(RADIO_DEFAULT_PEER,&peer);
+  CHECK_EQ(peer.retryBackoff,0);
+  CHECK_EQ(nrf24.retryDelay,1);
+  CHECK_EQ(peer.paLevel,RF24_PA_MIN);
+}
+
+static void TestRandomNoise(void)
+{
+  RadioLink link(&nrf24);
+  link.Begin(0,0);
+  lossPercent = 40; //random loss is not helped by a longer delay
+  isInterferer = false;
+  uint32_t failures = 0;
+  for(uint32_t i = 0; i < 2000; i++)
+  {
+    if(!WriteTo(link,RADIO_DEFAULT_PEER,RF24_PA_LOW))
+    {
+      failures++;
+    }
+  }
+  RadioLink::peer_t peer;
+  link.GetPeer(RADIO_DEFAULT_PEER,&peer);
+  CHECK_EQ(failures,0);
+  CHECK_EQ(peer.retryBackoff,0);
+  CHECK(peer.paLevel >= RF24_PA_LOW);
+  printf("40%% random loss: mean retries per write %.2f, PA %u, failures %u\n",
+         (double)peer.numOfRetries / peer.numOfWrites,peer.paLevel,failures);
+}
+
+int main(void)
+{
+  nrf24.attempt = Attempt;
+  TestPeerPower();
+  TestCollisionBackoff();
+  TestRandomNoise();
+  return TEST_RESULT();
+}
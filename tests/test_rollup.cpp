@@ -0,0 +1,193 @@
+/*
+ * Tests of the per-meter rollups (rollup.cpp), and a benchmark of the load
+ * on the broker (messages and bytes) with rollups against raw readings.
+*/
+#include <Arduino.h>
+#include "test.h"
+#include "rollup.h"
+#include "numfmt.h"
+
+#define CAPACITY            256 //RADIO_MAX_METERS (utility)
+#define NUM_OF_METERS       100
+#define TELEMETRY_PERIOD    5000 //millisecs (master)
+#define ROLLUP_PERIOD       60000 //millisecs (default)
+#define SIM_DURATION        3600000UL //millisecs
+#define TOPIC               "water/site-0001" //typical topic
+
+static void TestAggregates(void)
+{
+  Rollup rollup(2);
+  Rollup::summary_t summary;
+  uint16_t cursor = 0;
+  uint32_t balances[ROLLUP_NUM_OF_USERS] = {10000,5000,0};
+
+  CHECK(!rollup.Take(&cursor,&summary)); //nothing yet
+  SetMillis(1000);
+  CHECK(rollup.Add(7,balances,1700000000));
+  SetMillis(61000); //1 min later: 600 mL and 60 mL consumed, user 3 recharged
+  balances[0] -= 600;
+  balances[1] -= 60;
+  balances[2] = 2000;
+  CHECK(rollup.Add(7,balances,1700000060));
+  SetMillis(91000); //30 s later: 600 mL (1200 mL/min) for user 1 only
+  balances[0] -= 600;
+  CHECK(rollup.Add(7,balances,1700000090));
+  cursor = 0;
+  CHECK(rollup.Take(&cursor,&summary));
+  CHECK_EQ(summary.meterId,7);
+  CHECK_EQ(summary.numOfReadings,3);
+  CHECK_EQ(summary.firstTime,1700000000);
+  CHECK_EQ(summary.lastTime,1700000090);
+  CHECK_EQ(summary.users[0].consumed,1200);
+  CHECK_EQ(summary.users[0].minRate,600);
+  CHECK_EQ(summary.users[0].maxRate,1200);
+  CHECK_EQ(summary.users[0].balance,8800);
+  CHECK_EQ(summary.users[1].consumed,60);
+  CHECK_EQ(summary.users[1].minRate,0);
+  CHECK_EQ(summary.users[1].maxRate,60);
+  CHECK_EQ(summary.users[2].consumed,0); //recharges aren't consumption
+  CHECK_EQ(summary.users[2].balance,2000);
+  CHECK(!rollup.Take(&cursor,&summary));
+
+  char message[256];
+  size_t len = Rollup::Format(&summary,message,sizeof(message));
+  CHECK(!strcmp(message,"M7 N3 T1700000000,1700000090 U1:1.20,600,1200,8.80 "
+                        "U2:0.06,0,60,4.94 U3:0.00,0,0,2.00"));
+  CHECK_EQ(len,strlen(message));
+  CHECK_EQ(Rollup::Format(&summary,message,len),0);
+
+  //The last reading is the baseline of the next interval
+  SetMillis(151000);
+  balances[0] -= 100;
+  CHECK(rollup.Add(7,balances,0));
+  cursor = 0;
+  CHECK(rollup.Take(&cursor,&summary));
+  CHECK_EQ(summary.numOfReadings,1);
+  CHECK_EQ(summary.users[0].consumed,100);
+  CHECK_EQ(summary.users[0].minRate,100);
+  CHECK_EQ(summary.users[0].maxRate,100);
+  Rollup::Format(&summary,message,sizeof(message));
+  CHECK(!strncmp(message,"M7 N1 U1:0.10,",14)); //no time
+
+  //Worst case fits the MQTT task's buffer (SIZE_REPORT)
+  Rollup::summary_t worst;
+  memset(&worst,0xFF,sizeof(worst));
+  CHECK(Rollup::Format(&worst,message,sizeof(message)) > 0);
+}
+
+static void TestCapacity(void)
+{
+  Rollup rollup(2);
+  Rollup::summary_t summary;
+  uint16_t cursor = 0;
+  uint32_t balances[ROLLUP_NUM_OF_USERS] = {100,100,100};
+  CHECK(rollup.Add(1,balances,0));
+  CHECK(rollup.Add(2,balances,0));
+  CHECK(!rollup.Add(3,balances,0)); //full
+  CHECK(rollup.Take(&cursor,&summary));
+  CHECK_EQ(summary.meterId,1);
+  CHECK(rollup.Add(3,balances,0)); //meter 1 idle since taken: replaced
+  CHECK(!rollup.Add(1,balances,0));
+  cursor = 0;
+  uint16_t meterIds[2] = {0};
+  for(uint8_t i = 0; i < 2; i++)
+  {
+    CHECK(rollup.Take(&cursor,&summary));
+    meterIds[i] = summary.meterId;
+  }
+  CHECK(meterIds[0] == 3 && meterIds[1] == 2);
+  CHECK(!rollup.Take(&cursor,&summary));
+}
+
+//Size of an MQTT PUBLISH packet (QoS 0)
+static uint32_t PublishSize(const char* topic,const char* payload)
+{
+  uint32_t remaining = 2 + strlen(topic) + strlen(payload);
+  return 1 + ((remaining < 128) ? 1 : 2) + remaining;
+}
+
+//Raw pass-through message of a reading (as built by the MQTT task)
+static void FormatRaw(uint16_t meterId,uint32_t timestamp,const uint32_t* volumes,
+                      char* buffer,size_t bufferSize)
+{
+  StringBuilder payload(buffer,bufferSize);
+  payload.Append("METER: ").AppendUnsigned(meterId).Append('\n')
+         .Append("TIME: ").AppendUnsigned(timestamp).Append('\n')
+         .Append("USER1: ").AppendFixed(volumes[0] / 10,2).Append(" L\n")
+         .Append("USER2: ").AppendFixed(volumes[1] / 10,2).Append(" L\n")
+         .Append("USER3: ").AppendFixed(volumes[2] / 10,2).Append(" L");
+}
+
+static void Benchmark(void)
+{
+  Rollup rollup(CAPACITY);
+  static uint32_t balances[NUM_OF_METERS][ROLLUP_NUM_OF_USERS];
+  char message[256];
+  uint32_t rawMessages = 0;
+  uint64_t rawBytes = 0;
+  uint32_t rollupMessages = 0;
+  uint64_t rollupBytes = 0;
+  uint32_t numOfReadings = 0;
+  double addNs = 0;
+  double rawNs = 0;
+  double rollupNs = 0;
+
+  for(uint16_t id = 0; id < NUM_OF_METERS; id++)
+  {
+    for(uint8_t i = 0; i < ROLLUP_NUM_OF_USERS; i++)
+    {
+      balances[id][i] = 500000 + 1000 * id;
+    }
+  }
+  for(uint32_t t = TELEMETRY_PERIOD; t <= SIM_DURATION; t += TELEMETRY_PERIOD)
+  {
+    //Each meter reports once per telemetry period (spread over the period)
+    for(uint16_t id = 0; id < NUM_OF_METERS; id++)
+    {
+      SetMillis(t + id * (TELEMETRY_PERIOD / NUM_OF_METERS));
+      uint32_t timestamp = 1700000000 + millis() / 1000;
+      for(uint8_t i = 0; i < ROLLUP_NUM_OF_USERS; i++)
+      {
+        balances[id][i] -= (id + i + t / 1000) % 40;
+      }
+      double start = NowNs();
+      rollup.Add(id + 1,balances[id],timestamp);
+      addNs += NowNs() - start;
+      start = NowNs();
+      FormatRaw(id + 1,timestamp,balances[id],message,sizeof(message));
+      rawNs += NowNs() - start;
+      rawMessages++;
+      rawBytes += PublishSize(TOPIC,message);
+      numOfReadings++;
+    }
+    if((t % ROLLUP_PERIOD) == 0)
+    {
+      Rollup::summary_t summary;
+      uint16_t cursor = 0;
+      double start = NowNs();
+      while(rollup.Take(&cursor,&summary))
+      {
+        Rollup::Format(&summary,message,sizeof(message));
+        rollupMessages++;
+        rollupBytes += PublishSize(TOPIC "/rollup",message);
+      }
+      rollupNs += NowNs() - start;
+    }
+  }
+  double minutes = SIM_DURATION / 60000.0;
+  CHECK_EQ(rollupMessages * (ROLLUP_PERIOD / TELEMETRY_PERIOD),rawMessages);
+  printf("%u meters, 1 h: raw %.0f msgs/min (%.0f B/min), rollup %.0f msgs/min "
+         "(%.0f B/min)\n",NUM_OF_METERS,rawMessages / minutes,rawBytes / minutes,
+         rollupMessages / minutes,rollupBytes / minutes);
+  printf("CPU (ns): Add %.0f per reading (%u-entry table), raw format %.0f per reading, "
+         "take and format %.0f per rollup\n",addNs / numOfReadings,CAPACITY,
+         rawNs / rawMessages,rollupNs / rollupMessages);
+}
+
+int main(void)
+{
+  TestAggregates();
+  TestCapacity();
+  Benchmark();
+  return TEST_RESULT();
+}
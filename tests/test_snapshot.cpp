@@ -0,0 +1,116 @@
+/*
+ * Stress test of the seqlock (Water_Meter/Master/snapshot.h): one writer and
+ * several readers hammer the same Snapshot; every copy must be consistent and
+ * the versions seen by a reader must never go backwards.
+*/
+#include <Arduino.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "test.h"
+#include "snapshot.h"
+
+#define NUM_OF_WRITES   200000
+#define NUM_OF_READERS  3
+
+typedef struct
+{
+  uint32_t counter;
+  uint32_t words[16]; //all equal to 'counter'
+  uint32_t check; //~counter
+}sample_t;
+
+static Snapshot<sample_t> snapshot;
+static std::atomic<bool> isDone(false);
+static std::atomic<int> numOfReadersReady(0);
+
+static void Reader(long* numOfReads,long* numOfTorn,long* numOfBackwards)
+{
+  uint32_t lastVersion = 0;
+  uint32_t lastCounter = 0;
+  numOfReadersReady++;
+  while(!isDone.load())
+  {
+    sample_t sample;
+    uint32_t version;
+    if(!snapshot.Read(sample,&version))
+    {
+      continue;
+    }
+    (*numOfReads)++;
+    bool isConsistent = (sample.check == ~sample.counter);
+    for(uint8_t i = 0; i < 16; i++)
+    {
+      isConsistent = isConsistent && (sample.words[i] == sample.counter);
+    }
+    if(!isConsistent || version != sample.counter)
+    {
+      (*numOfTorn)++;
+    }
+    if(version < lastVersion || sample.counter < lastCounter)
+    {
+      (*numOfBackwards)++;
+    }
+    lastVersion = version;
+    lastCounter = sample.counter;
+  }
+}
+
+int main(void)
+{
+  sample_t sample;
+  CHECK(!snapshot.Read(sample));
+  CHECK_EQ(snapshot.Version(),0);
+
+  long numOfReads[NUM_OF_READERS] = {0};
+  long numOfTorn[NUM_OF_READERS] = {0};
+  long numOfBackwards[NUM_OF_READERS] = {0};
+  std::vector<std::thread> readers;
+  for(uint8_t i = 0; i < NUM_OF_READERS; i++)
+  {
+    readers.emplace_back(Reader,&numOfReads[i],&numOfTorn[i],&numOfBackwards[i]);
+  }
+  while(numOfReadersReady.load() < NUM_OF_READERS)
+  {
+    std::this_thread::yield();
+  }
+  for(uint32_t counter = 1; counter <= NUM_OF_WRITES; counter++)
+  {
+    sample.counter = counter;
+    for(uint8_t i = 0; i < 16; i++)
+    {
+      sample.words[i] = counter;
+    }
+    sample.check = ~counter;
+    snapshot.Write(sample);
+    if((counter % 64) == 0)
+    {
+      std::this_thread::yield(); //let the readers in (single core hosts)
+    }
+  }
+  isDone.store(true);
+  for(std::thread& reader : readers)
+  {
+    reader.join();
+  }
+  long totalReads = 0;
+  for(uint8_t i = 0; i < NUM_OF_READERS; i++)
+  {
+    CHECK_EQ(numOfTorn[i],0);
+    CHECK_EQ(numOfBackwards[i],0);
+    totalReads += numOfReads[i];
+  }
+  CHECK(totalReads > 0);
+  CHECK_EQ(snapshot.Version(),NUM_OF_WRITES);
+
+  uint32_t lastVersion = NUM_OF_WRITES;
+  CHECK(!snapshot.ReadIfNewer(sample,lastVersion));
+  lastVersion--;
+  CHECK(snapshot.ReadIfNewer(sample,lastVersion));
+  CHECK_EQ(lastVersion,NUM_OF_WRITES);
+  CHECK_EQ(sample.counter,NUM_OF_WRITES);
+
+  printf("%d writes, %ld consistent reads by %d readers\n",
+         NUM_OF_WRITES,totalReads,NUM_OF_READERS);
+  return TEST_RESULT();
+}
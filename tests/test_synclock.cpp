@@ -0,0 +1,154 @@
+/*
+ * Tests of the master's clock (synclock.cpp): extrapolation between syncs,
+ * drift estimation, and the error of the time between hourly syncs for an
+ * oscillator off by a few tens of ppm, with the jitter of the radio round trip.
+*/
+#include <Arduino.h>
+#include <math.h>
+#include "test.h"
+#include "synclock.h"
+
+#define EPOCH         1700000000UL //Unix time at the start of a simulation
+#define SYNC_PERIOD   3600000 //millisecs (TIME_SYNC_PERIOD)
+
+//Time of the clock in millisecs since EPOCH
+static int64_t GetMillis(SyncClock& clock)
+{
+  uint16_t milliseconds;
+  uint32_t time = clock.GetTime(&milliseconds);
+  return ((int64_t)time - EPOCH) * 1000 + milliseconds;
+}
+
+static void Sync(SyncClock& clock,int64_t sourceMillis)
+{
+  clock.Sync(EPOCH + sourceMillis / 1000,sourceMillis % 1000);
+}
+
+static void TestBasics(void)
+{
+  SetMillis(0xFFFFF000); //millis() wraps during the test
+  SyncClock clock;
+  uint16_t milliseconds = 1;
+  CHECK(!clock.IsSynced());
+  CHECK_EQ(clock.GetTime(&milliseconds),0);
+  CHECK_EQ(milliseconds,0);
+  clock.Sync(EPOCH,900);
+  CHECK(clock.IsSynced());
+  CHECK_EQ(clock.GetTime(&milliseconds),EPOCH);
+  CHECK_EQ(milliseconds,900);
+  AdvanceMillis(150); //carried into the seconds
+  CHECK_EQ(clock.GetTime(&milliseconds),EPOCH + 1);
+  CHECK_EQ(milliseconds,50);
+  CHECK_EQ(clock.GetTime(),EPOCH + 1);
+  //No drift estimate below the minimum baseline
+  AdvanceMillis(SYNC_MIN_BASELINE - 151);
+  Sync(clock,SYNC_MIN_BASELINE + 1000);
+  CHECK_EQ(clock.GetDriftPpm(),0);
+  CHECK_EQ(GetMillis(clock),SYNC_MIN_BASELINE + 1000);
+  //Local clock 1 s behind over 1000 s: +1000 ppm
+  AdvanceMillis(1000000 - SYNC_MIN_BASELINE + 1);
+  Sync(clock,1001000 + 900);
+  CHECK_EQ(clock.GetDriftPpm(),1000);
+  AdvanceMillis(100000);
+  CHECK_EQ(GetMillis(clock),1001900 + 100100);
+  //A jump of the source isn't taken as drift (new baseline, time set)
+  AdvanceMillis(SYNC_MIN_BASELINE);
+  Sync(clock,86400000);
+  CHECK_EQ(clock.GetDriftPpm(),1000);
+  CHECK_EQ(GetMillis(clock),86400000);
+  AdvanceMillis(SYNC_MIN_BASELINE - 1);
+  Sync(clock,86400000 + SYNC_MIN_BASELINE - 1);
+  CHECK_EQ(clock.GetDriftPpm(),1000); //baseline too short
+  AdvanceMillis(1);
+  Sync(clock,86400000 + SYNC_MIN_BASELINE);
+  CHECK_EQ(clock.GetDriftPpm(),0);
+}
+
+/**
+ * Syncs every hour for 'hours', with a local oscillator off by 'ppm' and the
+ * time of each sync off by up to +/- 'jitter' millisecs (half the round trip
+ * isn't always the one-way delay).
+ * @return Max error (millisecs) of the time after the first 2 syncs.
+*/
+static int64_t Simulate(int32_t ppm,uint32_t jitter,uint32_t hours,int32_t* driftPtr)
+{
+  SyncClock clock;
+  uint32_t seed = 11;
+  int64_t maxError = 0;
+  for(int64_t t = 0; t <= (int64_t)hours * SYNC_PERIOD; t += 1000)
+  {
+    SetMillis(1000 + (uint32_t)(t + t * ppm / 1000000));
+    if(t % SYNC_PERIOD == 0)
+    {
+      seed = seed * 1103515245 + 12345;
+      int64_t error = (jitter == 0) ? 0 : (int64_t)((seed >> 16) % (2 * jitter + 1)) - jitter;
+      Sync(clock,t + error);
+    }
+    else if(t > 2 * SYNC_PERIOD)
+    {
+      int64_t error = llabs(GetMillis(clock) - t);
+      maxError = (error > maxError) ? error : maxError;
+    }
+  }
+  *driftPtr = clock.GetDriftPpm();
+  return maxError;
+}
+
+static void TestDrift(void)
+{
+  const int32_t ppms[] = {-100,-30,0,30,100};
+  printf("oscillator(ppm)  jitter(ms)  drift estimate(ppm)  max error(ms)  uncorrected(ms)\n");
+  for(int32_t ppm : ppms)
+  {
+    for(uint32_t jitter : {0U,20U})
+    {
+      int32_t drift;
+      int64_t maxError = Simulate(ppm,jitter,48,&drift);
+      //Local clock faster (+ppm): the estimate is negative
+      int32_t expected = lround(-ppm / (1 + ppm / 1e6));
+      printf("%15ld  %10u  %19ld  %13lld  %15.0f\n",(long)ppm,jitter,(long)drift,
+             (long long)maxError,fabs(ppm * 3.6) + jitter);
+      CHECK(abs(drift - expected) <= 1 + (int32_t)jitter);
+      CHECK(maxError <= 4 + 2 * jitter); //1 ppm resolution: up to 3.6 ms per hour
+    }
+  }
+}
+
+/**
+ * The node's millis() stops in power-down sleep (why the node doesn't keep
+ * time): with the node asleep 90% of the time, its clock falls behind and
+ * the drift estimates are out of range.
+*/
+static void TestSleepingClock(void)
+{
+  SyncClock clock;
+  int64_t local = 0;
+  int64_t maxLag = 0;
+  SetMillis(0);
+  for(int64_t t = 0; t <= 3 * 3600000; t += 1000)
+  {
+    if(t % 600000 == 0)
+    {//Synced every 10 minutes
+      Sync(clock,t);
+    }
+    else
+    {
+      int64_t lag = t - GetMillis(clock);
+      maxLag = (lag > maxLag) ? lag : maxLag;
+    }
+    local += ((t / 1000) % 10 == 0) ? 1000 : 0; //awake 1 s in 10
+    SetMillis(local);
+  }
+  printf("clock asleep 90%%: max lag %lld ms between syncs, drift estimate %ld ppm\n",
+         (long long)maxLag,(long)clock.GetDriftPpm());
+  CHECK_EQ(clock.GetDriftPpm(),0); //every estimate (9000000 ppm) was discarded
+  CHECK(maxLag > 500000);
+}
+
+int main(void)
+{
+  TestBasics();
+  TestDrift();
+  TestSleepingClock();
+  return TEST_RESULT();
+}